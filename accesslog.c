@@ -0,0 +1,287 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <errno.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>
+
+#include "accesslog.h"
+#include "json.h"
+#include "debug.h"
+
+/*
+ * A bounded multi-producer, single-consumer queue (after Dmitry Vyukov's
+ * bounded MPMC queue). Each cell's sequence number says whose turn it is:
+ * it equals the position a producer may fill, or that position plus 1 once
+ * the record is in and the consumer may take it.
+ */
+typedef struct {
+    unsigned long sequence;
+    AccessRecord record;
+} LogCell;
+
+typedef struct {
+    unsigned long tail;           // Next position producers fill.
+    char pad[56];                 // Keep the two ends on separate cache lines.
+    unsigned long head;           // Next position the writer drains.
+    unsigned long dropped;        // Records lost to a full queue.
+    int writer_asleep;            // Set by the writer before it sleeps on wake.
+    sem_t wake;
+    LogCell cells[LOG_QUEUE_SIZE];
+} LogQueue;
+
+static LogQueue *queue = NULL;
+
+// Helper function declarations.
+void run_log_writer(const char *path);
+void wait_for_records(const struct timespec *deadline);
+int format_record(char *buf, int size, const AccessRecord *record);
+int open_log(const char *path);
+void rotate_log(const char *path);
+
+
+void init_access_log(const char *path) {
+    if (path == NULL || path[0] == '\0') {
+        return;
+    }
+    queue = mmap(NULL, sizeof(LogQueue), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (queue == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    for (unsigned long i = 0; i < LOG_QUEUE_SIZE; i++) {
+        queue->cells[i].sequence = i;
+    }
+    sem_init(&queue->wake, 1, 0);
+
+    // Fail now, not silently in the writer, if the log can't be opened.
+    int fd = open_log(path);
+    if (fd == -1) {
+        exit(1);
+    }
+    close(fd);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    } else if (pid == 0) {
+        // Don't outlive the server.
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        run_log_writer(path);
+        exit(0);
+    }
+}
+
+
+void log_access(const AccessRecord *record) {
+    if (queue == NULL) {
+        return;
+    }
+    unsigned long pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+    while (1) {
+        LogCell *cell = &queue->cells[pos & (LOG_QUEUE_SIZE - 1)];
+        unsigned long sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        long diff = (long) (sequence - pos);
+        if (diff == 0) {
+            // Our turn for this cell, if no other producer claims it first.
+            if (__atomic_compare_exchange_n(&queue->tail, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                cell->record = *record;
+                __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+                // Pairs with the fence in wait_for_records: either the
+                // writer sees this record, or we see that it is asleep.
+                __atomic_thread_fence(__ATOMIC_SEQ_CST);
+                if (__atomic_exchange_n(&queue->writer_asleep, 0, __ATOMIC_RELAXED)) {
+                    sem_post(&queue->wake);
+                }
+                return;
+            }
+            // pos now holds the current tail; try again.
+        } else if (diff < 0) {
+            // The writer hasn't drained this cell since the last lap: full.
+            __atomic_add_fetch(&queue->dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+
+long socket_bytes_sent(int sock) {
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    memset(&info, 0, sizeof(info));
+    if (getsockopt(sock, IPPROTO_TCP, TCP_INFO, &info, &len) == -1) {
+        return -1;
+    }
+    return info.tcpi_bytes_sent - info.tcpi_bytes_retrans + info.tcpi_notsent_bytes;
+}
+
+
+/*
+ * The writer process: drain the queue into a buffer, and write the buffer
+ * out whenever it is nearly full or its oldest line is LOG_FLUSH_MS old.
+ */
+void run_log_writer(const char *path) {
+    int fd = open_log(path);
+    if (fd == -1) {
+        exit(1);
+    }
+    struct stat st;
+    long size = (fstat(fd, &st) == 0) ? st.st_size : 0;
+
+    char *buf = malloc(LOG_BATCH_SIZE);
+    int len = 0;
+    unsigned long reported_dropped = 0;
+    struct timespec flush_at;     // Of the buffer, once it holds anything.
+
+    while (1) {
+        LogCell *cell = &queue->cells[queue->head & (LOG_QUEUE_SIZE - 1)];
+        int ready = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) == queue->head + 1;
+
+        if (ready) {
+            char line[1024];
+            int line_len = format_record(line, sizeof(line), &cell->record);
+            // Hand the cell back to the producers for the next lap.
+            __atomic_store_n(&cell->sequence, queue->head + LOG_QUEUE_SIZE, __ATOMIC_RELEASE);
+            queue->head++;
+
+            if (len + line_len > LOG_BATCH_SIZE) {
+                write(fd, buf, len);
+                size += len;
+                len = 0;
+            }
+            if (len == 0) {
+                // sem_timedwait takes a deadline on the realtime clock.
+                clock_gettime(CLOCK_REALTIME, &flush_at);
+                flush_at.tv_nsec += LOG_FLUSH_MS * 1000000L;
+                flush_at.tv_sec += flush_at.tv_nsec / 1000000000L;
+                flush_at.tv_nsec %= 1000000000L;
+            }
+            memcpy(buf + len, line, line_len);
+            len += line_len;
+            continue;
+        }
+
+        // Nothing left: wait for more, until the buffer is due if it holds
+        // anything. Records are only dropped while the queue is full, so
+        // there is always a flush to report them with.
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        if (len == 0 || now.tv_sec < flush_at.tv_sec ||
+                (now.tv_sec == flush_at.tv_sec && now.tv_nsec < flush_at.tv_nsec)) {
+            wait_for_records((len > 0) ? &flush_at : NULL);
+            continue;
+        }
+
+        // The buffer is due: flush it, then rotate if needed.
+        unsigned long dropped = __atomic_load_n(&queue->dropped, __ATOMIC_RELAXED);
+        if (dropped != reported_dropped && len + 64 <= LOG_BATCH_SIZE) {
+            len += sprintf(buf + len, "{\"dropped\":%lu}\n", dropped - reported_dropped);
+            reported_dropped = dropped;
+        }
+        write(fd, buf, len);
+        size += len;
+        len = 0;
+        if (size >= LOG_ROTATE_BYTES) {
+            close(fd);
+            rotate_log(path);
+            fd = open_log(path);
+            if (fd == -1) {
+                exit(1);
+            }
+            size = 0;
+        }
+    }
+}
+
+
+/*
+ * In the writer: sleep until a producer queues a record, or until
+ * <deadline> (on the realtime clock) if it isn't NULL. May return early.
+ */
+void wait_for_records(const struct timespec *deadline) {
+    __atomic_store_n(&queue->writer_asleep, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    LogCell *cell = &queue->cells[queue->head & (LOG_QUEUE_SIZE - 1)];
+    if (__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) != queue->head + 1) {
+        // A post left over from an earlier wait only makes this one return
+        // early.
+        int result;
+        do {
+            result = (deadline != NULL) ? sem_timedwait(&queue->wake, deadline)
+                                        : sem_wait(&queue->wake);
+        } while (result == -1 && errno == EINTR);
+    }
+    __atomic_store_n(&queue->writer_asleep, 0, __ATOMIC_RELAXED);
+}
+
+
+int open_log(const char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        perror("open access log");
+    }
+    return fd;
+}
+
+
+/*
+ * Shift <path>.1 .. <path>.(LOG_KEEP - 1) up by one, dropping the oldest,
+ * and move <path> to <path>.1.
+ */
+void rotate_log(const char *path) {
+    char from[512];
+    char to[512];
+    for (int i = LOG_KEEP - 1; i >= 1; i--) {
+        snprintf(from, sizeof(from), "%s.%d", path, i);
+        snprintf(to, sizeof(to), "%s.%d", path, i + 1);
+        rename(from, to);
+    }
+    snprintf(to, sizeof(to), "%s.1", path);
+    rename(path, to);
+    DEBUG_LOG("Rotated access log %s\n", path);
+}
+
+
+/*
+ * Format a record as one line of JSON. Return its length.
+ */
+int format_record(char *buf, int size, const AccessRecord *record) {
+    time_t seconds = record->time_ms / 1000;
+    struct tm tm;
+    gmtime_r(&seconds, &tm);
+
+    int len = strftime(buf, size, "{\"time\":\"%Y-%m-%dT%H:%M:%S", &tm);
+    len += snprintf(buf + len, size - len, ".%03luZ\",\"pid\":%d,\"method\":",
+                    record->time_ms % 1000, record->pid);
+    len += json_string(buf + len, size - len, record->method);
+    len += snprintf(buf + len, size - len, ",\"route\":");
+    len += json_string(buf + len, size - len, record->route);
+    if (record->filter[0] != '\0') {
+        len += snprintf(buf + len, size - len, ",\"filter\":");
+        len += json_string(buf + len, size - len, record->filter);
+    }
+    if (record->image[0] != '\0') {
+        len += snprintf(buf + len, size - len, ",\"image\":");
+        len += json_string(buf + len, size - len, record->image);
+    }
+    len += snprintf(buf + len, size - len,
+                    ",\"status\":%d,%s\"bytes\":%ld,\"wait_ms\":%.3f,\"total_ms\":%.3f,"
+                    "\"user_ms\":%.3f,\"sys_ms\":%.3f}\n",
+                    record->status, record->failed ? "\"failed\":true," : "", record->bytes, record->wait_us / 1e3,
+                    record->total_us / 1e3, record->user_ms, record->sys_ms);
+    return len;
+}
@@ -0,0 +1,60 @@
+#ifndef ACCESSLOG_H_
+#define ACCESSLOG_H_
+
+/*
+ * A structured access log, written off the request path: each finished
+ * request becomes one fixed-size record pushed onto a lock-free queue in
+ * shared memory, and a dedicated writer process drains the queue, formats
+ * the records as JSON lines and writes them in large batches, rotating the
+ * file when it grows too big. A full queue drops records (and counts them)
+ * rather than block anyone. The writer sleeps while the queue is empty, and
+ * a producer wakes it only if it is asleep.
+ */
+
+#define ACCESS_LOG_DEFAULT "access.log"
+#define LOG_QUEUE_SIZE 4096           // Records; must be a power of two.
+#define LOG_BATCH_SIZE 65536          // Bytes the writer buffers before a write.
+#define LOG_FLUSH_MS 50               // Longest a record waits in the writer's buffer.
+#define LOG_ROTATE_BYTES (64L << 20)  // Rotate once the log reaches this size...
+#define LOG_KEEP 4                    // ...keeping this many old files (.1 is newest).
+
+#define LOG_FIELD_LEN 48
+
+
+// One request, as recorded by the acceptor that served it.
+typedef struct {
+    unsigned long time_ms;        // Wall clock time it was dispatched.
+    int pid;                      // The request process, or the acceptor.
+    int status;                   // HTTP status code.
+    int failed;                   // The request process exited non-zero or was killed.
+    long bytes;                   // Bytes sent to the client.
+    unsigned long wait_us;        // From accepting the connection to dispatch.
+    unsigned long total_us;       // From dispatch to the request process exiting.
+    double user_ms;               // CPU time of the request process.
+    double sys_ms;
+    char method[8];
+    char route[LOG_FIELD_LEN];
+    char filter[LOG_FIELD_LEN];
+    char image[LOG_FIELD_LEN];
+} AccessRecord;
+
+
+/*
+ * Set up the shared queue and fork the writer process, appending to the file
+ * at <path>. Does nothing if <path> is NULL or empty. Must be called before
+ * the first acceptor is forked.
+ */
+void init_access_log(const char *path);
+
+/*
+ * Queue a record for the writer. Never blocks.
+ */
+void log_access(const AccessRecord *record);
+
+/*
+ * Return the number of bytes written to a TCP socket so far (sent or still
+ * queued), or -1 if the kernel can't tell.
+ */
+long socket_bytes_sent(int sock);
+
+#endif /* ACCESSLOG_H_ */
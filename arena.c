@@ -0,0 +1,35 @@
+#include <string.h>
+
+#include "arena.h"
+
+
+void arena_init(Arena *arena, void *buf, size_t size) {
+    arena->base = buf;
+    arena->size = size;
+    arena->used = 0;
+}
+
+
+void *arena_alloc(Arena *arena, size_t size) {
+    size_t start = (arena->used + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+    if (start + size > arena->size) {
+        return NULL;
+    }
+    arena->used = start + size;
+    return arena->base + start;
+}
+
+
+char *arena_strndup(Arena *arena, const char *str, size_t len) {
+    char *copy = arena_alloc(arena, len + 1);
+    if (copy != NULL) {
+        memcpy(copy, str, len);
+        copy[len] = '\0';
+    }
+    return copy;
+}
+
+
+void arena_reset(Arena *arena) {
+    arena->used = 0;
+}
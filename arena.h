@@ -0,0 +1,42 @@
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <stddef.h>
+
+/*
+ * A bump allocator over a fixed buffer, for memory that lives exactly as
+ * long as one request: allocating is a pointer bump, there is no per-object
+ * free, and arena_reset releases everything at once in O(1).
+ */
+
+#define ARENA_ALIGN 8
+
+typedef struct {
+    char *base;
+    size_t size;
+    size_t used;
+} Arena;
+
+
+/*
+ * Make the arena allocate from the <size> bytes at <buf>.
+ */
+void arena_init(Arena *arena, void *buf, size_t size);
+
+/*
+ * Return <size> bytes aligned to ARENA_ALIGN, or NULL if the arena is full.
+ */
+void *arena_alloc(Arena *arena, size_t size);
+
+/*
+ * Copy the first <len> characters of <str> into the arena as a
+ * null-terminated string. Return NULL if the arena is full.
+ */
+char *arena_strndup(Arena *arena, const char *str, size_t len);
+
+/*
+ * Release everything allocated from the arena.
+ */
+void arena_reset(Arena *arena);
+
+#endif /* ARENA_H_ */
@@ -0,0 +1,392 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/sendfile.h>
+
+#include "batch.h"
+#include "bitmap.h"
+#include "filter.h"
+#include "cache.h"
+#include "response.h"
+#include "filterpool.h"
+#include "scheduler.h"
+
+#define TAR_BLOCK 512
+
+enum batch_format { FORMAT_MULTIPART, FORMAT_TAR };
+
+// One filter to run on one image.
+typedef struct {
+    const char *image;
+    const char *filter;
+    pid_t pid;                // The running job, or 0.
+    char tmp_path[MAX_PATH];  // Where the job writes its output.
+} BatchJob;
+
+// Helper function declarations.
+int split_list(char *list, char **items, int max_items);
+int start_job(BatchJob *job, const Bitmap *bmp);
+int send_result(int fd, int format, const BatchJob *job, const char *path);
+int send_error(int fd, int format, const BatchJob *job, const char *message);
+int write_part_header(int fd, int format, const BatchJob *job, const char *suffix,
+                      const char *content_type, long size);
+int write_part_trailer(int fd, int format, long size);
+int write_all(int fd, const char *buf, long size);
+
+
+void image_batch_response(int fd, const ReqData *reqData) {
+    const char *images_param = get_param(reqData, "images");
+    const char *filters_param = get_param(reqData, "filters");
+    const char *format_param = get_param(reqData, "format");
+    if (images_param == NULL || filters_param == NULL) {
+        bad_request_response(fd, "Query params 'images' and 'filters' are required.");
+        return;
+    }
+
+    int format = FORMAT_MULTIPART;
+    if (format_param != NULL && strcmp(format_param, "tar") == 0) {
+        format = FORMAT_TAR;
+    } else if (format_param != NULL && strcmp(format_param, "multipart") != 0) {
+        bad_request_response(fd, "Query param 'format' must be 'multipart' or 'tar'.");
+        return;
+    }
+
+    // The params come from the start line, so they fit in MAXLINE.
+    char images_list[MAXLINE];
+    char filters_list[MAXLINE];
+    snprintf(images_list, sizeof(images_list), "%s", images_param);
+    snprintf(filters_list, sizeof(filters_list), "%s", filters_param);
+    char *images[MAX_BATCH_IMAGES];
+    char *filters[MAX_BATCH_FILTERS];
+    int num_images = split_list(images_list, images, MAX_BATCH_IMAGES);
+    int num_filters = split_list(filters_list, filters, MAX_BATCH_FILTERS);
+    if (num_images <= 0 || num_filters <= 0) {
+        bad_request_response(fd, "Too many or too few images or filters.");
+        return;
+    }
+
+    // Validate everything up front, so a bad name is a 400 rather than a
+    // failure halfway through the response.
+    char path[MAX_PATH];
+    for (int i = 0; i < num_images; i++) {
+        snprintf(path, sizeof(path), "%s%s", IMAGE_DIR, images[i]);
+        if (strchr(images[i], '/') != NULL || access(path, R_OK) != 0) {
+            bad_request_response(fd, "An image doesn't refer to a readable file under images/.");
+            return;
+        }
+    }
+    for (int i = 0; i < num_filters; i++) {
+        snprintf(path, sizeof(path), "%s%s", FILTER_DIR, filters[i]);
+        if (strchr(filters[i], '/') != NULL ||
+                (find_builtin_filter(filters[i]) == NULL && access(path, X_OK) != 0)) {
+            bad_request_response(fd, "A filter doesn't refer to an executable file under filters/.");
+            return;
+        }
+    }
+
+    // Jobs are ordered by image, so each image only needs to be decoded once.
+    int num_jobs = num_images * num_filters;
+    BatchJob *jobs = calloc(num_jobs, sizeof(BatchJob));
+    for (int i = 0; i < num_jobs; i++) {
+        jobs[i].image = images[i / num_filters];
+        jobs[i].filter = filters[i % num_filters];
+    }
+
+    response_status = 200;
+    if (format == FORMAT_TAR) {
+        dprintf(fd, "HTTP/1.1 200 OK\r\n"
+                    "Content-Type: application/x-tar\r\n"
+                    "Content-Disposition: attachment; filename=\"batch.tar\"\r\n"
+                    "Connection: close\r\n\r\n");
+    } else {
+        dprintf(fd, "HTTP/1.1 200 OK\r\n"
+                    "Content-Type: multipart/mixed; boundary=" BATCH_BOUNDARY "\r\n"
+                    "Connection: close\r\n\r\n");
+    }
+
+    // A client that goes away should stop the batch, not kill this process
+    // while its jobs are still running.
+    signal(SIGPIPE, SIG_IGN);
+
+    long max_running = sysconf(_SC_NPROCESSORS_ONLN);
+    if (max_running < 1) {
+        max_running = 1;
+    }
+    int next = 0;
+    int running = 0;
+    int client_ok = 1;
+    Bitmap *bmp = NULL;
+    const char *bmp_image = NULL;
+
+    while (client_ok && (next < num_jobs || running > 0)) {
+        // Start as many jobs as there are free CPUs.
+        while (client_ok && next < num_jobs && running < max_running) {
+            BatchJob *job = &jobs[next++];
+            if (cache_lookup(job->filter, job->image, path, sizeof(path))) {
+                client_ok = send_result(fd, format, job, path) == 0;
+                continue;
+            }
+
+            if (find_builtin_filter(job->filter) != NULL && job->image != bmp_image) {
+                if (bmp != NULL) {
+                    free_bitmap(bmp);
+                }
+                snprintf(path, sizeof(path), "%s%s", IMAGE_DIR, job->image);
+                bmp = read_bitmap(path);
+                bmp_image = job->image;
+            }
+
+            if (start_job(job, bmp) == -1) {
+                client_ok = send_error(fd, format, job, "Couldn't run the filter.") == 0;
+                continue;
+            }
+            running++;
+        }
+        if (!client_ok || running == 0) {
+            continue;
+        }
+
+        // Stream whichever job finishes first.
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("waitpid");
+            break;
+        }
+        for (int i = 0; i < next; i++) {
+            BatchJob *job = &jobs[i];
+            if (job->pid != pid) {
+                continue;
+            }
+            // In case it died before giving up its slot.
+            release_job(pid);
+            job->pid = 0;
+            running--;
+            if (WIFEXITED(status) && WEXITSTATUS(status) == 0 &&
+                    cache_commit(job->tmp_path, job->filter, job->image) == 0) {
+                cache_path(path, sizeof(path), job->filter, job->image);
+                client_ok = send_result(fd, format, job, path) == 0;
+            } else {
+                unlink(job->tmp_path);
+                client_ok = send_error(fd, format, job, "The filter failed.") == 0;
+            }
+            break;
+        }
+    }
+
+    if (client_ok) {
+        if (format == FORMAT_TAR) {
+            // An archive ends with two zero blocks.
+            char end[2 * TAR_BLOCK] = {0};
+            write_all(fd, end, sizeof(end));
+        } else {
+            dprintf(fd, "--" BATCH_BOUNDARY "--\r\n");
+        }
+    } else {
+        // Nobody is listening anymore: abandon the remaining jobs.
+        for (int i = 0; i < next; i++) {
+            if (jobs[i].pid > 0) {
+                kill(jobs[i].pid, SIGKILL);
+                waitpid(jobs[i].pid, NULL, 0);
+                release_job(jobs[i].pid);
+                unlink(jobs[i].tmp_path);
+            }
+        }
+    }
+
+    if (bmp != NULL) {
+        free_bitmap(bmp);
+    }
+    free(jobs);
+}
+
+
+/*
+ * Split a comma-separated list in place, storing the items in <items>.
+ * Return the number of items, or -1 if there are more than <max_items>.
+ */
+int split_list(char *list, char **items, int max_items) {
+    int count = 0;
+    char *saveptr;
+    for (char *item = strtok_r(list, ",", &saveptr); item != NULL;
+            item = strtok_r(NULL, ",", &saveptr)) {
+        if (count == max_items) {
+            return -1;
+        }
+        items[count++] = item;
+    }
+    return count;
+}
+
+
+/*
+ * Fork a process that writes the output of the job to a new cache file.
+ * Built-in filters run on <bmp>, the decoded image of the job, which the
+ * child shares with this process until either writes to it.
+ * Return 0 on success, -1 on failure.
+ */
+int start_job(BatchJob *job, const Bitmap *bmp) {
+    const BuiltinFilter *builtin = find_builtin_filter(job->filter);
+    if (builtin != NULL && bmp == NULL) {
+        return -1;  // The image couldn't be decoded.
+    }
+
+    int out_fd = cache_create(job->filter, job->image, job->tmp_path, sizeof(job->tmp_path));
+    if (out_fd == -1) {
+        return -1;
+    }
+
+    job->pid = fork();
+    if (job->pid == 0) {
+        // Each job waits for the scheduler like a single filter request, and
+        // gives up its slot as soon as its output is written.
+        char imagepath[MAX_PATH];
+        snprintf(imagepath, sizeof(imagepath), "%s%s", IMAGE_DIR, job->image);
+        schedule_filter(job->filter, imagepath, 1);
+        int ok;
+        if (builtin != NULL) {
+            Pixel *out = run_builtin_filter(builtin, bmp);
+            ok = write_bitmap(out_fd, bmp, out) == 0;
+        } else {
+            int in_fd = open(imagepath, O_RDONLY);
+            int status = (in_fd == -1) ? -1 : run_filter(job->filter, in_fd, out_fd);
+            ok = status != -1 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        }
+        finish_job();
+        exit(ok ? 0 : 1);
+    } else if (job->pid < 0) {
+        perror("fork");
+    }
+    close(out_fd);
+
+    if (job->pid <= 0) {
+        job->pid = 0;
+        unlink(job->tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * Stream the file at <path> as the result of the job.
+ * Return 0 on success, -1 if the client can't be written to.
+ */
+int send_result(int fd, int format, const BatchJob *job, const char *path) {
+    int file_fd = open(path, O_RDONLY);
+    if (file_fd == -1) {
+        return send_error(fd, format, job, "Couldn't open the result.");
+    }
+    struct stat st;
+    fstat(file_fd, &st);
+
+    int result = write_part_header(fd, format, job, "", "image/bmp", st.st_size);
+    off_t offset = 0;
+    while (result == 0 && offset < st.st_size) {
+        if (sendfile(fd, file_fd, &offset, st.st_size - offset) <= 0) {
+            result = -1;
+        }
+    }
+    close(file_fd);
+
+    if (result == 0) {
+        result = write_part_trailer(fd, format, st.st_size);
+    }
+    return result;
+}
+
+
+/*
+ * Stream an error message in place of the result of the job. In a tar
+ * archive it becomes the file "<filter>/<image>.error".
+ * Return 0 on success, -1 if the client can't be written to.
+ */
+int send_error(int fd, int format, const BatchJob *job, const char *message) {
+    long size = strlen(message);
+    if (write_part_header(fd, format, job, ".error", "text/plain", size) == -1 ||
+            write_all(fd, message, size) == -1) {
+        return -1;
+    }
+    return write_part_trailer(fd, format, size);
+}
+
+
+/*
+ * Write what precedes the body of a result: a multipart part header, or a
+ * ustar header block with <filter> as the directory and <image><suffix> as
+ * the file name.
+ */
+int write_part_header(int fd, int format, const BatchJob *job, const char *suffix,
+                      const char *content_type, long size) {
+    if (format == FORMAT_MULTIPART) {
+        char header[MAXLINE];
+        int len = snprintf(header, sizeof(header),
+                           "--" BATCH_BOUNDARY "\r\n"
+                           "Content-Type: %s\r\n"
+                           "Content-Disposition: attachment; filename=\"%s/%s%s\"\r\n"
+                           "Content-Length: %ld\r\n\r\n",
+                           content_type, job->filter, job->image, suffix, size);
+        return write_all(fd, header, len);
+    }
+
+    char block[TAR_BLOCK] = {0};
+    snprintf(block, 100, "%s%s", job->image, suffix);            // name
+    sprintf(block + 100, "%07o", 0644);                          // mode
+    sprintf(block + 108, "%07o", 0);                             // uid
+    sprintf(block + 116, "%07o", 0);                             // gid
+    sprintf(block + 124, "%011lo", (unsigned long) size);        // size
+    sprintf(block + 136, "%011lo", (unsigned long) time(NULL));  // mtime
+    block[156] = '0';                                            // regular file
+    memcpy(block + 257, "ustar", 6);                             // magic
+    memcpy(block + 263, "00", 2);                                // version
+    snprintf(block + 345, 155, "%s", job->filter);               // prefix
+
+    // The checksum is computed with its own field set to spaces.
+    memset(block + 148, ' ', 8);
+    unsigned int checksum = 0;
+    for (int i = 0; i < TAR_BLOCK; i++) {
+        checksum += (unsigned char) block[i];
+    }
+    sprintf(block + 148, "%06o", checksum);
+    block[155] = ' ';
+    return write_all(fd, block, TAR_BLOCK);
+}
+
+
+/*
+ * Write what follows a body of <size> bytes: the line break before the next
+ * boundary, or padding to a whole tar block.
+ */
+int write_part_trailer(int fd, int format, long size) {
+    if (format == FORMAT_MULTIPART) {
+        return write_all(fd, "\r\n", 2);
+    }
+    char padding[TAR_BLOCK] = {0};
+    return write_all(fd, padding, (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK);
+}
+
+
+/*
+ * Write all of <buf> to <fd>. Return 0 on success, -1 on failure.
+ */
+int write_all(int fd, const char *buf, long size) {
+    long written = 0;
+    while (written < size) {
+        int numWritten = write(fd, buf + written, size - written);
+        if (numWritten <= 0) {
+            return -1;
+        }
+        written += numWritten;
+    }
+    return 0;
+}
@@ -0,0 +1,32 @@
+#ifndef BATCH_H_
+#define BATCH_H_
+
+#include "request.h"
+
+#define IMAGE_BATCH "/image-batch"
+
+// Limits on the size of a single batch request.
+#define MAX_BATCH_IMAGES 32
+#define MAX_BATCH_FILTERS 16
+
+#define BATCH_BOUNDARY "image-batch-boundary"
+
+
+/*
+ * Respond to an image-batch request, of the form
+ *   /image-batch?images=<a.bmp>,<b.bmp>&filters=<f1>,<f2>&format=<multipart|tar>
+ *
+ * Every filter is run on every image. Each image is decoded once, and the
+ * built-in filters run on its decoded pixels in forked jobs that share them
+ * copy-on-write; other filters are exec'd as usual. Up to one job per CPU
+ * is started at a time, each waiting for the filter scheduler like a single
+ * filter request, and each result is streamed back as soon as its job is
+ * done, either as one part of a multipart/mixed body (the default) or as one
+ * file "<filter>/<image>" of an uncompressed tar archive.
+ *
+ * Results are written through the filter cache, so cached ones are streamed
+ * without running anything.
+ */
+void image_batch_response(int fd, const ReqData *reqData);
+
+#endif /* BATCH_H_ */
@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#include "socket.h"
+
+#ifndef PORT
+#define PORT 30000
+#endif
+
+#define BUFSIZE 65536
+
+/*
+ * A small load generator for comparing server builds and I/O backends, e.g.
+ *     ./image_server &        then    ./bench -c 8 -n 2000 /main.html
+ *     ./image_server -u &     then    ./bench -c 8 -n 2000 /main.html
+ *
+ * Each of the <concurrency> worker processes issues its share of the requests
+ * one after another, and reports the latency of each back to the parent,
+ * which prints the throughput and latency distribution.
+ */
+
+
+double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+
+/*
+ * Send one GET request for <path> and read the whole response.
+ * Return the latency in microseconds, or -1 on failure.
+ */
+double timed_request(const char *host, int port, const char *path) {
+    char buf[BUFSIZE];
+    double start = now_us();
+
+    // A refused or timed-out connect (e.g. the listen backlog overflowed)
+    // counts as a failed request; the worker carries on with the next one.
+    int soc = try_connect_to_server(port, host, 0);
+    if (soc == -1) {
+        return -1;
+    }
+    int len = snprintf(buf, sizeof(buf), "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n", path, host);
+    if (write(soc, buf, len) != len) {
+        close(soc);
+        return -1;
+    }
+    // The server closes the connection once the response is complete.
+    int numRead;
+    while ((numRead = read(soc, buf, sizeof(buf))) > 0) {
+    }
+    close(soc);
+    return (numRead == 0) ? now_us() - start : -1;
+}
+
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+
+int main(int argc, char **argv) {
+    int concurrency = 4;
+    int requests = 1000;
+    char *host = "localhost";
+    int port = PORT;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "c:n:h:p:")) != -1) {
+        switch (opt) {
+        case 'c':
+            concurrency = strtol(optarg, NULL, 10);
+            break;
+        case 'n':
+            requests = strtol(optarg, NULL, 10);
+            break;
+        case 'h':
+            host = optarg;
+            break;
+        case 'p':
+            port = strtol(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-c concurrency] [-n requests] [-h host] [-p port] [path]\n",
+                    argv[0]);
+            exit(1);
+        }
+    }
+    char *path = (optind < argc) ? argv[optind] : "/main.html";
+    if (concurrency <= 0 || requests < concurrency) {
+        fprintf(stderr, "bench: need at least one request per worker\n");
+        exit(1);
+    }
+
+    int fd[2];
+    if (pipe(fd) == -1) {
+        perror("pipe");
+        exit(1);
+    }
+
+    double start = now_us();
+    for (int i = 0; i < concurrency; i++) {
+        int result = fork();
+        if (result < 0) {
+            perror("fork");
+            exit(1);
+        } else if (result == 0) {
+            close(fd[0]);
+            int share = requests / concurrency + (i < requests % concurrency);
+            for (int j = 0; j < share; j++) {
+                double latency = timed_request(host, port, path);
+                write(fd[1], &latency, sizeof(latency));
+            }
+            exit(0);
+        }
+    }
+    close(fd[1]);
+
+    double *latencies = malloc(requests * sizeof(double));
+    int count = 0;
+    int failed = 0;
+    double latency;
+    while (read(fd[0], &latency, sizeof(latency)) == sizeof(latency)) {
+        if (latency < 0) {
+            failed++;
+        } else {
+            latencies[count++] = latency;
+        }
+    }
+    double elapsed = now_us() - start;
+    while (wait(NULL) > 0) {
+    }
+
+    if (count == 0) {
+        fprintf(stderr, "bench: every request failed\n");
+        exit(1);
+    }
+    qsort(latencies, count, sizeof(double), compare_doubles);
+    double total = 0;
+    for (int i = 0; i < count; i++) {
+        total += latencies[i];
+    }
+
+    printf("requests: %d ok, %d failed in %.2f s (%.0f req/s)\n",
+           count, failed, elapsed / 1e6, count / (elapsed / 1e6));
+    printf("latency (us): mean %.0f  p50 %.0f  p90 %.0f  p99 %.0f  max %.0f\n",
+           total / count, latencies[count / 2], latencies[count * 9 / 10],
+           latencies[count * 99 / 100], latencies[count - 1]);
+    free(latencies);
+    return 0;
+}
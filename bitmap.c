@@ -0,0 +1,261 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "bitmap.h"
+#include "uring.h"
+
+
+long bitmap_row_size(int width) {
+    return ((long) width * 3 + 3) & ~3L;
+}
+
+
+/*
+ * Check the dimensions read from a header, making a negative <height> (rows
+ * stored top-down) positive. Return 0 if they are within MAX_BITMAP_SIDE,
+ * -1 otherwise.
+ */
+static int check_dimensions(int width, int *height) {
+    long abs_height = (*height < 0) ? -(long) *height : *height;
+    if (width <= 0 || width > MAX_BITMAP_SIDE || abs_height <= 0 || abs_height > MAX_BITMAP_SIDE) {
+        return -1;
+    }
+    *height = abs_height;
+    return 0;
+}
+
+
+/*
+ * Read the whole file at <path> into a newly allocated buffer, storing its
+ * size in <size>. Return NULL on failure.
+ */
+static unsigned char *read_whole_file(const char *path, long *size) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return NULL;
+    }
+
+    unsigned char *data = malloc(st.st_size);
+    if (data == NULL) {
+        close(fd);
+        return NULL;
+    }
+    long total = 0;
+    Uring *ring = uring_for_request();
+    if (ring != NULL) {
+        close(fd);
+        total = uring_read_file(ring, path, data, st.st_size);
+    } else {
+        int numRead;
+        while (total < st.st_size &&
+                (numRead = read(fd, data + total, st.st_size - total)) > 0) {
+            total += numRead;
+        }
+        close(fd);
+    }
+
+    if (total != st.st_size) {
+        free(data);
+        return NULL;
+    }
+    *size = total;
+    return data;
+}
+
+
+Bitmap *read_bitmap(const char *path) {
+    long size;
+    unsigned char *data = read_whole_file(path, &size);
+    if (data == NULL) {
+        return NULL;
+    }
+
+    int offset;
+    int width;
+    int height;
+    short bpp;
+    if (size < BMP_MIN_HEADER || data[0] != 'B' || data[1] != 'M') {
+        free(data);
+        return NULL;
+    }
+    memcpy(&offset, data + BMP_OFFSET_FIELD, sizeof(int));
+    memcpy(&width, data + BMP_WIDTH_FIELD, sizeof(int));
+    memcpy(&height, data + BMP_HEIGHT_FIELD, sizeof(int));
+    memcpy(&bpp, data + BMP_BPP_FIELD, sizeof(short));
+
+    // A negative height means the rows are stored top-down; the row order
+    // doesn't matter to us as long as it is preserved.
+    if (bpp != 24 || check_dimensions(width, &height) == -1 ||
+            (long) width * height > MAX_BITMAP_PIXELS || offset < BMP_MIN_HEADER ||
+            offset + bitmap_row_size(width) * height > size) {
+        free(data);
+        return NULL;
+    }
+
+    Bitmap *bmp = malloc(sizeof(Bitmap));
+    bmp->header_size = offset;
+    bmp->header = malloc(offset);
+    bmp->width = width;
+    bmp->height = height;
+    bmp->pixels = malloc(sizeof(Pixel) * (long) width * height);
+    if (bmp->header == NULL || bmp->pixels == NULL) {
+        free(data);
+        free_bitmap(bmp);
+        return NULL;
+    }
+    memcpy(bmp->header, data, offset);
+    for (int y = 0; y < height; y++) {
+        memcpy(bmp->pixels + (long) y * width, data + offset + (long) y * bitmap_row_size(width),
+               sizeof(Pixel) * width);
+    }
+
+    free(data);
+    return bmp;
+}
+
+
+long bitmap_file_size(const Bitmap *bmp) {
+    return bmp->header_size + bitmap_row_size(bmp->width) * bmp->height;
+}
+
+
+int write_bitmap(int fd, const Bitmap *bmp, const Pixel *pixels) {
+    // Build the whole file in memory so it goes out in one write.
+    long size = bitmap_file_size(bmp);
+    unsigned char *data = calloc(size, 1);
+    if (data == NULL) {
+        perror("calloc");
+        return -1;
+    }
+    memcpy(data, bmp->header, bmp->header_size);
+    for (int y = 0; y < bmp->height; y++) {
+        memcpy(data + bmp->header_size + y * bitmap_row_size(bmp->width),
+               pixels + (long) y * bmp->width, sizeof(Pixel) * bmp->width);
+    }
+
+    long written = 0;
+    int result = 0;
+    while (written < size) {
+        int numWritten = write(fd, data + written, size - written);
+        if (numWritten <= 0) {
+            perror("write");
+            result = -1;
+            break;
+        }
+        written += numWritten;
+    }
+    free(data);
+    return result;
+}
+
+
+void bitmap_header(unsigned char *header, int width, int height) {
+    long abs_height = (height < 0) ? -(long) height : height;
+    long image_size = bitmap_row_size(width) * abs_height;
+    long file_size = BMP_MIN_HEADER + image_size;
+    // The fields are 32 bits; 0 is allowed for the image size, and readers
+    // (ours included) go by the dimensions rather than either.
+    unsigned int file_size_field = (file_size <= 0xffffffffL) ? file_size : 0;
+    unsigned int image_size_field = (image_size <= 0xffffffffL) ? image_size : 0;
+    int offset = BMP_MIN_HEADER;
+    int info_size = BMP_MIN_HEADER - 14;  // BITMAPINFOHEADER follows the file header.
+    short planes = 1;
+    short bpp = 24;
+    int resolution = 2835;  // 72 DPI, in pixels per meter.
+
+    memset(header, 0, BMP_MIN_HEADER);
+    header[0] = 'B';
+    header[1] = 'M';
+    memcpy(header + 2, &file_size_field, sizeof(int));
+    memcpy(header + BMP_OFFSET_FIELD, &offset, sizeof(int));
+    memcpy(header + 14, &info_size, sizeof(int));
+    memcpy(header + BMP_WIDTH_FIELD, &width, sizeof(int));
+    memcpy(header + BMP_HEIGHT_FIELD, &height, sizeof(int));
+    memcpy(header + 26, &planes, sizeof(short));
+    memcpy(header + BMP_BPP_FIELD, &bpp, sizeof(short));
+    memcpy(header + 34, &image_size_field, sizeof(int));
+    memcpy(header + 38, &resolution, sizeof(int));
+    memcpy(header + 42, &resolution, sizeof(int));
+}
+
+
+Bitmap *new_bitmap(int width, int height) {
+    Bitmap *bmp = malloc(sizeof(Bitmap));
+    bmp->header_size = BMP_MIN_HEADER;
+    bmp->header = malloc(BMP_MIN_HEADER);
+    bitmap_header(bmp->header, width, height);
+    bmp->width = width;
+    bmp->height = height;
+    bmp->pixels = malloc(sizeof(Pixel) * (long) width * height);
+    if (bmp->header == NULL || bmp->pixels == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    return bmp;
+}
+
+
+int open_bitmap_file(const char *path, BitmapFile *file) {
+    unsigned char header[BMP_MIN_HEADER];
+    file->fd = open(path, O_RDONLY);
+    if (file->fd == -1) {
+        return -1;
+    }
+    struct stat st;
+    short bpp;
+    if (fstat(file->fd, &st) == -1 ||
+            pread(file->fd, header, BMP_MIN_HEADER, 0) != BMP_MIN_HEADER ||
+            header[0] != 'B' || header[1] != 'M') {
+        close(file->fd);
+        return -1;
+    }
+    memcpy(&file->offset, header + BMP_OFFSET_FIELD, sizeof(int));
+    memcpy(&file->width, header + BMP_WIDTH_FIELD, sizeof(int));
+    memcpy(&file->height, header + BMP_HEIGHT_FIELD, sizeof(int));
+    memcpy(&bpp, header + BMP_BPP_FIELD, sizeof(short));
+    file->top_down = file->height < 0;
+    if (bpp != 24 || check_dimensions(file->width, &file->height) == -1 ||
+            file->offset < BMP_MIN_HEADER ||
+            file->offset + bitmap_row_size(file->width) * file->height > st.st_size) {
+        close(file->fd);
+        return -1;
+    }
+    return 0;
+}
+
+
+int read_bitmap_row(const BitmapFile *file, int y, int x, int n, Pixel *out) {
+    int row = file->top_down ? y : file->height - 1 - y;
+    off_t start = file->offset + row * bitmap_row_size(file->width) + (off_t) x * sizeof(Pixel);
+    long size = (long) n * sizeof(Pixel);
+    long total = 0;
+    while (total < size) {
+        ssize_t numRead = pread(file->fd, (char *) out + total, size - total, start + total);
+        if (numRead <= 0) {
+            return -1;
+        }
+        total += numRead;
+    }
+    return 0;
+}
+
+
+void close_bitmap_file(BitmapFile *file) {
+    close(file->fd);
+}
+
+
+void free_bitmap(Bitmap *bmp) {
+    free(bmp->header);
+    free(bmp->pixels);
+    free(bmp);
+}
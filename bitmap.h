@@ -0,0 +1,106 @@
+#ifndef BITMAP_H_
+#define BITMAP_H_
+
+// Offsets of the fields we need in a BMP file header.
+#define BMP_OFFSET_FIELD 10   // Start of the pixel array.
+#define BMP_WIDTH_FIELD 18
+#define BMP_HEIGHT_FIELD 22
+#define BMP_BPP_FIELD 28      // Bits per pixel; only 24 is supported.
+#define BMP_MIN_HEADER 54
+
+// Largest bitmaps we read, so sizes computed from a header can't overflow
+// and a crafted one can't ask for gigabytes.
+#define MAX_BITMAP_SIDE (1 << 20)           // Pixels in a row or column.
+#define MAX_BITMAP_PIXELS (1L << 28)        // When decoded whole.
+
+
+// One pixel of a 24-bit bitmap, in the order it is stored in the file.
+typedef struct pixel {
+    unsigned char blue;
+    unsigned char green;
+    unsigned char red;
+} Pixel;
+
+
+/*
+ * A decoded 24-bit bitmap. The header is kept verbatim so filtered output
+ * can be written with exactly the same header. Pixels are stored without
+ * row padding, in the same row order as the file (usually bottom-up).
+ */
+typedef struct {
+    int header_size;          // Number of bytes before the pixel array.
+    unsigned char *header;
+    int width;
+    int height;
+    Pixel *pixels;            // width * height pixels.
+} Bitmap;
+
+
+/*
+ * A bitmap file opened to be read a row (or part of one) at a time, for
+ * images too large to decode whole.
+ */
+typedef struct {
+    int fd;
+    int offset;               // Start of the pixel array.
+    int width;
+    int height;
+    int top_down;             // The rows are stored top to bottom.
+} BitmapFile;
+
+
+/*
+ * Read and decode the bitmap file at <path>.
+ * Return NULL if it can't be read or is not a 24-bit bitmap.
+ */
+Bitmap *read_bitmap(const char *path);
+
+/*
+ * Write a bitmap with the header of <bmp> and the given pixels (which must
+ * have the dimensions of <bmp>) to <fd>. Return 0 on success, -1 on failure.
+ */
+int write_bitmap(int fd, const Bitmap *bmp, const Pixel *pixels);
+
+/*
+ * Return the size in bytes of the file write_bitmap produces for <bmp>.
+ */
+long bitmap_file_size(const Bitmap *bmp);
+
+/*
+ * Return the number of bytes a row of <width> pixels takes up in the file:
+ * rows are padded to a multiple of 4 bytes.
+ */
+long bitmap_row_size(int width);
+
+/*
+ * Fill in the BMP_MIN_HEADER bytes of a header for a 24-bit bitmap of the
+ * given dimensions, whose pixels follow it. A negative <height> marks the
+ * rows as stored top-down, as in the file format.
+ */
+void bitmap_header(unsigned char *header, int width, int height);
+
+/*
+ * Return a new bitmap of the given dimensions, with a header of its own
+ * (rows stored bottom-up) and uninitialized pixels. Exits if it can't be
+ * allocated.
+ */
+Bitmap *new_bitmap(int width, int height);
+
+void free_bitmap(Bitmap *bmp);
+
+/*
+ * Open the 24-bit bitmap file at <path> and read its header into <file>.
+ * Return 0 on success, -1 if it can't be read or isn't a 24-bit bitmap.
+ */
+int open_bitmap_file(const char *path, BitmapFile *file);
+
+/*
+ * Read the <n> pixels starting at column <x> of row <y> (counted from the
+ * top of the image, whatever the row order in the file) into <out>.
+ * Return 0 on success, -1 on failure.
+ */
+int read_bitmap_row(const BitmapFile *file, int y, int x, int n, Pixel *out);
+
+void close_bitmap_file(BitmapFile *file);
+
+#endif /* BITMAP_H_ */
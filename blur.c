@@ -0,0 +1,170 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "blur.h"
+#include "parallel.h"
+#include "isa.h"
+
+// Minimum number of rows or columns worth handing to another thread.
+#define MIN_ROWS_PER_THREAD 16
+#define MIN_COLUMNS_PER_THREAD 64
+
+// One box blur pass over a whole image, in one direction.
+typedef struct {
+    const Pixel *src;
+    Pixel *dst;
+    int width;
+    int height;
+    int radius;                    // The box is 2 * radius + 1 pixels wide.
+    unsigned long long inverse;    // 2^32 / box width, rounded up.
+} BoxPass;
+
+
+void box_sizes(double sigma, int sizes[BLUR_PASSES]) {
+    // The widest odd box no larger than the ideal width, and the next odd
+    // width up; m passes of the first and the rest of the second give the
+    // closest variance to sigma^2 (Kovesi, "Fast almost-Gaussian filtering").
+    double ideal = sqrt(12 * sigma * sigma / BLUR_PASSES + 1);
+    int lower = floor(ideal);
+    if (lower % 2 == 0) {
+        lower--;
+    }
+    int upper = lower + 2;
+    int m = round((12 * sigma * sigma - BLUR_PASSES * lower * lower - 4 * BLUR_PASSES * lower
+                   - 3 * BLUR_PASSES) / (-4 * lower - 4));
+    for (int i = 0; i < BLUR_PASSES; i++) {
+        sizes[i] = (i < m) ? lower : upper;
+    }
+}
+
+
+/*
+ * Return the average of <sum> over the box, rounded to nearest, using a
+ * multiplication instead of a division. This is exact for boxes up to 4096
+ * pixels wide, far more than MAX_SIGMA needs.
+ */
+static inline unsigned char box_average(int sum, const BoxPass *pass) {
+    return ((unsigned long long) (sum + pass->radius) * pass->inverse) >> 32;
+}
+
+
+static inline int clamp(int i, int n) {
+    return (i < 0) ? 0 : (i >= n) ? n - 1 : i;
+}
+
+
+/*
+ * Box blur rows [start, end) horizontally with running sums, so the cost
+ * per pixel doesn't depend on the radius. The image edges are extended.
+ */
+static inline __attribute__((always_inline))
+void box_rows_kernel(void *arg, int start, int end) {
+    const BoxPass *pass = arg;
+    const int width = pass->width;
+    const int r = pass->radius;
+
+    for (int y = start; y < end; y++) {
+        const Pixel *in = pass->src + (long) y * width;
+        Pixel *o = pass->dst + (long) y * width;
+
+        int blue = (r + 1) * in[0].blue;
+        int green = (r + 1) * in[0].green;
+        int red = (r + 1) * in[0].red;
+        for (int i = 1; i <= r; i++) {
+            const Pixel *p = &in[clamp(i, width)];
+            blue += p->blue;
+            green += p->green;
+            red += p->red;
+        }
+
+        for (int x = 0; x < width; x++) {
+            o[x].blue = box_average(blue, pass);
+            o[x].green = box_average(green, pass);
+            o[x].red = box_average(red, pass);
+            const Pixel *add = &in[clamp(x + r + 1, width)];
+            const Pixel *sub = &in[clamp(x - r, width)];
+            blue += add->blue - sub->blue;
+            green += add->green - sub->green;
+            red += add->red - sub->red;
+        }
+    }
+}
+
+
+/*
+ * Box blur columns [start, end) vertically. The columns are swept together
+ * a row at a time, so memory is still read in order.
+ */
+static inline __attribute__((always_inline))
+void box_columns_kernel(void *arg, int start, int end) {
+    const BoxPass *pass = arg;
+    const int width = pass->width;
+    const int height = pass->height;
+    const int r = pass->radius;
+    const int n = end - start;
+    int *sums = malloc(sizeof(int) * 3 * n);
+
+    const Pixel *first = pass->src + start;
+    for (int x = 0; x < n; x++) {
+        sums[3 * x] = (r + 1) * first[x].blue;
+        sums[3 * x + 1] = (r + 1) * first[x].green;
+        sums[3 * x + 2] = (r + 1) * first[x].red;
+    }
+    for (int i = 1; i <= r; i++) {
+        const Pixel *row = pass->src + (long) clamp(i, height) * width + start;
+        for (int x = 0; x < n; x++) {
+            sums[3 * x] += row[x].blue;
+            sums[3 * x + 1] += row[x].green;
+            sums[3 * x + 2] += row[x].red;
+        }
+    }
+
+    for (int y = 0; y < height; y++) {
+        const Pixel *add = pass->src + (long) clamp(y + r + 1, height) * width + start;
+        const Pixel *sub = pass->src + (long) clamp(y - r, height) * width + start;
+        Pixel *o = pass->dst + (long) y * width + start;
+        for (int x = 0; x < n; x++) {
+            o[x].blue = box_average(sums[3 * x], pass);
+            o[x].green = box_average(sums[3 * x + 1], pass);
+            o[x].red = box_average(sums[3 * x + 2], pass);
+            sums[3 * x] += add[x].blue - sub[x].blue;
+            sums[3 * x + 1] += add[x].green - sub[x].green;
+            sums[3 * x + 2] += add[x].red - sub[x].red;
+        }
+    }
+    free(sums);
+}
+
+
+// Both passes compiled for each instruction set (see isa.h).
+ISA_VARIANTS(box_rows, box_rows_kernel, (void *arg, int start, int end), (arg, start, end))
+ISA_VARIANTS(box_columns, box_columns_kernel, (void *arg, int start, int end), (arg, start, end))
+
+
+void gaussian_blur_sigma(const Bitmap *bmp, Pixel *out, double sigma) {
+    long n = (long) bmp->width * bmp->height;
+    Pixel *tmp = malloc(sizeof(Pixel) * n);
+    memcpy(out, bmp->pixels, sizeof(Pixel) * n);
+
+    int sizes[BLUR_PASSES];
+    box_sizes(sigma, sizes);
+    for (int i = 0; i < BLUR_PASSES; i++) {
+        if (sizes[i] <= 1) {
+            continue;
+        }
+        BoxPass pass = {
+            .src = out,
+            .dst = tmp,
+            .width = bmp->width,
+            .height = bmp->height,
+            .radius = sizes[i] / 2,
+            .inverse = ((1ULL << 32) + sizes[i] - 1) / sizes[i]
+        };
+        parallel_for(bmp->height, MIN_ROWS_PER_THREAD, ISA_CALL(box_rows), &pass);
+        pass.src = tmp;
+        pass.dst = out;
+        parallel_for(bmp->width, MIN_COLUMNS_PER_THREAD, ISA_CALL(box_columns), &pass);
+    }
+    free(tmp);
+}
@@ -0,0 +1,51 @@
+#ifndef BLUR_H_
+#define BLUR_H_
+
+#include "bitmap.h"
+
+/*
+ * Gaussian blur of any strength, requested as
+ *     /image-filter?image=dog.bmp&filter=gaussian_blur&sigma=10
+ *
+ * Approximated by BLUR_PASSES successive box blurs whose widths are chosen
+ * so their combined variance is as close as possible to sigma^2. Each box
+ * blur is a horizontal and a vertical pass of running sums, so the cost per
+ * pixel is the same for any sigma. Rows (then columns) are split across
+ * threads.
+ *
+ * Error against a true Gaussian (float, truncated at 4 sigma), as reported
+ * by ./validate images/dog.bmp (which tiles it to 1000x1000 for this), in
+ * channel levels out of 255. "Interior" excludes a band of 3 sigma along
+ * the edges:
+ *
+ *     sigma    max    mean    interior max    interior mean
+ *       5        6    0.34          2              0.34
+ *      10       16    0.41          3              0.40
+ *      20       19    0.87          3              0.78
+ *      50       24    1.37          3              0.69
+ *
+ * Away from the edges the error stays under one level on average. In the
+ * edge band it is larger, since each box pass extends the edge pixels of
+ * an already blurred image rather than of the original. Over three runs of
+ * ./validate the box blur took 17-27 ms for every sigma; the exact one
+ * 0.26-0.28 s at sigma 5, rising to 3.2-3.8 s at sigma 50.
+ */
+
+#define BLUR_PASSES 3
+#define MIN_SIGMA 0.5
+#define MAX_SIGMA 100
+
+
+/*
+ * Store the widths (all odd) of the box blurs approximating a Gaussian of
+ * the given sigma in <sizes>.
+ */
+void box_sizes(double sigma, int sizes[BLUR_PASSES]);
+
+/*
+ * Blur <bmp> with a Gaussian of the given sigma, writing the result to
+ * <out>, which must have the dimensions of <bmp>.
+ */
+void gaussian_blur_sigma(const Bitmap *bmp, Pixel *out, double sigma);
+
+#endif /* BLUR_H_ */
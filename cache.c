@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+#include "request.h"
+
+
+void cache_path(char *path, int size, const char *filter, const char *image) {
+    snprintf(path, size, "%s%s/%s", CACHE_DIR, filter, image);
+}
+
+
+int cache_lookup(const char *filter, const char *image, char *path, int size) {
+    return cache_lookup_entry(filter, image, image, path, size);
+}
+
+
+int cache_lookup_entry(const char *filter, const char *entry, const char *image,
+                       char *path, int size) {
+    char imagepath[MAX_PATH];
+    struct stat image_st;
+    struct stat cache_st;
+
+    snprintf(imagepath, sizeof(imagepath), "%s%s", IMAGE_DIR, image);
+    cache_path(path, size, filter, entry);
+
+    if (stat(imagepath, &image_st) == -1 || stat(path, &cache_st) == -1) {
+        return 0;
+    }
+    // A stale entry (e.g. the image was replaced) is treated as a miss. The
+    // two are often written within the same second, so compare nanoseconds.
+    if (cache_st.st_mtim.tv_sec < image_st.st_mtim.tv_sec ||
+            (cache_st.st_mtim.tv_sec == image_st.st_mtim.tv_sec &&
+             cache_st.st_mtim.tv_nsec < image_st.st_mtim.tv_nsec)) {
+        return 0;
+    }
+    return 1;
+}
+
+
+int cache_create(const char *filter, const char *image, char *tmp_path, int size) {
+    char dir[MAX_PATH];
+
+    // Make sure both cache/ and cache/<filter>/ exist.
+    if (mkdir(CACHE_DIR, 0755) == -1 && errno != EEXIST) {
+        perror("mkdir");
+        return -1;
+    }
+    snprintf(dir, sizeof(dir), "%s%s", CACHE_DIR, filter);
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+        perror("mkdir");
+        return -1;
+    }
+
+    // The pid makes the name unique, so concurrent fills never collide.
+    snprintf(tmp_path, size, "%s/.%s.%d", dir, image, getpid());
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror("open");
+    }
+    return fd;
+}
+
+
+int cache_commit(const char *tmp_path, const char *filter, const char *image) {
+    char path[MAX_PATH];
+    cache_path(path, sizeof(path), filter, image);
+
+    // rename is atomic, so readers either see the old entry or the new one.
+    if (rename(tmp_path, path) == -1) {
+        perror("rename");
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+
+pid_t spawn_filter(const char *filter, const char *image, int out_fd) {
+    char filepath[MAX_PATH];
+    char imagepath[MAX_PATH];
+    snprintf(filepath, sizeof(filepath), "%s%s", FILTER_DIR, filter);
+    snprintf(imagepath, sizeof(imagepath), "%s%s", IMAGE_DIR, image);
+
+    int in_fd = open(imagepath, O_RDONLY);
+    if (in_fd == -1) {
+        perror("open");
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        close(in_fd);
+        return -1;
+    } else if (pid == 0) {
+        if (dup2(in_fd, STDIN_FILENO) == -1 || dup2(out_fd, STDOUT_FILENO) == -1) {
+            perror("dup2");
+            exit(1);
+        }
+        execl(filepath, filepath, NULL);
+        perror("execl");
+        exit(1);
+    }
+
+    close(in_fd);
+    return pid;
+}
@@ -0,0 +1,51 @@
+#ifndef CACHE_H_
+#define CACHE_H_
+
+#include <sys/types.h>
+
+// Filtered images are stored as CACHE_DIR/<filter>/<image>.
+#define CACHE_DIR "cache/"
+#define MAX_PATH 512
+
+
+/*
+ * Store the path of the cached output of running <filter> on <image>
+ * into <path> (of capacity <size>).
+ */
+void cache_path(char *path, int size, const char *filter, const char *image);
+
+/*
+ * Return 1 if a cached output of running <filter> on <image> exists and is
+ * at least as new as the image itself, storing its path in <path>.
+ * Return 0 otherwise.
+ */
+int cache_lookup(const char *filter, const char *image, char *path, int size);
+
+/*
+ * Like cache_lookup, for an <entry> other than the image's own name that is
+ * derived from <image> (e.g. one tile of it), and goes stale with it.
+ */
+int cache_lookup_entry(const char *filter, const char *entry, const char *image,
+                       char *path, int size);
+
+/*
+ * Create a temporary file that will become the cached output of running
+ * <filter> on <image>, storing its path in <tmp_path>.
+ * Return the open file descriptor, or -1 on failure.
+ */
+int cache_create(const char *filter, const char *image, char *tmp_path, int size);
+
+/*
+ * Atomically publish a temporary file returned by cache_create as the cached
+ * output of running <filter> on <image>. Return 0 on success, -1 otherwise.
+ */
+int cache_commit(const char *tmp_path, const char *filter, const char *image);
+
+/*
+ * Fork a child process that runs FILTER_DIR/<filter> with its stdin reading
+ * from IMAGE_DIR/<image> and its stdout writing to <out_fd>.
+ * Return the pid of the child, or -1 on failure.
+ */
+pid_t spawn_filter(const char *filter, const char *image, int out_fd);
+
+#endif /* CACHE_H_ */
@@ -0,0 +1,104 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "capture.h"
+
+static int capture_fd = -1;
+static long keep_limit = 0;
+
+// The request being captured by this process.
+static int capturing = 0;
+static pid_t capturer = 0;   // The process that called capture_request.
+static CaptureRecord record;
+static char head[CAPTURE_MAX_HEAD];
+static int head_done;
+static char *kept = NULL;
+static long kept_size = 0;   // Allocated size of kept.
+
+
+void init_capture(const char *path, long keep_bytes) {
+    if (path == NULL || path[0] == '\0') {
+        return;
+    }
+    capture_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (capture_fd == -1) {
+        perror("open capture file");
+        exit(1);
+    }
+    keep_limit = (keep_bytes > 0) ? keep_bytes : 0;
+}
+
+
+void capture_request(const ClientState *client) {
+    if (capture_fd == -1) {
+        return;
+    }
+    capturing = 1;
+    capturer = getpid();
+    memset(&record, 0, sizeof(record));
+    record.magic = CAPTURE_MAGIC;
+    record.time_us = client->accepted_us;
+    record.body_hash = FNV_OFFSET_BASIS;
+    head_done = 0;
+    capture_bytes(client->buf, client->num_bytes);
+}
+
+
+void capture_bytes(const char *data, int size) {
+    if (!capturing) {
+        return;
+    }
+    // The head ends with the blank line (or when it can't get any longer).
+    int i = 0;
+    while (!head_done && i < size) {
+        head[record.head_len++] = data[i++];
+        head_done = record.head_len == CAPTURE_MAX_HEAD ||
+            (record.head_len >= 4 && memcmp(head + record.head_len - 4, "\r\n\r\n", 4) == 0);
+    }
+
+    for (int j = i; j < size; j++) {
+        record.body_hash = (record.body_hash ^ (unsigned char) data[j]) * FNV_PRIME;
+    }
+    record.body_len += size - i;
+
+    long keep = keep_limit - (long) record.body_kept;
+    if (keep > size - i) {
+        keep = size - i;
+    }
+    if (keep > 0) {
+        if ((long) record.body_kept + keep > kept_size) {
+            kept_size = (record.body_kept + keep) * 2;
+            if (kept_size > keep_limit) {
+                kept_size = keep_limit;
+            }
+            kept = realloc(kept, kept_size);
+        }
+        memcpy(kept + record.body_kept, data + i, keep);
+        record.body_kept += keep;
+    }
+}
+
+
+void finish_capture(void) {
+    // Children forked while a body was read (the precompute worker, a filter
+    // whose exec failed) inherit the atexit handler, but not the record.
+    if (!capturing || getpid() != capturer) {
+        return;
+    }
+    capturing = 0;
+    long size = sizeof(record) + record.head_len + record.body_kept;
+    char *buf = malloc(size);
+    memcpy(buf, &record, sizeof(record));
+    memcpy(buf + sizeof(record), head, record.head_len);
+    if (record.body_kept > 0) {
+        memcpy(buf + sizeof(record) + record.head_len, kept, record.body_kept);
+    }
+    // A single write, so records from different processes don't interleave.
+    if (write(capture_fd, buf, size) != size) {
+        perror("capture");
+    }
+    free(buf);
+}
@@ -0,0 +1,64 @@
+#ifndef CAPTURE_H_
+#define CAPTURE_H_
+
+#include <stdint.h>
+#include "request.h"
+
+/*
+ * Traffic capture, for replaying realistic load against other builds (see
+ * replay.c). With -R <file>, every request is appended to <file> as one
+ * record: when its connection was accepted, its start line and headers as
+ * sent, and its body. Bodies are kept verbatim only up to -K bytes each;
+ * the rest is recorded as its length and an FNV-1a hash, and replayed as a
+ * stand-in of the same length.
+ *
+ * Records are written with a single write to a file opened with O_APPEND,
+ * so the acceptors and request processes don't interleave them. Requests
+ * with a body are written once the body has been read, so the file is not
+ * quite in time order.
+ */
+
+#define CAPTURE_MAGIC 0x31504143   // "CAP1" in a little-endian file.
+#define CAPTURE_MAX_HEAD (4 * MAXLINE)
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+
+// Followed by head_len bytes of start line and headers (through the blank
+// line), then body_kept bytes of the body.
+typedef struct {
+    uint32_t magic;
+    uint32_t head_len;
+    uint64_t time_us;              // Monotonic, as trace_now().
+    uint64_t body_len;             // All of the body, as received.
+    uint64_t body_kept;
+    uint64_t body_hash;            // FNV-1a of all body_len bytes.
+} CaptureRecord;
+
+
+/*
+ * Open the capture file at <path> (NULL or empty turns capture off),
+ * keeping up to <keep_bytes> of each body. Must be called before the first
+ * fork.
+ */
+void init_capture(const char *path, long keep_bytes);
+
+/*
+ * Start capturing the request of <client>, from what is in client->buf.
+ * Bytes read from the socket later are added with capture_bytes.
+ */
+void capture_request(const ClientState *client);
+
+/*
+ * Add bytes read from the socket of the request being captured.
+ */
+void capture_bytes(const char *data, int size);
+
+/*
+ * Write the record of the request being captured. Does nothing in a process
+ * forked from the one that called capture_request.
+ */
+void finish_capture(void);
+
+#endif /* CAPTURE_H_ */
@@ -0,0 +1,330 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "children.h"
+#include "precompute.h"
+#include "trace.h"
+#include "response.h"
+#include "accesslog.h"
+#include "scheduler.h"
+#include "batch.h"
+#include "cache.h"
+#include "stats.h"
+#include "upload.h"
+#include "tiles.h"
+#include "profile.h"
+#include "filter.h"
+#include "convolve.h"
+#include "rank.h"
+
+
+// A request process that has not been reaped yet. The table is shared with
+// the request processes, which fill in how their response went.
+typedef struct {
+    pid_t pid;                // 0 marks a free entry, -1 a reserved one.
+    char method[8];
+    char route[MAX_ROUTE];
+    char filter[MAX_ROUTE];
+    char image[MAX_ROUTE];
+    unsigned long start_ms;
+    unsigned long trace_request;  // Its id if it is being traced, or 0.
+    unsigned long start_us;
+    unsigned long time_ms;    // Wall clock time it was dispatched.
+    unsigned long wait_us;    // From accepting the connection to dispatch.
+    int status;               // Reported by the request process, 0 if it never did.
+    long bytes;
+} ChildInfo;
+
+static ChildInfo *children = NULL;
+static CostEntry costs[MAX_COST_ENTRIES];
+
+// The routes costs are accounted under; any other path counts as "other", so
+// made-up paths can't fill the table.
+static const char *cost_routes[] = {
+    MAIN_HTML, IMAGE_FILTER, IMAGE_UPLOAD, IMAGE_BATCH, IMAGE_STATS,
+    DEBUG_METRICS, DEBUG_TRACE, DEBUG_PROFILE,
+};
+static int num_costs = 0;
+static int signal_fd = -1;
+
+// In a request process: its entry, and its pid (so that processes it forks
+// in turn don't report as if they were the request).
+static int current_slot = -1;
+static pid_t report_pid = 0;
+static int report_sock = -1;
+
+// Helper function declarations.
+const char *cost_route(const char *path);
+const char *cost_filter(const char *filter);
+void record_cost(const ChildInfo *child, int status, const struct rusage *usage);
+void log_child(const ChildInfo *child, int status, const struct rusage *usage);
+void report_at_exit(void);
+
+
+int init_child_signals(void) {
+    children = mmap(NULL, MAX_CHILDREN * sizeof(ChildInfo), PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (children == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) {
+        perror("sigprocmask");
+        exit(1);
+    }
+
+    signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd == -1) {
+        perror("signalfd");
+        exit(1);
+    }
+
+    // The acceptor writes to client sockets itself (static files, timeouts);
+    // a client that has gone away must not kill it.
+    signal(SIGPIPE, SIG_IGN);
+    return signal_fd;
+}
+
+
+void reset_child_signals(void) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_UNBLOCK, &mask, NULL);
+    signal(SIGPIPE, SIG_DFL);
+    if (signal_fd != -1) {
+        close(signal_fd);
+        signal_fd = -1;
+    }
+}
+
+
+int reserve_child(const ReqData *reqData, unsigned long accepted_us) {
+    current_slot = -1;
+    for (int i = 0; i < MAX_CHILDREN; i++) {
+        if (children[i].pid == 0) {
+            ChildInfo *child = &children[i];
+            const char *filter = get_param(reqData, "filter");
+            const char *image = get_param(reqData, "image");
+            child->pid = -1;
+            snprintf(child->method, sizeof(child->method), "%s", reqData->method);
+            snprintf(child->route, MAX_ROUTE, "%s", reqData->path);
+            snprintf(child->filter, MAX_ROUTE, "%s", filter ? filter : "");
+            snprintf(child->image, MAX_ROUTE, "%s", image ? image : "");
+            child->start_ms = monotonic_ms();
+            child->trace_request = trace_current_request();
+            child->start_us = trace_now();
+            child->wait_us = child->start_us - accepted_us;
+            struct timespec now;
+            clock_gettime(CLOCK_REALTIME, &now);
+            child->time_ms = now.tv_sec * 1000UL + now.tv_nsec / 1000000;
+            child->status = 0;
+            child->bytes = 0;
+            current_slot = i;
+            return i;
+        }
+    }
+    // Too many children in flight: this one is reaped but not accounted.
+    return -1;
+}
+
+
+void track_child(int slot, pid_t pid) {
+    if (slot >= 0) {
+        children[slot].pid = pid;
+    }
+}
+
+
+void report_on_exit(int sock) {
+    report_pid = getpid();
+    // Responses usually close the socket before exiting, so keep our own.
+    report_sock = fcntl(sock, F_DUPFD_CLOEXEC, 0);
+    atexit(report_at_exit);
+}
+
+
+void report_response(int status, long bytes) {
+    if (current_slot >= 0 && getpid() == report_pid) {
+        children[current_slot].bytes = bytes;
+        // Written last: the acceptor reads a non-zero status as a complete report.
+        __atomic_store_n(&children[current_slot].status, status, __ATOMIC_RELEASE);
+    }
+}
+
+
+/*
+ * Report the response of a request process as it exits normally.
+ */
+void report_at_exit(void) {
+    if (response_status != 0) {
+        report_response(response_status, socket_bytes_sent(report_sock));
+    }
+}
+
+
+int reap_children(void) {
+    // Consume the pending notifications so the signalfd stops being readable.
+    struct signalfd_siginfo info;
+    while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+    }
+
+    // SIGCHLD notifications coalesce, so keep reaping until nothing is left.
+    int num_reaped = 0;
+    int status;
+    struct rusage usage;
+    pid_t pid;
+    while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0) {
+        num_reaped++;
+        foreground_finished();
+        release_job(pid);
+        if (WIFSIGNALED(status)) {
+            fprintf(stderr, "Child [%d] failed with signal %d\n", pid,
+                    WTERMSIG(status));
+        }
+
+        for (int i = 0; i < MAX_CHILDREN; i++) {
+            if (children[i].pid == pid) {
+                record_cost(&children[i], status, &usage);
+                log_child(&children[i], status, &usage);
+                // For exec'd filters this is also when the last byte was sent.
+                trace_request_span(children[i].trace_request, "request",
+                                   children[i].start_us, trace_now());
+                children[i].pid = 0;
+                break;
+            }
+        }
+    }
+    return num_reaped;
+}
+
+
+/*
+ * Queue an access log record for a finished child.
+ */
+void log_child(const ChildInfo *child, int status, const struct rusage *usage) {
+    AccessRecord record;
+    memset(&record, 0, sizeof(record));
+    record.time_ms = child->time_ms;
+    record.pid = child->pid;
+    // A request process that died before reporting failed to respond.
+    record.status = __atomic_load_n(&child->status, __ATOMIC_ACQUIRE);
+    record.bytes = child->bytes;
+    if (record.status == 0) {
+        record.status = 500;
+    }
+    record.failed = !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+    record.wait_us = child->wait_us;
+    record.total_us = trace_now() - child->start_us;
+    record.user_ms = usage->ru_utime.tv_sec * 1e3 + usage->ru_utime.tv_usec / 1e3;
+    record.sys_ms = usage->ru_stime.tv_sec * 1e3 + usage->ru_stime.tv_usec / 1e3;
+    strcpy(record.method, child->method);
+    strcpy(record.route, child->route);
+    strcpy(record.filter, child->filter);
+    strcpy(record.image, child->image);
+    log_access(&record);
+}
+
+
+/*
+ * Return the route <path> is accounted under: one of cost_routes, the
+ * prefix of a path under /uploads or /tiles, or "other".
+ */
+const char *cost_route(const char *path) {
+    for (int i = 0; i < (int) (sizeof(cost_routes) / sizeof(cost_routes[0])); i++) {
+        if (strcmp(path, cost_routes[i]) == 0) {
+            return cost_routes[i];
+        }
+    }
+    if (strcmp(path, UPLOADS) == 0 || strncmp(path, UPLOADS "/", strlen(UPLOADS "/")) == 0) {
+        return UPLOADS;
+    } else if (strncmp(path, TILES_PREFIX, strlen(TILES_PREFIX)) == 0) {
+        return TILES_PREFIX;
+    }
+    return "other";
+}
+
+
+/*
+ * Return the name <filter> is accounted under: its own if it names a filter
+ * the server has (in-process, built in or in filters/), "other" otherwise.
+ */
+const char *cost_filter(const char *filter) {
+    if (filter[0] == '\0' || strcmp(filter, CONVOLVE_FILTER) == 0 ||
+            strcmp(filter, MEDIAN_FILTER) == 0 || strcmp(filter, PERCENTILE_FILTER) == 0 ||
+            find_builtin_filter(filter) != NULL) {
+        return filter;
+    }
+    char path[MAX_PATH];
+    snprintf(path, sizeof(path), "%s%s", FILTER_DIR, filter);
+    if (strchr(filter, '/') == NULL && filter[0] != '.' && access(path, X_OK) == 0) {
+        return filter;
+    }
+    return "other";
+}
+
+
+/*
+ * Add the resource usage of a finished child to the entry for its route
+ * and filter.
+ */
+void record_cost(const ChildInfo *child, int status, const struct rusage *usage) {
+    const char *route = cost_route(child->route);
+    const char *filter = cost_filter(child->filter);
+    CostEntry *entry = NULL;
+    for (int i = 0; i < num_costs && entry == NULL; i++) {
+        if (strcmp(costs[i].route, route) == 0 && strcmp(costs[i].filter, filter) == 0) {
+            entry = &costs[i];
+        }
+    }
+    if (entry == NULL) {
+        if (num_costs == MAX_COST_ENTRIES) {
+            return;
+        }
+        entry = &costs[num_costs++];
+        memset(entry, 0, sizeof(CostEntry));
+        snprintf(entry->route, MAX_ROUTE, "%s", route);
+        snprintf(entry->filter, MAX_ROUTE, "%s", filter);
+    }
+
+    entry->count++;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        entry->failures++;
+    }
+    entry->user_sec += usage->ru_utime.tv_sec + usage->ru_utime.tv_usec / 1e6;
+    entry->sys_sec += usage->ru_stime.tv_sec + usage->ru_stime.tv_usec / 1e6;
+    entry->wall_sec += (monotonic_ms() - child->start_ms) / 1e3;
+    if (usage->ru_maxrss > entry->max_rss_kb) {
+        entry->max_rss_kb = usage->ru_maxrss;
+    }
+}
+
+
+void write_cost_report(int fd) {
+    dprintf(fd, "# Request costs for acceptor %d (averages per request)\n", getppid());
+    dprintf(fd, "%-20s %-20s %8s %8s %10s %10s %10s %12s\n", "route", "filter",
+            "count", "failed", "user_ms", "sys_ms", "wall_ms", "max_rss_kb");
+    for (int i = 0; i < num_costs; i++) {
+        CostEntry *entry = &costs[i];
+        dprintf(fd, "%-20s %-20s %8ld %8ld %10.2f %10.2f %10.2f %12ld\n",
+                entry->route, entry->filter[0] ? entry->filter : "-",
+                entry->count, entry->failures,
+                entry->user_sec * 1e3 / entry->count,
+                entry->sys_sec * 1e3 / entry->count,
+                entry->wall_sec * 1e3 / entry->count,
+                entry->max_rss_kb);
+    }
+}
@@ -0,0 +1,81 @@
+#ifndef CHILDREN_H_
+#define CHILDREN_H_
+
+#include <sys/types.h>
+#include "request.h"
+
+#define MAX_CHILDREN 256      // Request processes tracked at once.
+#define MAX_COST_ENTRIES 32   // Distinct (route, filter) pairs accounted.
+#define MAX_ROUTE 32
+
+
+/*
+ * Per (route, filter) resource usage of finished request processes,
+ * as reported by wait4. Routes and filters are from a fixed set, with
+ * unknown ones counted together as "other".
+ */
+typedef struct {
+    char route[MAX_ROUTE];
+    char filter[MAX_ROUTE];
+    long count;               // Number of finished requests.
+    long failures;            // Killed by a signal or exited non-zero.
+    double user_sec;          // Total user CPU time.
+    double sys_sec;           // Total system CPU time.
+    double wall_sec;          // Total time from fork to exit.
+    long max_rss_kb;          // Largest maximum resident set size seen.
+} CostEntry;
+
+
+/*
+ * Block SIGCHLD and return a signalfd that becomes readable whenever a child
+ * exits, so child supervision can run inside the event loop. Also ignore
+ * SIGPIPE, so writing to a client that has gone away fails with EPIPE.
+ */
+int init_child_signals(void);
+
+/*
+ * Undo init_child_signals in a newly forked request process, so that it (and
+ * any filter it execs) gets SIGCHLD and SIGPIPE the usual way.
+ */
+void reset_child_signals(void);
+
+/*
+ * Claim an entry for the request about to be dispatched, recording what it
+ * is serving and when its connection was accepted (a trace_now timestamp).
+ * Call this just before forking; the request process inherits the entry.
+ * Return the index of the entry, or -1 if too many requests are in flight.
+ */
+int reserve_child(const ReqData *reqData, unsigned long accepted_us);
+
+/*
+ * Remember the pid of the request process forked for a reserved entry.
+ */
+void track_child(int slot, pid_t pid);
+
+/*
+ * In a newly forked request process: arrange for the status of the response
+ * (response_status) and the bytes sent on sock to be reported to the
+ * acceptor when the process exits.
+ */
+void report_on_exit(int sock);
+
+/*
+ * In a request process: report its response now, e.g. just before it execs
+ * a program that will send the rest of it. Later reports replace this one.
+ */
+void report_response(int status, long bytes);
+
+/*
+ * Drain the signalfd and reap every child that has exited, recording its
+ * resource usage against its route and filter, and logging its request to
+ * the access log.
+ * Return the number of children reaped.
+ */
+int reap_children(void);
+
+/*
+ * Write a plain-text table of the per route and filter costs to fd.
+ */
+void write_cost_report(int fd);
+
+#endif /* CHILDREN_H_ */
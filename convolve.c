@@ -0,0 +1,408 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "convolve.h"
+#include "isa.h"
+#include "parallel.h"
+
+// Large enough for any useful kernel, small enough that no sum can overflow:
+// 15 * 15 * 4096 * 255 < 2^31.
+#define MAX_KERNEL_WEIGHT 4096
+
+// Minimum number of rows worth handing to another thread.
+#define MIN_ROWS_PER_THREAD 16
+
+typedef void (*ConvolveFunc)(const Kernel *kernel, const Bitmap *bmp, Pixel *out,
+                             int row_start, int row_end);
+
+// A convolution of a whole image, split into ranges of rows.
+typedef struct {
+    const Kernel *kernel;
+    const Bitmap *bmp;
+    Pixel *out;
+} ConvolveTask;
+
+// Helper function declarations.
+void detect_separable(Kernel *kernel);
+int *clamped_columns(int width, int half);
+void convolve_rows(void *arg, int start, int end);
+
+
+int parse_kernel(const char *weights, const char *norm, Kernel *kernel) {
+    memset(kernel, 0, sizeof(Kernel));
+
+    int count = 0;
+    const char *p = weights;
+    while (*p != '\0') {
+        char *end;
+        long weight = strtol(p, &end, 10);
+        if (end == p || count == MAX_KERNEL_SIZE * MAX_KERNEL_SIZE ||
+                weight < -MAX_KERNEL_WEIGHT || weight > MAX_KERNEL_WEIGHT) {
+            return -1;
+        }
+        kernel->weights[count++] = weight;
+        if (*end == ',') {
+            end++;
+        } else if (*end != '\0') {
+            return -1;
+        }
+        p = end;
+    }
+
+    int size = 0;
+    while (size * size < count) {
+        size++;
+    }
+    if (size * size != count || size % 2 == 0 || size < MIN_KERNEL_SIZE) {
+        return -1;
+    }
+    kernel->size = size;
+
+    if (norm != NULL) {
+        char *end;
+        long value = strtol(norm, &end, 10);
+        if (end == norm || *end != '\0' || value == 0 ||
+                value < -MAX_KERNEL_WEIGHT * count || value > MAX_KERNEL_WEIGHT * count) {
+            return -1;
+        }
+        kernel->norm = value;
+    } else {
+        for (int i = 0; i < count; i++) {
+            kernel->norm += kernel->weights[i];
+        }
+        if (kernel->norm == 0) {
+            kernel->norm = 1;  // E.g. edge detection kernels.
+        }
+    }
+
+    detect_separable(kernel);
+    return 0;
+}
+
+
+static int gcd(int a, int b) {
+    while (b != 0) {
+        int t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+
+/*
+ * Check whether the kernel is the outer product of two integer vectors, and
+ * if so store them in kernel->col and kernel->row.
+ *
+ * Take the first nonzero row, divided by the gcd of its weights, as the row
+ * vector. Since its weights are then coprime, every other row must be an
+ * integer multiple of it if the kernel is separable at all.
+ */
+void detect_separable(Kernel *kernel) {
+    int n = kernel->size;
+    int first = -1;
+    for (int i = 0; i < n * n && first == -1; i++) {
+        if (kernel->weights[i] != 0) {
+            first = i / n;
+        }
+    }
+    if (first == -1) {
+        return;
+    }
+
+    int divisor = 0;
+    for (int j = 0; j < n; j++) {
+        divisor = gcd(divisor, abs(kernel->weights[first * n + j]));
+    }
+    int pivot = -1;
+    for (int j = 0; j < n; j++) {
+        kernel->row[j] = kernel->weights[first * n + j] / divisor;
+        if (pivot == -1 && kernel->row[j] != 0) {
+            pivot = j;
+        }
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (kernel->weights[i * n + pivot] % kernel->row[pivot] != 0) {
+            return;
+        }
+        kernel->col[i] = kernel->weights[i * n + pivot] / kernel->row[pivot];
+        for (int j = 0; j < n; j++) {
+            if (kernel->col[i] * kernel->row[j] != kernel->weights[i * n + j]) {
+                return;
+            }
+        }
+    }
+    kernel->separable = 1;
+}
+
+
+void kernel_cache_name(const Kernel *kernel, char *name, int size) {
+    // FNV-1a over everything that affects the output.
+    unsigned long long hash = 14695981039346656037ULL;
+    int values[MAX_KERNEL_SIZE * MAX_KERNEL_SIZE + 2];
+    int count = kernel->size * kernel->size;
+    values[0] = kernel->size;
+    values[1] = kernel->norm;
+    memcpy(values + 2, kernel->weights, count * sizeof(int));
+    const unsigned char *bytes = (const unsigned char *) values;
+    for (int i = 0; i < (count + 2) * sizeof(int); i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+    snprintf(name, size, "%s-%dx%d-%016llx", CONVOLVE_FILTER, kernel->size, kernel->size, hash);
+}
+
+
+/*
+ * Return a table mapping x + half to x clamped to [0, width), for x in
+ * [-half, width + half), so the inner loops need no bounds checks.
+ */
+int *clamped_columns(int width, int half) {
+    int *cols = malloc(sizeof(int) * (width + 2 * half));
+    for (int i = 0; i < width + 2 * half; i++) {
+        int x = i - half;
+        cols[i] = (x < 0) ? 0 : (x >= width) ? width - 1 : x;
+    }
+    return cols;
+}
+
+
+static inline int clamp_row(int y, int height) {
+    return (y < 0) ? 0 : (y >= height) ? height - 1 : y;
+}
+
+
+/*
+ * Normalize a weighted sum to a channel value. Dividing in double, rather
+ * than in int, lets the loops calling this vectorize (there is no vector
+ * integer division), and gives the same result: as |sum| < 2^31, the
+ * quotient is never within rounding error of an integer it doesn't reach,
+ * so truncating it gives exactly sum / norm.
+ */
+static inline unsigned char normalize(int sum, int norm) {
+    int value = (double) sum / norm;
+    return (value < 0) ? 0 : (value > 255) ? 255 : value;
+}
+
+
+/*
+ * Apply the full n x n kernel to pixel <x> of a row, through the clamped
+ * column table. Used for the columns where the kernel reaches past an edge.
+ */
+static inline __attribute__((always_inline))
+void convolve_pixel(const int *weights, const Pixel **rows, const int *cols, int x,
+                    int norm, Pixel *o, const int n) {
+    int blue = 0;
+    int green = 0;
+    int red = 0;
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n; j++) {
+            const int weight = weights[i * n + j];
+            const Pixel *p = &rows[i][cols[x + j]];
+            blue += weight * p->blue;
+            green += weight * p->green;
+            red += weight * p->red;
+        }
+    }
+    o->blue = normalize(blue, norm);
+    o->green = normalize(green, norm);
+    o->red = normalize(red, norm);
+}
+
+
+/*
+ * Apply the full n x n kernel to each pixel.
+ *
+ * Only the edge columns need the clamped column table. In between, the
+ * channels don't mix, so each row is treated as a plain array of bytes, in
+ * which tap j of a byte is 3 * (j - half) bytes away. Each tap is then added
+ * to a row of sums in a unit-stride loop, which the compiler vectorizes for
+ * each instruction set whatever the kernel size.
+ */
+static inline __attribute__((always_inline))
+void convolve_direct(const Kernel *kernel, const Bitmap *bmp, Pixel *out,
+                     int row_start, int row_end, const int n) {
+    const int half = n / 2;
+    const int norm = kernel->norm;
+    const int width = bmp->width;
+    const int edge = (half < width) ? half : width;
+    int *cols = clamped_columns(width, half);
+    const Pixel *rows[MAX_KERNEL_SIZE];
+    const unsigned char *bytes[MAX_KERNEL_SIZE];
+    // A copy, so the compiler knows the stores to the output don't change it.
+    int weights[MAX_KERNEL_SIZE * MAX_KERNEL_SIZE];
+    memcpy(weights, kernel->weights, sizeof(int) * n * n);
+    int *restrict sums = malloc(sizeof(int) * 3 * width);
+
+    for (int y = row_start; y < row_end; y++) {
+        for (int i = 0; i < n; i++) {
+            rows[i] = bmp->pixels + (long) clamp_row(y + i - half, bmp->height) * width;
+            bytes[i] = (const unsigned char *) rows[i];
+        }
+        Pixel *o = out + (long) y * width;
+        for (int x = 0; x < edge; x++) {
+            convolve_pixel(weights, rows, cols, x, norm, &o[x], n);
+        }
+        for (int b = 3 * half; b < 3 * (width - half); b++) {
+            sums[b] = 0;
+        }
+        for (int i = 0; i < n; i++) {
+            for (int j = 0; j < n; j++) {
+                const int weight = weights[i * n + j];
+                const int offset = 3 * (j - half);
+                for (int b = 3 * half; b < 3 * (width - half); b++) {
+                    sums[b] += weight * bytes[i][b + offset];
+                }
+            }
+        }
+        unsigned char *restrict ob = (unsigned char *) o;
+        for (int b = 3 * half; b < 3 * (width - half); b++) {
+            ob[b] = normalize(sums[b], norm);
+        }
+        for (int x = (width - half > edge) ? width - half : edge; x < width; x++) {
+            convolve_pixel(weights, rows, cols, x, norm, &o[x], n);
+        }
+    }
+    free(sums);
+    free(cols);
+}
+
+
+/*
+ * Store the sums of the horizontal pass for pixel <x> of <row>, through the
+ * clamped column table.
+ */
+static inline __attribute__((always_inline))
+void row_sums(const int *weights, const Pixel *row, const int *cols, int x, int *s, const int n) {
+    int blue = 0;
+    int green = 0;
+    int red = 0;
+#pragma GCC unroll 16
+    for (int j = 0; j < n; j++) {
+        const Pixel *p = &row[cols[x + j]];
+        blue += weights[j] * p->blue;
+        green += weights[j] * p->green;
+        red += weights[j] * p->red;
+    }
+    s[3 * x] = blue;
+    s[3 * x + 1] = green;
+    s[3 * x + 2] = red;
+}
+
+
+/*
+ * Apply a separable kernel as a horizontal pass with kernel->row, into
+ * unnormalized sums for every source row the strip needs, followed by a
+ * vertical pass with kernel->col. The integer sums are exactly those of
+ * convolve_direct, so both give the same output. As there, the interior of
+ * the horizontal pass, and all of the vertical one, run over the bytes of a
+ * row so that they vectorize.
+ */
+static inline __attribute__((always_inline))
+void convolve_separable(const Kernel *kernel, const Bitmap *bmp, Pixel *out,
+                        int row_start, int row_end, const int n) {
+    const int half = n / 2;
+    const int norm = kernel->norm;
+    const int width = bmp->width;
+    const int edge = (half < width) ? half : width;
+    int *cols = clamped_columns(width, half);
+    int row_weights[MAX_KERNEL_SIZE];
+    int col_weights[MAX_KERNEL_SIZE];
+    memcpy(row_weights, kernel->row, sizeof(int) * n);
+    memcpy(col_weights, kernel->col, sizeof(int) * n);
+
+    int first = clamp_row(row_start - half, bmp->height);
+    int last = clamp_row(row_end - 1 + half, bmp->height);
+    int *sums = malloc(sizeof(int) * 3 * width * (last - first + 1));
+
+    for (int y = first; y <= last; y++) {
+        const Pixel *row = bmp->pixels + (long) y * width;
+        const unsigned char *bytes = (const unsigned char *) row;
+        int *restrict s = sums + 3 * width * (y - first);
+        for (int x = 0; x < edge; x++) {
+            row_sums(row_weights, row, cols, x, s, n);
+        }
+        for (int b = 3 * half; b < 3 * (width - half); b++) {
+            int sum = 0;
+#pragma GCC unroll 16
+            for (int j = 0; j < n; j++) {
+                sum += row_weights[j] * bytes[b + 3 * (j - half)];
+            }
+            s[b] = sum;
+        }
+        for (int x = (width - half > edge) ? width - half : edge; x < width; x++) {
+            row_sums(row_weights, row, cols, x, s, n);
+        }
+    }
+
+    const int *rows[MAX_KERNEL_SIZE];
+    for (int y = row_start; y < row_end; y++) {
+        for (int i = 0; i < n; i++) {
+            rows[i] = sums + 3 * width * (clamp_row(y + i - half, bmp->height) - first);
+        }
+        unsigned char *restrict o = (unsigned char *) (out + (long) y * width);
+        for (int b = 0; b < 3 * width; b++) {
+            int sum = 0;
+#pragma GCC unroll 16
+            for (int i = 0; i < n; i++) {
+                sum += col_weights[i] * rows[i][b];
+            }
+            o[b] = normalize(sum, norm);
+        }
+    }
+
+    free(sums);
+    free(cols);
+}
+
+
+// Versions of both passes for the common kernel sizes and for any other
+// size, each in every instruction set (see isa.h).
+#define CONVOLVE_PARAMS (const Kernel *kernel, const Bitmap *bmp, Pixel *out, \
+                         int row_start, int row_end)
+#define DEFINE_CONVOLVE(N, size) \
+    ISA_VARIANTS(convolve_direct_##N, convolve_direct, CONVOLVE_PARAMS, \
+                 (kernel, bmp, out, row_start, row_end, size)) \
+    ISA_VARIANTS(convolve_separable_##N, convolve_separable, CONVOLVE_PARAMS, \
+                 (kernel, bmp, out, row_start, row_end, size))
+
+DEFINE_CONVOLVE(3, 3)
+DEFINE_CONVOLVE(5, 5)
+DEFINE_CONVOLVE(7, 7)
+DEFINE_CONVOLVE(any, kernel->size)
+
+static const struct {
+    int size;
+    const ConvolveFunc *direct;
+    const ConvolveFunc *separable;
+} specialized[] = {
+    {3, convolve_direct_3_variants, convolve_separable_3_variants},
+    {5, convolve_direct_5_variants, convolve_separable_5_variants},
+    {7, convolve_direct_7_variants, convolve_separable_7_variants},
+};
+
+
+void convolve(const Kernel *kernel, const Bitmap *bmp, Pixel *out, int row_start, int row_end) {
+    // Any other size goes through the generic versions.
+    const ConvolveFunc *variants = kernel->separable ? convolve_separable_any_variants
+                                                     : convolve_direct_any_variants;
+    for (int i = 0; i < sizeof(specialized) / sizeof(specialized[0]); i++) {
+        if (specialized[i].size == kernel->size) {
+            variants = kernel->separable ? specialized[i].separable : specialized[i].direct;
+        }
+    }
+    variants[active_isa](kernel, bmp, out, row_start, row_end);
+}
+
+
+void convolve_rows(void *arg, int start, int end) {
+    ConvolveTask *task = arg;
+    convolve(task->kernel, task->bmp, task->out, start, end);
+}
+
+
+void convolve_image(const Kernel *kernel, const Bitmap *bmp, Pixel *out) {
+    ConvolveTask task = {kernel, bmp, out};
+    parallel_for(bmp->height, MIN_ROWS_PER_THREAD, convolve_rows, &task);
+}
@@ -0,0 +1,60 @@
+#ifndef CONVOLVE_H_
+#define CONVOLVE_H_
+
+#include "bitmap.h"
+
+/*
+ * A convolution engine for user-supplied kernels, so a custom filter can be
+ * requested as
+ *     /image-filter?image=dog.bmp&filter=convolve&kernel=1,2,1,2,4,2,1,2,1&norm=16
+ * instead of being deployed as an executable in FILTER_DIR.
+ */
+
+#define CONVOLVE_FILTER "convolve"
+#define MIN_KERNEL_SIZE 3
+#define MAX_KERNEL_SIZE 15
+
+
+/*
+ * A square kernel of integer weights. Each output channel is the weighted
+ * sum of the input channel over the size x size neighbourhood (with the
+ * image edges extended), divided by norm and clamped to 0..255.
+ */
+typedef struct {
+    int size;                 // Odd, between MIN_KERNEL_SIZE and MAX_KERNEL_SIZE.
+    int weights[MAX_KERNEL_SIZE * MAX_KERNEL_SIZE];  // Row by row.
+    int norm;                 // Never 0.
+    // If the kernel is the outer product col * row, it is applied as a
+    // horizontal pass followed by a vertical pass.
+    int separable;
+    int row[MAX_KERNEL_SIZE];
+    int col[MAX_KERNEL_SIZE];
+} Kernel;
+
+
+/*
+ * Parse a kernel from a comma-separated list of size * size weights and an
+ * optional normalization divisor (by default the sum of the weights, or 1
+ * if that is 0). Return 0 on success, -1 if the kernel is invalid.
+ */
+int parse_kernel(const char *weights, const char *norm, Kernel *kernel);
+
+/*
+ * Return a name identifying the kernel (by a 64-bit hash of it), under which
+ * its results are cached.
+ */
+void kernel_cache_name(const Kernel *kernel, char *name, int size);
+
+/*
+ * Compute rows [row_start, row_end) of <bmp> convolved with <kernel>,
+ * writing them to the same rows of <out>.
+ */
+void convolve(const Kernel *kernel, const Bitmap *bmp, Pixel *out, int row_start, int row_end);
+
+/*
+ * Convolve all of <bmp> with <kernel> into <out>, with the rows split
+ * across threads.
+ */
+void convolve_image(const Kernel *kernel, const Bitmap *bmp, Pixel *out);
+
+#endif /* CONVOLVE_H_ */
@@ -0,0 +1,16 @@
+#ifndef DEBUG_H_
+#define DEBUG_H_
+
+#include <stdio.h>
+
+/*
+ * Verbose diagnostics, printed to stderr. A release build (make RELEASE=1)
+ * compiles them out entirely, arguments included.
+ */
+#ifdef RELEASE
+#define DEBUG_LOG(...) ((void) 0)
+#else
+#define DEBUG_LOG(...) fprintf(stderr, __VA_ARGS__)
+#endif
+
+#endif /* DEBUG_H_ */
@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "filewriter.h"
+#include "request.h"
+
+// A write of <len> bytes of <data> to fd, or with data NULL, closing it.
+typedef struct {
+    int fd;
+    char *data;
+    int len;
+    int *result;
+} WriteJob;
+
+struct file_writer {
+    pthread_t thread;
+    int threaded;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    WriteJob jobs[WRITER_QUEUE];
+    int first_job;
+    int num_jobs;
+    char *free_buffers[WRITER_BUFFERS];
+    int num_free;
+    int stopping;
+    int failed;               // A write to the file being written failed.
+};
+
+// Helper function declarations.
+void *run_writer(void *arg);
+void queue_job(FileWriter *writer, WriteJob job);
+void do_job(FileWriter *writer, WriteJob *job);
+
+
+FileWriter *start_file_writer(void) {
+    FileWriter *writer = calloc(1, sizeof(FileWriter));
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->changed, NULL);
+    for (int i = 0; i < WRITER_BUFFERS; i++) {
+        writer->free_buffers[writer->num_free++] = malloc(UPLOAD_BUFFER_SIZE);
+    }
+    writer->threaded = pthread_create(&writer->thread, NULL, run_writer, writer) == 0;
+    if (!writer->threaded) {
+        fprintf(stderr, "Couldn't start a writer thread; writing in place.\n");
+    }
+    return writer;
+}
+
+
+/*
+ * Do the queued jobs in order until told to stop and none are left.
+ */
+void *run_writer(void *arg) {
+    FileWriter *writer = arg;
+    pthread_mutex_lock(&writer->lock);
+    while (1) {
+        while (writer->num_jobs == 0 && !writer->stopping) {
+            pthread_cond_wait(&writer->changed, &writer->lock);
+        }
+        if (writer->num_jobs == 0) {
+            break;
+        }
+        // Leave it queued while it is done, so its slot isn't reused.
+        WriteJob job = writer->jobs[writer->first_job];
+        pthread_mutex_unlock(&writer->lock);
+        do_job(writer, &job);
+        pthread_mutex_lock(&writer->lock);
+        writer->first_job = (writer->first_job + 1) % WRITER_QUEUE;
+        writer->num_jobs--;
+        pthread_cond_broadcast(&writer->changed);
+    }
+    pthread_mutex_unlock(&writer->lock);
+    return NULL;
+}
+
+
+/*
+ * Write or close, then return the job's buffer to the pool. Only called by
+ * one thread at a time.
+ */
+void do_job(FileWriter *writer, WriteJob *job) {
+    if (job->data == NULL) {
+        if (close(job->fd) == -1) {
+            perror("close");
+            writer->failed = 1;
+        }
+        *job->result = writer->failed ? -1 : 0;
+        writer->failed = 0;
+        return;
+    }
+    for (int written = 0; written < job->len && !writer->failed; ) {
+        int numWritten = write(job->fd, job->data + written, job->len - written);
+        if (numWritten <= 0) {
+            perror("write");
+            writer->failed = 1;
+        } else {
+            written += numWritten;
+        }
+    }
+    writer_release(writer, job->data);
+}
+
+
+void queue_job(FileWriter *writer, WriteJob job) {
+    if (!writer->threaded) {
+        do_job(writer, &job);
+        return;
+    }
+    pthread_mutex_lock(&writer->lock);
+    while (writer->num_jobs == WRITER_QUEUE) {
+        pthread_cond_wait(&writer->changed, &writer->lock);
+    }
+    writer->jobs[(writer->first_job + writer->num_jobs) % WRITER_QUEUE] = job;
+    writer->num_jobs++;
+    pthread_cond_broadcast(&writer->changed);
+    pthread_mutex_unlock(&writer->lock);
+}
+
+
+char *writer_buffer(FileWriter *writer) {
+    pthread_mutex_lock(&writer->lock);
+    while (writer->num_free == 0) {
+        pthread_cond_wait(&writer->changed, &writer->lock);
+    }
+    char *data = writer->free_buffers[--writer->num_free];
+    pthread_mutex_unlock(&writer->lock);
+    return data;
+}
+
+
+void writer_release(FileWriter *writer, char *data) {
+    pthread_mutex_lock(&writer->lock);
+    writer->free_buffers[writer->num_free++] = data;
+    pthread_cond_broadcast(&writer->changed);
+    pthread_mutex_unlock(&writer->lock);
+}
+
+
+void writer_write(FileWriter *writer, int fd, char *data, int len) {
+    queue_job(writer, (WriteJob) {fd, data, len, NULL});
+}
+
+
+void writer_close(FileWriter *writer, int fd, int *result) {
+    queue_job(writer, (WriteJob) {fd, NULL, 0, result});
+}
+
+
+void stop_file_writer(FileWriter *writer) {
+    if (writer->threaded) {
+        pthread_mutex_lock(&writer->lock);
+        writer->stopping = 1;
+        pthread_cond_broadcast(&writer->changed);
+        pthread_mutex_unlock(&writer->lock);
+        pthread_join(writer->thread, NULL);
+    }
+    for (int i = 0; i < writer->num_free; i++) {
+        free(writer->free_buffers[i]);
+    }
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->changed);
+    free(writer);
+}
@@ -0,0 +1,52 @@
+#ifndef FILEWRITER_H_
+#define FILEWRITER_H_
+
+/*
+ * A thread that writes to files in the background, so that a request
+ * process can keep reading its socket while the data it has read so far
+ * reaches the disk. Writes and closes are done in the order they are
+ * queued. Buffers come from a fixed pool, so a reader faster than the disk
+ * waits for the writer rather than buffering the whole body.
+ */
+
+#define WRITER_BUFFERS 8              // Of UPLOAD_BUFFER_SIZE bytes, in flight at once.
+#define WRITER_QUEUE (2 * WRITER_BUFFERS)
+
+
+typedef struct file_writer FileWriter;
+
+/*
+ * Start a writer. If its thread can't be started, every write is done as
+ * it is queued instead.
+ */
+FileWriter *start_file_writer(void);
+
+/*
+ * Return a free buffer of UPLOAD_BUFFER_SIZE bytes, waiting for one if they
+ * are all queued.
+ */
+char *writer_buffer(FileWriter *writer);
+
+/*
+ * Queue writing <len> bytes of <data>, a buffer from writer_buffer, to fd.
+ * The buffer goes back to the pool once written.
+ */
+void writer_write(FileWriter *writer, int fd, char *data, int len);
+
+/*
+ * Return an unused buffer from writer_buffer to the pool.
+ */
+void writer_release(FileWriter *writer, char *data);
+
+/*
+ * Queue closing fd after the writes to it queued so far. Once the writer has
+ * stopped, *result is 0 if they were all written in full, -1 otherwise.
+ */
+void writer_close(FileWriter *writer, int fd, int *result);
+
+/*
+ * Wait for everything queued to be done, then stop and free the writer.
+ */
+void stop_file_writer(FileWriter *writer);
+
+#endif /* FILEWRITER_H_ */
@@ -0,0 +1,267 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "filter.h"
+#include "isa.h"
+
+// The same kernels as the standalone filters.
+static const int gaussian_kernel[3][3] = {
+    {1, 2, 1},
+    {2, 4, 2},
+    {1, 2, 1}
+};
+// The weights add up to 16, so normalizing is a shift.
+#define GAUSSIAN_SHIFT 4
+static const float gaussian_normalizing_factor = 16.0;
+
+static const int kernel_dx[3][3] = {
+    {1, 0, -1},
+    {2, 0, -2},
+    {1, 0, -1}
+};
+static const int kernel_dy[3][3] = {
+    {1, 2, 1},
+    {0, 0, 0},
+    {-1, -2, -1}
+};
+
+// Sobel magnitudes of 256 and up are clamped to 255 anyway, so the integer
+// square root is only needed below 256 * 256.
+#define SQRT_TABLE_SIZE (256 * 256)
+static unsigned char sqrt_table[SQRT_TABLE_SIZE];
+static int sqrt_table_ready = 0;
+
+// Helper function declarations.
+void copy_filter(const Bitmap *bmp, Pixel *out, int row_start, int row_end);
+void greyscale_filter(const Bitmap *bmp, Pixel *out, int row_start, int row_end);
+void greyscale_reference(const Bitmap *bmp, Pixel *out, int row_start, int row_end);
+void gaussian_blur_filter(const Bitmap *bmp, Pixel *out, int row_start, int row_end);
+void gaussian_blur_reference(const Bitmap *bmp, Pixel *out, int row_start, int row_end);
+void edge_detection_filter(const Bitmap *bmp, Pixel *out, int row_start, int row_end);
+void edge_detection_reference(const Bitmap *bmp, Pixel *out, int row_start, int row_end);
+
+const BuiltinFilter builtin_filters[] = {
+    {"copy", copy_filter, copy_filter},
+    {"greyscale", greyscale_filter, greyscale_reference},
+    {"gaussian_blur", gaussian_blur_filter, gaussian_blur_reference},
+    {"edge_detection", edge_detection_filter, edge_detection_reference},
+};
+const int num_builtin_filters = sizeof(builtin_filters) / sizeof(builtin_filters[0]);
+
+
+void init_builtin_filters(void) {
+    if (sqrt_table_ready) {
+        return;
+    }
+    for (int root = 0; root < 256; root++) {
+        for (int square = root * root; square < (root + 1) * (root + 1); square++) {
+            sqrt_table[square] = root;
+        }
+    }
+    sqrt_table_ready = 1;
+}
+
+
+const BuiltinFilter *find_builtin_filter(const char *name) {
+    init_builtin_filters();
+    for (int i = 0; i < num_builtin_filters; i++) {
+        if (strcmp(builtin_filters[i].name, name) == 0) {
+            return &builtin_filters[i];
+        }
+    }
+    return NULL;
+}
+
+
+Pixel *run_builtin_filter(const BuiltinFilter *filter, const Bitmap *bmp) {
+    Pixel *out = malloc(sizeof(Pixel) * bmp->width * bmp->height);
+    filter->apply(bmp, out, 0, bmp->height);
+    return out;
+}
+
+
+/*
+ * Return the pixel at (x, y), clamping coordinates to the edges of the image
+ * so kernels can be applied to border pixels too.
+ */
+static inline const Pixel *pixel_at(const Bitmap *bmp, int x, int y) {
+    x = (x < 0) ? 0 : (x >= bmp->width) ? bmp->width - 1 : x;
+    y = (y < 0) ? 0 : (y >= bmp->height) ? bmp->height - 1 : y;
+    return &bmp->pixels[(long) y * bmp->width + x];
+}
+
+
+void copy_filter(const Bitmap *bmp, Pixel *out, int row_start, int row_end) {
+    memcpy(out + (long) row_start * bmp->width, bmp->pixels + (long) row_start * bmp->width,
+           sizeof(Pixel) * bmp->width * (row_end - row_start));
+}
+
+
+static inline __attribute__((always_inline))
+void greyscale_kernel(const Bitmap *bmp, Pixel *out, int row_start, int row_end) {
+    for (long i = (long) row_start * bmp->width; i < (long) row_end * bmp->width; i++) {
+        const Pixel *p = &bmp->pixels[i];
+        // x / 3 == (x * 43691) >> 17 for any sum of three channels.
+        unsigned char avg = ((p->blue + p->green + p->red) * 43691) >> 17;
+        out[i].blue = avg;
+        out[i].green = avg;
+        out[i].red = avg;
+    }
+}
+
+
+static inline __attribute__((always_inline))
+void gaussian_blur_kernel(const Bitmap *bmp, Pixel *out, int row_start, int row_end) {
+    for (int y = row_start; y < row_end; y++) {
+        for (int x = 0; x < bmp->width; x++) {
+            int blue = 0;
+            int green = 0;
+            int red = 0;
+            for (int i = 0; i < 3; i++) {
+                for (int j = 0; j < 3; j++) {
+                    const Pixel *p = pixel_at(bmp, x + j - 1, y + i - 1);
+                    blue += gaussian_kernel[i][j] * p->blue;
+                    green += gaussian_kernel[i][j] * p->green;
+                    red += gaussian_kernel[i][j] * p->red;
+                }
+            }
+            Pixel *o = &out[(long) y * bmp->width + x];
+            o->blue = blue >> GAUSSIAN_SHIFT;
+            o->green = green >> GAUSSIAN_SHIFT;
+            o->red = red >> GAUSSIAN_SHIFT;
+        }
+    }
+}
+
+
+static inline __attribute__((always_inline))
+void edge_detection_kernel(const Bitmap *bmp, Pixel *out, int row_start, int row_end) {
+    for (int y = row_start; y < row_end; y++) {
+        for (int x = 0; x < bmp->width; x++) {
+            int gx[3] = {0, 0, 0};
+            int gy[3] = {0, 0, 0};
+            for (int i = 0; i < 3; i++) {
+                for (int j = 0; j < 3; j++) {
+                    const Pixel *p = pixel_at(bmp, x + j - 1, y + i - 1);
+                    gx[0] += kernel_dx[i][j] * p->blue;
+                    gx[1] += kernel_dx[i][j] * p->green;
+                    gx[2] += kernel_dx[i][j] * p->red;
+                    gy[0] += kernel_dy[i][j] * p->blue;
+                    gy[1] += kernel_dy[i][j] * p->green;
+                    gy[2] += kernel_dy[i][j] * p->red;
+                }
+            }
+
+            // The square root is monotonic, so the strongest channel can be
+            // picked before taking it.
+            int square = 0;
+            for (int c = 0; c < 3; c++) {
+                int g = gx[c] * gx[c] + gy[c] * gy[c];
+                square = (g > square) ? g : square;
+            }
+            int magnitude = (square < SQRT_TABLE_SIZE) ? sqrt_table[square] : 255;
+
+            Pixel *o = &out[(long) y * bmp->width + x];
+            o->blue = magnitude;
+            o->green = magnitude;
+            o->red = magnitude;
+        }
+    }
+}
+
+
+// The kernels compiled for each instruction set (see isa.h).
+#define FILTER_PARAMS (const Bitmap *bmp, Pixel *out, int row_start, int row_end)
+#define FILTER_ARGS (bmp, out, row_start, row_end)
+ISA_VARIANTS(greyscale, greyscale_kernel, FILTER_PARAMS, FILTER_ARGS)
+ISA_VARIANTS(gaussian_blur, gaussian_blur_kernel, FILTER_PARAMS, FILTER_ARGS)
+ISA_VARIANTS(edge_detection, edge_detection_kernel, FILTER_PARAMS, FILTER_ARGS)
+
+
+void greyscale_filter(const Bitmap *bmp, Pixel *out, int row_start, int row_end) {
+    ISA_CALL(greyscale)(bmp, out, row_start, row_end);
+}
+
+
+void gaussian_blur_filter(const Bitmap *bmp, Pixel *out, int row_start, int row_end) {
+    ISA_CALL(gaussian_blur)(bmp, out, row_start, row_end);
+}
+
+
+void edge_detection_filter(const Bitmap *bmp, Pixel *out, int row_start, int row_end) {
+    ISA_CALL(edge_detection)(bmp, out, row_start, row_end);
+}
+
+
+/******************************************************************************
+ * Floating point versions, computed the way the standalone filters do.
+ * Only used to validate the integer versions above.
+ *****************************************************************************/
+
+void greyscale_reference(const Bitmap *bmp, Pixel *out, int row_start, int row_end) {
+    for (long i = (long) row_start * bmp->width; i < (long) row_end * bmp->width; i++) {
+        const Pixel *p = &bmp->pixels[i];
+        unsigned char avg = (p->blue + p->green + p->red) / 3.0;
+        out[i].blue = avg;
+        out[i].green = avg;
+        out[i].red = avg;
+    }
+}
+
+
+void gaussian_blur_reference(const Bitmap *bmp, Pixel *out, int row_start, int row_end) {
+    for (int y = row_start; y < row_end; y++) {
+        for (int x = 0; x < bmp->width; x++) {
+            int blue = 0;
+            int green = 0;
+            int red = 0;
+            for (int i = 0; i < 3; i++) {
+                for (int j = 0; j < 3; j++) {
+                    const Pixel *p = pixel_at(bmp, x + j - 1, y + i - 1);
+                    blue += gaussian_kernel[i][j] * p->blue;
+                    green += gaussian_kernel[i][j] * p->green;
+                    red += gaussian_kernel[i][j] * p->red;
+                }
+            }
+            Pixel *o = &out[(long) y * bmp->width + x];
+            o->blue = blue / gaussian_normalizing_factor;
+            o->green = green / gaussian_normalizing_factor;
+            o->red = red / gaussian_normalizing_factor;
+        }
+    }
+}
+
+
+void edge_detection_reference(const Bitmap *bmp, Pixel *out, int row_start, int row_end) {
+    for (int y = row_start; y < row_end; y++) {
+        for (int x = 0; x < bmp->width; x++) {
+            int gx[3] = {0, 0, 0};
+            int gy[3] = {0, 0, 0};
+            for (int i = 0; i < 3; i++) {
+                for (int j = 0; j < 3; j++) {
+                    const Pixel *p = pixel_at(bmp, x + j - 1, y + i - 1);
+                    gx[0] += kernel_dx[i][j] * p->blue;
+                    gx[1] += kernel_dx[i][j] * p->green;
+                    gx[2] += kernel_dx[i][j] * p->red;
+                    gy[0] += kernel_dy[i][j] * p->blue;
+                    gy[1] += kernel_dy[i][j] * p->green;
+                    gy[2] += kernel_dy[i][j] * p->red;
+                }
+            }
+
+            int magnitude = 0;
+            for (int c = 0; c < 3; c++) {
+                int g = floor(sqrt(gx[c] * gx[c] + gy[c] * gy[c]));
+                magnitude = (g > magnitude) ? g : magnitude;
+            }
+            if (magnitude > 255) {
+                magnitude = 255;
+            }
+            Pixel *o = &out[(long) y * bmp->width + x];
+            o->blue = magnitude;
+            o->green = magnitude;
+            o->red = magnitude;
+        }
+    }
+}
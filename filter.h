@@ -0,0 +1,47 @@
+#ifndef FILTER_H_
+#define FILTER_H_
+
+#include "bitmap.h"
+
+/*
+ * Filters compiled into the server, so they can run on an already decoded
+ * bitmap instead of an executable in FILTER_DIR re-reading the file.
+ * They produce the same output as the filters of the same name, but use
+ * integer arithmetic only: shifts instead of dividing by the kernel weight,
+ * and a table instead of sqrt/floor for Sobel magnitudes.
+ */
+
+/*
+ * Compute rows [row_start, row_end) of the output of a filter applied to
+ * <bmp>, writing them to the same rows of <out>.
+ */
+typedef void (*FilterFunc)(const Bitmap *bmp, Pixel *out, int row_start, int row_end);
+
+typedef struct {
+    const char *name;
+    FilterFunc apply;
+    FilterFunc reference;  // Floating point version, as in the standalone filter.
+} BuiltinFilter;
+
+extern const BuiltinFilter builtin_filters[];
+extern const int num_builtin_filters;
+
+
+/*
+ * Set up the tables the built-in filters use. This is done by
+ * find_builtin_filter, but must be done before using builtin_filters directly.
+ */
+void init_builtin_filters(void);
+
+/*
+ * Return the built-in filter with the given name, or NULL if there is none.
+ */
+const BuiltinFilter *find_builtin_filter(const char *name);
+
+/*
+ * Apply a built-in filter to the whole bitmap.
+ * Return the newly allocated output pixels.
+ */
+Pixel *run_builtin_filter(const BuiltinFilter *filter, const Bitmap *bmp);
+
+#endif /* FILTER_H_ */
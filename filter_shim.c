@@ -0,0 +1,246 @@
+/*
+ * Preloaded into filter workers (see filterpool.h). It wraps the filter's
+ * main(): started normally the filter runs as usual, but when
+ * FILTER_SERVER_FD is set, the fully initialized process serves jobs from
+ * that socket instead, forking a child to run main() for each one.
+ *
+ * Built as a shared library: gcc -shared -fPIC -o filter_shim.so filter_shim.c -ldl
+ */
+#define _GNU_SOURCE  // RTLD_NEXT, accept4, struct ucred
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dlfcn.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "filterpool.h"
+
+#define MAX_RUNNING_JOBS 256
+
+typedef int (*MainFunc)(int, char **, char **);
+
+// A job whose process hasn't exited yet.
+typedef struct {
+    pid_t pid;                // 0 marks a free entry.
+    int conn;                 // Where the result goes.
+    int out_fd;               // To measure the output.
+    uint64_t job;
+} RunningJob;
+
+static MainFunc real_main;
+static RunningJob jobs[MAX_RUNNING_JOBS];
+
+// Helper function declarations. All static: the program's own symbols take
+// precedence over a preloaded library's, and bash, for one, has a start_job.
+static int serve_jobs(int listen_fd, int argc, char **argv, char **envp);
+static void start_job(int listen_fd, int signal_fd, int argc, char **argv, char **envp);
+static void finish_jobs(void);
+
+
+/*
+ * Remove <name> from the environment and return its value, or NULL if it
+ * isn't set. This edits environ directly: the program may define its own
+ * getenv and unsetenv (bash does), which can't be called before its main().
+ */
+static const char *take_env(const char *name) {
+    size_t len = strlen(name);
+    const char *value = NULL;
+    char **out = environ;
+    for (char **env = environ; *env != NULL; env++) {
+        if (strncmp(*env, name, len) == 0 && (*env)[len] == '=') {
+            value = *env + len + 1;
+        } else {
+            *out++ = *env;
+        }
+    }
+    *out = NULL;
+    return value;
+}
+
+
+static int shim_main(int argc, char **argv, char **envp) {
+    // Whatever the filter runs itself shouldn't inherit either of these.
+    const char *fd_str = take_env(FILTER_SERVER_FD_ENV);
+    take_env("LD_PRELOAD");
+    if (fd_str == NULL) {
+        return real_main(argc, argv, envp);
+    }
+    return serve_jobs(atoi(fd_str), argc, argv, environ);
+}
+
+
+/*
+ * Replaces the C library's __libc_start_main, which the program's entry
+ * point calls with the address of main(), so that shim_main runs instead
+ * (after the usual initialization).
+ */
+int __libc_start_main(MainFunc main, int argc, char **argv, void (*init)(void),
+                      void (*fini)(void), void (*rtld_fini)(void), void *stack_end) {
+    typedef int (*StartFunc)(MainFunc, int, char **, void (*)(void), void (*)(void),
+                             void (*)(void), void *);
+    StartFunc real_start = (StartFunc) dlsym(RTLD_NEXT, "__libc_start_main");
+    real_main = main;
+    return real_start(shim_main, argc, argv, init, fini, rtld_fini, stack_end);
+}
+
+
+/*
+ * The fork server: accept jobs and run each in a child, reporting back when
+ * it exits. Never returns unless the socket breaks.
+ */
+static int serve_jobs(int listen_fd, int argc, char **argv, char **envp) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    int signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    signal(SIGPIPE, SIG_IGN);
+
+    struct pollfd fds[2] = {{listen_fd, POLLIN, 0}, {signal_fd, POLLIN, 0}};
+    while (1) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return 1;
+        }
+        if (fds[1].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+            }
+            finish_jobs();
+        }
+        if (fds[0].revents & POLLIN) {
+            start_job(listen_fd, signal_fd, argc, argv, envp);
+        } else if (fds[0].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+            return 1;
+        }
+    }
+}
+
+
+/*
+ * Accept a connection, read its job frame and fork a child that runs the
+ * filter on the attached files.
+ */
+static void start_job(int listen_fd, int signal_fd, int argc, char **argv, char **envp) {
+    int conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (conn == -1) {
+        return;
+    }
+    // Only the server's own processes may have jobs run, and one that
+    // connects but never sends its frame mustn't hold up the others.
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+    if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == -1 ||
+            cred.uid != getuid()) {
+        close(conn);
+        return;
+    }
+    struct timeval timeout = {JOB_FRAME_MS / 1000, (JOB_FRAME_MS % 1000) * 1000};
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    FilterJobFrame frame;
+    struct iovec iov = {&frame, sizeof(frame)};
+    union {
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    int fds[2] = {-1, -1};
+    ssize_t n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+            cmsg->cmsg_len == CMSG_LEN(2 * sizeof(int))) {
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    }
+
+    int slot = -1;
+    for (int i = 0; i < MAX_RUNNING_JOBS && slot == -1; i++) {
+        if (jobs[i].pid == 0) {
+            slot = i;
+        }
+    }
+    if (n != sizeof(frame) || frame.magic != FILTER_FRAME_MAGIC || fds[0] == -1 || slot == -1) {
+        // Closing without a result makes the client run the filter itself.
+        close(fds[0]);
+        close(fds[1]);
+        close(conn);
+        return;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+        signal(SIGPIPE, SIG_DFL);
+        // Only the worker may hold the connections, so that a client sees its
+        // own close if the worker dies.
+        close(listen_fd);
+        close(signal_fd);
+        close(conn);
+        for (int i = 0; i < MAX_RUNNING_JOBS; i++) {
+            if (jobs[i].pid != 0) {
+                close(jobs[i].conn);
+                close(jobs[i].out_fd);
+            }
+        }
+        // dup2 clears close-on-exec, which the filter may rely on.
+        if (dup2(fds[0], STDIN_FILENO) == -1 || dup2(fds[1], STDOUT_FILENO) == -1) {
+            _exit(1);
+        }
+        exit(real_main(argc, argv, envp));
+    }
+
+    close(fds[0]);
+    if (pid < 0) {
+        close(fds[1]);
+        close(conn);
+        return;
+    }
+    jobs[slot].pid = pid;
+    jobs[slot].conn = conn;
+    jobs[slot].out_fd = fds[1];
+    jobs[slot].job = frame.job;
+}
+
+
+/*
+ * Report every job that has exited to its client.
+ */
+static void finish_jobs(void) {
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (int i = 0; i < MAX_RUNNING_JOBS; i++) {
+            if (jobs[i].pid != pid) {
+                continue;
+            }
+            struct stat st;
+            FilterResultFrame result = {FILTER_FRAME_MAGIC, status, -1, jobs[i].job};
+            if (fstat(jobs[i].out_fd, &st) == 0) {
+                result.output_size = st.st_size;
+            }
+            send(jobs[i].conn, &result, sizeof(result), MSG_NOSIGNAL);
+            close(jobs[i].conn);
+            close(jobs[i].out_fd);
+            jobs[i].pid = 0;
+            break;
+        }
+    }
+}
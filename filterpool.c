@@ -0,0 +1,384 @@
+#define _GNU_SOURCE  // accept4, SOCK_CLOEXEC, struct ucred
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "filterpool.h"
+#include "cache.h"
+#include "request.h"
+#include "timer.h"
+
+// A filter and its workers, as seen by the supervisor.
+typedef struct {
+    char name[NAME_MAX + 1];   // As in a dirent.
+    struct timespec mtime;      // Of the executable the workers run.
+    int present;                // Still in filters/ at the last scan.
+    pid_t pid[MAX_FILTER_WORKERS];
+    unsigned long started_ms[MAX_FILTER_WORKERS];
+    unsigned long next_start_ms[MAX_FILTER_WORKERS];
+    unsigned long backoff_ms[MAX_FILTER_WORKERS];
+} PoolFilter;
+
+// Set in every process forked after init_filter_pool; 0 when there is no pool.
+static pid_t supervisor_pid = 0;
+static int num_workers = 0;
+
+static char shim_path[PATH_MAX];
+static PoolFilter pool[MAX_POOL_FILTERS];
+static int num_pool = 0;
+
+// Helper function declarations.
+void run_supervisor(void);
+void scan_filters(void);
+void start_worker(PoolFilter *filter, int k);
+void reap_workers(void);
+void stop_workers(PoolFilter *filter);
+socklen_t worker_address(struct sockaddr_un *addr, pid_t supervisor,
+                         const char *filter, int k);
+
+
+void init_filter_pool(int workers) {
+    if (workers <= 0) {
+        return;
+    }
+    if (realpath(FILTER_SHIM, shim_path) == NULL) {
+        fprintf(stderr, "%s not found, filters will be exec'd per request\n", FILTER_SHIM);
+        return;
+    }
+    num_workers = (workers < MAX_FILTER_WORKERS) ? workers : MAX_FILTER_WORKERS;
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    } else if (pid == 0) {
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        run_supervisor();
+        exit(0);
+    }
+    supervisor_pid = pid;
+}
+
+
+/******************************************************************************
+ * The supervisor
+ *****************************************************************************/
+
+/*
+ * Keep num_workers workers running for every executable in filters/,
+ * restarting those that die (with backoff, in case a filter can't start)
+ * and those whose executable is replaced.
+ */
+void run_supervisor(void) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+
+    struct timespec timeout = {POOL_SCAN_MS / 1000, (POOL_SCAN_MS % 1000) * 1000000L};
+    while (1) {
+        scan_filters();
+        unsigned long now = monotonic_ms();
+        for (int i = 0; i < num_pool; i++) {
+            for (int k = 0; k < num_workers; k++) {
+                if (pool[i].present && pool[i].pid[k] == 0 && now >= pool[i].next_start_ms[k]) {
+                    start_worker(&pool[i], k);
+                }
+            }
+        }
+        // Wake up as soon as a worker dies, or for the next scan.
+        sigtimedwait(&mask, NULL, &timeout);
+        reap_workers();
+    }
+}
+
+
+/*
+ * Bring the table up to date with the executables in filters/.
+ */
+void scan_filters(void) {
+    for (int i = 0; i < num_pool; i++) {
+        pool[i].present = 0;
+    }
+
+    DIR *dir = opendir(FILTER_DIR);
+    struct dirent *entry;
+    while (dir != NULL && (entry = readdir(dir)) != NULL) {
+        char path[MAX_PATH];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s%s", FILTER_DIR, entry->d_name);
+        if (entry->d_name[0] == '.' || stat(path, &st) == -1 || !S_ISREG(st.st_mode) ||
+                access(path, X_OK) != 0) {
+            continue;
+        }
+
+        PoolFilter *filter = NULL;
+        for (int i = 0; i < num_pool && filter == NULL; i++) {
+            if (strcmp(pool[i].name, entry->d_name) == 0) {
+                filter = &pool[i];
+            }
+        }
+        if (filter == NULL) {
+            if (num_pool == MAX_POOL_FILTERS) {
+                continue;
+            }
+            filter = &pool[num_pool++];
+            memset(filter, 0, sizeof(PoolFilter));
+            snprintf(filter->name, sizeof(filter->name), "%s", entry->d_name);
+            filter->mtime = st.st_mtim;
+        }
+        filter->present = 1;
+
+        // A redeployed filter: replace the workers running the old one.
+        if (filter->mtime.tv_sec != st.st_mtim.tv_sec ||
+                filter->mtime.tv_nsec != st.st_mtim.tv_nsec) {
+            filter->mtime = st.st_mtim;
+            stop_workers(filter);
+        }
+    }
+    if (dir != NULL) {
+        closedir(dir);
+    }
+
+    for (int i = 0; i < num_pool; i++) {
+        if (!pool[i].present) {
+            stop_workers(&pool[i]);
+        }
+    }
+}
+
+
+/*
+ * Create the worker's socket and start the filter on it, with the shim
+ * preloaded. The socket exists before the worker runs, so jobs sent while
+ * it starts up just wait in the backlog.
+ */
+void start_worker(PoolFilter *filter, int k) {
+    struct sockaddr_un addr;
+    socklen_t len = worker_address(&addr, getpid(), filter->name, k);
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (fd == -1 || bind(fd, (struct sockaddr *) &addr, len) == -1 || listen(fd, 64) == -1) {
+        // Most likely the previous worker hasn't quite gone yet.
+        if (fd != -1) {
+            close(fd);
+        }
+        filter->next_start_ms[k] = monotonic_ms() + POOL_SCAN_MS;
+        return;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        close(fd);
+        return;
+    } else if (pid == 0) {
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+
+        // Without the shim (e.g. a static binary) the filter runs once on an
+        // empty input and exits, and backs off.
+        int null_fd = open("/dev/null", O_RDONLY);
+        dup2(null_fd, STDIN_FILENO);
+        char fd_str[16];
+        snprintf(fd_str, sizeof(fd_str), "%d", fd);
+        setenv(FILTER_SERVER_FD_ENV, fd_str, 1);
+        setenv("LD_PRELOAD", shim_path, 1);
+
+        char path[MAX_PATH];
+        snprintf(path, sizeof(path), "%s%s", FILTER_DIR, filter->name);
+        execl(path, path, NULL);
+        perror("execl");
+        exit(1);
+    }
+
+    close(fd);
+    filter->pid[k] = pid;
+    filter->started_ms[k] = monotonic_ms();
+}
+
+
+/*
+ * Collect the workers that have died and schedule their restarts.
+ */
+void reap_workers(void) {
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (int i = 0; i < num_pool; i++) {
+            for (int k = 0; k < num_workers; k++) {
+                if (pool[i].pid[k] != pid) {
+                    continue;
+                }
+                PoolFilter *filter = &pool[i];
+                unsigned long now = monotonic_ms();
+                filter->pid[k] = 0;
+                if (now - filter->started_ms[k] < WORKER_MIN_UPTIME_MS) {
+                    unsigned long backoff = filter->backoff_ms[k] * 2;
+                    if (backoff < WORKER_MIN_UPTIME_MS) {
+                        backoff = WORKER_MIN_UPTIME_MS;
+                    }
+                    filter->backoff_ms[k] = (backoff < WORKER_MAX_BACKOFF_MS) ?
+                                            backoff : WORKER_MAX_BACKOFF_MS;
+                } else {
+                    filter->backoff_ms[k] = 0;
+                }
+                filter->next_start_ms[k] = now + filter->backoff_ms[k];
+                if (filter->present) {
+                    fprintf(stderr, "Filter worker %s [%d] exited with status %d, "
+                                    "restarting in %lu ms\n",
+                            filter->name, pid, status, filter->backoff_ms[k]);
+                }
+            }
+        }
+    }
+}
+
+
+void stop_workers(PoolFilter *filter) {
+    for (int k = 0; k < num_workers; k++) {
+        if (filter->pid[k] > 0) {
+            kill(filter->pid[k], SIGTERM);
+        }
+        filter->backoff_ms[k] = 0;
+        filter->next_start_ms[k] = 0;
+    }
+}
+
+
+/*
+ * Store the abstract socket address of worker <k> for <filter> in <addr>,
+ * and return its length.
+ */
+socklen_t worker_address(struct sockaddr_un *addr, pid_t supervisor,
+                         const char *filter, int k) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    // sun_path[0] is '\0': a name in the abstract namespace, not a file.
+    int len = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1,
+                       "image_server.%d.%s.%d", supervisor, filter, k);
+    if (len > (int) sizeof(addr->sun_path) - 2) {
+        len = sizeof(addr->sun_path) - 2;
+    }
+    return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+
+/******************************************************************************
+ * Running jobs
+ *****************************************************************************/
+
+/*
+ * Send a job frame with the two fds attached. Return 0 on success.
+ */
+static int send_job(int sock, int in_fd, int out_fd) {
+    FilterJobFrame frame = {FILTER_FRAME_MAGIC, 0, getpid()};
+    struct iovec iov = {&frame, sizeof(frame)};
+    union {
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(2 * sizeof(int));
+    int fds[2] = {in_fd, out_fd};
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    return (sendmsg(sock, &msg, MSG_NOSIGNAL) == sizeof(frame)) ? 0 : -1;
+}
+
+
+int run_filter_job(const char *filter, int in_fd, int out_fd) {
+    if (supervisor_pid == 0) {
+        return -1;
+    }
+
+    // Spread jobs over the workers, moving on if one is down.
+    for (int attempt = 0; attempt < num_workers; attempt++) {
+        int k = (getpid() + attempt) % num_workers;
+        struct sockaddr_un addr;
+        socklen_t len = worker_address(&addr, supervisor_pid, filter, k);
+        int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        if (sock == -1) {
+            return -1;
+        }
+        // The name could have been taken by another user's socket; our
+        // files only go to a worker of our own.
+        struct ucred cred;
+        socklen_t cred_len = sizeof(cred);
+        if (connect(sock, (struct sockaddr *) &addr, len) == -1 ||
+                getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == -1 ||
+                cred.uid != getuid() || send_job(sock, in_fd, out_fd) == -1) {
+            close(sock);
+            continue;
+        }
+
+        FilterResultFrame result;
+        ssize_t n;
+        do {
+            n = recv(sock, &result, sizeof(result), 0);
+        } while (n == -1 && errno == EINTR);
+        close(sock);
+        if (n == sizeof(result) && result.magic == FILTER_FRAME_MAGIC) {
+            return result.status;
+        }
+
+        // The worker died with the job: start over from scratch.
+        lseek(in_fd, 0, SEEK_SET);
+        lseek(out_fd, 0, SEEK_SET);
+        ftruncate(out_fd, 0);
+    }
+    return -1;
+}
+
+
+int run_filter(const char *filter, int in_fd, int out_fd) {
+    int status = run_filter_job(filter, in_fd, out_fd);
+    if (status != -1) {
+        return status;
+    }
+
+    char filepath[MAX_PATH];
+    snprintf(filepath, sizeof(filepath), "%s%s", FILTER_DIR, filter);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    } else if (pid == 0) {
+        if (dup2(in_fd, STDIN_FILENO) == -1 || dup2(out_fd, STDOUT_FILENO) == -1) {
+            perror("dup2");
+            exit(1);
+        }
+        execl(filepath, filepath, NULL);
+        perror("execl");
+        exit(1);
+    }
+    while (waitpid(pid, &status, 0) == -1) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return status;
+}
@@ -0,0 +1,80 @@
+#ifndef FILTERPOOL_H_
+#define FILTERPOOL_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Persistent filter co-processes. Instead of exec'ing filters/<name> for
+ * every request (paying for exec, dynamic linking and libc startup each
+ * time), a supervisor keeps a few long-lived workers per filter running and
+ * restarts any that die.
+ *
+ * Filters stay ordinary stdin -> stdout BMP programs. Each worker is the
+ * filter itself, started with FILTER_SHIM preloaded: the shim takes over
+ * __libc_start_main and, once the process is fully loaded and initialized,
+ * turns it into a fork server. For each job it forks a child that runs the
+ * filter's real main() with stdin and stdout set to the job's files, so
+ * every job still gets a fresh process, but without an exec.
+ *
+ * Jobs arrive on a SOCK_SEQPACKET Unix socket, one frame per message: a
+ * FilterJobFrame carrying the input and output fds (SCM_RIGHTS), answered
+ * with a FilterResultFrame once the job has exited. Outputs go to memfds,
+ * so the pixels are handed back through shared memory rather than a pipe.
+ *
+ * The sockets are in the abstract namespace, which any local user can
+ * connect to or bind first, so each end checks (SO_PEERCRED) that the other
+ * runs as the same user before it passes or takes any files.
+ */
+
+#define FILTER_SHIM "filter_shim.so"
+#define FILTER_SERVER_FD_ENV "FILTER_SERVER_FD"  // Tells the shim to serve jobs.
+
+#define DEFAULT_FILTER_WORKERS 2    // Workers per filter.
+#define MAX_FILTER_WORKERS 8
+#define MAX_POOL_FILTERS 32         // Filters beyond this are always exec'd.
+#define POOL_SCAN_MS 500            // How often filters/ is rescanned.
+#define WORKER_MIN_UPTIME_MS 1000   // Workers dying sooner than this back off...
+#define WORKER_MAX_BACKOFF_MS 60000 // ...doubling up to this long between restarts.
+#define JOB_FRAME_MS 500            // A worker waits this long for an accepted job's frame.
+
+#define FILTER_FRAME_MAGIC 0x544c4946u  // "FILT"
+
+// A job: run the filter with stdin and stdout set to the two fds attached.
+typedef struct {
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t job;
+} FilterJobFrame;
+
+// The outcome of a job.
+typedef struct {
+    uint32_t magic;
+    int32_t status;         // As reported by waitpid.
+    int64_t output_size;    // Bytes written to the output.
+    uint64_t job;
+} FilterResultFrame;
+
+
+/*
+ * Start the supervisor, keeping <workers> workers running for every filter
+ * (0 turns co-processes off). Must be called before the first acceptor is
+ * forked.
+ */
+void init_filter_pool(int workers);
+
+/*
+ * Have a worker for <filter> run it with stdin reading <in_fd> and stdout
+ * writing <out_fd>, and wait for it. Return the job's wait status, or -1 if
+ * no worker could take the job (the caller should exec the filter instead;
+ * both files are rewound).
+ */
+int run_filter_job(const char *filter, int in_fd, int out_fd);
+
+/*
+ * Like run_filter_job, but exec the filter if no worker takes the job.
+ * Return its wait status, or -1 if it couldn't be started.
+ */
+int run_filter(const char *filter, int in_fd, int out_fd);
+
+#endif /* FILTERPOOL_H_ */
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE  // sched_setaffinity
 #include <stdio.h>
 #include <string.h>
 #include <strings.h>
@@ -7,11 +8,33 @@
 #include <unistd.h>
 #include <sys/socket.h>
 #include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sched.h>
 #include <netinet/in.h>    /* Internet domain header */
 
 #include "socket.h"
 #include "request.h"
 #include "response.h"
+#include "precompute.h"
+#include "uring.h"
+#include "children.h"
+#include "batch.h"
+#include "convolve.h"
+#include "parallel.h"
+#include "trace.h"
+#include "accesslog.h"
+#include "static.h"
+#include "filterpool.h"
+#include "stats.h"
+#include "tiles.h"
+#include "upload.h"
+#include "scheduler.h"
+#include "capture.h"
+#include "remote.h"
+#include "isa.h"
+#include "tune.h"
+#include "profile.h"
 
 #ifndef PORT
 #define PORT 30000
@@ -20,6 +43,24 @@
 #define BACKLOG 10
 #define MAX_CLIENTS 10
 
+// Tags stored in the user_data of io_uring submissions. Client reads carry
+// the index of the client in the low bits.
+#define URING_ACCEPT (1ULL << 32)
+#define URING_TIMEOUT (2ULL << 32)
+#define URING_CLIENT (3ULL << 32)
+#define URING_SIGNAL (4ULL << 32)
+#define URING_WRITABLE (5ULL << 32)
+#define URING_TAG_MASK (~0ULL << 32)
+
+#define URING_ENTRIES 64
+
+// Returned by dispatch_request when the acceptor is sending the response
+// itself, and must call static_continue whenever the socket is writable.
+#define CLIENT_SENDING 2
+
+int dispatch_request(ClientState *client);
+void log_rejected(ClientState *client, int status);
+
 
 /*
  * Read data from a client socket, and, if there is enough information to
@@ -32,38 +73,74 @@
  *   b) A child process has been created to respond to the request.
  *
  * This return value indicates that the server process should close the socket.
- * Otherwise, return 0 (indicating that the server must continue to monitor the
- * socket).
+ * Return CLIENT_SENDING if the server is sending a static file and must keep
+ * writing to the socket. Otherwise, return 0 (indicating that the server must
+ * continue to monitor the socket, because the start line of the request is
+ * not complete yet).
  */
 int handle_client(ClientState *client) {
-    // Read in data (request) from the client's socket into its buffer,
-    // (just first few line of the request)
-    // and update num_bytes. If no bytes were read, return 1.
-
-    // number of bytes read from client's socket.
-    int numRead = read(client->sock, client->buf, sizeof(client->buf) - 1);
-    // sizeof(client->buf) - 1 = MAXLINE - 1,
-    // since sizeof(client->buf) is MAXLINE, we have to give a space for buf
-    // to include a '\0'.
+    // Read in data (request) from the client's socket, appending it to
+    // whatever part of the start line is already in its buffer.
+    // read_from_client updates num_bytes and null-terminates the buffer.
+    int numRead = read_from_client(client);
 
     if (numRead == 0) {
         //  No bytes were read from the socket. (The client has likely closed the connection.)
         return 1;
 
-    } else if (numRead > 0) {
-        client->num_bytes = numRead;  // The number of bytes currently in the buffer.
-        client->buf[numRead] = '\0';  // null-terminate it explicitly.
+    } else if (numRead < 0) {  // error checking.
+        return -1;
+    }
 
-        // Next update ReqData using parse_req_start_line(client).
-        parse_req_start_line(client);
+    return dispatch_request(client);
+}
 
-        // Now client->reqData has been initialized.
 
-    } else if (numRead < 0) {  // error checking.
-        perror("read");
-        return -1;
+/*
+ * Parse the request data buffered in client->buf and spawn a child process to
+ * respond to the request. This is shared by both event loops: the select loop
+ * reads the data itself, while the io_uring loop has it delivered straight
+ * into client->buf.
+ *
+ * Return 1 if a child process has been created (or an error response sent),
+ * indicating that the server process should close the socket, CLIENT_SENDING
+ * if a static file is being sent from this process, or 0 if the start line
+ * (or, for static files, the headers) of the request has not been fully
+ * received yet.
+ */
+int dispatch_request(ClientState *client) {
+    // Next update ReqData using parse_req_start_line(client).
+    unsigned long parse_start = trace_now();
+    if (client->reqData == NULL && !parse_req_start_line(client)) {
+        if (client->num_bytes >= MAXLINE - 1) {
+            // The start line can never fit in the buffer.
+            uri_too_long_response(client->sock);
+            log_rejected(client, 414);
+            return 1;
+        }
+        return 0;  // Wait for the rest of the start line.
+    }
+
+    // Static files are served right here, without a fork. Their responses
+    // depend on the conditional and encoding headers, so wait for those.
+    if (is_static_request(client->reqData)) {
+        if (!headers_complete(client)) {
+            return 0;
+        }
+        capture_request(client);
+        finish_capture();
+        return static_response(client) ? 1 : CLIENT_SENDING;
     }
 
+    // Only now is it known to be a request, so this is where it is sampled.
+    if (trace_begin_request()) {
+        trace_instant("accept", client->accepted_us);
+        trace_span("read_start_line", client->accepted_us, parse_start);
+        trace_span("parse_req_start_line", parse_start, trace_now());
+    }
+
+    // Now client->reqData has been initialized.
+
     // At this point client->reqData is not null, and so we are guaranteed
     // to spawn a child process to handle the request (so we return 1).
     // First, call fork. In the *parent* process, just return 1.
@@ -72,14 +149,32 @@ int handle_client(ClientState *client) {
     // The child should call exit(0) (rather than return) to prevent it from
     // executing the main server loop that listens for new requests.
 
+    int slot = reserve_child(client->reqData, client->accepted_us);
+    unsigned long fork_start = trace_now();
     int result = fork();
     if (result < 0) {  // error checking.
         perror("fork");
         exit(1);
     } else if (result > 0) {  // parent process.
+        trace_span("fork", fork_start, trace_now());
+        foreground_started();
+        track_child(slot, result);
+        trace_end_request();
         return 1;
 
     } else if (result == 0) {  // child process.
+        reset_child_signals();
+        profile_poll();
+        report_on_exit(client->sock);
+
+        // Requests with a body are recorded once it has been read.
+        capture_request(client);
+        if (strcmp(client->reqData->method, POST) == 0 || strcmp(client->reqData->method, PUT) == 0) {
+            atexit(finish_capture);
+        } else {
+            finish_capture();
+        }
+
         // when typing the URL in browser, the 1st request is sent,
         // to render the provided main.html page.
         int ret1 = strcmp(client->reqData->method, GET);
@@ -96,6 +191,20 @@ int handle_client(ClientState *client) {
             image_filter_response(client->sock, client->reqData);
         } else if ((ret4 == 0) && (ret5 == 0)) {
             image_upload_response(client);
+        } else if ((ret1 == 0) && strcmp(client->reqData->path, IMAGE_BATCH) == 0) {
+            image_batch_response(client->sock, client->reqData);
+        } else if ((ret1 == 0) && strcmp(client->reqData->path, IMAGE_STATS) == 0) {
+            image_stats_response(client->sock, client->reqData);
+        } else if (is_upload_request(client->reqData)) {
+            upload_response(client);
+        } else if ((ret1 == 0) && is_tile_request(client->reqData)) {
+            tile_response(client->sock, client->reqData);
+        } else if ((ret1 == 0) && strcmp(client->reqData->path, DEBUG_METRICS) == 0) {
+            metrics_response(client->sock);
+        } else if ((ret1 == 0) && strcmp(client->reqData->path, DEBUG_TRACE) == 0) {
+            trace_response(client->sock);
+        } else if ((ret1 == 0) && strcmp(client->reqData->path, DEBUG_PROFILE) == 0) {
+            profile_response(client->sock, client->reqData);
         } else {
             // Render the "Not Found" string.
             not_found_response(client->sock);
@@ -115,34 +224,285 @@ int handle_client(ClientState *client) {
 }
 
 
-int main(int argc, char **argv) {
-    // Creates an array of ClientState of size MAX_CLIENTS = 10.
-    ClientState *clients = init_clients(MAX_CLIENTS);
+/*
+ * Log a response the acceptor sent itself, to a request it couldn't parse.
+ */
+void log_rejected(ClientState *client, int status) {
+    AccessRecord record;
+    memset(&record, 0, sizeof(record));
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    record.time_ms = now.tv_sec * 1000UL + now.tv_nsec / 1000000;
+    record.pid = getpid();
+    record.status = status;
+    record.bytes = socket_bytes_sent(client->sock);
+    record.wait_us = trace_now() - client->accepted_us;
+    log_access(&record);
+}
 
-    struct sockaddr_in *servaddr = init_server_addr(PORT);
 
-    // Create an fd to listen to new connections.
-    int listenfd = setup_server_socket(servaddr, BACKLOG);
+/*
+ * Close every connection whose deadline has passed, in one batch. A client
+ * still reading gets a 408 first; one that stopped reading a static file
+ * just gets disconnected.
+ * In the select loop the client can be removed right away. In the io_uring
+ * loop a read is still pending on the socket, so it is only shut down here;
+ * the read then completes with 0 and the client is removed as usual.
+ */
+void expire_clients(TimerWheel *wheel, fd_set *allset, fd_set *writeset) {
+    Timer expired;
+    timer_init(&expired, NULL);
+    if (timer_wheel_advance(wheel, &expired) == 0) {
+        return;
+    }
 
-    // Print out information about this server
-    char host[MAX_HOSTNAME];
-    if ((gethostname(host, sizeof(host))) == -1) {
-        perror("gethostname");
+    Timer *timer;
+    while ((timer = timer_next_expired(&expired)) != NULL) {
+        ClientState *client = timer->data;
+        fprintf(stderr, "Client [%d] timed out\n", client->sock);
+        if (client->out_buf == NULL) {
+            request_timeout_response(client->sock);
+            log_rejected(client, 408);
+        }
+        if (allset != NULL) {
+            FD_CLR(client->sock, allset);
+            FD_CLR(client->sock, writeset);
+            remove_client(client);
+        } else {
+            shutdown(client->sock, SHUT_RDWR);
+        }
+    }
+}
+
+
+/*
+ * Take a free client slot for a newly accepted socket and start its idle
+ * deadline. Return the index of the slot, or -1 if all slots are in use
+ * (in which case the socket is closed).
+ */
+int add_client(ClientState *clients, TimerWheel *wheel, int fd) {
+    ClientState *client = alloc_client();
+    if (client == NULL) {
+        fprintf(stderr, "Too many clients, dropping connection\n");
+        close(fd);
+        return -1;
+    }
+    client->sock = fd;
+    client->accepted_us = trace_now();
+    timer_add(wheel, &client->timer, IDLE_TIMEOUT_MS);
+    return client - clients;
+}
+
+
+/*
+ * Return a submission entry to fill in. The queue is flushed when full, so
+ * none can be had only if io_uring_enter fails, which the loop can't go on
+ * from either.
+ */
+struct io_uring_sqe *next_sqe(Uring *ring) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (sqe == NULL) {
+        perror("io_uring_enter");
         exit(1);
     }
-    fprintf(stderr, "Server hostname: %s\n", host);
-    fprintf(stderr, "Port: %d\n", PORT);
+    return sqe;
+}
+
+
+/*
+ * Queue a read from the client's socket straight into the unused part of its
+ * (registered) buffer.
+ */
+void queue_client_read(Uring *ring, ClientState *clients, int i) {
+    struct io_uring_sqe *sqe = next_sqe(ring);
+    uring_prep_read_fixed(sqe, clients[i].sock, clients[i].buf + clients[i].num_bytes,
+                          MAXLINE - 1 - clients[i].num_bytes, i, URING_CLIENT | i);
+}
+
+
+/*
+ * Wait for the client's socket to become writable again, with a fresh
+ * deadline, to send more of a static file.
+ */
+void queue_client_write(Uring *ring, TimerWheel *wheel, ClientState *clients, int i) {
+    timer_del(wheel, &clients[i].timer);
+    timer_add(wheel, &clients[i].timer, SEND_IDLE_TIMEOUT_MS);
+    uring_prep_poll_add(next_sqe(ring), clients[i].sock, POLLOUT, URING_WRITABLE | i);
+}
+
+
+/*
+ * Queue a timeout that wakes the loop in time for the next deadline.
+ */
+void queue_timeout(Uring *ring, TimerWheel *wheel, struct __kernel_timespec *ts) {
+    unsigned long ms = timer_wheel_next_ms(wheel, 2000);
+    ts->tv_sec = ms / 1000;
+    ts->tv_nsec = (ms % 1000) * 1000000;
+    uring_prep_timeout(next_sqe(ring), ts, URING_TIMEOUT);
+}
+
+
+/*
+ * The io_uring version of the main server loop. One multishot accept keeps
+ * delivering new connections, request data is received directly into the
+ * registered client buffers, and every batch of submissions and completions
+ * costs a single io_uring_enter call.
+ *
+ * Never returns, unless the kernel turns out not to support multishot
+ * accept (before 5.19): the ring is then torn down, and the caller should
+ * serve with select instead.
+ */
+void serve_uring(int listenfd, int sigfd, Uring *ring) {
+    ClientState *clients = init_clients(MAX_CLIENTS);
+    TimerWheel wheel;
+    timer_wheel_init(&wheel);
+
+    struct iovec iov[MAX_CLIENTS];
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        iov[i].iov_base = clients[i].buf;
+        iov[i].iov_len = MAXLINE;
+    }
+    if (uring_register_buffers(ring, iov, MAX_CLIENTS) < 0) {
+        perror("io_uring_register");
+        exit(1);
+    }
+
+    uring_prep_multishot_accept(next_sqe(ring), listenfd, URING_ACCEPT);
+    uring_prep_poll_add(next_sqe(ring), sigfd, POLLIN, URING_SIGNAL);
+
+    // Plays the role of the select timeout: wakes the loop for deadlines.
+    struct __kernel_timespec timer;
+    queue_timeout(ring, &wheel, &timer);
+    int accepted = 0;
+
+    // Main server loop.
+    while (1) {
+        profile_poll();
+        if (uring_submit_and_wait(ring, 1) < 0) {
+            if (errno == EINTR) {
+                continue;     // A profiling signal.
+            }
+            perror("io_uring_enter");
+            exit(1);
+        }
+
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek_cqe(ring)) != NULL) {
+            __u64 tag = cqe->user_data & URING_TAG_MASK;
+            int res = cqe->res;
+            int more = cqe->flags & IORING_CQE_F_MORE;
+            int i = cqe->user_data & ~URING_TAG_MASK;
+            uring_cqe_seen(ring);
+
+            if (tag == URING_TIMEOUT) {
+                queue_timeout(ring, &wheel, &timer);
+
+            } else if (tag == URING_SIGNAL) {    // Some children exited.
+                reap_children();
+                uring_prep_poll_add(next_sqe(ring), sigfd, POLLIN, URING_SIGNAL);
+
+            } else if (tag == URING_ACCEPT) {    // New client connection.
+                if (res == -EINVAL && !accepted) {
+                    // Older kernels reject the multishot flag outright, and
+                    // re-arming it would only fail again.
+                    fprintf(stderr, "io_uring multishot accept is not supported\n");
+                    uring_exit(ring);
+                    free(clients);
+                    return;
+                }
+                if (!more) {
+                    // The kernel stopped the multishot accept; re-arm it.
+                    uring_prep_multishot_accept(next_sqe(ring), listenfd, URING_ACCEPT);
+                }
+                if (res < 0) {
+                    fprintf(stderr, "accept: %s\n", strerror(-res));
+                    continue;
+                }
+
+                accepted = 1;
+                int slot = add_client(clients, &wheel, res);
+                if (slot >= 0) {
+                    queue_client_read(ring, clients, slot);
+                }
+
+            } else if (tag == URING_CLIENT) {
+                if (res <= 0) {
+                    // The client closed the connection, the read failed, or
+                    // the client timed out and its socket was shut down.
+                    timer_del(&wheel, &clients[i].timer);
+                    remove_client(&clients[i]);
+                    continue;
+                }
+
+                // The first bytes of a request start the header deadline.
+                int was_idle = (clients[i].num_bytes == 0);
+                clients[i].num_bytes += res;
+                clients[i].buf[clients[i].num_bytes] = '\0';
+                int done = dispatch_request(&clients[i]);
+                if (done == CLIENT_SENDING) {
+                    queue_client_write(ring, &wheel, clients, i);
+                } else if (done) {
+                    timer_del(&wheel, &clients[i].timer);
+                    remove_client(&clients[i]);
+                } else {
+                    if (was_idle) {
+                        timer_add(&wheel, &clients[i].timer, HEADER_TIMEOUT_MS);
+                    }
+                    queue_client_read(ring, clients, i);
+                }
+
+            } else if (tag == URING_WRITABLE) {
+                if (static_continue(&clients[i])) {
+                    timer_del(&wheel, &clients[i].timer);
+                    remove_client(&clients[i]);
+                } else {
+                    queue_client_write(ring, &wheel, clients, i);
+                }
+            }
+        }
+
+        expire_clients(&wheel, NULL, NULL);
+    }
+}
+
+
+/*
+ * Run the main server loop, accepting connections on listenfd.
+ * Each acceptor runs its own copy of this loop; it never returns.
+ */
+void serve(int listenfd) {
+    // Exited children are reported through this fd, as part of the loop.
+    int sigfd = init_child_signals();
+
+    if (use_uring) {
+        Uring ring;
+        if (uring_init(&ring, URING_ENTRIES) == 0) {
+            serve_uring(listenfd, sigfd, &ring);
+        }
+        fprintf(stderr, "io_uring is not available, falling back to select\n");
+        use_uring = 0;
+    }
+
+    // Creates an array of ClientState of size MAX_CLIENTS = 10.
+    ClientState *clients = init_clients(MAX_CLIENTS);
+
+    // Deadlines for slow or stalled clients.
+    TimerWheel wheel;
+    timer_wheel_init(&wheel);
 
     // Set up the arguments for select
-    int maxfd = listenfd;
+    int maxfd = (listenfd > sigfd) ? listenfd : sigfd;
     fd_set allset;
+    fd_set writeset;    // Clients being sent a static file.
 
-    // initialize allset and add listenfd to the
+    // initialize allset and add listenfd and sigfd to the
     // set of file descriptors passed into select.
     FD_ZERO(&allset);
+    FD_ZERO(&writeset);
     FD_SET(listenfd, &allset);
+    FD_SET(sigfd, &allset);
 
-    // Set up a timer for select (This is only necessary for debugging help)
+    // Set up a timer for select: wake up in time for the next deadline.
     struct timeval timer;
 
 
@@ -150,44 +510,46 @@ int main(int argc, char **argv) {
     while (1) {
         // make a copy of the set before we pass it into select.
         fd_set rset = allset;
-        timer.tv_sec = 2;
-        timer.tv_usec = 0;
+        fd_set wset = writeset;
+        unsigned long ms = timer_wheel_next_ms(&wheel, 2000);
+        timer.tv_sec = ms / 1000;
+        timer.tv_usec = (ms % 1000) * 1000;
 
-        int nready = select(maxfd + 1, &rset, NULL, NULL, &timer);
+        profile_poll();
+        int nready = select(maxfd + 1, &rset, &wset, NULL, &timer);
         // nready is numbers of ready file_descriptors if not 0 and -1.
         // if nready is 0, means timer expired.
         if(nready == -1) {
+            if (errno == EINTR) {
+                continue;     // A profiling signal.
+            }
             perror("select");
             exit(1);
         }
 
+        expire_clients(&wheel, &allset, &writeset);
+
         if(nready == 0) {  // timer expired
-            // Check if any children have failed
-            int status;
-            int pid;
-            errno = 0;
-            if ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
-                if (WIFSIGNALED(status)) {
-                    fprintf(stderr, "Child [%d] failed with signal %d\n", pid,
-                            WTERMSIG(status));
-                }
-            }
             continue;
         }
 
+        if (FD_ISSET(sigfd, &rset)) {    // Some children exited.
+            reap_children();
+            nready -= 1;
+        }
+
 
         if (FD_ISSET(listenfd, &rset)) {    // New client connection.
             int new_client_fd = accept_connection(listenfd);  // block until one client connects.
-            if (new_client_fd >= 0) {
+            if (new_client_fd >= 0 && add_client(clients, &wheel, new_client_fd) >= 0) {
                 maxfd = (new_client_fd > maxfd) ? new_client_fd : maxfd;
                 FD_SET(new_client_fd, &allset);    // Add new descriptor to set.
-
-                for(int i = 0; i < MAX_CLIENTS; i++) {
-                    if (clients[i].sock < 0) {
-                        clients[i].sock = new_client_fd;
-                        break;
-                    }
-                }
+            }
+            // It may reuse the fd of a client expired above, whose stale
+            // readiness must not be taken for the new one's.
+            if (new_client_fd >= 0) {
+                FD_CLR(new_client_fd, &rset);
+                FD_CLR(new_client_fd, &wset);
             }
 
             nready -= 1;
@@ -196,18 +558,220 @@ int main(int argc, char **argv) {
         // The nready is just an optimization; no harm in checking all fds
         // except efficiency
         for (int i = 0; i < MAX_CLIENTS && nready > 0; i++) {
+            if (clients[i].sock >= 0 && FD_ISSET(clients[i].sock, &wset)) {
+                if (static_continue(&clients[i])) {
+                    FD_CLR(clients[i].sock, &writeset);
+                    timer_del(&wheel, &clients[i].timer);
+                    remove_client(&clients[i]);
+                } else {
+                    timer_del(&wheel, &clients[i].timer);
+                    timer_add(&wheel, &clients[i].timer, SEND_IDLE_TIMEOUT_MS);
+                }
+                nready -= 1;
+                continue;
+            }
+
             // Check whether clients[i] has an active, ready socket.
             if (clients[i].sock < 0 || !FD_ISSET(clients[i].sock, &rset)) {
                 continue;
             }
 
+            // The first bytes of a request start the header deadline.
+            int was_idle = (clients[i].num_bytes == 0);
             int done = handle_client(&clients[i]);
-            if (done) {
+            if (done == CLIENT_SENDING) {
+                // Stop reading; wait for room to send the rest.
+                FD_CLR(clients[i].sock, &allset);
+                FD_SET(clients[i].sock, &writeset);
+                timer_del(&wheel, &clients[i].timer);
+                timer_add(&wheel, &clients[i].timer, SEND_IDLE_TIMEOUT_MS);
+            } else if (done) {
                 FD_CLR(clients[i].sock, &allset);  // remove the socket fd associate with this client.
+                timer_del(&wheel, &clients[i].timer);
                 remove_client(&clients[i]);
+            } else if (was_idle) {
+                timer_add(&wheel, &clients[i].timer, HEADER_TIMEOUT_MS);
             }
 
             nready -= 1;
         }
     }
 }
+
+
+/*
+ * Restrict the calling process to a single CPU.
+ */
+void pin_to_cpu(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+        perror("sched_setaffinity");
+    }
+}
+
+
+/*
+ * Fork an acceptor process with its own SO_REUSEPORT listening socket and
+ * its own event loop. Return the pid of the acceptor.
+ */
+pid_t start_acceptor(struct sockaddr_in *servaddr, int index, int pin) {
+    int result = fork();
+    if (result < 0) {
+        perror("fork");
+        exit(1);
+    } else if (result == 0) {
+        if (pin) {
+            pin_to_cpu(index % sysconf(_SC_NPROCESSORS_ONLN));
+        }
+        trace_set_ring(index);
+        serve(setup_reuseport_socket(servaddr, BACKLOG));
+    }
+    return result;
+}
+
+
+int main(int argc, char **argv) {
+    int num_acceptors = 1;
+    int pin = 0;
+    int trace_every = 0;
+    const char *access_log = ACCESS_LOG_DEFAULT;
+    int filter_workers = DEFAULT_FILTER_WORKERS;
+    int filter_jobs = 0;
+    const char *capture_file = NULL;
+    long capture_keep = 0;
+    const char *remote_workers = NULL;
+    int worker_port = 0;
+    const char *remote_key = NULL;
+    int strip_rows = 0;
+    int profile = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:cut:S:T:Pl:s:w:j:R:K:F:W:A:")) != -1) {
+        switch (opt) {
+        case 'n':  // Number of acceptors, 0 means one per online CPU.
+            num_acceptors = strtol(optarg, NULL, 10);
+            if (num_acceptors <= 0) {
+                num_acceptors = sysconf(_SC_NPROCESSORS_ONLN);
+            }
+            break;
+        case 'c':  // Pin each acceptor to its own CPU.
+            pin = 1;
+            break;
+        case 'u':  // Use the io_uring event loop and response paths.
+            use_uring = 1;
+            break;
+        case 't':  // Threads per request for in-process filters, 0 tunes it at startup.
+            parallel_threads = strtol(optarg, NULL, 10);
+            break;
+        case 'S':  // Rows per strip of in-process filters, 0 tunes it at startup.
+            strip_rows = strtol(optarg, NULL, 10);
+            break;
+        case 'T':  // Trace one in every this many requests, 0 means never.
+            trace_every = strtol(optarg, NULL, 10);
+            break;
+        case 'P':  // Allow profiles to be taken at /debug/profile.
+            profile = 1;
+            break;
+        case 'l':  // Access log file, "" for none.
+            access_log = optarg;
+            break;
+        case 's':  // Directory of files served under /static/.
+            init_static(optarg);
+            break;
+        case 'w':  // Long-lived workers per filter, 0 to exec filters per request.
+            filter_workers = strtol(optarg, NULL, 10);
+            break;
+        case 'j':  // Filter jobs run at once, 0 means one per CPU, -1 no limit.
+            filter_jobs = strtol(optarg, NULL, 10);
+            break;
+        case 'R':  // Record every request to this capture file, for ./replay.
+            capture_file = optarg;
+            break;
+        case 'K':  // Bytes of each request body kept in the capture, 0 for hashes only.
+            capture_keep = strtol(optarg, NULL, 10);
+            break;
+        case 'F':  // Send filter jobs to these workers (host:port,...).
+            remote_workers = optarg;
+            break;
+        case 'W':  // Be a filter worker on this port instead of a web server.
+            worker_port = strtol(optarg, NULL, 10);
+            break;
+        case 'A':  // File holding the key shared with filter workers or servers.
+            remote_key = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n acceptors] [-c] [-u] [-t threads] [-S strip_rows] [-T trace_every]"
+                            " [-P] [-l access_log] [-s static_dir] [-w filter_workers] [-j filter_jobs]"
+                            " [-R capture_file] [-K body_bytes] [-F host:port,...] [-W worker_port] [-A key_file]\n",
+                    argv[0]);
+            exit(1);
+        }
+    }
+
+    if (worker_port > 0) {
+        // Runs the jobs of servers started with -F, with its own filter
+        // workers and scheduler.
+        init_filter_pool(filter_workers);
+        init_scheduler(filter_jobs);
+        run_filter_worker(worker_port, remote_key);
+    }
+
+    // Choose the kernel variants for this CPU, then how in-process filters
+    // are split across threads. A pinned acceptor's requests only have its
+    // CPU, so they keep to one thread unless told otherwise.
+    init_isa();
+    tune_kernels((pin && parallel_threads == 0) ? 1 : parallel_threads, strip_rows);
+
+    // Shared with every child we fork, so they must exist before the first one.
+    init_precompute();
+    init_trace(trace_every);
+    init_profiler(profile);
+    init_access_log(access_log);
+    init_filter_pool(filter_workers);
+    init_scheduler(filter_jobs);
+    init_capture(capture_file, capture_keep);
+    init_remote_workers(remote_workers, remote_key);
+
+    struct sockaddr_in *servaddr = init_server_addr(PORT);
+
+    // Print out information about this server
+    char host[MAX_HOSTNAME];
+    if ((gethostname(host, sizeof(host))) == -1) {
+        perror("gethostname");
+        exit(1);
+    }
+    fprintf(stderr, "Server hostname: %s\n", host);
+    fprintf(stderr, "Port: %d\n", PORT);
+
+    if (num_acceptors == 1) {
+        // Create an fd to listen to new connections.
+        serve(setup_server_socket(servaddr, BACKLOG));
+    }
+
+    // Each acceptor has its own listening socket bound to the same port, so
+    // the kernel balances connections between them without a shared lock.
+    fprintf(stderr, "Acceptors: %d\n", num_acceptors);
+    pid_t acceptors[num_acceptors];
+    for (int i = 0; i < num_acceptors; i++) {
+        acceptors[i] = start_acceptor(servaddr, i, pin);
+    }
+
+    // Supervise the acceptors, replacing any that die.
+    while (1) {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid == -1) {
+            perror("waitpid");
+            exit(1);
+        }
+        for (int i = 0; i < num_acceptors; i++) {
+            if (acceptors[i] == pid) {
+                fprintf(stderr, "Acceptor [%d] exited with status %d, restarting\n",
+                        pid, status);
+                acceptors[i] = start_acceptor(servaddr, i, pin);
+            }
+        }
+    }
+}
@@ -0,0 +1,68 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "isa.h"
+
+int active_isa = ISA_GENERIC;
+int detected_isa = ISA_GENERIC;
+
+static const char *isa_names[NUM_ISAS] = {"generic", "sse4.2", "avx2", "avx512"};
+
+
+int isa_supported(int isa) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    switch (isa) {
+    case ISA_GENERIC:
+        return 1;
+    case ISA_SSE42:
+        return __builtin_cpu_supports("sse4.2");
+    case ISA_AVX2:
+        return __builtin_cpu_supports("avx2");
+    case ISA_AVX512:
+        return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+               __builtin_cpu_supports("avx512vl");
+    }
+    return 0;
+#else
+    return isa == ISA_GENERIC;
+#endif
+}
+
+
+const char *isa_name(int isa) {
+    return (isa >= 0 && isa < NUM_ISAS) ? isa_names[isa] : "unknown";
+}
+
+
+int find_isa(const char *name) {
+    for (int i = 0; i < NUM_ISAS; i++) {
+        if (strcmp(isa_names[i], name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+void init_isa(void) {
+    for (int i = 0; i < NUM_ISAS; i++) {
+        if (isa_supported(i)) {
+            detected_isa = i;
+        }
+    }
+    active_isa = detected_isa;
+
+    const char *requested = getenv(ISA_ENV);
+    if (requested == NULL || requested[0] == '\0') {
+        return;
+    }
+    int isa = find_isa(requested);
+    if (isa == -1 || !isa_supported(isa)) {
+        fprintf(stderr, "%s=%s is not a variant this CPU can run, using %s\n",
+                ISA_ENV, requested, isa_name(detected_isa));
+        return;
+    }
+    active_isa = isa;
+}
@@ -0,0 +1,88 @@
+#ifndef ISA_H_
+#define ISA_H_
+
+/*
+ * Instruction set variants of the pixel kernels, so that a single build
+ * makes good use of every host it runs on. Each kernel is compiled once per
+ * variant with ISA_VARIANTS, and called through the table it defines. At
+ * startup init_isa picks the widest variant the CPU supports (as reported by
+ * CPUID), unless the ISA_ENV environment variable names another one, e.g.
+ *     IMAGE_SERVER_ISA=sse4.2 ./image_server
+ */
+
+#define ISA_ENV "IMAGE_SERVER_ISA"
+
+#define ISA_GENERIC 0     // Whatever the compiler targets by default (SSE2 on x86-64).
+#define ISA_SSE42 1
+#define ISA_AVX2 2
+#define ISA_AVX512 3      // AVX-512 F, BW and VL.
+#define NUM_ISAS 4
+
+/*
+ * The variant in use. ISA_GENERIC until init_isa is called.
+ */
+extern int active_isa;
+
+/*
+ * The widest variant this CPU supports.
+ */
+extern int detected_isa;
+
+/*
+ * Detect the instruction sets of this CPU and choose the variant to use.
+ */
+void init_isa(void);
+
+/*
+ * Return 1 if this CPU can run the <isa> variant, 0 otherwise.
+ */
+int isa_supported(int isa);
+
+/*
+ * Return the name of <isa>, as accepted in ISA_ENV.
+ */
+const char *isa_name(int isa);
+
+/*
+ * Return the variant called <name>, or -1 if there is none.
+ */
+int find_isa(const char *name);
+
+
+/*
+ * Define <name>_variants, a table of NUM_ISAS functions with the parameter
+ * list <params>, each calling <body> (an always_inline function) with the
+ * argument list <args>, compiled for its instruction set. Kernels are built
+ * with -O3, so each variant gets loops vectorized for its vector width.
+ * Call the active one with ISA_CALL(name).
+ */
+#if defined(__x86_64__) || defined(__i386__)
+#define ISA_VARIANTS(name, body, params, args) \
+    static void name##_generic params { \
+        body args; \
+    } \
+    __attribute__((target("sse4.2"))) static void name##_sse42 params { \
+        body args; \
+    } \
+    __attribute__((target("avx2"))) static void name##_avx2 params { \
+        body args; \
+    } \
+    __attribute__((target("avx512f,avx512bw,avx512vl"))) static void name##_avx512 params { \
+        body args; \
+    } \
+    static void (*const name##_variants[NUM_ISAS]) params = { \
+        name##_generic, name##_sse42, name##_avx2, name##_avx512 \
+    };
+#else
+#define ISA_VARIANTS(name, body, params, args) \
+    static void name##_generic params { \
+        body args; \
+    } \
+    static void (*const name##_variants[NUM_ISAS]) params = { \
+        name##_generic, name##_generic, name##_generic, name##_generic \
+    };
+#endif
+
+#define ISA_CALL(name) (name##_variants[active_isa])
+
+#endif /* ISA_H_ */
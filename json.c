@@ -0,0 +1,23 @@
+#include <stdio.h>
+
+#include "json.h"
+
+
+int json_string(char *buf, int size, const char *str) {
+    int len = 0;
+    buf[len++] = '"';
+    for (; *str != '\0' && len < size - 8; str++) {
+        unsigned char c = *str;
+        if (c == '"' || c == '\\') {
+            buf[len++] = '\\';
+            buf[len++] = c;
+        } else if (c < 0x20) {
+            len += sprintf(buf + len, "\\u%04x", c);
+        } else {
+            buf[len++] = c;
+        }
+    }
+    buf[len++] = '"';
+    buf[len] = '\0';
+    return len;
+}
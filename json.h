@@ -0,0 +1,12 @@
+#ifndef JSON_H_
+#define JSON_H_
+
+/*
+ * Write <str> to <buf> as a quoted JSON string, escaping '"', '\' and
+ * control characters, and null-terminate it. A string too long for <size>
+ * bytes (which must be at least 3) is cut short but still quoted.
+ * Return the length written, not counting the '\0'.
+ */
+int json_string(char *buf, int size, const char *str);
+
+#endif /* JSON_H_ */
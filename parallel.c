@@ -0,0 +1,101 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "parallel.h"
+
+int parallel_threads = 0;
+int parallel_strip = 0;
+
+// One thread's share of a parallel_for: the range [start, end), or with
+// strips, whichever of them it takes.
+typedef struct {
+    RangeFunc func;
+    void *arg;
+    int start;
+    int end;
+    int strip;
+    int *next_strip;          // Shared by all the threads.
+} RangeTask;
+
+
+static void *run_task(void *data) {
+    RangeTask *task = data;
+    if (task->strip == 0) {
+        task->func(task->arg, task->start, task->end);
+        return NULL;
+    }
+    while (1) {
+        long start = (long) __atomic_fetch_add(task->next_strip, 1, __ATOMIC_RELAXED) * task->strip;
+        if (start >= task->end) {
+            return NULL;
+        }
+        task->func(task->arg, start, (start + task->strip < task->end) ? start + task->strip
+                                                                       : task->end);
+    }
+}
+
+
+int parallel_thread_count(void) {
+    int threads = parallel_threads;
+    if (threads <= 0) {
+        // Only count the CPUs we may run on: a pinned acceptor's requests
+        // inherit its single CPU.
+        cpu_set_t set;
+        threads = (sched_getaffinity(0, sizeof(set), &set) == 0) ? CPU_COUNT(&set)
+                                                                 : sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    return (threads < MAX_THREADS) ? threads : MAX_THREADS;
+}
+
+
+void parallel_for(int n, int min_chunk, RangeFunc func, void *arg) {
+    int threads = parallel_thread_count();
+    if (min_chunk < 1) {
+        min_chunk = 1;
+    }
+    if (threads > n / min_chunk) {
+        threads = n / min_chunk;
+    }
+    if (threads <= 1) {
+        func(arg, 0, n);
+        return;
+    }
+
+    int strip = 0;
+    int next_strip = 0;
+    if (parallel_strip > 0) {
+        strip = (parallel_strip > min_chunk) ? parallel_strip : min_chunk;
+        if (threads > (n + strip - 1) / strip) {
+            threads = (n + strip - 1) / strip;
+        }
+    }
+
+    RangeTask tasks[MAX_THREADS];
+    pthread_t ids[MAX_THREADS];
+    int started[MAX_THREADS] = {0};
+    for (int i = 0; i < threads; i++) {
+        tasks[i].func = func;
+        tasks[i].arg = arg;
+        tasks[i].start = strip ? 0 : (long) n * i / threads;
+        tasks[i].end = strip ? n : (long) n * (i + 1) / threads;
+        tasks[i].strip = strip;
+        tasks[i].next_strip = &next_strip;
+    }
+
+    for (int i = 1; i < threads; i++) {
+        started[i] = pthread_create(&ids[i], NULL, run_task, &tasks[i]) == 0;
+        if (!started[i]) {
+            // Do its share here instead.
+            run_task(&tasks[i]);
+        }
+    }
+    run_task(&tasks[0]);
+    for (int i = 1; i < threads; i++) {
+        if (started[i]) {
+            pthread_join(ids[i], NULL);
+        }
+    }
+}
@@ -0,0 +1,39 @@
+#ifndef PARALLEL_H_
+#define PARALLEL_H_
+
+// Upper bound on the threads a single request may use.
+#define MAX_THREADS 64
+
+
+/*
+ * Work on the items [start, end) of a range, e.g. rows or columns of an image.
+ */
+typedef void (*RangeFunc)(void *arg, int start, int end);
+
+/*
+ * The number of threads parallel_for uses. 0 (the default) means one per
+ * CPU the process may run on.
+ */
+extern int parallel_threads;
+
+/*
+ * The number of items (rows, say) in each range parallel_for hands out.
+ * 0 (the default) gives each thread one range of an equal share.
+ */
+extern int parallel_strip;
+
+/*
+ * Split [0, n) into contiguous ranges of at least <min_chunk> items and run
+ * <func> on them in parallel, with the calling thread taking part. With
+ * parallel_strip set, the ranges are strips of that many items (or
+ * min_chunk, if more) which the threads take in turn until none are left;
+ * otherwise each thread gets one range. Return once all of them are done.
+ */
+void parallel_for(int n, int min_chunk, RangeFunc func, void *arg);
+
+/*
+ * Return the number of threads parallel_for may use.
+ */
+int parallel_thread_count(void);
+
+#endif /* PARALLEL_H_ */
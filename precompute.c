@@ -0,0 +1,227 @@
+#define _GNU_SOURCE  // SCHED_IDLE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "precompute.h"
+#include "cache.h"
+#include "request.h"
+#include "tiles.h"
+
+
+// A slot in the shared popularity table.
+typedef struct {
+    int state;                   // SLOT_FREE, SLOT_CLAIMED or SLOT_READY
+    char name[MAX_FILTER_NAME];  // Only valid once state is SLOT_READY.
+    long count;                  // Number of requests seen for this filter.
+} FilterCount;
+
+#define SLOT_FREE 0
+#define SLOT_CLAIMED 1
+#define SLOT_READY 2
+
+// Lives in a MAP_SHARED mapping so the counts survive fork().
+typedef struct {
+    int foreground;              // Number of requests currently being served.
+    FilterCount filters[MAX_TRACKED_FILTERS];
+} PrecomputeStats;
+
+static PrecomputeStats *stats = NULL;
+
+// Helper function declarations.
+int pick_popular_filters(FilterCount *picked, int n);
+double run_precompute_job(const char *filter, const char *image);
+
+
+void init_precompute(void) {
+    stats = mmap(NULL, sizeof(PrecomputeStats), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (stats == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    memset(stats, 0, sizeof(PrecomputeStats));
+}
+
+
+void record_filter_request(const char *filter) {
+    if (stats == NULL || filter == NULL || strchr(filter, '/') != NULL ||
+            strlen(filter) >= MAX_FILTER_NAME) {
+        return;
+    }
+
+    for (int i = 0; i < MAX_TRACKED_FILTERS; i++) {
+        FilterCount *slot = &stats->filters[i];
+        if (slot->state == SLOT_FREE &&
+                __sync_bool_compare_and_swap(&slot->state, SLOT_FREE, SLOT_CLAIMED)) {
+            strcpy(slot->name, filter);
+            __sync_synchronize();
+            slot->state = SLOT_READY;
+        }
+        if (slot->state == SLOT_READY && strcmp(slot->name, filter) == 0) {
+            __sync_fetch_and_add(&slot->count, 1);
+            return;
+        }
+    }
+    // The table is full; filters beyond the first few are never precomputed.
+}
+
+
+void foreground_started(void) {
+    if (stats != NULL) {
+        __sync_fetch_and_add(&stats->foreground, 1);
+    }
+}
+
+
+void foreground_finished(void) {
+    if (stats != NULL && stats->foreground > 0) {
+        __sync_fetch_and_sub(&stats->foreground, 1);
+    }
+}
+
+
+void precompute_filters(const char **images, int num_images) {
+    if (stats == NULL) {
+        return;
+    }
+
+    int result = fork();
+    if (result < 0) {
+        perror("fork");
+        return;
+    } else if (result > 0) {
+        // The worker is orphaned as soon as the request process exits, so
+        // nobody needs to wait for it.
+        return;
+    }
+
+    // Don't hold on to the client connection (or anything else) the
+    // request process had open.
+    for (int fd = 3; fd < getdtablesize(); fd++) {
+        close(fd);
+    }
+
+    // Only use CPU time nobody else wants.
+    struct sched_param param = {0};
+    if (sched_setscheduler(0, SCHED_IDLE, &param) == -1) {
+        perror("sched_setscheduler");
+    }
+    if (setpriority(PRIO_PROCESS, 0, 19) == -1) {
+        perror("setpriority");
+    }
+
+    // Filters inherit this limit, so a runaway filter is killed by SIGXCPU.
+    rlim_t budget = (rlim_t) PRECOMPUTE_CPU_BUDGET * num_images;
+    struct rlimit limit = {budget, budget};
+    setrlimit(RLIMIT_CPU, &limit);
+
+    FilterCount picked[PRECOMPUTE_TOP_N];
+    int num_picked = pick_popular_filters(picked, PRECOMPUTE_TOP_N);
+
+    for (int n = 0; n < num_images; n++) {
+        double cpu_used = 0;
+        for (int i = 0; i < num_picked && cpu_used < PRECOMPUTE_CPU_BUDGET; i++) {
+            cpu_used += run_precompute_job(picked[i].name, images[n]);
+        }
+
+        // So that zooming out of a large image doesn't have to wait for it.
+        build_pyramid(images[n]);
+    }
+    exit(0);
+}
+
+
+/*
+ * Copy the <n> most requested filters into <picked>, most popular first.
+ * Return the number of filters copied.
+ */
+int pick_popular_filters(FilterCount *picked, int n) {
+    int num_picked = 0;
+
+    for (int i = 0; i < MAX_TRACKED_FILTERS; i++) {
+        FilterCount slot = stats->filters[i];
+        if (slot.state != SLOT_READY || slot.count == 0) {
+            continue;
+        }
+
+        // Insertion sort into picked, keeping only the top n.
+        int pos = num_picked;
+        while (pos > 0 && picked[pos - 1].count < slot.count) {
+            pos--;
+        }
+        if (pos >= n) {
+            continue;
+        }
+        int last = (num_picked < n) ? num_picked : n - 1;
+        memmove(&picked[pos + 1], &picked[pos], (last - pos) * sizeof(FilterCount));
+        picked[pos] = slot;
+        if (num_picked < n) {
+            num_picked++;
+        }
+    }
+    return num_picked;
+}
+
+
+/*
+ * Run <filter> on <image> and store the output in the result cache,
+ * pausing the filter while foreground requests are being served.
+ * Return the number of CPU seconds spent by the filter.
+ */
+double run_precompute_job(const char *filter, const char *image) {
+    char path[MAX_PATH];
+    char tmp_path[MAX_PATH];
+    char filepath[MAX_PATH];
+
+    snprintf(filepath, sizeof(filepath), "%s%s", FILTER_DIR, filter);
+    if (cache_lookup(filter, image, path, sizeof(path)) ||
+            access(filepath, F_OK | X_OK) != 0) {
+        return 0;
+    }
+
+    int out_fd = cache_create(filter, image, tmp_path, sizeof(tmp_path));
+    if (out_fd == -1) {
+        return 0;
+    }
+    pid_t pid = spawn_filter(filter, image, out_fd);
+    close(out_fd);
+    if (pid == -1) {
+        unlink(tmp_path);
+        return 0;
+    }
+
+    int status;
+    struct rusage usage;
+    int stopped = 0;
+    int yielded_ticks = 0;   // 10ms ticks spent stopped.
+    while (wait4(pid, &status, WNOHANG, &usage) == 0) {
+        if (stats->foreground > 0 && yielded_ticks < PRECOMPUTE_MAX_YIELD * 100) {
+            if (!stopped) {
+                kill(pid, SIGSTOP);
+                stopped = 1;
+            }
+            yielded_ticks++;
+        } else if (stopped) {
+            kill(pid, SIGCONT);
+            stopped = 0;
+        }
+        usleep(10000);
+    }
+
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        cache_commit(tmp_path, filter, image);
+    } else {
+        unlink(tmp_path);
+    }
+
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+           (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
@@ -0,0 +1,41 @@
+#ifndef PRECOMPUTE_H_
+#define PRECOMPUTE_H_
+
+#define MAX_TRACKED_FILTERS 16
+#define MAX_FILTER_NAME 64
+
+// How many of the most requested filters are run after each upload.
+#define PRECOMPUTE_TOP_N 3
+// CPU seconds a precompute worker may spend on the filters of each image.
+#define PRECOMPUTE_CPU_BUDGET 10
+// Longest time (in seconds) a job is paused while foreground requests run.
+#define PRECOMPUTE_MAX_YIELD 5
+
+
+/*
+ * Set up the popularity table shared between the server and all of the
+ * processes it forks. Must be called before the first fork.
+ */
+void init_precompute(void);
+
+/*
+ * Count one request for the given filter.
+ */
+void record_filter_request(const char *filter);
+
+/*
+ * Track the number of requests currently being served in the foreground,
+ * so that precompute workers can get out of their way.
+ */
+void foreground_started(void);
+void foreground_finished(void);
+
+/*
+ * Start a low-priority background worker that fills the result cache with
+ * the most popular filters applied to each of the <num_images> newly
+ * uploaded <images>, in turn. Returns immediately; the worker is never
+ * waited on by the caller.
+ */
+void precompute_filters(const char **images, int num_images);
+
+#endif /* PRECOMPUTE_H_ */
@@ -0,0 +1,929 @@
+#define _GNU_SOURCE  // syscall
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <execinfo.h>
+#include <elf.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "profile.h"
+#include "cache.h"
+#include "trace.h"
+
+#define PROCESS_BUCKETS 1024
+#define STACK_BUCKETS 4096
+#define MAX_STACK_LINE 8192
+#define MAX_PROCESSES 65536       // Scanned in /proc when the profile starts.
+
+// Frames above the interrupted one in a backtrace taken by the SIGPROF
+// handler: the handler itself and the kernel's signal trampoline.
+#define SIGNAL_FRAMES 2
+
+// A function in an ELF file.
+typedef struct {
+    unsigned long addr;
+    unsigned long size;
+    const char *name;
+} Symbol;
+
+// The functions of an executable or shared library, loaded once per profile.
+typedef struct elf_file {
+    struct elf_file *next;
+    char path[MAX_PATH];
+    char label[MAX_PATH];     // "[name]", for addresses in no known function.
+    Symbol *symbols;          // Sorted by address.
+    int num_symbols;
+    Elf64_Phdr *loads;        // To turn file offsets into addresses.
+    int num_loads;
+} ElfFile;
+
+// An executable mapping of a process. Lists of them are only ever prepended
+// to, so a forked process can share its parent's.
+typedef struct mapping {
+    struct mapping *next;
+    unsigned long start;
+    unsigned long end;
+    unsigned long offset;     // Of start, in the file.
+    ElfFile *file;
+} Mapping;
+
+typedef struct process {
+    struct process *hash_next;
+    int pid;
+    char comm[32];
+    Mapping *maps;            // Most recent first.
+} Process;
+
+// The buffer the samples taken on one CPU go to.
+typedef struct {
+    struct perf_event_mmap_page *page;
+    char *data;
+    unsigned long size;
+} Ring;
+
+typedef struct stack_count {
+    struct stack_count *next;
+    long count;
+    char stack[];
+} StackCount;
+
+// A sample taken by the fallback's SIGPROF handler.
+typedef struct {
+    int depth;                // 0 until the sample is complete.
+    void *ips[MAX_PROFILE_DEPTH];  // Leaf first.
+} TimerSample;
+
+// Shared by every process the server forks.
+typedef struct {
+    int owner;                // The request process taking a profile, or 0.
+    int sampling;             // The fallback is sampling.
+    unsigned long generation; // Bumped whenever sampling starts or stops.
+    unsigned long next;       // Next free sample.
+    unsigned long dropped;    // Samples that didn't fit.
+    TimerSample samples[MAX_TIMER_SAMPLES];
+} ProfileShared;
+
+static ProfileShared *shared = NULL;
+static pid_t server_pid = 0;
+
+// The fallback's state in this process; reset in forked children, which
+// don't inherit the timer.
+static unsigned long seen_generation = 0;
+static int has_timer = 0;
+static timer_t cpu_timer;
+
+// Built up while taking a profile, in the request process taking it, which
+// exits right after; so none of this is ever freed.
+static ElfFile *elf_files = NULL;
+static Process *processes[PROCESS_BUCKETS];
+static Process *self_process = NULL;
+static StackCount *stacks[STACK_BUCKETS];
+static int num_stacks = 0;
+static long num_samples = 0;
+static long num_lost = 0;
+static Ring *rings = NULL;    // One per CPU.
+static int num_rings = 0;
+static int *events = NULL;    // One per thread and CPU.
+static int num_events = 0;
+
+// Helper function declarations.
+void record_timer_sample(int sig, siginfo_t *info, void *context);
+void forget_timer(void);
+int compare_symbols(const void *a, const void *b);
+ElfFile *load_elf(const char *path);
+const char *symbolize(const Process *process, unsigned long ip);
+Process *lookup_process(int pid);
+Process *find_process(int pid);
+Process *load_process(int pid);
+void add_mapping(Process *process, unsigned long start, unsigned long end,
+                 unsigned long offset, const char *path);
+void add_stack(const Process *process, const unsigned long *ips, int depth);
+int server_threads(pid_t *tids, int max);
+int process_of(int tid);
+int open_perf_events(void);
+void drain_ring(Ring *ring);
+void handle_record(const struct perf_event_header *header);
+void sample_with_perf(int seconds);
+void sample_with_timers(int seconds);
+int compare_counts(const void *a, const void *b);
+void write_stacks(int fd);
+
+
+void init_profiler(int enabled) {
+    if (!enabled) {
+        return;
+    }
+    server_pid = getpid();
+    shared = mmap(NULL, sizeof(ProfileShared), PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+
+    // The first backtrace loads the unwinder, which mustn't happen in a
+    // signal handler.
+    void *ips[1];
+    backtrace(ips, 1);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = record_timer_sample;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, NULL) == -1) {
+        perror("sigaction");
+        exit(1);
+    }
+    pthread_atfork(NULL, NULL, forget_timer);
+}
+
+
+int profiler_enabled(void) {
+    return shared != NULL;
+}
+
+
+/*
+ * The SIGPROF handler of the fallback: record the stack of the interrupted
+ * thread. Only called while the process is on CPU.
+ */
+void record_timer_sample(int sig, siginfo_t *info, void *context) {
+    if (!__atomic_load_n(&shared->sampling, __ATOMIC_RELAXED)) {
+        return;
+    }
+    int saved_errno = errno;
+    unsigned long i = __atomic_fetch_add(&shared->next, 1, __ATOMIC_RELAXED);
+    if (i < MAX_TIMER_SAMPLES) {
+        void *ips[SIGNAL_FRAMES + MAX_PROFILE_DEPTH];
+        int depth = backtrace(ips, SIGNAL_FRAMES + MAX_PROFILE_DEPTH) - SIGNAL_FRAMES;
+        TimerSample *sample = &shared->samples[i];
+        if (depth > 0) {
+            memcpy(sample->ips, ips + SIGNAL_FRAMES, depth * sizeof(void *));
+            __atomic_store_n(&sample->depth, depth, __ATOMIC_RELEASE);
+        }
+    } else {
+        __atomic_add_fetch(&shared->dropped, 1, __ATOMIC_RELAXED);
+    }
+    errno = saved_errno;
+}
+
+
+/*
+ * In a forked child: the parent's timer isn't inherited.
+ */
+void forget_timer(void) {
+    seen_generation = 0;
+    has_timer = 0;
+}
+
+
+void profile_poll(void) {
+    if (shared == NULL) {
+        return;
+    }
+    unsigned long generation = __atomic_load_n(&shared->generation, __ATOMIC_ACQUIRE);
+    if (generation == seen_generation) {
+        return;
+    }
+    seen_generation = generation;
+    int sampling = __atomic_load_n(&shared->sampling, __ATOMIC_RELAXED);
+    if (!sampling && !has_timer) {
+        return;
+    }
+
+    // A POSIX timer, unlike setitimer, is neither inherited by forked
+    // children nor kept across exec, where SIGPROF would kill the program.
+    if (!has_timer) {
+        struct sigevent event;
+        memset(&event, 0, sizeof(event));
+        event.sigev_notify = SIGEV_SIGNAL;
+        event.sigev_signo = SIGPROF;
+        if (timer_create(CLOCK_PROCESS_CPUTIME_ID, &event, &cpu_timer) == -1) {
+            perror("timer_create");
+            return;
+        }
+        has_timer = 1;
+    }
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    if (sampling) {
+        spec.it_interval.tv_nsec = 1000000000 / PROFILE_HZ;
+        spec.it_value = spec.it_interval;
+    }
+    timer_settime(cpu_timer, 0, &spec, NULL);
+}
+
+
+int begin_profile(void) {
+    int owner = __atomic_load_n(&shared->owner, __ATOMIC_ACQUIRE);
+    // A request process killed while taking a profile leaves it claimed.
+    if (owner != 0 && kill(owner, 0) == -1 && errno == ESRCH) {
+        __atomic_compare_exchange_n(&shared->owner, &owner, 0, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    }
+    int expected = 0;
+    if (!__atomic_compare_exchange_n(&shared->owner, &expected, getpid(), 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return -1;
+    }
+    return 0;
+}
+
+
+void write_profile(int fd, int seconds) {
+    unsigned long start = trace_now();
+    self_process = load_process(getpid());
+    if (self_process == NULL) {
+        self_process = calloc(1, sizeof(Process));
+        strcpy(self_process->comm, "image_server");
+    }
+
+    int perf = (open_perf_events() > 0);
+    if (perf) {
+        sample_with_perf(seconds);
+    } else {
+        sample_with_timers(seconds);
+    }
+    write_stacks(fd);
+
+    fprintf(stderr, "Profile: %ld samples in %d stacks over %.1f s, %s, %ld lost\n",
+            num_samples, num_stacks, (trace_now() - start) / 1e6,
+            perf ? "perf_event_open" : "SIGPROF timers", num_lost);
+    __atomic_store_n(&shared->owner, 0, __ATOMIC_RELEASE);
+}
+
+
+/******************************************************************************
+ * Symbols
+ *****************************************************************************/
+
+int compare_symbols(const void *a, const void *b) {
+    const Symbol *x = a;
+    const Symbol *y = b;
+    return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+
+/*
+ * Return the functions of the ELF file at <path>, loading them the first
+ * time. Files that can't be read (or aren't files, like "[vdso]") have none.
+ */
+ElfFile *load_elf(const char *path) {
+    for (ElfFile *file = elf_files; file != NULL; file = file->next) {
+        if (strcmp(file->path, path) == 0) {
+            return file;
+        }
+    }
+    ElfFile *file = calloc(1, sizeof(ElfFile));
+    snprintf(file->path, sizeof(file->path), "%s", path);
+    const char *slash = strrchr(path, '/');
+    if (path[0] == '[') {
+        snprintf(file->label, sizeof(file->label), "%s", path);
+    } else {
+        snprintf(file->label, sizeof(file->label), "[%s]", slash ? slash + 1 : path);
+    }
+    file->next = elf_files;
+    elf_files = file;
+
+    int elf_fd = open(path, O_RDONLY);
+    struct stat st;
+    if (elf_fd == -1 || fstat(elf_fd, &st) == -1 || st.st_size < sizeof(Elf64_Ehdr)) {
+        if (elf_fd != -1) {
+            close(elf_fd);
+        }
+        return file;
+    }
+    // Kept mapped: the symbol names point into it.
+    const char *image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, elf_fd, 0);
+    close(elf_fd);
+    if (image == MAP_FAILED) {
+        return file;
+    }
+    const Elf64_Ehdr *ehdr = (const Elf64_Ehdr *) image;
+    if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 || ehdr->e_ident[EI_CLASS] != ELFCLASS64 ||
+            ehdr->e_phoff + (unsigned long) ehdr->e_phnum * sizeof(Elf64_Phdr) > st.st_size ||
+            ehdr->e_shoff + (unsigned long) ehdr->e_shnum * sizeof(Elf64_Shdr) > st.st_size) {
+        return file;
+    }
+
+    const Elf64_Phdr *phdrs = (const Elf64_Phdr *) (image + ehdr->e_phoff);
+    file->loads = malloc(sizeof(Elf64_Phdr) * (ehdr->e_phnum + 1));
+    for (int i = 0; i < ehdr->e_phnum; i++) {
+        if (phdrs[i].p_type == PT_LOAD) {
+            file->loads[file->num_loads++] = phdrs[i];
+        }
+    }
+
+    // The full symbol table if it wasn't stripped, else the dynamic one.
+    const Elf64_Shdr *shdrs = (const Elf64_Shdr *) (image + ehdr->e_shoff);
+    const Elf64_Shdr *table = NULL;
+    for (int i = 0; i < ehdr->e_shnum; i++) {
+        if (shdrs[i].sh_type == SHT_SYMTAB ||
+                (shdrs[i].sh_type == SHT_DYNSYM && table == NULL)) {
+            table = &shdrs[i];
+        }
+    }
+    if (table == NULL || table->sh_link >= ehdr->e_shnum ||
+            table->sh_offset + table->sh_size > st.st_size ||
+            shdrs[table->sh_link].sh_offset + shdrs[table->sh_link].sh_size > st.st_size) {
+        return file;
+    }
+    const Elf64_Sym *syms = (const Elf64_Sym *) (image + table->sh_offset);
+    const char *names = image + shdrs[table->sh_link].sh_offset;
+    unsigned long names_size = shdrs[table->sh_link].sh_size;
+    int count = table->sh_size / sizeof(Elf64_Sym);
+    file->symbols = malloc(sizeof(Symbol) * (count + 1));
+    for (int i = 0; i < count; i++) {
+        int type = ELF64_ST_TYPE(syms[i].st_info);
+        if ((type == STT_FUNC || type == STT_GNU_IFUNC) && syms[i].st_shndx != SHN_UNDEF &&
+                syms[i].st_value != 0 && syms[i].st_name < names_size) {
+            file->symbols[file->num_symbols++] =
+                (Symbol) {syms[i].st_value, syms[i].st_size, names + syms[i].st_name};
+        }
+    }
+    qsort(file->symbols, file->num_symbols, sizeof(Symbol), compare_symbols);
+    return file;
+}
+
+
+/*
+ * Return the name of the function at <ip> in <process>, or the label of the
+ * file it is in if that has no function there.
+ */
+const char *symbolize(const Process *process, unsigned long ip) {
+    const Mapping *map = process->maps;
+    while (map != NULL && (ip < map->start || ip >= map->end)) {
+        map = map->next;
+    }
+    if (map == NULL) {
+        return "[unknown]";
+    }
+    const ElfFile *file = map->file;
+
+    unsigned long addr = ip - map->start + map->offset;
+    for (int i = 0; i < file->num_loads; i++) {
+        const Elf64_Phdr *load = &file->loads[i];
+        if (addr >= load->p_offset && addr < load->p_offset + load->p_filesz) {
+            addr = addr - load->p_offset + load->p_vaddr;
+            break;
+        }
+    }
+
+    // The last function starting at or before addr.
+    int low = 0;
+    int high = file->num_symbols - 1;
+    int found = -1;
+    while (low <= high) {
+        int middle = (low + high) / 2;
+        if (file->symbols[middle].addr <= addr) {
+            found = middle;
+            low = middle + 1;
+        } else {
+            high = middle - 1;
+        }
+    }
+    if (found == -1 || (file->symbols[found].size != 0 &&
+                        addr >= file->symbols[found].addr + file->symbols[found].size)) {
+        return file->label;
+    }
+    return file->symbols[found].name;
+}
+
+
+/******************************************************************************
+ * Processes
+ *****************************************************************************/
+
+/*
+ * Return the process with the given pid, or NULL if it hasn't been seen.
+ */
+Process *lookup_process(int pid) {
+    for (Process *process = processes[pid % PROCESS_BUCKETS]; process != NULL;
+         process = process->hash_next) {
+        if (process->pid == pid) {
+            return process;
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * Return the process with the given pid, loading it from /proc if it hasn't
+ * been seen; one that has already exited is taken to be a fork of this one.
+ */
+Process *find_process(int pid) {
+    Process *process = lookup_process(pid);
+    if (process != NULL) {
+        return process;
+    }
+    process = load_process(pid);
+    if (process == NULL) {
+        process = calloc(1, sizeof(Process));
+        process->pid = pid;
+        strcpy(process->comm, self_process->comm);
+        process->maps = self_process->maps;
+    }
+    process->hash_next = processes[pid % PROCESS_BUCKETS];
+    processes[pid % PROCESS_BUCKETS] = process;
+    return process;
+}
+
+
+/*
+ * Read the name and executable mappings of a running process from /proc.
+ * Return NULL if it isn't running.
+ */
+Process *load_process(int pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/maps", pid);
+    FILE *maps = fopen(path, "r");
+    if (maps == NULL) {
+        return NULL;
+    }
+    Process *process = calloc(1, sizeof(Process));
+    process->pid = pid;
+
+    char line[MAX_PATH + 128];
+    while (fgets(line, sizeof(line), maps) != NULL) {
+        unsigned long start, end, offset;
+        char perms[8];
+        char file[MAX_PATH] = "";
+        if (sscanf(line, "%lx-%lx %7s %lx %*s %*s %511[^\n]", &start, &end, perms, &offset,
+                   file) >= 4 && perms[2] == 'x') {
+            add_mapping(process, start, end, offset, file[0] ? file : "[anon]");
+        }
+    }
+    fclose(maps);
+
+    snprintf(path, sizeof(path), "/proc/%d/comm", pid);
+    FILE *comm = fopen(path, "r");
+    if (comm != NULL) {
+        if (fgets(process->comm, sizeof(process->comm), comm) != NULL) {
+            process->comm[strcspn(process->comm, "\n")] = '\0';
+        }
+        fclose(comm);
+    }
+    return process;
+}
+
+
+void add_mapping(Process *process, unsigned long start, unsigned long end,
+                 unsigned long offset, const char *path) {
+    Mapping *map = malloc(sizeof(Mapping));
+    map->start = start;
+    map->end = end;
+    map->offset = offset;
+    map->file = load_elf(path);
+    map->next = process->maps;
+    process->maps = map;
+}
+
+
+/*
+ * Count one sample of the stack <ips> (leaf first) in <process>.
+ */
+void add_stack(const Process *process, const unsigned long *ips, int depth) {
+    char line[MAX_STACK_LINE];
+    int len = snprintf(line, sizeof(line), "%s", process->comm[0] ? process->comm : "[unknown]");
+    for (int i = 0; i < len; i++) {
+        if (line[i] == ' ' || line[i] == ';') {
+            line[i] = '_';
+        }
+    }
+    for (int i = depth - 1; i >= 0 && len < sizeof(line) - 1; i--) {
+        // Callers' entries are return addresses, which may already be past
+        // the end of the calling function.
+        const char *name = symbolize(process, (i > 0) ? ips[i] - 1 : ips[i]);
+        len += snprintf(line + len, sizeof(line) - len, ";%s", name);
+    }
+    if (len >= sizeof(line)) {
+        len = sizeof(line) - 1;
+    }
+
+    // FNV-1a.
+    unsigned int hash = 2166136261u;
+    for (int i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char) line[i]) * 16777619u;
+    }
+    StackCount **bucket = &stacks[hash % STACK_BUCKETS];
+    for (StackCount *entry = *bucket; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->stack, line) == 0) {
+            entry->count++;
+            num_samples++;
+            return;
+        }
+    }
+    StackCount *entry = malloc(sizeof(StackCount) + len + 1);
+    memcpy(entry->stack, line, len + 1);
+    entry->count = 1;
+    entry->next = *bucket;
+    *bucket = entry;
+    num_stacks++;
+    num_samples++;
+}
+
+
+/******************************************************************************
+ * Sampling with perf_event_open
+ *****************************************************************************/
+
+/*
+ * Store the ids of the threads of every process descended from the server
+ * (other than this one) in <tids>. Return the number of threads.
+ */
+int server_threads(pid_t *tids, int max) {
+    DIR *proc = opendir("/proc");
+    if (proc == NULL) {
+        perror("opendir");
+        return 0;
+    }
+    int *pids = malloc(sizeof(int) * MAX_PROCESSES);
+    int *parents = malloc(sizeof(int) * MAX_PROCESSES);
+    int num_pids = 0;
+    struct dirent *entry;
+    while ((entry = readdir(proc)) != NULL && num_pids < MAX_PROCESSES) {
+        int pid = atoi(entry->d_name);
+        char path[64];
+        char stat[512];
+        snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+        int stat_fd = (pid > 0) ? open(path, O_RDONLY) : -1;
+        if (stat_fd == -1) {
+            continue;
+        }
+        int n = read(stat_fd, stat, sizeof(stat) - 1);
+        close(stat_fd);
+        stat[(n > 0) ? n : 0] = '\0';
+        // The name in parentheses may contain anything, so skip past it.
+        char *name_end = strrchr(stat, ')');
+        int parent;
+        if (name_end != NULL && sscanf(name_end + 1, " %*c %d", &parent) == 1) {
+            pids[num_pids] = pid;
+            parents[num_pids++] = parent;
+        }
+    }
+    closedir(proc);
+
+    // Mark descendants of the server by passes until none are added. Its
+    // process tree is only a few levels deep.
+    char *in_tree = calloc(num_pids, 1);
+    int added = 1;
+    while (added) {
+        added = 0;
+        for (int i = 0; i < num_pids; i++) {
+            if (in_tree[i]) {
+                continue;
+            }
+            int member = (pids[i] == server_pid);
+            for (int j = 0; !member && j < num_pids; j++) {
+                member = in_tree[j] && pids[j] == parents[i];
+            }
+            if (member) {
+                in_tree[i] = added = 1;
+            }
+        }
+    }
+
+    int num_tids = 0;
+    for (int i = 0; i < num_pids && num_tids < max; i++) {
+        if (!in_tree[i] || pids[i] == getpid()) {
+            continue;
+        }
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/%d/task", pids[i]);
+        DIR *tasks = opendir(path);
+        if (tasks == NULL) {
+            continue;
+        }
+        while ((entry = readdir(tasks)) != NULL && num_tids < max) {
+            if (atoi(entry->d_name) > 0) {
+                tids[num_tids++] = atoi(entry->d_name);
+            }
+        }
+        closedir(tasks);
+    }
+    free(pids);
+    free(parents);
+    free(in_tree);
+    return num_tids;
+}
+
+
+/*
+ * Return the process the thread <tid> belongs to.
+ */
+int process_of(int tid) {
+    int pid = tid;
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", tid);
+    FILE *status = fopen(path, "r");
+    if (status != NULL) {
+        char line[256];
+        while (fgets(line, sizeof(line), status) != NULL) {
+            if (sscanf(line, "Tgid: %d", &pid) == 1) {
+                break;
+            }
+        }
+        fclose(status);
+    }
+    return pid;
+}
+
+
+/*
+ * Open a sampling event, disabled, on every thread of the server for each
+ * CPU, with the events of each CPU writing to one mapped ring buffer (the
+ * kernel won't map an inherited event that follows its thread across CPUs).
+ * Return the number of events, or 0 if perf_event_open isn't allowed.
+ */
+int open_perf_events(void) {
+    pid_t *tids = malloc(sizeof(pid_t) * MAX_PROFILE_THREADS);
+    int num_tids = server_threads(tids, MAX_PROFILE_THREADS);
+    int num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    // One file descriptor per thread and CPU; the request process taking the
+    // profile exits right after, so its limit may as well be raised.
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_SOFTWARE;
+    attr.config = PERF_COUNT_SW_CPU_CLOCK;
+    attr.freq = 1;
+    attr.sample_freq = PROFILE_HZ;
+    attr.sample_type = PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_CALLCHAIN;
+    attr.disabled = 1;
+    attr.inherit = 1;         // Processes and threads started while sampling.
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.exclude_callchain_kernel = 1;
+    attr.mmap = 1;            // Executables and libraries they map,
+    attr.comm = 1;            // the programs they exec,
+    attr.task = 1;            // and the processes they fork.
+
+    long page_size = sysconf(_SC_PAGESIZE);
+    rings = calloc(num_cpus, sizeof(Ring));
+    int *ring_fds = malloc(sizeof(int) * num_cpus);
+    events = malloc(sizeof(int) * num_tids * num_cpus);
+    for (int i = 0; i < num_tids; i++) {
+        for (int cpu = 0; cpu < num_cpus; cpu++) {
+            int event_fd = syscall(SYS_perf_event_open, &attr, tids[i], cpu, -1,
+                                   PERF_FLAG_FD_CLOEXEC);
+            if (event_fd == -1) {
+                if (errno != ESRCH && num_events == 0) {
+                    perror("perf_event_open");
+                    free(tids);
+                    free(ring_fds);
+                    return 0;
+                }
+                break;        // The thread has exited, or we are out of descriptors.
+            }
+            events[num_events++] = event_fd;
+
+            if (cpu < num_rings) {
+                if (ioctl(event_fd, PERF_EVENT_IOC_SET_OUTPUT, ring_fds[cpu]) == -1) {
+                    perror("ioctl");
+                }
+                continue;
+            }
+            void *page = mmap(NULL, (1 + PROFILE_RING_PAGES) * page_size, PROT_READ | PROT_WRITE,
+                              MAP_SHARED, event_fd, 0);
+            if (page == MAP_FAILED) {
+                perror("mmap");
+                for (int j = 0; j < num_events; j++) {
+                    close(events[j]);
+                }
+                num_events = 0;
+                free(tids);
+                free(ring_fds);
+                return 0;
+            }
+            ring_fds[num_rings] = event_fd;
+            rings[num_rings].page = page;
+            rings[num_rings].data = (char *) page + page_size;
+            rings[num_rings].size = PROFILE_RING_PAGES * page_size;
+            num_rings++;
+        }
+        // Its process as of now; later changes come in as records.
+        find_process(process_of(tids[i]));
+    }
+    free(tids);
+    free(ring_fds);
+    return num_events;
+}
+
+
+/*
+ * Copy <len> bytes at position <pos> of a ring buffer of <size> bytes.
+ */
+static void ring_copy(const char *data, unsigned long size, unsigned long pos, void *dst,
+                      unsigned long len) {
+    unsigned long start = pos % size;
+    unsigned long first = (len < size - start) ? len : size - start;
+    memcpy(dst, data + start, first);
+    memcpy((char *) dst + first, data, len - first);
+}
+
+
+/*
+ * Handle every record in the ring buffer, and free their space.
+ */
+void drain_ring(Ring *ring) {
+    static char record[65536];    // Records are at most 64 KB.
+    struct perf_event_mmap_page *page = ring->page;
+    unsigned long head = __atomic_load_n(&page->data_head, __ATOMIC_ACQUIRE);
+    unsigned long tail = page->data_tail;
+    while (tail < head) {
+        struct perf_event_header header;
+        ring_copy(ring->data, ring->size, tail, &header, sizeof(header));
+        if (header.size < sizeof(header)) {
+            tail = head;      // Corrupt; drop the rest.
+            break;
+        }
+        ring_copy(ring->data, ring->size, tail, record, header.size);
+        handle_record((struct perf_event_header *) record);
+        tail += header.size;
+    }
+    __atomic_store_n(&page->data_tail, tail, __ATOMIC_RELEASE);
+}
+
+
+void handle_record(const struct perf_event_header *header) {
+    const char *body = (const char *) (header + 1);
+    if (header->type == PERF_RECORD_SAMPLE) {
+        // ip, pid, tid, callchain length, callchain.
+        const unsigned int *ids = (const unsigned int *) (body + 8);
+        unsigned long nr = *(const unsigned long *) (body + 16);
+        const unsigned long *chain = (const unsigned long *) (body + 24);
+        unsigned long ips[MAX_PROFILE_DEPTH];
+        int depth = 0;
+        for (unsigned long i = 0; i < nr && depth < MAX_PROFILE_DEPTH; i++) {
+            // Skip the markers of which context the entries that follow are in.
+            if (chain[i] < (unsigned long) PERF_CONTEXT_MAX) {
+                ips[depth++] = chain[i];
+            }
+        }
+        if (depth == 0) {
+            ips[depth++] = *(const unsigned long *) body;
+        }
+        add_stack(find_process(ids[0]), ips, depth);
+
+    } else if (header->type == PERF_RECORD_MMAP) {
+        const unsigned int *ids = (const unsigned int *) body;
+        const unsigned long *range = (const unsigned long *) (body + 8);
+        add_mapping(find_process(ids[0]), range[0], range[0] + range[1], range[2], body + 32);
+
+    } else if (header->type == PERF_RECORD_COMM) {
+        const unsigned int *ids = (const unsigned int *) body;
+        Process *process = find_process(ids[0]);
+        if (header->misc & PERF_RECORD_MISC_COMM_EXEC) {
+            // Its mappings come next.
+            process->maps = NULL;
+        }
+        if (ids[0] == ids[1]) {
+            snprintf(process->comm, sizeof(process->comm), "%s", body + 8);
+        }
+
+    } else if (header->type == PERF_RECORD_FORK) {
+        const unsigned int *ids = (const unsigned int *) body;
+        // A new process (not thread), with its parent's mappings, unless its
+        // own records were drained first from another CPU's ring.
+        if (ids[0] != ids[1] && lookup_process(ids[0]) == NULL) {
+            Process *parent = find_process(ids[1]);
+            Process *child = calloc(1, sizeof(Process));
+            child->pid = ids[0];
+            strcpy(child->comm, parent->comm);
+            child->maps = parent->maps;
+            child->hash_next = processes[child->pid % PROCESS_BUCKETS];
+            processes[child->pid % PROCESS_BUCKETS] = child;
+        }
+
+    } else if (header->type == PERF_RECORD_LOST) {
+        num_lost += *(const unsigned long *) (body + 8);
+    }
+}
+
+
+void sample_with_perf(int seconds) {
+    for (int i = 0; i < num_events; i++) {
+        ioctl(events[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+    for (int elapsed = 0; elapsed < seconds * 1000; elapsed += PROFILE_DRAIN_MS) {
+        usleep(PROFILE_DRAIN_MS * 1000);
+        for (int i = 0; i < num_rings; i++) {
+            drain_ring(&rings[i]);
+        }
+    }
+    for (int i = 0; i < num_events; i++) {
+        ioctl(events[i], PERF_EVENT_IOC_DISABLE, 0);
+    }
+    for (int i = 0; i < num_rings; i++) {
+        drain_ring(&rings[i]);
+    }
+    for (int i = 0; i < num_events; i++) {
+        close(events[i]);
+    }
+}
+
+
+/******************************************************************************
+ * Sampling with timers, the fallback
+ *****************************************************************************/
+
+void sample_with_timers(int seconds) {
+    __atomic_store_n(&shared->next, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&shared->dropped, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&shared->sampling, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&shared->generation, 1, __ATOMIC_RELEASE);
+
+    sleep(seconds);
+
+    __atomic_store_n(&shared->sampling, 0, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&shared->generation, 1, __ATOMIC_RELEASE);
+    // Let handlers already running finish their samples.
+    usleep(PROFILE_DRAIN_MS * 1000);
+
+    // Every sampled process is a fork of the server, so it has the same
+    // mappings as this one.
+    unsigned long taken = __atomic_load_n(&shared->next, __ATOMIC_ACQUIRE);
+    if (taken > MAX_TIMER_SAMPLES) {
+        taken = MAX_TIMER_SAMPLES;
+    }
+    for (unsigned long i = 0; i < taken; i++) {
+        TimerSample *sample = &shared->samples[i];
+        int depth = __atomic_load_n(&sample->depth, __ATOMIC_ACQUIRE);
+        if (depth > 0) {
+            unsigned long ips[MAX_PROFILE_DEPTH];
+            for (int j = 0; j < depth; j++) {
+                ips[j] = (unsigned long) sample->ips[j];
+            }
+            add_stack(self_process, ips, depth);
+        }
+        sample->depth = 0;
+    }
+    num_lost = __atomic_load_n(&shared->dropped, __ATOMIC_RELAXED);
+}
+
+
+int compare_counts(const void *a, const void *b) {
+    const StackCount *x = *(const StackCount **) a;
+    const StackCount *y = *(const StackCount **) b;
+    return (y->count > x->count) - (y->count < x->count);
+}
+
+
+/*
+ * Write the stacks seen, most frequent first.
+ */
+void write_stacks(int fd) {
+    StackCount **sorted = malloc(sizeof(StackCount *) * (num_stacks + 1));
+    int n = 0;
+    for (int i = 0; i < STACK_BUCKETS; i++) {
+        for (StackCount *entry = stacks[i]; entry != NULL; entry = entry->next) {
+            sorted[n++] = entry;
+        }
+    }
+    qsort(sorted, n, sizeof(StackCount *), compare_counts);
+    for (int i = 0; i < n; i++) {
+        dprintf(fd, "%s %ld\n", sorted[i]->stack, sorted[i]->count);
+    }
+    free(sorted);
+}
@@ -0,0 +1,70 @@
+#ifndef PROFILE_H_
+#define PROFILE_H_
+
+/*
+ * A sampling profiler built into the server, for finding out which functions
+ * are hot while it is slow, without attaching external tools:
+ *     curl 'localhost:PORT/debug/profile?seconds=30' > out.folded
+ *     flamegraph.pl out.folded > flame.svg
+ * returns the on-CPU stacks of the server's processes, sampled PROFILE_HZ
+ * times a second of CPU time, as collapsed stacks ("comm;outer;...;leaf
+ * count" lines). It is off unless the server is started with -P.
+ *
+ * Samples are taken with perf_event_open: a CPU clock event on every thread
+ * of every process the server has forked (acceptors, request processes,
+ * filter workers and their filters), inherited by the ones they fork while
+ * the profile is taken. User stacks are walked by frame pointers, so the
+ * server is built with -fno-omit-frame-pointer. Nothing runs between
+ * profiles.
+ *
+ * Where perf_event_open isn't allowed (e.g. by perf_event_paranoid or a
+ * seccomp filter), acceptors and the request processes they fork sample
+ * themselves instead, with a CPU-time timer whose SIGPROF handler records a
+ * backtrace into shared memory. Between profiles each process only checks a
+ * shared counter once per event loop iteration or fork. Exec'd filters
+ * aren't sampled this way.
+ */
+
+#define DEBUG_PROFILE "/debug/profile"
+
+#define PROFILE_HZ 99
+#define DEFAULT_PROFILE_SECONDS 10
+#define MAX_PROFILE_SECONDS 300
+#define MAX_PROFILE_DEPTH 64      // Frames kept per sample, from the leaf.
+#define MAX_PROFILE_THREADS 512   // Threads given a perf event on each CPU.
+#define PROFILE_RING_PAGES 64     // Of samples per thread, drained every PROFILE_DRAIN_MS.
+#define PROFILE_DRAIN_MS 100
+#define MAX_TIMER_SAMPLES 16384   // Kept in shared memory by the fallback.
+
+
+/*
+ * Allow profiles to be taken if <enabled>, and if so set up the shared state
+ * of the fallback. Must be called before the first fork.
+ */
+void init_profiler(int enabled);
+
+/*
+ * Return 1 if profiles may be taken, 0 otherwise.
+ */
+int profiler_enabled(void);
+
+/*
+ * Start or stop the fallback's sampling of the calling process, if a profile
+ * using it has begun or ended since the process last checked. Call from
+ * event loops and in newly forked processes; it costs a load otherwise.
+ */
+void profile_poll(void);
+
+/*
+ * Claim the profiler for a profile. Return 0 on success, -1 if another
+ * profile is being taken.
+ */
+int begin_profile(void);
+
+/*
+ * Sample the server for <seconds>, write the collapsed stacks to fd, and
+ * release the profiler. Call after begin_profile.
+ */
+void write_profile(int fd, int seconds);
+
+#endif /* PROFILE_H_ */
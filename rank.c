@@ -0,0 +1,269 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "rank.h"
+#include "isa.h"
+#include "parallel.h"
+
+#define COARSE_BINS 16
+#define FINE_BINS 256
+#define FINE_PER_COARSE (FINE_BINS / COARSE_BINS)
+
+// Minimum number of rows worth handing to another thread. Each range starts
+// by building its column histograms from 2 * radius + 1 rows, so ranges are
+// also kept at least RANGE_WINDOWS times that tall.
+#define MIN_ROWS_PER_THREAD 16
+#define RANGE_WINDOWS 4
+
+// Columns filtered at a time, so that their histograms (1.6 KB per column,
+// including those within the radius on either side) stay in the L2 cache
+// however wide the image is.
+#define STRIPE_COLUMNS 256
+
+// 16 bins of a histogram, added and subtracted as one vector (a single
+// register with AVX2).
+typedef unsigned short Bins __attribute__((vector_size(2 * FINE_PER_COARSE)));
+
+// The histogram of one channel over some pixels: bin v of fine counts the
+// pixels of value v, bin v of coarse those of values [16v, 16v + 16).
+typedef struct {
+    Bins coarse;
+    Bins fine[COARSE_BINS];
+} Histogram;
+
+// A rank filter of a whole image, split into ranges of rows.
+typedef struct {
+    const RankFilter *rank;
+    const Bitmap *bmp;
+    Pixel *out;
+} RankTask;
+
+// Helper function declarations.
+int parse_number(const char *s, double min, double max, double *value);
+void rank_rows(void *arg, int start, int end);
+
+
+/*
+ * Parse <s> as a number in [min, max] into <value>.
+ * Return 0 on success, -1 otherwise.
+ */
+int parse_number(const char *s, double min, double max, double *value) {
+    char *end;
+    *value = strtod(s, &end);
+    if (end == s || *end != '\0' || !(*value >= min && *value <= max)) {
+        return -1;
+    }
+    return 0;
+}
+
+
+int parse_rank_filter(const char *name, const char *radius, const char *percentile,
+                      RankFilter *rank) {
+    memset(rank, 0, sizeof(RankFilter));
+
+    double value = DEFAULT_RANK_RADIUS;
+    if (radius != NULL && (parse_number(radius, 1, MAX_RANK_RADIUS, &value) == -1 ||
+                           value != floor(value))) {
+        return -1;
+    }
+    rank->radius = value;
+
+    if (strcmp(name, MEDIAN_FILTER) == 0) {
+        rank->percentile = 50;
+    } else if (strcmp(name, PERCENTILE_FILTER) != 0 || percentile == NULL ||
+               parse_number(percentile, 0, 100, &rank->percentile) == -1) {
+        return -1;
+    }
+
+    int size = 2 * rank->radius + 1;
+    rank->rank = round(rank->percentile / 100 * (size * size - 1));
+    return 0;
+}
+
+
+void rank_cache_name(const RankFilter *rank, char *name, int size) {
+    if (rank->percentile == 50) {
+        snprintf(name, size, "%s-r%d", MEDIAN_FILTER, rank->radius);
+    } else {
+        snprintf(name, size, "%s-p%g-r%d", PERCENTILE_FILTER, rank->percentile, rank->radius);
+    }
+}
+
+
+/*
+ * Add the pixel of value <v> to (<n> = 1) or remove it from (<n> = -1) <h>.
+ */
+static inline void count_pixel(Histogram *h, unsigned char v, int n) {
+    h->coarse[v / FINE_PER_COARSE] += n;
+    h->fine[v / FINE_PER_COARSE][v % FINE_PER_COARSE] += n;
+}
+
+
+/*
+ * Move the histograms of every channel of column x, stored at <h>, down
+ * from the window around row y - 1 to the one around row y.
+ */
+static inline void move_column(Histogram *h, const unsigned char *old_row,
+                               const unsigned char *new_row, int x) {
+    for (int c = 0; c < 3; c++) {
+        count_pixel(&h[c], old_row[3 * x + c], -1);
+        count_pixel(&h[c], new_row[3 * x + c], 1);
+    }
+}
+
+
+/*
+ * Compute columns [x_start, x_end) of rows [start, end). <columns> has room
+ * for the histograms of every channel of the columns within <r> of them,
+ * and <clamped> maps x + r + 1 to x clamped to the image, for x in
+ * [-r - 1, width + r].
+ */
+static inline __attribute__((always_inline))
+void rank_kernel(const RankFilter *rank, const Bitmap *bmp, Pixel *out, int start, int end,
+                 int x_start, int x_end, Histogram *columns, const int *clamped) {
+    const int width = bmp->width;
+    const int height = bmp->height;
+    const int r = rank->radius;
+    const int wanted = rank->rank;
+    const unsigned char *in = (const unsigned char *) bmp->pixels;
+    const int *col = clamped + r + 1;        // col[x] for x in [-r - 1, width + r].
+    // Column x has its histograms at hist[3 * x], for x in [first, last].
+    const int first = col[x_start - r];
+    const int last = col[x_end - 1 + r];
+    Histogram *hist = columns - 3 * first;
+
+    // Start with the column histograms of the window around row start - 1.
+    memset(columns, 0, sizeof(Histogram) * 3 * (last - first + 1));
+    for (int i = start - 1 - r; i <= start - 1 + r; i++) {
+        const unsigned char *row = in + 3 * (long) ((i < 0) ? 0 : (i >= height) ? height - 1 : i) * width;
+        for (int x = first; x <= last; x++) {
+            for (int c = 0; c < 3; c++) {
+                count_pixel(&hist[3 * x + c], row[3 * x + c], 1);
+            }
+        }
+    }
+
+    Histogram window[3];
+    int updated[3][COARSE_BINS];   // The column the fine bins of each coarse bin are for.
+    for (int y = start; y < end; y++) {
+        // Each column histogram moves down a row a column before it enters
+        // the window, so it is in cache and its counts are stored by then.
+        const unsigned char *old_row = in + 3 * (long) ((y - r - 1 < 0) ? 0 : y - r - 1) * width;
+        const unsigned char *new_row = in + 3 * (long) ((y + r >= height) ? height - 1 : y + r) * width;
+        for (int x = first; x <= col[x_start + r]; x++) {
+            move_column(&hist[3 * x], old_row, new_row, x);
+        }
+
+        for (int c = 0; c < 3; c++) {
+            window[c].coarse = (Bins) {0};
+            for (int i = x_start - r; i <= x_start + r; i++) {
+                window[c].coarse += hist[3 * col[i] + c].coarse;
+            }
+            for (int b = 0; b < COARSE_BINS; b++) {
+                updated[c][b] = x_start - 2 * r - 2;
+            }
+        }
+
+        unsigned char *o = (unsigned char *) (out + (long) y * width);
+        for (int x = x_start; x < x_end; x++) {
+            if (x + r + 1 <= last) {
+                move_column(&hist[3 * (x + r + 1)], old_row, new_row, x + r + 1);
+            }
+            const Histogram *add = &hist[3 * col[x + r]];
+            const Histogram *sub = &hist[3 * col[x - r - 1]];
+
+            for (int c = 0; c < 3; c++) {
+                Histogram *w = &window[c];
+                if (x > x_start) {
+                    w->coarse += add[c].coarse - sub[c].coarse;
+                }
+
+                // The coarse bin holding the value of the wanted rank.
+                int below = 0;
+                int b = 0;
+                while (below + w->coarse[b] <= wanted) {
+                    below += w->coarse[b++];
+                }
+
+                // Bring its fine bins up to date: rebuilt if the window has
+                // moved past every column they counted, otherwise moved along.
+                Bins fine = w->fine[b];
+                if (x - updated[c][b] > 2 * r) {
+                    fine = (Bins) {0};
+                    for (int i = x - r; i <= x + r; i++) {
+                        fine += hist[3 * col[i] + c].fine[b];
+                    }
+                } else {
+                    for (int i = updated[c][b] + 1; i <= x; i++) {
+                        fine += hist[3 * col[i + r] + c].fine[b] -
+                                hist[3 * col[i - r - 1] + c].fine[b];
+                    }
+                }
+                w->fine[b] = fine;
+                updated[c][b] = x;
+
+                int v = 0;
+                while (below + fine[v] <= wanted) {
+                    below += fine[v++];
+                }
+                o[3 * x + c] = b * FINE_PER_COARSE + v;
+            }
+        }
+    }
+}
+
+
+/*
+ * Compute rows [start, end) of <bmp> filtered with <rank> into <out>, a
+ * stripe of columns at a time so that their histograms stay in cache.
+ */
+static inline __attribute__((always_inline))
+void rank_range(const RankFilter *rank, const Bitmap *bmp, Pixel *out, int start, int end) {
+    const int r = rank->radius;
+    Histogram *columns;
+    if (posix_memalign((void **) &columns, sizeof(Bins),
+                       sizeof(Histogram) * 3 * (STRIPE_COLUMNS + 2 * r)) != 0) {
+        perror("posix_memalign");
+        exit(1);
+    }
+    int *clamped = malloc(sizeof(int) * (bmp->width + 2 * r + 2));
+    for (int i = 0; i < bmp->width + 2 * r + 2; i++) {
+        int x = i - r - 1;
+        clamped[i] = (x < 0) ? 0 : (x >= bmp->width) ? bmp->width - 1 : x;
+    }
+
+    for (int x = 0; x < bmp->width; x += STRIPE_COLUMNS) {
+        int x_end = (x + STRIPE_COLUMNS < bmp->width) ? x + STRIPE_COLUMNS : bmp->width;
+        rank_kernel(rank, bmp, out, start, end, x, x_end, columns, clamped);
+    }
+    free(columns);
+    free(clamped);
+}
+
+
+// Compiled for each instruction set (see isa.h); the bin loops are one
+// vector operation wide with AVX2.
+ISA_VARIANTS(rank_rows_range, rank_range,
+             (const RankFilter *rank, const Bitmap *bmp, Pixel *out, int start, int end),
+             (rank, bmp, out, start, end))
+
+
+void rank_filter(const RankFilter *rank, const Bitmap *bmp, Pixel *out, int row_start, int row_end) {
+    ISA_CALL(rank_rows_range)(rank, bmp, out, row_start, row_end);
+}
+
+
+void rank_rows(void *arg, int start, int end) {
+    RankTask *task = arg;
+    rank_filter(task->rank, task->bmp, task->out, start, end);
+}
+
+
+void rank_image(const RankFilter *rank, const Bitmap *bmp, Pixel *out) {
+    RankTask task = {rank, bmp, out};
+    int min_rows = RANGE_WINDOWS * (2 * rank->radius + 1);
+    parallel_for(bmp->height, (min_rows > MIN_ROWS_PER_THREAD) ? min_rows : MIN_ROWS_PER_THREAD,
+                 rank_rows, &task);
+}
@@ -0,0 +1,75 @@
+#ifndef RANK_H_
+#define RANK_H_
+
+#include "bitmap.h"
+
+/*
+ * Median and percentile filters, for removing noise, requested as
+ *     /image-filter?image=dog.bmp&filter=median&radius=5
+ *     /image-filter?image=dog.bmp&filter=percentile&p=90&radius=5
+ *
+ * Each output channel is the value of the given percentile of the input
+ * channel over the (2 * radius + 1)^2 square around the pixel, with the
+ * image edges extended. Computed with histograms as in Perreault and Hébert,
+ * "Median Filtering in Constant Time": every column keeps a histogram of its
+ * 2 * radius + 1 pixels around the current row, updated by one pixel in and
+ * one out per row, and the window's histogram is the sum of
+ * the column histograms, updated by one column in and one out per pixel.
+ * The histograms have 16 coarse bins and 256 fine ones, and the fine bins of
+ * the window are only brought up to date for the coarse bin holding the
+ * percentile, so the cost per pixel doesn't depend on the radius. Images are
+ * filtered in stripes of columns, so the histograms stay in cache, and
+ * strips of rows are split across threads.
+ *
+ * Time on one thread for dog.bmp tiled to 2048x1536, against counting the
+ * values in each window (as ./validate does to check the output):
+ *
+ *     radius    histograms    counting
+ *        1        0.51 s        1.2 s
+ *        5        0.45 s        2.8 s
+ *       15        0.47 s         16 s
+ *       30        0.43 s          -
+ */
+
+#define MEDIAN_FILTER "median"
+#define PERCENTILE_FILTER "percentile"
+#define DEFAULT_RANK_RADIUS 1
+#define MAX_RANK_RADIUS 100       // Keeps window counts within 16 bits.
+
+
+/*
+ * A median or percentile filter.
+ */
+typedef struct {
+    int radius;
+    double percentile;        // 0 is the minimum, 50 the median, 100 the maximum.
+    int rank;                 // The output is the value with <rank> smaller ones in the window.
+} RankFilter;
+
+
+/*
+ * Parse the filter called <name> (MEDIAN_FILTER or PERCENTILE_FILTER) from
+ * its optional radius and, for percentiles, its percentile. Return 0 on
+ * success, -1 if a parameter is invalid or missing.
+ */
+int parse_rank_filter(const char *name, const char *radius, const char *percentile,
+                      RankFilter *rank);
+
+/*
+ * Return a name identifying the filter, under which its results are cached.
+ */
+void rank_cache_name(const RankFilter *rank, char *name, int size);
+
+/*
+ * Compute rows [row_start, row_end) of <bmp> filtered with <rank>, writing
+ * them to the same rows of <out>.
+ */
+void rank_filter(const RankFilter *rank, const Bitmap *bmp, Pixel *out, int row_start, int row_end);
+
+/*
+ * Filter all of <bmp> with <rank> into <out>, with strips of rows split
+ * across threads.
+ */
+void rank_image(const RankFilter *rank, const Bitmap *bmp, Pixel *out);
+
+#endif /* RANK_H_ */
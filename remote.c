@@ -0,0 +1,667 @@
+#define _GNU_SOURCE  // memfd_create
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "remote.h"
+#include "socket.h"
+#include "request.h"
+#include "cache.h"
+#include "capture.h"
+#include "bitmap.h"
+#include "filterpool.h"
+#include "scheduler.h"
+#include "trace.h"
+
+#define REMOTE_BACKLOG 64
+#define COPY_BUFSIZE 65536
+
+// A worker as seen by the server; lives in a MAP_SHARED mapping so the
+// health checker and the request processes share what they find out.
+typedef struct {
+    char host[MAX_HOSTNAME];
+    int port;
+    int up;
+    int failed_checks;        // In a row.
+    long jobs;                // Jobs it has run,
+    long hits;                // how many of them from its cache,
+    long failures;            // and jobs that failed to reach it,
+    long timeouts;            // or ran too long on it.
+    double ping_ms;           // Round trip of the last ping.
+    double ring_share;        // Fraction of the images it is home to.
+} RemoteWorker;
+
+typedef struct {
+    uint64_t hash;
+    int worker;
+} RingPoint;
+
+static RemoteWorker *workers = NULL;
+static int num_workers = 0;
+
+// The ring, sorted by hash. Set up before any fork, and never changed.
+static RingPoint ring[MAX_REMOTE_WORKERS * REMOTE_VNODES];
+static int num_points = 0;
+
+// The port of this filter worker, in worker mode.
+static int worker_port = 0;
+
+// Shared by a server and its workers; zero-padded like the frames.
+static char remote_key[REMOTE_KEY_SIZE];
+
+// Helper function declarations.
+void load_key(const char *path);
+int key_matches(const char *key);
+uint64_t ring_hash(const char *name);
+int compare_points(const void *a, const void *b);
+void parse_worker(const char *spec);
+void run_health_checker(void);
+int ping_worker(RemoteWorker *worker);
+void mark_down(RemoteWorker *worker, const char *why);
+int send_job(RemoteWorker *worker, const RemoteJobFrame *job, int image_fd, int out_fd,
+             int *status);
+int send_all(int soc, const void *buf, long size);
+int recv_all(int soc, void *buf, long size);
+int read_frame(int soc, RemoteResultFrame *frame);
+int read_job_frame(int soc, RemoteJobFrame *job);
+void serve_job(int soc, RemoteJobFrame *job);
+int valid_name(const char *name);
+
+
+/*
+ * FNV-1a, finished with a 64-bit mix so that similar names (such as a
+ * worker's points) spread evenly around the ring.
+ */
+uint64_t ring_hash(const char *name) {
+    uint64_t hash = FNV_OFFSET_BASIS;
+    for (const char *c = name; *c != '\0'; c++) {
+        hash = (hash ^ (unsigned char) *c) * FNV_PRIME;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+
+int compare_points(const void *a, const void *b) {
+    const RingPoint *x = a;
+    const RingPoint *y = b;
+    return (x->hash > y->hash) - (x->hash < y->hash);
+}
+
+
+void init_remote_workers(const char *list, const char *key_file) {
+    if (list == NULL || list[0] == '\0') {
+        return;
+    }
+    load_key(key_file);
+    workers = mmap(NULL, MAX_REMOTE_WORKERS * sizeof(RemoteWorker), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (workers == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    memset(workers, 0, MAX_REMOTE_WORKERS * sizeof(RemoteWorker));
+
+    char *specs = strdup(list);
+    char *saveptr;
+    for (char *spec = strtok_r(specs, ",", &saveptr); spec != NULL;
+            spec = strtok_r(NULL, ",", &saveptr)) {
+        parse_worker(spec);
+    }
+    free(specs);
+
+    // The ring: each worker owns the arcs ending at its points.
+    for (int i = 0; i < num_workers; i++) {
+        for (int k = 0; k < REMOTE_VNODES; k++) {
+            char name[MAX_HOSTNAME + 32];
+            snprintf(name, sizeof(name), "%s:%d#%d", workers[i].host, workers[i].port, k);
+            ring[num_points].hash = ring_hash(name);
+            ring[num_points].worker = i;
+            num_points++;
+        }
+    }
+    qsort(ring, num_points, sizeof(RingPoint), compare_points);
+    for (int p = 0; p < num_points; p++) {
+        uint64_t from = ring[(p + num_points - 1) % num_points].hash;
+        workers[ring[p].worker].ring_share += (double) (ring[p].hash - from) / 18446744073709551616.0;
+    }
+
+    fprintf(stderr, "Filter workers: %d\n", num_workers);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    } else if (pid == 0) {
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        run_health_checker();
+        exit(0);
+    }
+}
+
+
+/*
+ * Read the key from the first line of the file at <path>, exiting if there
+ * is none or it is too short or too long.
+ */
+void load_key(const char *path) {
+    if (path == NULL) {
+        fprintf(stderr, "Filter workers need a shared key (-A key_file)\n");
+        exit(1);
+    }
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        perror(path);
+        exit(1);
+    }
+    char line[REMOTE_KEY_SIZE + 1];
+    if (fgets(line, sizeof(line), fp) == NULL) {
+        line[0] = '\0';
+    }
+    fclose(fp);
+    line[strcspn(line, "\r\n")] = '\0';
+    if (strlen(line) < REMOTE_MIN_KEY || strlen(line) >= REMOTE_KEY_SIZE) {
+        fprintf(stderr, "The key in %s must be %d to %d characters on its first line\n",
+                path, REMOTE_MIN_KEY, REMOTE_KEY_SIZE - 1);
+        exit(1);
+    }
+    memset(remote_key, 0, sizeof(remote_key));
+    strcpy(remote_key, line);
+}
+
+
+/*
+ * Return 1 if <key>, from a frame, is ours. Takes as long whatever the key,
+ * so its timing doesn't give away how much of it was right.
+ */
+int key_matches(const char *key) {
+    unsigned char diff = 0;
+    for (int i = 0; i < REMOTE_KEY_SIZE; i++) {
+        diff |= key[i] ^ remote_key[i];
+    }
+    return diff == 0;
+}
+
+
+/*
+ * Add the worker at <spec> ("host:port") to the table.
+ */
+void parse_worker(const char *spec) {
+    const char *colon = strrchr(spec, ':');
+    char *end;
+    long port = (colon != NULL) ? strtol(colon + 1, &end, 10) : 0;
+    if (colon == NULL || colon == spec || colon - spec >= MAX_HOSTNAME ||
+            *end != '\0' || port <= 0 || port > 65535) {
+        fprintf(stderr, "Bad filter worker '%s', expected host:port\n", spec);
+        exit(1);
+    }
+    if (num_workers == MAX_REMOTE_WORKERS) {
+        fprintf(stderr, "Too many filter workers, ignoring %s\n", spec);
+        return;
+    }
+    RemoteWorker *worker = &workers[num_workers++];
+    memcpy(worker->host, spec, colon - spec);
+    worker->host[colon - spec] = '\0';
+    worker->port = port;
+    // Until the first ping says otherwise; a job finds out soon enough.
+    worker->up = 1;
+}
+
+
+/******************************************************************************
+ * The health checker
+ *****************************************************************************/
+
+void run_health_checker(void) {
+    signal(SIGPIPE, SIG_IGN);
+    while (1) {
+        for (int i = 0; i < num_workers; i++) {
+            RemoteWorker *worker = &workers[i];
+            if (ping_worker(worker) == 0) {
+                worker->failed_checks = 0;
+                if (!__atomic_exchange_n(&worker->up, 1, __ATOMIC_RELAXED)) {
+                    fprintf(stderr, "Filter worker %s:%d is up\n", worker->host, worker->port);
+                }
+            } else if (++worker->failed_checks >= REMOTE_DOWN_AFTER) {
+                mark_down(worker, "is not answering pings");
+            }
+        }
+        struct timespec pause = {REMOTE_CHECK_MS / 1000, (REMOTE_CHECK_MS % 1000) * 1000000L};
+        nanosleep(&pause, NULL);
+    }
+}
+
+
+/*
+ * Return 0 if <worker> answers a ping in time, -1 otherwise.
+ */
+int ping_worker(RemoteWorker *worker) {
+    unsigned long start = trace_now();
+    int soc = try_connect_to_server(worker->port, worker->host, REMOTE_CONNECT_MS);
+    if (soc == -1) {
+        return -1;
+    }
+    RemoteJobFrame ping;
+    memset(&ping, 0, sizeof(ping));
+    ping.magic = REMOTE_FRAME_MAGIC;
+    ping.type = REMOTE_PING;
+    memcpy(ping.key, remote_key, REMOTE_KEY_SIZE);
+    RemoteResultFrame pong;
+    int result = (send_all(soc, &ping, sizeof(ping)) == 0 && read_frame(soc, &pong) == 0 &&
+                  pong.type == REMOTE_PONG) ? 0 : -1;
+    close(soc);
+    if (result == 0) {
+        worker->ping_ms = (trace_now() - start) / 1e3;
+    }
+    return result;
+}
+
+
+void mark_down(RemoteWorker *worker, const char *why) {
+    if (__atomic_exchange_n(&worker->up, 0, __ATOMIC_RELAXED)) {
+        fprintf(stderr, "Filter worker %s:%d %s, marking it down\n",
+                worker->host, worker->port, why);
+    }
+}
+
+
+/******************************************************************************
+ * Sending jobs
+ *****************************************************************************/
+
+int run_remote_job(const char *filter, const char *image, int image_fd, int out_fd) {
+    struct stat st;
+    if (num_workers == 0 || fstat(image_fd, &st) == -1 || st.st_size > REMOTE_MAX_IMAGE ||
+            strlen(filter) >= REMOTE_MAX_NAME || strlen(image) >= REMOTE_MAX_NAME) {
+        return -1;
+    }
+    RemoteJobFrame job;
+    memset(&job, 0, sizeof(job));
+    job.magic = REMOTE_FRAME_MAGIC;
+    job.type = REMOTE_JOB;
+    memcpy(job.key, remote_key, REMOTE_KEY_SIZE);
+    strcpy(job.filter, filter);
+    strcpy(job.image, image);
+    job.image_size = st.st_size;
+    job.image_mtime_ns = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+
+    // The image's home is the first point at or after its hash; if that
+    // worker can't take the job, the next distinct worker along the ring is
+    // tried, so a failed worker's images are spread over all the others.
+    uint64_t key = ring_hash(image);
+    int lo = 0;
+    int hi = num_points;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (ring[mid].hash < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    int tried[MAX_REMOTE_WORKERS] = {0};
+    for (int i = 0; i < num_points; i++) {
+        int w = ring[(lo + i) % num_points].worker;
+        RemoteWorker *worker = &workers[w];
+        if (tried[w] || !__atomic_load_n(&worker->up, __ATOMIC_RELAXED)) {
+            continue;
+        }
+        tried[w] = 1;
+
+        int status;
+        int sent = send_job(worker, &job, image_fd, out_fd, &status);
+        if (sent == 0) {
+            return status;
+        } else if (sent == REMOTE_TIMED_OUT) {
+            __atomic_add_fetch(&worker->timeouts, 1, __ATOMIC_RELAXED);
+            return REMOTE_TIMED_OUT;
+        }
+        __atomic_add_fetch(&worker->failures, 1, __ATOMIC_RELAXED);
+        mark_down(worker, "failed a job");
+        lseek(out_fd, 0, SEEK_SET);
+        ftruncate(out_fd, 0);
+    }
+    return -1;
+}
+
+
+/*
+ * Run <job> on <worker>, storing the filter's wait status in <status>.
+ * Return 0 on success, REMOTE_TIMED_OUT if it took longer than REMOTE_JOB_MS,
+ * or -1 if the worker couldn't be reached or failed.
+ */
+int send_job(RemoteWorker *worker, const RemoteJobFrame *job, int image_fd, int out_fd,
+             int *status) {
+    int soc = try_connect_to_server(worker->port, worker->host, REMOTE_CONNECT_MS);
+    if (soc == -1) {
+        return -1;
+    }
+    struct timeval timeout = {REMOTE_JOB_MS / 1000, (REMOTE_JOB_MS % 1000) * 1000};
+    setsockopt(soc, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    setsockopt(soc, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    errno = 0;
+
+    char buf[COPY_BUFSIZE];
+    RemoteResultFrame result;
+    int ok = send_all(soc, job, sizeof(*job)) == 0 && read_frame(soc, &result) == 0;
+
+    // Send the image, unless the worker has the output cached.
+    if (ok && result.type == REMOTE_NEED_IMAGE) {
+        off_t offset = 0;
+        while (ok && offset < job->image_size) {
+            ssize_t n = pread(image_fd, buf, sizeof(buf), offset);
+            ok = n > 0 && send_all(soc, buf, n) == 0;
+            offset += n;
+        }
+        ok = ok && read_frame(soc, &result) == 0;
+    }
+    ok = ok && result.type == REMOTE_RESULT;
+
+    for (int64_t left = ok ? result.output_size : 0; ok && left > 0; ) {
+        ssize_t n = read(soc, buf, (left < sizeof(buf)) ? left : sizeof(buf));
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        ok = n > 0 && write(out_fd, buf, n) == n;
+        left -= n;
+    }
+    // The socket timeouts only expire once the worker has the job.
+    int timed_out = !ok && (errno == EAGAIN || errno == EWOULDBLOCK);
+    close(soc);
+    if (!ok) {
+        return timed_out ? REMOTE_TIMED_OUT : -1;
+    }
+    __atomic_add_fetch(&worker->jobs, 1, __ATOMIC_RELAXED);
+    if (result.cached) {
+        __atomic_add_fetch(&worker->hits, 1, __ATOMIC_RELAXED);
+    }
+    *status = result.status;
+    return 0;
+}
+
+
+int send_all(int soc, const void *buf, long size) {
+    const char *p = buf;
+    while (size > 0) {
+        // MSG_NOSIGNAL: a worker that went away is a failed job, not a
+        // SIGPIPE for this process.
+        ssize_t n = send(soc, p, size, MSG_NOSIGNAL);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+
+int recv_all(int soc, void *buf, long size) {
+    char *p = buf;
+    while (size > 0) {
+        ssize_t n = read(soc, p, size);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+
+int read_frame(int soc, RemoteResultFrame *frame) {
+    if (recv_all(soc, frame, sizeof(*frame)) == -1 || frame->magic != REMOTE_FRAME_MAGIC) {
+        return -1;
+    }
+    return 0;
+}
+
+
+void write_remote_report(int fd) {
+    if (num_workers == 0) {
+        return;
+    }
+    dprintf(fd, "# Filter workers: %d\n", num_workers);
+    dprintf(fd, "%-28s %5s %10s %10s %10s %10s %10s %8s\n", "worker", "state", "jobs",
+            "cache_hits", "failures", "timeouts", "ping_ms", "share");
+    for (int i = 0; i < num_workers; i++) {
+        RemoteWorker *worker = &workers[i];
+        char name[MAX_HOSTNAME + 8];
+        snprintf(name, sizeof(name), "%s:%d", worker->host, worker->port);
+        dprintf(fd, "%-28s %5s %10ld %10ld %10ld %10ld %10.2f %7.1f%%\n", name,
+                worker->up ? "up" : "down", worker->jobs, worker->hits, worker->failures,
+                worker->timeouts, worker->ping_ms, worker->ring_share * 100);
+    }
+}
+
+
+/******************************************************************************
+ * Worker mode
+ *****************************************************************************/
+
+void run_filter_worker(int port, const char *key_file) {
+    load_key(key_file);
+    worker_port = port;
+    signal(SIGPIPE, SIG_IGN);
+    int listenfd = setup_server_socket(init_server_addr(port), REMOTE_BACKLOG);
+    fprintf(stderr, "Filter worker on port %d\n", port);
+
+    struct pollfd pfd = {listenfd, POLLIN, 0};
+    while (1) {
+        // Wake up now and then to reap finished jobs even when idle.
+        int ready = poll(&pfd, 1, REMOTE_CHECK_MS);
+        int status;
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            release_job(pid);
+        }
+        if (ready <= 0) {
+            continue;
+        }
+
+        int soc = accept_connection(listenfd);
+        if (soc == -1) {
+            continue;
+        }
+        // Only a client with the key gets a process; anyone else costs us at
+        // most REMOTE_FRAME_MS here.
+        RemoteJobFrame job;
+        if (read_job_frame(soc, &job) == -1) {
+            close(soc);
+            continue;
+        }
+        // Each job runs in its own process, like a request.
+        pid = fork();
+        if (pid < 0) {
+            perror("fork");
+        } else if (pid == 0) {
+            close(listenfd);
+            serve_job(soc, &job);
+            exit(0);
+        }
+        close(soc);
+    }
+}
+
+
+/*
+ * Return 1 if <name> may be used as a file name in our directories.
+ */
+int valid_name(const char *name) {
+    return name[0] != '\0' && name[0] != '.' && strchr(name, '/') == NULL;
+}
+
+
+/*
+ * Read the job frame from <soc> into <job>, giving up after REMOTE_FRAME_MS in
+ * all (a timeout on each read would let a client trickle bytes forever).
+ * Return 0 if it's a frame with our key, or -1.
+ */
+int read_job_frame(int soc, RemoteJobFrame *job) {
+    unsigned long deadline = trace_now() + REMOTE_FRAME_MS * 1000UL;
+    struct pollfd pfd = {soc, POLLIN, 0};
+    char *p = (char *) job;
+    long left = sizeof(*job);
+    while (left > 0) {
+        unsigned long now = trace_now();
+        if (now >= deadline) {
+            return -1;
+        }
+        int ready = poll(&pfd, 1, (deadline - now + 999) / 1000);
+        ssize_t n = (ready > 0) ? read(soc, p, left) : ready;
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        left -= n;
+    }
+    return (job->magic == REMOTE_FRAME_MAGIC && key_matches(job->key)) ? 0 : -1;
+}
+
+
+/*
+ * Answer the ping or run the job in <frame>, which arrived on <soc>.
+ */
+void serve_job(int soc, RemoteJobFrame *frame) {
+    struct timeval timeout = {REMOTE_JOB_MS / 1000, (REMOTE_JOB_MS % 1000) * 1000};
+    setsockopt(soc, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    RemoteJobFrame job = *frame;
+    RemoteResultFrame result;
+    memset(&result, 0, sizeof(result));
+    result.magic = REMOTE_FRAME_MAGIC;
+    if (job.type == REMOTE_PING) {
+        result.type = REMOTE_PONG;
+        send_all(soc, &result, sizeof(result));
+        return;
+    }
+
+    // Exit status 127, as for a command that can't be found.
+    result.type = REMOTE_RESULT;
+    result.status = 127 << 8;
+    job.filter[REMOTE_MAX_NAME - 1] = '\0';
+    job.image[REMOTE_MAX_NAME - 1] = '\0';
+    char filepath[MAX_PATH];
+    snprintf(filepath, sizeof(filepath), "%s%s", FILTER_DIR, job.filter);
+    if (job.type != REMOTE_JOB || !valid_name(job.filter) || !valid_name(job.image) ||
+            job.image_size <= 0 || job.image_size > REMOTE_MAX_IMAGE ||
+            access(filepath, X_OK) != 0) {
+        send_all(soc, &result, sizeof(result));
+        return;
+    }
+
+    // The size and mtime name the version of the image, so a replaced image
+    // never hits an old result.
+    char name[MAX_PATH];
+    char entry[MAX_PATH];
+    char path[MAX_PATH];
+    snprintf(name, sizeof(name), "worker%d-%s", worker_port, job.filter);
+    snprintf(entry, sizeof(entry), "%s@%lld.%lld", job.image,
+             (long long) job.image_size, (long long) job.image_mtime_ns);
+    cache_path(path, sizeof(path), name, entry);
+    int out_fd = open(path, O_RDONLY);
+
+    if (out_fd == -1) {
+        result.type = REMOTE_NEED_IMAGE;
+        if (send_all(soc, &result, sizeof(result)) == -1) {
+            return;
+        }
+        int in_fd = memfd_create("remote-image", MFD_CLOEXEC);
+        char buf[COPY_BUFSIZE];
+        for (int64_t left = job.image_size; left > 0; ) {
+            ssize_t n = read(soc, buf, (left < sizeof(buf)) ? left : sizeof(buf));
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0 || write(in_fd, buf, n) != n) {
+                return;
+            }
+            left -= n;
+        }
+        lseek(in_fd, 0, SEEK_SET);
+
+        // Wait for this worker's scheduler, like any filter job.
+        char in_path[64];
+        snprintf(in_path, sizeof(in_path), "/proc/self/fd/%d", in_fd);
+        BitmapFile file;
+        double pixels = 0;
+        if (open_bitmap_file(in_path, &file) == 0) {
+            pixels = (double) file.width * file.height;
+            close_bitmap_file(&file);
+        }
+        schedule_job(job.filter, pixels);
+
+        char tmp_path[MAX_PATH];
+        int cache_fd = cache_create(name, entry, tmp_path, sizeof(tmp_path));
+        int filter_out = (cache_fd != -1) ? cache_fd : memfd_create("remote-output", MFD_CLOEXEC);
+        unsigned long start = trace_now();
+        result.status = run_filter(job.filter, in_fd, filter_out);
+        trace_span("filter_worker", start, trace_now());
+        finish_job();
+        close(in_fd);
+
+        int succeeded = result.status != -1 && WIFEXITED(result.status) &&
+                        WEXITSTATUS(result.status) == 0;
+        if (cache_fd == -1) {
+            out_fd = filter_out;
+        } else {
+            close(cache_fd);
+            if (succeeded && cache_commit(tmp_path, name, entry) == 0) {
+                out_fd = open(path, O_RDONLY);
+            } else {
+                unlink(tmp_path);
+            }
+        }
+        result.type = REMOTE_RESULT;
+        if (!succeeded || out_fd == -1) {
+            // A filter that ran fine but whose output was lost still failed.
+            result.status = (result.status == -1 || succeeded) ? 1 << 8 : result.status;
+            send_all(soc, &result, sizeof(result));
+            return;
+        }
+    } else {
+        result.cached = 1;
+        result.status = 0;
+    }
+
+    struct stat st;
+    fstat(out_fd, &st);
+    result.output_size = st.st_size;
+    if (send_all(soc, &result, sizeof(result)) == -1) {
+        return;
+    }
+    off_t offset = 0;
+    while (offset < st.st_size) {
+        if (sendfile(soc, out_fd, &offset, st.st_size - offset) <= 0) {
+            perror("sendfile");
+            return;
+        }
+    }
+    close(out_fd);
+}
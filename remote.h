@@ -0,0 +1,114 @@
+#ifndef REMOTE_H_
+#define REMOTE_H_
+
+#include <stdint.h>
+
+/*
+ * Filter workers on other hosts, so filtering isn't limited to the CPUs of
+ * the server that takes the requests.
+ *
+ * ./image_server -W <port> runs as a filter worker: rather than HTTP, it
+ * accepts filter jobs over TCP and runs them as a request process would
+ * (with its own filter pool and scheduler, -w and -j), caching the results
+ * under cache/worker<port>-<filter>/.
+ *
+ * A server started with -F host:port,host:port,... sends the jobs of
+ * /image-filter requests for filters in filters/ to those workers. Each
+ * image has a home worker on a consistent-hash ring (REMOTE_VNODES points
+ * per worker), so every filter run on it hits the same worker's cache, and
+ * adding or removing a worker only moves the images that were its own. If
+ * the worker is down, or fails during the job, the job moves on to the next
+ * worker along the ring; if none is up, it runs locally.
+ *
+ * A health checker process pings every worker each REMOTE_CHECK_MS. A
+ * worker is marked down after REMOTE_DOWN_AFTER failed pings, or as soon as
+ * a job can't be run on it, and up again once it answers a ping. A job that
+ * reached a worker but takes longer than REMOTE_JOB_MS fails the request
+ * instead: the worker is busy rather than down, and the job would be as slow
+ * anywhere else.
+ *
+ * The server and its workers share a key, read from the file given with -A
+ * to both. Every frame the server sends carries it, and a worker drops any
+ * connection whose key doesn't match, so only its servers can have it run
+ * filters and store images. Neither end starts without one.
+ *
+ * A connection carries one job:
+ *   server -> worker: RemoteJobFrame
+ *   worker -> server: a REMOTE_RESULT frame and the output if it is cached,
+ *                     otherwise a REMOTE_NEED_IMAGE frame
+ *   server -> worker: the image (image_size bytes)
+ *   worker -> server: a REMOTE_RESULT frame and the output
+ * Frames are in host byte order: both ends must be the same architecture.
+ */
+
+#define MAX_REMOTE_WORKERS 16
+#define REMOTE_VNODES 64            // Points on the ring per worker.
+#define REMOTE_CONNECT_MS 500
+#define REMOTE_FRAME_MS 1000        // For a worker to get the job frame.
+#define REMOTE_JOB_MS 60000         // A job taking longer counts as a failure.
+#define REMOTE_CHECK_MS 1000
+#define REMOTE_DOWN_AFTER 2
+#define REMOTE_MAX_NAME 256
+#define REMOTE_KEY_SIZE 64          // Longest key, with its '\0'.
+#define REMOTE_MIN_KEY 16
+#define REMOTE_MAX_IMAGE (1L << 30) // Bytes; larger images are filtered locally.
+
+// Returned by run_remote_job when a worker took the job but didn't finish it
+// in time.
+#define REMOTE_TIMED_OUT -2
+
+#define REMOTE_FRAME_MAGIC 0x544d4552u  // "REMT"
+
+// Frame types.
+#define REMOTE_PING 1
+#define REMOTE_JOB 2
+#define REMOTE_PONG 3
+#define REMOTE_NEED_IMAGE 4
+#define REMOTE_RESULT 5
+
+typedef struct {
+    uint32_t magic;
+    uint32_t type;                  // REMOTE_PING or REMOTE_JOB
+    char key[REMOTE_KEY_SIZE];      // Zero-padded.
+    char filter[REMOTE_MAX_NAME];
+    char image[REMOTE_MAX_NAME];
+    int64_t image_size;             // With the mtime, names this version of
+    int64_t image_mtime_ns;         // the image in the worker's cache.
+} RemoteJobFrame;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t type;                  // REMOTE_PONG, REMOTE_NEED_IMAGE or REMOTE_RESULT
+    int32_t status;                 // Of the filter, as reported by waitpid.
+    int32_t cached;                 // The output came from the worker's cache.
+    int64_t output_size;            // Bytes of output following the frame.
+} RemoteResultFrame;
+
+
+/*
+ * Send filter jobs to the workers listed in <workers> ("host:port,..."; NULL
+ * or empty runs every job locally), with the key in <key_file>, and start
+ * their health checker. Must be called before the first acceptor is forked.
+ */
+void init_remote_workers(const char *workers, const char *key_file);
+
+/*
+ * Have the home worker of <image> (or the next one up) run <filter> on the
+ * image open at <image_fd>, writing the output to <out_fd>. Return the
+ * filter's wait status, REMOTE_TIMED_OUT if the worker running it took too
+ * long, or -1 if no worker could run the job (nothing was written).
+ */
+int run_remote_job(const char *filter, const char *image, int image_fd, int out_fd);
+
+/*
+ * Write the state of every worker, for /debug/metrics.
+ */
+void write_remote_report(int fd);
+
+/*
+ * Serve filter jobs on <port> as a filter worker, to servers with the key in
+ * <key_file>. Never returns.
+ */
+void run_filter_worker(int port, const char *key_file);
+
+#endif /* REMOTE_H_ */
@@ -0,0 +1,550 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "socket.h"
+#include "capture.h"
+
+#ifndef PORT
+#define PORT 30000
+#endif
+
+#define BUFSIZE 65536
+#define MAX_ROUTES 64
+#define MAX_ROUTE_LEN 128
+
+/*
+ * Replays traffic recorded with ./image_server -R against a server, to
+ * compare builds under realistic load rather than a loop of one request:
+ *     ./replay -s 2 -o before.lat capture.bin     (then rebuild, restart)
+ *     ./replay -s 2 -o after.lat capture.bin
+ *     ./replay -d before.lat after.lat
+ *
+ * Requests are issued open loop, at their recorded times divided by the
+ * speed (-s 1, 2, 10, ...), each from its own process, whether or not the
+ * ones before have been answered; -c caps how many are in flight. Bodies
+ * that weren't kept in full are sent as a stand-in of the same length.
+ *
+ * A run reports its latency distribution overall and per route (the first
+ * path component, and the filter for /image-filter), and -o saves every
+ * latency so -d can compare two runs route by route.
+ */
+
+typedef struct {
+    const CaptureRecord *record;
+    const char *head;
+    const char *body;        // The body_kept bytes of the body.
+    int route;
+} Request;
+
+// One finished request, as sent back by the process that issued it.
+typedef struct {
+    int route;
+    int status;              // 0 if there was no response.
+    double latency_us;
+    double lag_us;           // How late it was issued.
+} Result;
+
+typedef struct {
+    char names[MAX_ROUTES][MAX_ROUTE_LEN];
+    int num_routes;
+} RouteTable;
+
+static RouteTable routes;
+
+
+double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+
+int compare_requests(const void *a, const void *b) {
+    const Request *x = a;
+    const Request *y = b;
+    return (x->record->time_us > y->record->time_us) - (x->record->time_us < y->record->time_us);
+}
+
+
+/*
+ * Return the index of the route called <name>, adding it if it's new. Routes
+ * beyond MAX_ROUTES are lumped together as the last one.
+ */
+int find_route(const char *name) {
+    for (int i = 0; i < routes.num_routes; i++) {
+        if (strcmp(routes.names[i], name) == 0) {
+            return i;
+        }
+    }
+    if (routes.num_routes == MAX_ROUTES) {
+        return MAX_ROUTES - 1;
+    }
+    snprintf(routes.names[routes.num_routes], MAX_ROUTE_LEN, "%s", name);
+    return routes.num_routes++;
+}
+
+
+/*
+ * Return the route of a request from its start line, e.g. "GET /tiles" for
+ * "GET /tiles/dog.bmp/0/0/0 HTTP/1.1".
+ */
+int route_of(const char *head, int head_len) {
+    char line[MAX_ROUTE_LEN];
+    int len = 0;
+    while (len < head_len && len < MAX_ROUTE_LEN - 1 && head[len] != '\r') {
+        len++;
+    }
+    memcpy(line, head, len);
+    line[len] = '\0';
+
+    char name[MAX_ROUTE_LEN];
+    char *path = strchr(line, ' ');
+    if (path == NULL) {
+        return find_route(line);
+    }
+    // The method and the first component of the path.
+    int end = path + 1 - line;
+    while (line[end] != '\0' && line[end] != ' ' && line[end] != '?' &&
+            (line[end] != '/' || end == path + 1 - line)) {
+        end++;
+    }
+    int name_len = end;
+    memcpy(name, line, name_len);
+    name[name_len] = '\0';
+
+    const char *filter = strstr(line, "filter=");
+    if (filter != NULL && strncmp(path + 1, "/image-filter?", strlen("/image-filter?")) == 0) {
+        int filter_len = strcspn(filter, "& ");
+        snprintf(name + name_len, sizeof(name) - name_len, " %.*s", filter_len, filter);
+    }
+    return find_route(name);
+}
+
+
+/*
+ * Read every record in the capture file at <path>, in time order.
+ * Return the number of requests.
+ */
+int load_capture(const char *path, Request **requests) {
+    FILE *in = fopen(path, "r");
+    struct stat st;
+    if (in == NULL || fstat(fileno(in), &st) == -1) {
+        perror(path);
+        exit(1);
+    }
+    char *data = malloc(st.st_size);
+    if (fread(data, 1, st.st_size, in) != st.st_size) {
+        perror("fread");
+        exit(1);
+    }
+    fclose(in);
+
+    int num = 0;
+    int size = 1024;
+    *requests = malloc(size * sizeof(Request));
+    long offset = 0;
+    while (offset + (long) sizeof(CaptureRecord) <= st.st_size) {
+        const CaptureRecord *record = (const CaptureRecord *) (data + offset);
+        long length = sizeof(CaptureRecord) + record->head_len + record->body_kept;
+        if (record->magic != CAPTURE_MAGIC || offset + length > st.st_size) {
+            fprintf(stderr, "replay: %s is damaged at byte %ld; using the %d requests before it\n",
+                    path, offset, num);
+            break;
+        }
+        if (num == size) {
+            size *= 2;
+            *requests = realloc(*requests, size * sizeof(Request));
+        }
+        Request *request = &(*requests)[num++];
+        request->record = record;
+        request->head = data + offset + sizeof(CaptureRecord);
+        request->body = request->head + record->head_len;
+        request->route = route_of(request->head, record->head_len);
+        offset += length;
+    }
+    qsort(*requests, num, sizeof(Request), compare_requests);
+    return num;
+}
+
+
+/*
+ * Return the Content-Length given in <head>, or -1 if there is none.
+ */
+long header_length(const char *head, int head_len) {
+    const char *name = "\r\ncontent-length:";
+    int name_len = strlen(name);
+    for (int i = 0; i + name_len < head_len; i++) {
+        if (strncasecmp(head + i, name, name_len) == 0) {
+            return strtol(head + i + name_len, NULL, 10);
+        }
+    }
+    return -1;
+}
+
+
+int write_all(int fd, const char *buf, long size) {
+    while (size > 0) {
+        ssize_t numWritten = write(fd, buf, size);
+        if (numWritten <= 0) {
+            return -1;
+        }
+        buf += numWritten;
+        size -= numWritten;
+    }
+    return 0;
+}
+
+
+/*
+ * Send one captured request and read the whole response, filling in the
+ * status and latency of <result>.
+ */
+void send_request(const char *host, int port, const Request *request, Result *result) {
+    const CaptureRecord *record = request->record;
+    char buf[BUFSIZE];
+    double start = now_us();
+    int soc = connect_to_server(port, host);
+
+    // A request process records the headers that had arrived when it
+    // started, which may not have included the blank line.
+    int sent = write_all(soc, request->head, record->head_len);
+    if (sent == 0 && (record->head_len < 4 ||
+            memcmp(request->head + record->head_len - 4, "\r\n\r\n", 4) != 0)) {
+        int crlfs = (record->head_len >= 2 &&
+                     memcmp(request->head + record->head_len - 2, "\r\n", 2) == 0) ? 1 : 2;
+        sent = write_all(soc, "\r\n\r\n", 2 * crlfs);
+    }
+    if (sent == 0 && record->body_kept > 0) {
+        sent = write_all(soc, request->body, record->body_kept);
+    }
+    // The stand-in for the rest of the body. The server may not have read
+    // all of it (having rejected the request early), but it was sent.
+    long body_len = record->body_len;
+    long content_length = header_length(request->head, record->head_len);
+    if (content_length > body_len) {
+        body_len = content_length;
+    }
+    memset(buf, 'x', sizeof(buf));
+    for (long left = body_len - record->body_kept; sent == 0 && left > 0; ) {
+        long n = (left < sizeof(buf)) ? left : sizeof(buf);
+        sent = write_all(soc, buf, n);
+        left -= n;
+    }
+    // A chunked body that wasn't captured in full can't be framed again, so
+    // end the request here rather than leave the server waiting for more.
+    shutdown(soc, SHUT_WR);
+
+    // The server closes the connection once the response is complete.
+    result->status = 0;
+    long total = 0;
+    int numRead;
+    while ((numRead = read(soc, buf, sizeof(buf) - 1)) > 0) {
+        if (total == 0) {
+            // Skip a 100 Continue sent before the response itself.
+            buf[numRead] = '\0';
+            const char *line = buf;
+            while (sscanf(line, "HTTP/%*s %d", &result->status) == 1 && result->status < 200 &&
+                    (line = strstr(line, "\r\n\r\n")) != NULL) {
+                line += 4;
+            }
+        }
+        total += numRead;
+    }
+    close(soc);
+    result->latency_us = now_us() - start;
+}
+
+
+/*
+ * Print the latency distribution of <n> sorted latencies.
+ */
+void print_distribution(const char *label, const double *latencies, int n) {
+    double total = 0;
+    for (int i = 0; i < n; i++) {
+        total += latencies[i];
+    }
+    printf("%-32s %7d %10.0f %10.0f %10.0f %10.0f %10.0f\n", label, n, total / n,
+           latencies[n / 2], latencies[n * 9 / 10], latencies[n * 99 / 100], latencies[n - 1]);
+}
+
+
+/*
+ * Print the latencies of <results> overall and per route.
+ */
+void print_report(const Result *results, int n) {
+    double *latencies = malloc(n * sizeof(double));
+    printf("%-32s %7s %10s %10s %10s %10s %10s\n", "route", "count", "mean_us", "p50_us",
+           "p90_us", "p99_us", "max_us");
+    for (int r = -1; r < routes.num_routes; r++) {
+        int count = 0;
+        for (int i = 0; i < n; i++) {
+            if (results[i].status != 0 && (r == -1 || results[i].route == r)) {
+                latencies[count++] = results[i].latency_us;
+            }
+        }
+        if (count > 0) {
+            qsort(latencies, count, sizeof(double), compare_doubles);
+            print_distribution((r == -1) ? "all" : routes.names[r], latencies, count);
+        }
+    }
+    free(latencies);
+}
+
+
+/*
+ * Read the results saved by -o at <path>. Return how many there are.
+ */
+int load_results(const char *path, Result **results) {
+    FILE *in = fopen(path, "r");
+    if (in == NULL) {
+        perror(path);
+        exit(1);
+    }
+    int num = 0;
+    int size = 1024;
+    *results = malloc(size * sizeof(Result));
+    char line[MAX_ROUTE_LEN + 64];
+    while (fgets(line, sizeof(line), in) != NULL) {
+        Result result;
+        char name[MAX_ROUTE_LEN];
+        if (sscanf(line, "%lf\t%d\t%127[^\n]", &result.latency_us, &result.status, name) != 3) {
+            continue;
+        }
+        result.route = find_route(name);
+        if (num == size) {
+            size *= 2;
+            *results = realloc(*results, size * sizeof(Result));
+        }
+        (*results)[num++] = result;
+    }
+    fclose(in);
+    return num;
+}
+
+
+/*
+ * Return the <percent>th percentile latency of the answered results on
+ * <route> (-1 for all of them), or -1 if there are none.
+ */
+double route_percentile(const Result *results, int n, int route, int percent) {
+    double *latencies = malloc(n * sizeof(double));
+    int count = 0;
+    for (int i = 0; i < n; i++) {
+        if (results[i].status != 0 && (route == -1 || results[i].route == route)) {
+            latencies[count++] = results[i].latency_us;
+        }
+    }
+    double value = -1;
+    if (count > 0) {
+        qsort(latencies, count, sizeof(double), compare_doubles);
+        value = latencies[(long) count * percent / 100];
+    }
+    free(latencies);
+    return value;
+}
+
+
+/*
+ * Compare the latencies of two runs saved with -o, route by route.
+ */
+void diff_runs(const char *before_path, const char *after_path) {
+    Result *before;
+    Result *after;
+    int num_before = load_results(before_path, &before);
+    int num_after = load_results(after_path, &after);
+    const int percents[] = {50, 90, 99};
+
+    printf("%-32s %5s %10s %10s %8s\n", "route", "", "before_us", "after_us", "change");
+    for (int r = -1; r < routes.num_routes; r++) {
+        for (int p = 0; p < 3; p++) {
+            double x = route_percentile(before, num_before, r, percents[p]);
+            double y = route_percentile(after, num_after, r, percents[p]);
+            if (x < 0 || y < 0) {
+                continue;
+            }
+            printf("%-32s   p%-2d %10.0f %10.0f %+7.1f%%\n", (r == -1) ? "all" : routes.names[r],
+                   percents[p], x, y, (y - x) * 100 / x);
+        }
+    }
+    free(before);
+    free(after);
+}
+
+
+int main(int argc, char **argv) {
+    char *host = "localhost";
+    int port = PORT;
+    double speed = 1;
+    int max_in_flight = 256;
+    const char *out_path = NULL;
+    int diff = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:s:c:o:d")) != -1) {
+        switch (opt) {
+        case 'h':
+            host = optarg;
+            break;
+        case 'p':
+            port = strtol(optarg, NULL, 10);
+            break;
+        case 's':
+            speed = strtod(optarg, NULL);
+            break;
+        case 'c':
+            max_in_flight = strtol(optarg, NULL, 10);
+            break;
+        case 'o':
+            out_path = optarg;
+            break;
+        case 'd':
+            diff = 1;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-h host] [-p port] [-s speed] [-c max_in_flight]"
+                            " [-o latencies] capture_file\n"
+                            "       %s -d before_latencies after_latencies\n",
+                    argv[0], argv[0]);
+            exit(1);
+        }
+    }
+    if (diff) {
+        if (argc - optind != 2) {
+            fprintf(stderr, "replay: -d needs two files saved with -o\n");
+            exit(1);
+        }
+        diff_runs(argv[optind], argv[optind + 1]);
+        return 0;
+    }
+    if (optind >= argc || speed <= 0 || max_in_flight <= 0) {
+        fprintf(stderr, "replay: need a capture file, a positive speed and -c\n");
+        exit(1);
+    }
+
+    Request *requests;
+    int num = load_capture(argv[optind], &requests);
+    if (num == 0) {
+        fprintf(stderr, "replay: no requests in %s\n", argv[optind]);
+        exit(1);
+    }
+    Result *results = calloc(num, sizeof(Result));
+    for (int i = 0; i < num; i++) {
+        results[i].route = requests[i].route;
+    }
+
+    int fd[2];
+    if (pipe(fd) == -1) {
+        perror("pipe");
+        exit(1);
+    }
+    // A server that answers before reading the whole body closes on us.
+    signal(SIGPIPE, SIG_IGN);
+
+    double start = now_us();
+    uint64_t first = requests[0].record->time_us;
+    int in_flight = 0;
+    for (int i = 0; i <= num; i++) {
+        double due = (i < num) ? start + (requests[i].record->time_us - first) / speed : 0;
+        // Collect results until it is time for the next request, and there
+        // is room for it. After the last one, until every result is in.
+        while (1) {
+            double wait_ms = (i < num) ? (due - now_us()) / 1e3 : 10;
+            if (i < num && wait_ms <= 0 && in_flight < max_in_flight) {
+                break;
+            }
+            if (i == num && in_flight == 0) {
+                break;
+            }
+            struct pollfd pfd = {fd[0], POLLIN, 0};
+            int timeout = (in_flight >= max_in_flight || wait_ms > 10) ? 10 : (int) wait_ms;
+            if (poll(&pfd, 1, timeout) == 1) {
+                int index;
+                Result result;
+                char message[sizeof(index) + sizeof(result)];
+                if (read(fd[0], message, sizeof(message)) == sizeof(message)) {
+                    memcpy(&index, message, sizeof(index));
+                    memcpy(&results[index], message + sizeof(index), sizeof(result));
+                }
+            }
+            while (waitpid(-1, NULL, WNOHANG) > 0) {
+                in_flight--;
+            }
+        }
+        if (i == num) {
+            break;
+        }
+
+        int result = fork();
+        if (result < 0) {
+            perror("fork");
+            exit(1);
+        } else if (result == 0) {
+            close(fd[0]);
+            char message[sizeof(int) + sizeof(Result)];
+            results[i].lag_us = now_us() - due;
+            send_request(host, port, &requests[i], &results[i]);
+            memcpy(message, &i, sizeof(int));
+            memcpy(message + sizeof(int), &results[i], sizeof(Result));
+            write(fd[1], message, sizeof(message));
+            exit(0);
+        }
+        in_flight++;
+    }
+    // Results may still be in the pipe after their processes were reaped.
+    close(fd[1]);
+    struct pollfd pfd = {fd[0], POLLIN, 0};
+    char message[sizeof(int) + sizeof(Result)];
+    while (poll(&pfd, 1, 0) == 1 && read(fd[0], message, sizeof(message)) == sizeof(message)) {
+        int index;
+        memcpy(&index, message, sizeof(index));
+        memcpy(&results[index], message + sizeof(index), sizeof(Result));
+    }
+    double elapsed = now_us() - start;
+
+    int answered = 0;
+    double *lags = malloc(num * sizeof(double));
+    for (int i = 0; i < num; i++) {
+        answered += results[i].status != 0;
+        lags[i] = results[i].lag_us;
+    }
+    qsort(lags, num, sizeof(double), compare_doubles);
+    printf("requests: %d answered, %d failed in %.2f s at %gx (recorded over %.2f s)\n",
+           answered, num - answered, elapsed / 1e6, speed,
+           (requests[num - 1].record->time_us - first) / 1e6);
+    printf("issued late by (us): p50 %.0f  p99 %.0f  max %.0f\n",
+           lags[num / 2], lags[num * 99 / 100], lags[num - 1]);
+    free(lags);
+    if (answered > 0) {
+        print_report(results, num);
+    }
+
+    if (out_path != NULL) {
+        FILE *out = fopen(out_path, "w");
+        if (out == NULL) {
+            perror(out_path);
+            exit(1);
+        }
+        for (int i = 0; i < num; i++) {
+            fprintf(out, "%.0f\t%d\t%s\n", results[i].latency_us, results[i].status,
+                    routes.names[results[i].route]);
+        }
+        fclose(out);
+    }
+    return 0;
+}
@@ -1,37 +1,92 @@
+#define _GNU_SOURCE  // strcasestr
 #include "request.h"
 #include "response.h"
+#include "debug.h"
+#include "capture.h"
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <limits.h>
+#include <poll.h>
 
 
 /******************************************************************************
  * ClientState-processing functions
  *****************************************************************************/
+// Head of the list of free slots in the slab.
+static ClientState *free_clients = NULL;
+
 ClientState *init_clients(int n) {
     ClientState *clients = malloc(sizeof(ClientState) * n);
-    for (int i = 0; i < n; i++) {
+    free_clients = NULL;
+    // Push in reverse, so slots are handed out from the start of the slab.
+    for (int i = n - 1; i >= 0; i--) {
         clients[i].sock = -1;  // -1 here indicates available entry
+        clients[i].num_bytes = 0;
+        clients[i].reqData = NULL;
+        clients[i].read_start = 0;
+        clients[i].read_total = 0;
+        clients[i].accepted_us = 0;
+        clients[i].out_buf = NULL;
+        clients[i].out_body = NULL;
+        clients[i].out_body_len = 0;
+        clients[i].out_fd = -1;
+        clients[i].out_pin = NULL;
+        clients[i].body_length = -1;
+        clients[i].body_start = 0;
+        clients[i].chunk_state = CHUNK_NONE;
+        clients[i].chunk_left = 0;
+        clients[i].boundary = NULL;
+        timer_init(&clients[i].timer, &clients[i]);
+        arena_init(&clients[i].arena, clients[i].arena_buf, REQUEST_ARENA_SIZE);
+        clients[i].next_free = free_clients;
+        free_clients = &clients[i];
     }
     return clients;
 }
 
+
+ClientState *alloc_client(void) {
+    ClientState *cs = free_clients;
+    if (cs != NULL) {
+        free_clients = cs->next_free;
+        cs->next_free = NULL;
+    }
+    return cs;
+}
+
+
 /*
- * Remove the client from the client array, free any memory allocated for
- * fields of the ClientState struct, and close the socket.
+ * Release everything allocated for the client's request, close the socket,
+ * and put the slot back on the free list.
  */
 void remove_client(ClientState *cs) {
-    if (cs->reqData != NULL) {
-        free(cs->reqData->method);
-        free(cs->reqData->path);
-        for (int i = 0; i < MAX_QUERY_PARAMS && cs->reqData->params[i].name != NULL; i++) {
-            free(cs->reqData->params[i].name);
-            free(cs->reqData->params[i].value);
-        }
-        free(cs->reqData);
-        cs->reqData = NULL;
+    if (cs->out_fd != -1) {
+        close(cs->out_fd);
+        cs->out_fd = -1;
+    }
+    if (cs->out_pin != NULL) {
+        (*cs->out_pin)--;
+        cs->out_pin = NULL;
     }
+    cs->out_buf = NULL;
+    cs->out_body = NULL;
+    cs->out_body_len = 0;
+    arena_reset(&cs->arena);
+    cs->reqData = NULL;
     close(cs->sock);
     cs->sock = -1;
     cs->num_bytes = 0;
+    cs->read_start = 0;
+    cs->read_total = 0;
+    cs->accepted_us = 0;
+    cs->body_length = -1;
+    cs->body_start = 0;
+    cs->chunk_state = CHUNK_NONE;
+    cs->chunk_left = 0;
+    cs->boundary = NULL;
+    cs->next_free = free_clients;
+    free_clients = cs;
 }
 
 
@@ -63,7 +118,7 @@ int find_network_newline(const char *buf, int inbuf) {
 void remove_buffered_line(ClientState *client) {
     int position = find_network_newline(client->buf, client->num_bytes);
     if (position == -1) {
-        fprintf(stderr, "network newline is not found\n");
+        DEBUG_LOG("network newline is not found\n");
     } else {
         // Removes one line (terminated by \r\n) from the client's buffer.
         // Move the stuff after the network newline '\r\n' to the beginning
@@ -79,43 +134,142 @@ void remove_buffered_line(ClientState *client) {
 
 
 /*
- * Read some data into the client buffer. Append new data to data already
- * in the buffer.  Update client->num_bytes accordingly.
+ * Read up to <size> bytes from the client's socket into <out>.
  * Return the number of bytes read in, or -1 if the read failed.
  */
-int read_from_client(ClientState *client) {
-    int numRead = 0;
+static int read_socket(ClientState *client, char *out, int size) {
+    // Wait no longer than the minimum transfer rate allows, so a client
+    // trickling in its request can't tie up this process forever.
+    if (client->read_start == 0) {
+        client->read_start = monotonic_ms();
+    }
+    long deadline = client->read_start + BODY_GRACE_MS + client->read_total * 1000 / BODY_MIN_RATE;
+    long wait = deadline - (long) monotonic_ms();
+    struct pollfd pfd = {client->sock, POLLIN, 0};
+    if (wait <= 0 || poll(&pfd, 1, wait) == 0) {
+        fprintf(stderr, "Client is sending data too slowly, giving up.\n");
+        return -1;
+    }
 
-    // if the client->buf is full, overwrite it.
-    if (client->num_bytes == MAXLINE - 1) {
+    int numRead = read(client->sock, out, size);
+    if (numRead < 0) { // error
+        perror("read");
+        return -1;
+    }
+    client->read_total += numRead;
+    capture_bytes(out, numRead);
+    return numRead;
+}
 
-        numRead = read(client->sock, client->buf, MAXLINE - 1);
 
-        if (numRead < 0) { // error
-            perror("read");
-            return -1;
+/*
+ * Decode the chunked framing of client->buf[start, num_bytes) in place,
+ * leaving only the data behind. The framing may be split anywhere between
+ * reads; client->chunk_state and client->chunk_left carry over.
+ * Return the number of data bytes left, or -1 if the framing is invalid.
+ */
+static int decode_chunks(ClientState *client, int start) {
+    int out = start;
+    int in = start;
+    while (in < client->num_bytes && client->chunk_state != CHUNK_DONE) {
+        char c = client->buf[in];
+        switch (client->chunk_state) {
+        case CHUNK_SIZE:
+            if (isxdigit((unsigned char) c)) {
+                if (client->chunk_left > (LONG_MAX >> 4)) {
+                    return -1;
+                }
+                int digit = isdigit((unsigned char) c) ? c - '0' : tolower((unsigned char) c) - 'a' + 10;
+                client->chunk_left = client->chunk_left * 16 + digit;
+            } else if (c == ';' || c == ' ' || c == '\t' || c == '\r') {
+                client->chunk_state = CHUNK_EXTENSION;
+            } else {
+                return -1;
+            }
+            in++;
+            break;
+        case CHUNK_EXTENSION:
+            // Extensions are ignored, as the spec allows.
+            if (c == '\n') {
+                client->chunk_state = (client->chunk_left > 0) ? CHUNK_DATA : CHUNK_TRAILER;
+            }
+            in++;
+            break;
+        case CHUNK_DATA: {
+            long n = client->num_bytes - in;
+            if (n > client->chunk_left) {
+                n = client->chunk_left;
+            }
+            memmove(client->buf + out, client->buf + in, n);
+            out += n;
+            in += n;
+            client->chunk_left -= n;
+            if (client->chunk_left == 0) {
+                client->chunk_state = CHUNK_DATA_END;
+            }
+            break;
         }
+        case CHUNK_DATA_END:
+            if (c == '\n') {
+                client->chunk_state = CHUNK_SIZE;
+            } else if (c != '\r') {
+                return -1;
+            }
+            in++;
+            break;
+        case CHUNK_TRAILER:
+            // Either a trailer field or the CRLF that ends the body.
+            if (c == '\n') {
+                client->chunk_state = CHUNK_DONE;
+            } else if (c != '\r') {
+                client->chunk_state = CHUNK_TRAILER_LINE;
+            }
+            in++;
+            break;
+        case CHUNK_TRAILER_LINE:
+            if (c == '\n') {
+                client->chunk_state = CHUNK_TRAILER;
+            }
+            in++;
+            break;
+        }
+    }
+    client->num_bytes = out;
+    client->buf[out] = '\0';
+    return out - start;
+}
 
-        client->num_bytes = numRead;
-        client->buf[client->num_bytes] = '\0';
-        return numRead;
-
-    } else {
-        // Space left in client->buf is MAXLINE - client->num_bytes, -1 is for '\0'.
-        numRead = read(client->sock, client->buf + client->num_bytes, MAXLINE - client->num_bytes - 1);
 
-        if (numRead < 0) { // error
-            perror("read");
-            return -1;
+/*
+ * Read some data into the client buffer. Append new data to data already
+ * in the buffer.  Update client->num_bytes accordingly.
+ * Once begin_body has found a chunked body, only its data is kept, and the
+ * end of the body reads as the end of the connection.
+ * Return the number of bytes read in, or -1 if the read failed.
+ */
+int read_from_client(ClientState *client) {
+    while (client->chunk_state != CHUNK_DONE) {
+        // if the client->buf is full, overwrite it.
+        int start = (client->num_bytes == MAXLINE - 1) ? 0 : client->num_bytes;
+
+        // Space left in client->buf is MAXLINE - start, -1 is for '\0'.
+        int numRead = read_socket(client, client->buf + start, MAXLINE - start - 1);
+        if (numRead <= 0) {
+            return numRead;
         }
-
-        client->num_bytes = client->num_bytes + numRead;
+        client->num_bytes = start + numRead;
         client->buf[client->num_bytes] = '\0';
-        return numRead;
+        if (client->chunk_state == CHUNK_NONE) {
+            return numRead;
+        }
+
+        // Nothing but framing came in; read again.
+        int decoded = decode_chunks(client, start);
+        if (decoded != 0) {
+            return decoded;
+        }
     }
-    // IMPLEMENT THIS
-    // replace the return line with something more appropriate
-    // return -1;
+    return 0;
 }
 
 
@@ -123,9 +277,7 @@ int read_from_client(ClientState *client) {
  * Parsing the start line of an HTTP request.
  ****************************************************************************/
 // Helper function declarations.
-void parse_query(ReqData *req, const char *str);
-void update_fdata(Fdata *f, const char *str);
-void fdata_free(Fdata *f);
+void parse_query(ReqData *req, Arena *arena, const char *str);
 void log_request(const ReqData *req);
 
 
@@ -137,86 +289,56 @@ int parse_req_start_line(ClientState *client) {
 
     int end = find_network_newline(client->buf, client->num_bytes);
     if (end == -1) {
-        fprintf(stderr, "network newline is not found\n");
+        DEBUG_LOG("network newline is not found\n");
         return 0;  // a full line has not been read.
     }
 
-    // allocate space for client->reqData on heap.
-    client->reqData = malloc(sizeof(ReqData));
-
-    int path_len = 0; // the length of the path.
-
-    // initialize <method> first using malloc().
-    if ((client->buf[0] == 'G') && (client->buf[1] == 'E') && (client->buf[2] == 'T')) {
-
-        client->reqData->method = malloc(strlen(GET) + 1);
-        memcpy(client->reqData->method, GET, 4);
-
-        // next we initialize <path> using malloc().
-        while ((client->buf[path_len + 4] != '?') && (client->buf[path_len + 4] != ' ')) {
-            path_len++;
-        }
-        client->reqData->path = malloc(path_len + 1);  // add 1 for '\0'
-
-        int i = 4;
-        while ((client->buf[i] != '?') && (client->buf[i] != ' ')) {
-            // memcpy(client->reqData->path + i - 4, client->buf[i], 1);
-            client->reqData->path[i - 4] = client->buf[i];
-            i++;
-        }
-        // client->reqData->path + path_len = '\0';
-        client->reqData->path[path_len] = '\0';
-
-        // next we initialize client->reqData->params.
-        if (client->buf[4 + path_len] == '?') {  // means there are query parameters.
-
-            int query_len = 0;
-            while (client->buf[query_len + path_len + 5] != ' ') {
-                query_len++;
-            }
-            char query_str[query_len];
-
-            int ptr = path_len + 5;
-            while (client->buf[ptr] != ' ') {
-                query_str[ptr - (path_len + 5)] = client->buf[ptr];
-                ptr++;
-            }
-
-            query_str[ptr - (path_len + 5)] = '\0';
-
-            // Initializes client->reqData->params from the key-value pairs contained in query_str.
-            parse_query(client->reqData, query_str);
-
+    // allocate space for client->reqData from the request arena.
+    // The start line fits in client->buf, so this can't run out of room.
+    Arena *arena = &client->arena;
+    client->reqData = arena_alloc(arena, sizeof(ReqData));
 
-        } else {  // means there are no query parameter.
-            for (int j = 0; j < MAX_QUERY_PARAMS; j++) {
-                // set all the names and values to NULL.
-                client->reqData->params[j].name = NULL;
-                client->reqData->params[j].value = NULL;
-            }
-        }
+    // The method is everything before the first space.
+    int method_len = 0;
+    while (method_len < end - 2 && client->buf[method_len] != ' ') {
+        method_len++;
+    }
+    if (method_len == strlen(GET) && strncmp(client->buf, GET, method_len) == 0) {
+        client->reqData->method = GET;
+    } else if (method_len == strlen(POST) && strncmp(client->buf, POST, method_len) == 0) {
+        client->reqData->method = POST;
+    } else if (method_len == strlen(PUT) && strncmp(client->buf, PUT, method_len) == 0) {
+        client->reqData->method = PUT;
+    } else {
+        // Kept as is; no route matches it.
+        client->reqData->method = arena_strndup(arena, client->buf, method_len);
+    }
 
-    } else if ((client->buf[0] == 'P') && (client->buf[1] == 'O') && (client->buf[2] == 'S') && (client->buf[3] == 'T')) {
+    // next we initialize <path>, which ends at the query or the protocol version.
+    int path_start = (method_len < end - 2) ? method_len + 1 : method_len;
+    int path_len = 0; // the length of the path.
+    while (path_start + path_len < end - 2 && client->buf[path_start + path_len] != '?' &&
+            client->buf[path_start + path_len] != ' ') {
+        path_len++;
+    }
+    client->reqData->path = arena_strndup(arena, client->buf + path_start, path_len);
 
-        client->reqData->method = malloc(strlen(POST) + 1);
-        memcpy(client->reqData->method, POST, 5);
+    // next we initialize client->reqData->params.
+    if (client->buf[path_start + path_len] == '?') {  // means there are query parameters.
 
-        // next we initialize <path> using malloc().
-        while (client->buf[path_len + 5] != ' ') {
-            path_len++;
+        int query_start = path_start + path_len + 1;
+        int query_len = 0;
+        while (query_start + query_len < end - 2 && client->buf[query_start + query_len] != ' ') {
+            query_len++;
         }
-        client->reqData->path = malloc(path_len + 1);  // add 1 for '\0'
+        char query_str[query_len + 1];
+        memcpy(query_str, client->buf + query_start, query_len);
+        query_str[query_len] = '\0';
 
-        int i = 5;
-        while (client->buf[i] != ' ') {
-            // memcpy(client->reqData->path + i - 5, client->buf[i], 1);
-            client->reqData->path[i - 5] = client->buf[i];
-            i++;
-        }
-        // client->reqData->path + path_len = '\0';
-        client->reqData->path[path_len] = '\0';
+        // Initializes client->reqData->params from the key-value pairs contained in query_str.
+        parse_query(client->reqData, arena, query_str);
 
-        // since for POST method, there is no query parameters, set them to NULL.
+    } else {  // means there are no query parameter.
         for (int j = 0; j < MAX_QUERY_PARAMS; j++) {
             // set all the names and values to NULL.
             client->reqData->params[j].name = NULL;
@@ -224,9 +346,6 @@ int parse_req_start_line(ClientState *client) {
         }
     }
 
-
-    // IMPLEMENT THIS
-
     // This part is just for debugging purposes.
     log_request(client->reqData);
     return 1;
@@ -238,8 +357,9 @@ int parse_req_start_line(ClientState *client) {
  * string <str>.
  * Assumes that the string is the part after the '?' in the HTTP request target,
  * e.g., name1=value1&name2=value2.
+ * The names and values are allocated from <arena>.
  */
-void parse_query(ReqData *req, const char *str) {
+void parse_query(ReqData *req, Arena *arena, const char *str) {
     // Check how many key-value pairs contained in str by checking number of "&".
     int numParam = 1;
     for (int p = 0; p < strlen(str); p++) {
@@ -252,7 +372,6 @@ void parse_query(ReqData *req, const char *str) {
         fprintf(stderr, "Invaild request: the maximum number of query params is 5. Program exits.\n");
         exit(1);
     }
-    // req->params[i] = malloc(sizeof(Fdata));  // allocate enough space for each req->params.
 
     char *token = strtok((char *) str, "&");
 
@@ -272,24 +391,63 @@ void parse_query(ReqData *req, const char *str) {
             exit(1);
         }
 
-        // add 1*sizeof(char) to make room for '\0'.
-        req->params[count].name = malloc((eq + 1) * sizeof(char));
-        req->params[count].value = malloc((strlen(token) - eq) * sizeof(char));
-
-        for (int q = 0; q < eq; q++) {
-            req->params[count].name[q] = token[q];
-        }
-        req->params[count].name[eq] = '\0';
-
-        for (int q = eq + 1; q < strlen(token); q++) {
-            req->params[count].value[q - (eq + 1)] = token[q];
-        }
-        req->params[count].value[strlen(token) - (eq + 1)] = '\0';
+        req->params[count].name = arena_strndup(arena, token, eq);
+        req->params[count].value = arena_strndup(arena, token + eq + 1, strlen(token) - (eq + 1));
 
         // go to the next name-value pairs.
         token = strtok(NULL, "&");
         count++;
     }
+
+    // Mark the end of the params.
+    for (; count < MAX_QUERY_PARAMS; count++) {
+        req->params[count].name = NULL;
+        req->params[count].value = NULL;
+    }
+}
+
+
+const char *get_param(const ReqData *reqData, const char *name) {
+    for (int i = 0; i < MAX_QUERY_PARAMS && reqData->params[i].name != NULL; i++) {
+        if (strcmp(reqData->params[i].name, name) == 0) {
+            return reqData->params[i].value;
+        }
+    }
+    return NULL;
+}
+
+
+int headers_complete(const ClientState *client) {
+    return strstr(client->buf, "\r\n\r\n") != NULL || client->num_bytes >= MAXLINE - 1;
+}
+
+
+int get_header(const ClientState *client, const char *name, char *value, int size) {
+    int name_len = strlen(name);
+    // Skip the start line; every header begins right after a CRLF.
+    const char *line = strstr(client->buf, "\r\n");
+    while (line != NULL && line[2] != '\r' && line[2] != '\0') {
+        line += 2;
+        if (strncasecmp(line, name, name_len) == 0 && line[name_len] == ':') {
+            const char *start = line + name_len + 1;
+            while (*start == ' ' || *start == '\t') {
+                start++;
+            }
+            const char *end = strstr(start, "\r\n");
+            int len = (end != NULL) ? end - start : (int) strlen(start);
+            while (len > 0 && isspace((unsigned char) start[len - 1])) {
+                len--;
+            }
+            if (len >= size) {
+                len = size - 1;
+            }
+            memcpy(value, start, len);
+            value[len] = '\0';
+            return 1;
+        }
+        line = strstr(line, "\r\n");
+    }
+    return 0;
 }
 
 
@@ -297,123 +455,266 @@ void parse_query(ReqData *req, const char *str) {
  * Print information stored in the given request data to stderr.
  */
 void log_request(const ReqData *req) {
-    fprintf(stderr, "Request parsed: [%s] [%s]\n", req->method, req->path);
+    DEBUG_LOG("Request parsed: [%s] [%s]\n", req->method, req->path);
     for (int i = 0; i < MAX_QUERY_PARAMS && req->params[i].name != NULL; i++) {
-        fprintf(stderr, "  %s -> %s\n",
-                req->params[i].name, req->params[i].value);
+        DEBUG_LOG("  %s -> %s\n", req->params[i].name, req->params[i].value);
     }
 }
 
 
 /******************************************************************************
- * Parsing multipart form data (image-upload)
+ * Reading the request body
  *****************************************************************************/
+// Helper function declarations.
+int note_header(ClientState *client, char *line, int *chunked);
 
-char *get_boundary(ClientState *client) {
-    int len_header = strlen(POST_BOUNDARY_HEADER);
 
+int begin_body(ClientState *client) {
+    client->body_length = -1;
+    client->chunk_state = CHUNK_NONE;
+    client->chunk_left = 0;
+    client->boundary = NULL;
+    int chunked = 0;
+
+    // The start line has been parsed already.
+    remove_buffered_line(client);
     while (1) {
         int where = find_network_newline(client->buf, client->num_bytes);
-        if (where > 0) {
-            if (where < len_header || strncmp(POST_BOUNDARY_HEADER, client->buf, len_header) != 0) {
-                remove_buffered_line(client);
-            } else {
-                // We've found the boundary string!
-                // the line contains the boundary string does not end with
-                // '\r\n', instead, it ends with the boundary string.
-                // We are going to add "--" to the beginning to make it easier
-                // to match the boundary line later
-                char *boundary = malloc(where - len_header + 1);
-                strncpy(boundary, "--", where - len_header + 1);
-                strncat(boundary, client->buf + len_header, where - len_header - 1);
-                boundary[where - len_header] = '\0';
-                return boundary;
+        if (where == -1) {
+            if (client->num_bytes == MAXLINE - 1) {
+                fprintf(stderr, "Request header line too long.\n");
+                return -1;
             }
-        } else {
-            // Need to read more bytes
             if (read_from_client(client) <= 0) {
-                // Couldn't read; this is a bad request, so give up.
-                return NULL;
+                return -1;
             }
+            continue;
         }
+        if (where == 2) {  // The blank line that ends the headers.
+            remove_buffered_line(client);
+            break;
+        }
+
+        // Look at the line on its own, then put its CRLF back.
+        client->buf[where - 2] = '\0';
+        if (note_header(client, client->buf, &chunked) == -1) {
+            return -1;
+        }
+        client->buf[where - 2] = '\r';
+        remove_buffered_line(client);
     }
-    return NULL;
+
+    client->body_start = client->read_total - client->num_bytes;
+    if (chunked) {
+        client->chunk_state = CHUNK_SIZE;
+        if (decode_chunks(client, 0) == -1) {
+            fprintf(stderr, "Invalid chunked request body.\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * Take note of the header <line> (null-terminated, without its CRLF) if it
+ * says anything about the body.
+ * Return 0 on success, -1 if the request can't be handled.
+ */
+int note_header(ClientState *client, char *line, int *chunked) {
+    int len_boundary_header = strlen(POST_BOUNDARY_HEADER);
+    if (strncasecmp(line, "Content-Length:", strlen("Content-Length:")) == 0) {
+        client->body_length = strtol(line + strlen("Content-Length:"), NULL, 10);
+    } else if (strncasecmp(line, "Transfer-Encoding:", strlen("Transfer-Encoding:")) == 0) {
+        *chunked = strcasestr(line, "chunked") != NULL;
+    } else if (strncasecmp(line, "Expect:", strlen("Expect:")) == 0 &&
+            strcasestr(line, "100-continue") != NULL) {
+        // The client is waiting to hear whether to send the body at all.
+        const char *response = "HTTP/1.1 100 Continue\r\n\r\n";
+        write(client->sock, response, strlen(response));
+    } else if (strncasecmp(line, POST_BOUNDARY_HEADER, len_boundary_header) == 0) {
+        // We've found the boundary string!
+        // We are going to add "--" to the beginning to make it easier
+        // to match the boundary line later. Only the first one counts, so
+        // repeating the header can't use up the arena.
+        if (client->boundary != NULL) {
+            return 0;
+        }
+        const char *value = line + len_boundary_header;
+        client->boundary = arena_alloc(&client->arena, strlen(value) + 3);
+        if (client->boundary == NULL) {
+            fprintf(stderr, "Boundary too long.\n");
+            return -1;
+        }
+        strcpy(client->boundary, "--");
+        strcat(client->boundary, value);
+    }
+    return 0;
+}
+
+
+int read_body(ClientState *client, char *out, int size) {
+    if (client->num_bytes == 0) {
+        if (client->chunk_state == CHUNK_DATA && client->chunk_left > 0) {
+            // In the middle of a chunk, its data can be read straight in.
+            if (size > client->chunk_left) {
+                size = client->chunk_left;
+            }
+            int numRead = read_socket(client, out, size);
+            if (numRead > 0) {
+                client->chunk_left -= numRead;
+                if (client->chunk_left == 0) {
+                    client->chunk_state = CHUNK_DATA_END;
+                }
+            }
+            return numRead;
+        } else if (client->chunk_state != CHUNK_NONE) {
+            // Framing comes next, so decode it in client->buf.
+            int numRead = read_from_client(client);
+            if (numRead <= 0) {
+                return numRead;
+            }
+        } else {
+            if (client->body_length >= 0) {
+                long left = client->body_length - (client->read_total - client->body_start);
+                if (left <= 0) {
+                    return 0;
+                }
+                if (size > left) {
+                    size = left;
+                }
+            }
+            return read_socket(client, out, size);
+        }
+    }
+
+    // What has been read into client->buf already comes first.
+    int n = (size < client->num_bytes) ? size : client->num_bytes;
+    memcpy(out, client->buf, n);
+    memmove(client->buf, client->buf + n, client->num_bytes - n);
+    client->num_bytes -= n;
+    client->buf[client->num_bytes] = '\0';
+    return n;
+}
+
+
+/******************************************************************************
+ * Parsing multipart form data (image-upload)
+ *****************************************************************************/
+
+char *get_boundary(ClientState *client) {
+    if (begin_body(client) == -1) {
+        // Couldn't read the headers; this is a bad request, so give up.
+        return NULL;
+    }
+    return client->boundary;
 }
 
 
-char *get_bitmap_filename(ClientState *client, const char *boundary) {
+int next_bitmap_part(ClientState *client, const char *boundary, char *filename, int size) {
     int len_boundary = strlen(boundary);
 
-    // Read until finding the boundary string.
+    // Skip to the next boundary line: the end of the previous part's data,
+    // or of a part not being saved.
     while (1) {
+        int closing = client->num_bytes >= len_boundary + 2 &&
+                      strncmp(client->buf, boundary, len_boundary) == 0 &&
+                      strncmp(client->buf + len_boundary, "--", 2) == 0;
+        if (closing) {
+            return 0;
+        }
         int where = find_network_newline(client->buf, client->num_bytes);
         if (where > 0) {
-            if (where < len_boundary + 2 ||
-                    strncmp(boundary, client->buf, len_boundary) != 0) {
-                remove_buffered_line(client);
-            } else {
-                // We've found the line with the boundary!
-                remove_buffered_line(client);
+            int found = where >= len_boundary + 2 && strncmp(boundary, client->buf, len_boundary) == 0;
+            remove_buffered_line(client);
+            if (found) {
                 break;
             }
         } else {
-            // Need to read more bytes
+            if (client->num_bytes == MAXLINE - 1) {
+                // No line starts in here, unless after a trailing '\r'.
+                client->buf[0] = client->buf[client->num_bytes - 1];
+                client->num_bytes = 1;
+            }
             if (read_from_client(client) <= 0) {
                 // Couldn't read; this is a bad request, so give up.
-                return NULL;
+                return -1;
             }
         }
     }
 
-    int where = find_network_newline(client->buf, client->num_bytes);
-
-    client->buf[where - 1] = '\0';  // Used for strrchr to work on just the single line.
-    char *raw_filename = strrchr(client->buf, '=') + 2;
-    int len_filename = client->buf + where - 3 - raw_filename;
-    char *filename = malloc(len_filename + 1);
-    strncpy(filename, raw_filename, len_filename);
-    filename[len_filename] = '\0';
+    // Then the part's headers, up to the empty line. The file name is in
+    // its Content-Disposition.
+    filename[0] = '\0';
+    while (1) {
+        int where = find_network_newline(client->buf, client->num_bytes);
+        if (where == -1) {
+            if (client->num_bytes == MAXLINE - 1 || read_from_client(client) <= 0) {
+                return -1;
+            }
+            continue;
+        }
+        if (where == 2) {
+            remove_buffered_line(client);
+            return 1;
+        }
 
-    // Restore client->buf
-    client->buf[where - 1] = '\n';
-    remove_buffered_line(client);
-    return filename;
+        client->buf[where - 2] = '\0';  // Look at the line on its own.
+        char *name = strstr(client->buf, "filename=\"");
+        if (strncasecmp(client->buf, "Content-Disposition:", strlen("Content-Disposition:")) == 0 &&
+                name != NULL) {
+            name += strlen("filename=\"");
+            int len_filename = strcspn(name, "\"");
+            snprintf(filename, size, "%.*s", len_filename, name);
+        }
+        client->buf[where - 2] = '\r';
+        remove_buffered_line(client);
+    }
 }
 
 /*
- * Read the file data from the socket and write it to the file descriptor
- * file_fd.
- * You know when you have reached the end of the file in one of two ways:
- *    - search for the boundary string in each chunk of data read
- * ( the "\r\n" that comes before the boundary string, and the
- * "--\r\n" that comes after.)
- *    - extract the file size from the bitmap data, and use that to determine
- * how many bytes to read from the socket and write to the file
+ * Read the file data from the socket and queue it to be written to the file
+ * descriptor file_fd.
+ * The size of the file is extracted from the bitmap data and used to
+ * determine how many bytes to copy; the "\r\n" and boundary string must
+ * come right after them.
  */
-int save_file_upload(ClientState *client, const char *boundary, int file_fd) {
-    // Read in the next two lines: Content-Type line, and empty line
-    remove_buffered_line(client);
-    remove_buffered_line(client);
-
-    int total_bytes = 0; // total number of bytes we read.
-    int numRead = read_from_client(client); // read from socket, store it to client->buf.
+int save_file_upload(ClientState *client, const char *boundary, FileWriter *writer, int file_fd) {
+    // Get the size of the bitmap file from its header.
+    while (client->num_bytes < 6) {
+        if (read_from_client(client) <= 0) {
+            return -1;
+        }
+    }
     int file_size;
-    memcpy(&file_size, client->buf + 2, 4);   // get the size of the bitmap file.
-    printf("file_size: %d\n", file_size);
-
-    write(file_fd, client->buf, numRead);
-    total_bytes += numRead;
+    memcpy(&file_size, client->buf + 2, 4);
+    DEBUG_LOG("file_size: %d\n", file_size);
+    if (strncmp(client->buf, "BM", 2) != 0 || file_size < BMP_MIN_HEADER) {
+        return -1;
+    }
 
-    while ((numRead = read_from_client(client)) > 0) {
-        total_bytes += numRead;
-        if (total_bytes >= file_size) {  // we should stop reading.
-            write(file_fd, client->buf, numRead - (total_bytes - file_size));
-            return 0;
+    int left = file_size;
+    while (left > 0) {
+        char *data = writer_buffer(writer);
+        int numRead = read_body(client, data, (left < UPLOAD_BUFFER_SIZE) ? left : UPLOAD_BUFFER_SIZE);
+        if (numRead <= 0) {
+            writer_release(writer, data);
+            return -1;
         }
-
-        write(file_fd, client->buf, numRead);
-
+        // Written while the next buffer is read.
+        writer_write(writer, file_fd, data, numRead);
+        left -= numRead;
     }
 
+    // Then the boundary must follow.
+    int len_boundary = strlen(boundary);
+    while (client->num_bytes < len_boundary + 2) {
+        if (read_from_client(client) <= 0) {
+            return -1;
+        }
+    }
+    if (strncmp(client->buf, "\r\n", 2) != 0 || strncmp(client->buf + 2, boundary, len_boundary) != 0) {
+        return -1;
+    }
     return 0;
 }
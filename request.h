@@ -5,22 +5,51 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <sys/types.h>
 
+#include "timer.h"
+#include "arena.h"
+#include "filewriter.h"
 
 #define MAX_QUERY_PARAMS 5
 #define MAXLINE 1024
 
+// Per-request memory for the parsed start line and, for uploads, the
+// boundary and filename (each bounded by the MAXLINE buffer they come from).
+#define REQUEST_ARENA_SIZE (4 * MAXLINE)
+
 // String constants for parsing HTTP requests.
 #define GET "GET"
 #define POST "POST"
+#define PUT "PUT"
 #define MAIN_HTML "/main.html"
 #define IMAGE_FILTER "/image-filter"
 #define IMAGE_UPLOAD "/image-upload"
+#define DEBUG_METRICS "/debug/metrics"
 
 #define IMAGE_DIR "images/"
 #define FILTER_DIR "filters/"
 
 #define POST_BOUNDARY_HEADER "Content-Type: multipart/form-data; boundary="
+#define UPLOAD_BUFFER_SIZE (64 * 1024)  // Bodies are copied this much at a time.
+
+// Where the decoder of a chunked request body is (see begin_body).
+#define CHUNK_NONE 0         // The body isn't chunked.
+#define CHUNK_SIZE 1         // In the hex size at the start of a chunk.
+#define CHUNK_EXTENSION 2    // In the rest of the size line.
+#define CHUNK_DATA 3
+#define CHUNK_DATA_END 4     // In the CRLF after the data.
+#define CHUNK_TRAILER 5      // At the start of a trailer line (or the last CRLF).
+#define CHUNK_TRAILER_LINE 6
+#define CHUNK_DONE 7
+
+// Deadlines for slow or stalled clients, so they can't hold on to one of the
+// few client slots forever.
+#define IDLE_TIMEOUT_MS 10000    // From accepting a connection to its first byte.
+#define HEADER_TIMEOUT_MS 5000   // From the first byte to a complete start line.
+#define BODY_GRACE_MS 10000      // Time before the minimum body rate applies.
+#define BODY_MIN_RATE 1024       // Bytes per second a request must average.
+#define SEND_IDLE_TIMEOUT_MS 10000  // Time a response sent by the acceptor may stall.
 
 
 // A struct representing a key-value pair as a query params
@@ -37,13 +66,13 @@ typedef struct formdata {
  * value should have its fields set to NULL.
  */
 typedef struct {
-    char *method;       // Either "GET" or "POST"
+    const char *method; // GET, POST or PUT (the constants above), or as sent
     char *path;         // Request path, e.g. "main.html" or "image-filter"
     Fdata params[MAX_QUERY_PARAMS];  // An array of query params.
 } ReqData;
 
 
-typedef struct {
+typedef struct client_state {
     int sock;            // The socket fd used to communicate with the client.
     char buf[MAXLINE];   // A buffer of the data read from the client request,
                          // PLUS space for a null-terminator
@@ -52,18 +81,57 @@ typedef struct {
                          // (must be between 0 and MAXLINE - 1).
     ReqData *reqData;    // The data parsed from the first line of the HTTP
                          // request from the client.
+    Timer timer;         // The current deadline of this connection.
+    unsigned long read_start;  // When the first byte was read (monotonic ms).
+    long read_total;     // Total number of bytes read from the client.
+    unsigned long accepted_us; // When the connection was accepted (monotonic
+                               // microseconds), for tracing.
+    Arena arena;         // Everything allocated for the current request.
+    struct client_state *next_free;  // Next free slot, while this one is free.
+
+    // A response the acceptor is sending itself, a bit at a time as the
+    // socket becomes writable: out_buf (the header) and out_body first,
+    // then [out_offset, out_end) of out_fd. Nothing is being sent if
+    // out_buf is NULL.
+    const char *out_buf;
+    long out_len;
+    const char *out_body;  // NULL if the body (if any) comes from out_fd.
+    long out_body_len;
+    long out_sent;       // Bytes of out_buf and out_body sent so far.
+    int out_fd;          // -1 if there is no file to send.
+    off_t out_offset;
+    off_t out_end;
+    int *out_pin;        // A reference count to drop once done, or NULL.
+    int out_status;      // The status code of the response, for the log.
+    unsigned long out_start_us;  // When the response was started.
+
+    // The request body, as framed by the headers begin_body reads. Only
+    // the request process reads bodies.
+    long body_length;    // From Content-Length, or -1 if not given.
+    long body_start;     // The value of read_total where the body starts.
+    int chunk_state;     // CHUNK_NONE unless the body is chunked.
+    long chunk_left;     // Bytes left in the current chunk (or its size so far).
+    char *boundary;      // From a multipart Content-Type, with "--" before it.
+    char arena_buf[REQUEST_ARENA_SIZE];
 } ClientState;
 
 
 /*
- * Returns an array of ClientStates of the given size.
+ * Returns a slab of ClientStates of the given size, all of them free.
+ * Slots are handed out by alloc_client and returned by remove_client, so
+ * the slab is allocated once and never grows or moves.
  */
 ClientState *init_clients(int n);
 
 /*
- * Frees memory allocated for the given client fields.
- * Doesn't actually free the client itself since it is allocated as part of
- * an array of ClientState, but sets its sock value to -1 to act as a flag.
+ * Take a free slot from the slab in O(1). Return NULL if all are in use.
+ */
+ClientState *alloc_client(void);
+
+/*
+ * Releases everything allocated for the client's request (by resetting its
+ * arena), closes its socket, and returns the slot to the free list, with its
+ * sock value set to -1 to act as a flag.
  */
 void remove_client(ClientState *cs);
 
@@ -74,7 +142,8 @@ void remove_client(ClientState *cs);
 
 /*
  * Read some data into the client buffer. Update client->num_bytes accordingly.
- * Return the number of bytes read in, or -1 if the read failed.
+ * Return the number of bytes read in, or -1 if the read failed or the client
+ * is sending data slower than BODY_MIN_RATE.
  */
 int read_from_client(ClientState *client);
 
@@ -85,14 +154,59 @@ int read_from_client(ClientState *client);
 
 /*
  * Parse the start line of an HTTP request, storing the data in client->reqData.
+ * The ReqData and its strings are allocated from the client's arena.
  */
 int parse_req_start_line(ClientState *client);
 
 
+/*
+ * Return the value of the query param with the given name, or NULL if the
+ * request doesn't have it.
+ */
+const char *get_param(const ReqData *reqData, const char *name);
+
+/*
+ * Return 1 if the request headers have been read in full (up to the blank
+ * line), or if no more of them fit in the buffer.
+ */
+int headers_complete(const ClientState *client);
+
+/*
+ * Copy the value of the request header with the given name (matched without
+ * regard to case) into <value>, of capacity <size>. Only headers already in
+ * client->buf are searched.
+ * Return 1 if the header was found, 0 otherwise.
+ */
+int get_header(const ClientState *client, const char *name, char *value, int size);
+
+
+/*
+ * Read the request headers, which must start at client->buf (after the
+ * start line), up to the blank line that ends them, taking note of how the
+ * body is framed (Content-Length or Transfer-Encoding: chunked) and of the
+ * multipart boundary. Headers are consumed a line at a time, so any number
+ * of them fit. If the client sent Expect: 100-continue, tell it to go on.
+ *
+ * Afterwards client->buf holds the start of the body; reading more of it
+ * with read_from_client or read_body decodes chunked bodies transparently
+ * (a chunked body then ends like a connection being closed).
+ * Return 0 on success, -1 if the headers couldn't be read.
+ */
+int begin_body(ClientState *client);
+
+/*
+ * Copy up to <size> bytes of the request body into <out>: what is left in
+ * client->buf first, then read straight from the socket. Never reads past
+ * the end of a body with a Content-Length.
+ * Return the number of bytes copied, 0 at the end of the body, or -1 if
+ * the read failed or the client is too slow.
+ */
+int read_body(ClientState *client, char *out, int size);
+
 /*
  * Return the boundary string for this request.
- * This should be returned in a separate dynamically-allocated,
- * null-terminated string (note that the boundary in the raw request data is
+ * This is returned as a separate null-terminated string allocated from the
+ * client's arena (note that the boundary in the raw request data is
  * certainly *not* null-terminated).
  *
  * Return NULL if no boundary string is found.
@@ -101,28 +215,28 @@ char *get_boundary(ClientState *client);
 
 
 /*
- * Return the filename of the bitmap image for this request, using the
- * given boundary string to detect sections.
- * This should be returned in a separate dynamically-allocated,
- * null-terminated string (note that the filename in the raw request data is
- * certainly *not* null-terminated).
+ * Move on to the next part of the multipart body, using the given boundary
+ * string to detect parts, and copy the filename of the file it holds (""
+ * for a part that isn't a file) into <filename>, of <size> bytes.
  *
- * Return NULL if no filename string is found.
+ * Return 1 if there is a part, 0 after the last one, and -1 if the body
+ * ends early or is malformed (this indicates a bad request).
  */
-char *get_bitmap_filename(ClientState *client, const char *boundary);
+int next_bitmap_part(ClientState *client, const char *boundary, char *filename, int size);
 
 
 /*
- * Finally, read the bitmap image data from the request and write it
- * to the given fd (representing a file).
+ * Then read the bitmap image data of the part and queue it on <writer> to
+ * be written to the given fd (representing a file).
  *
- * Use the boundary string to determine when the file data stops,
- * as described on the assignment handout.
+ * The size of the file comes from its own BMP header; the boundary string
+ * must follow it.
  *
- * Return 0 if boundary string was found at the end of the request,
- * and -1 otherwise (this indicates a bad request).
+ * Return 0 if boundary string was found at the end of the file,
+ * and -1 otherwise (the next call to next_bitmap_part skips to the
+ * following part, if the body is still intact).
  */
-int save_file_upload(ClientState *client, const char *boundary, int file_fd);
+int save_file_upload(ClientState *client, const char *boundary, FileWriter *writer, int file_fd);
 
 
 #endif /* REQUEST_H_*/
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE  // memfd_create
 #define MAXLINE 1024
 #define IMAGE_DIR "images/"
 
@@ -5,13 +6,79 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <errno.h>
 #include <dirent.h>  // Used to inspect directory contents.
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 #include "response.h"
 #include "request.h"
+#include "cache.h"
+#include "precompute.h"
+#include "uring.h"
+#include "children.h"
+#include "bitmap.h"
+#include "convolve.h"
+#include "blur.h"
+#include "rank.h"
+#include "trace.h"
+#include "debug.h"
+#include "filterpool.h"
+#include "stats.h"
+#include "scheduler.h"
+#include "remote.h"
+#include "tune.h"
+#include "profile.h"
+#include "json.h"
+
+#define IMAGE_RESPONSE_HEADER \
+    "HTTP/1.1 200 OK\r\n" \
+    "Content-Type: image/bmp\r\n" \
+    "Content-Disposition: attachment; filename=\"output.bmp\"\r\n\r\n"
+
+#define JSON_RESPONSE_HEADER \
+    "HTTP/1.1 200 OK\r\n" \
+    "Content-Type: application/json\r\n" \
+    "Content-Length: %ld\r\n\r\n"
+
+// Upload file names, which are saved under IMAGE_DIR.
+#define MAX_UPLOAD_NAME (MAX_PATH - sizeof(IMAGE_DIR) + 1)
+
+// The weights of a convolution kernel are kept in CACHE_DIR/<name>.kernel,
+// beside its results, so that a kernel whose name collides with it can tell.
+#define KERNEL_SUFFIX ".kernel"
+#define KERNEL_TEXT_SIZE ((MAX_KERNEL_SIZE * MAX_KERNEL_SIZE + 2) * 12)
+
+// How each file of an upload went.
+enum {UPLOAD_SAVED, UPLOAD_EXISTS, UPLOAD_BAD_NAME, UPLOAD_BAD_DATA, UPLOAD_WRITE_FAILED};
+static const char *upload_statuses[] = {
+    "saved", "already exists", "invalid file name", "not a complete bitmap", "couldn't be written"
+};
+
+typedef struct {
+    char name[MAX_UPLOAD_NAME];
+    int status;
+    int written;              // 0 once the writer has saved it in full.
+} UploadedFile;
+
+int response_status = 0;
 
 // Functions for internal use only.
 void write_image_list(int fd);
 void write_image_response_header(int fd);
+void image_file_response(int fd, int file_fd);
+int pooled_filter_response(int fd, const char *filter, int image_fd);
+int remote_filter_response(int fd, const char *filter, const char *image, int image_fd);
+void convolve_response(int fd, const ReqData *reqData);
+int kernel_cache_claim(const Kernel *kernel, const char *name);
+int kernel_text(const Kernel *kernel, char *text, int size);
+int read_kernel_file(const char *path, char *text, int size);
+void gaussian_sigma_response(int fd, const ReqData *reqData, const char *sigma_param);
+void rank_response(int fd, const ReqData *reqData);
+void json_file_response(int fd, const char *path);
+void upload_status_response(int fd, UploadedFile *const *files, int num_files, int complete);
 
 
 /*
@@ -20,6 +87,7 @@ void write_image_response_header(int fd);
  * the filenames located in IMAGE_DIR.
  */
 void main_html_response(int fd) {
+    response_status = 200;
     char *header =
         "HTTP/1.1 200 OK\r\n"
         "Content-type: text/html\r\n\r\n";
@@ -82,6 +150,7 @@ void write_image_list(int fd) {
  *    the specified image filter and write the output directly to the socket.
  */
 void image_filter_response(int fd, const ReqData *reqData) {
+    unsigned long validate_start = trace_now();
 
     // First valid the input.
     // reqData->method("GET"), reqData->path("/image-filter") has been checked.
@@ -110,10 +179,28 @@ void image_filter_response(int fd, const ReqData *reqData) {
         exit(1);
     }
 
+    // User-supplied kernels run in this process rather than as an executable.
+    if (strcmp(reqData->params[1].value, CONVOLVE_FILTER) == 0) {
+        trace_span("validate", validate_start, trace_now());
+        convolve_response(fd, reqData);
+        return;
+    }
+    if (strcmp(reqData->params[1].value, MEDIAN_FILTER) == 0 ||
+            strcmp(reqData->params[1].value, PERCENTILE_FILTER) == 0) {
+        trace_span("validate", validate_start, trace_now());
+        rank_response(fd, reqData);
+        return;
+    }
+    const char *sigma = get_param(reqData, "sigma");
+    if (sigma != NULL && strcmp(reqData->params[1].value, "gaussian_blur") == 0) {
+        trace_span("validate", validate_start, trace_now());
+        gaussian_sigma_response(fd, reqData, sigma);
+        return;
+    }
+
     // Check if the filter value refer to an executable file under a4/filters/
-    char *filepath = malloc(strlen("filters/") + strlen(reqData->params[1].value) + 1);
-    strcpy(filepath, "filters/");
-    strcat(filepath, reqData->params[1].value);
+    char filepath[MAX_PATH];
+    snprintf(filepath, sizeof(filepath), "%s%s", FILTER_DIR, reqData->params[1].value);
 
     int f1 = access(filepath, F_OK | X_OK);
     if (f1 != 0) {
@@ -121,10 +208,13 @@ void image_filter_response(int fd, const ReqData *reqData) {
         exit(1);
     }
 
+    // Keep track of which filters are popular, for precompute workers. Only
+    // executables count: the in-process filters above have nothing to run.
+    record_filter_request(reqData->params[1].value);
+
     // Check if the image value must refer to a readable file under a4/images/.
-    char *imagepath = malloc(strlen("images/") + strlen(reqData->params[0].value) + 1);
-    strcpy(imagepath, "images/");
-    strcat(imagepath, reqData->params[0].value);
+    char imagepath[MAX_PATH];
+    snprintf(imagepath, sizeof(imagepath), "%s%s", IMAGE_DIR, reqData->params[0].value);
 
     int f2 = access(imagepath, F_OK | R_OK);
     if (f2 != 0) {
@@ -132,44 +222,368 @@ void image_filter_response(int fd, const ReqData *reqData) {
         exit(1);
     }
 
-    FILE *file = fopen(imagepath, "r");
+    trace_span("validate", validate_start, trace_now());
+
+    // Serve a previously computed result (e.g. from a precompute worker)
+    // instead of running the filter again.
+    char cachepath[MAX_PATH];
+    if (cache_lookup(reqData->params[1].value, reqData->params[0].value,
+                     cachepath, sizeof(cachepath))) {
+        cached_image_response(fd, cachepath);
+        return;
+    }
+
+    int image_fd = open(imagepath, O_RDONLY);
+
+    // Filter workers on other hosts (-F) take the job off this one.
+    if (remote_filter_response(fd, reqData->params[1].value, reqData->params[0].value, image_fd)) {
+        return;
+    }
+
+    // Wait for the scheduler, which lets smaller jobs go first.
+    schedule_filter(reqData->params[1].value, imagepath, 1);
+
+    // A long-lived worker for this filter saves the exec below.
+    if (pooled_filter_response(fd, reqData->params[1].value, image_fd)) {
+        return;
+    }
 
     // write an appropriate HTTP header for a bitmap file.
     write_image_response_header(fd);
 
-    // Reset stdin so when we read from stdin, it comes from the image file.
-    // i.e. redirects the data from image file to stdin of the child process.
-    if (dup2(fileno(file), STDIN_FILENO) == -1) {
-        perror("dup2");
+    // The filter sends the rest. Filters keep the size of the image.
+    struct stat st;
+    fstat(image_fd, &st);
+    report_response(200, strlen(IMAGE_RESPONSE_HEADER) + st.st_size);
+
+    // Run the filter with stdin reading the image and stdout writing
+    // directly to the socket, and wait for it, so that its slot goes to the
+    // next job (and its cost is measured) as soon as it's done.
+    trace_instant("exec", trace_now());
+    pid_t pid = spawn_filter(reqData->params[1].value, reqData->params[0].value, fd);
+    if (pid == -1) {
         exit(1);
     }
+    while (waitpid(pid, NULL, 0) == -1 && errno == EINTR) {
+    }
+    finish_job();
+}
 
-    // write the output directly to the socket.
-    if (dup2(fd, STDOUT_FILENO) == -1) {
-        perror("dup2");
-        exit(1);
+
+/*
+ * Run <filter> on the image open at <image_fd> in a filter worker, and send
+ * the result (or a 500 if the filter failed). Unlike an exec'd filter
+ * writing straight to the socket, a failure is noticed before the header
+ * goes out. Return 0 (having sent nothing) if no worker took the job.
+ */
+int pooled_filter_response(int fd, const char *filter, int image_fd) {
+    int out_fd = memfd_create("filter-output", MFD_CLOEXEC);
+    if (out_fd == -1) {
+        return 0;
     }
+    unsigned long start = trace_now();
+    int status = run_filter_job(filter, image_fd, out_fd);
+    if (status == -1) {
+        close(out_fd);
+        return 0;
+    }
+    trace_span("filter_worker", start, trace_now());
+    finish_job();
 
-    // use execl to run the specified image filter.
-    if (execl(filepath, filepath, NULL) == -1) {
-        perror("execl");
-        exit(1);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        internal_server_error_response(fd, "The filter failed.");
+    } else {
+        image_file_response(fd, out_fd);
     }
+    close(out_fd);
+    return 1;
+}
 
-    // close the image file.
-    if (fclose(file) == -1) {
-        perror("fclose");
-        exit(1);
+
+/*
+ * Have a remote filter worker run <filter> on <image>, open at <image_fd>,
+ * and send the result (or a 500 if the filter failed). Return 0 (having
+ * sent nothing) if no worker could take the job.
+ */
+int remote_filter_response(int fd, const char *filter, const char *image, int image_fd) {
+    int out_fd = memfd_create("remote-output", MFD_CLOEXEC);
+    if (out_fd == -1) {
+        return 0;
+    }
+    unsigned long start = trace_now();
+    int status = run_remote_job(filter, image, image_fd, out_fd);
+    if (status == -1) {
+        close(out_fd);
+        return 0;
+    }
+    trace_span("remote_filter", start, trace_now());
+
+    if (status == REMOTE_TIMED_OUT) {
+        internal_server_error_response(fd, "The filter worker took too long.");
+    } else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        internal_server_error_response(fd, "The filter failed.");
+    } else {
+        image_file_response(fd, out_fd);
+    }
+    close(out_fd);
+    return 1;
+}
+
+
+/*
+ * Respond to an image-filter request for filter=convolve, whose kernel is
+ * given by the 'kernel' and (optional) 'norm' query params.
+ * The result is cached under a name derived from the kernel, unless another
+ * kernel already has that name.
+ */
+void convolve_response(int fd, const ReqData *reqData) {
+    Kernel kernel;
+    const char *weights = get_param(reqData, "kernel");
+    if (weights == NULL || parse_kernel(weights, get_param(reqData, "norm"), &kernel) == -1) {
+        bad_request_response(fd, "'kernel' must be 9 to 225 comma-separated integer weights "
+                                 "forming an odd-sized square, and 'norm' a nonzero integer.");
+        return;
+    }
+
+    const char *image = reqData->params[0].value;
+    char name[MAX_PATH];
+    char path[MAX_PATH];
+    kernel_cache_name(&kernel, name, sizeof(name));
+    int cacheable = kernel_cache_claim(&kernel, name);
+    if (cacheable && cache_lookup(name, image, path, sizeof(path))) {
+        cached_image_response(fd, path);
+        return;
+    }
+
+    snprintf(path, sizeof(path), "%s%s", IMAGE_DIR, image);
+    // Costs are relative to a 3x3 kernel, per weight or per pass.
+    schedule_filter(CONVOLVE_FILTER, path, kernel.separable ? 2.0 * kernel.size / 6 :
+                                                              kernel.size * kernel.size / 9.0);
+    Bitmap *bmp = read_bitmap(path);
+    if (bmp == NULL) {
+        finish_job();
+        internal_server_error_response(fd, "the image value doesn't refer to a readable 24-bit bitmap under a4/images/.");
+        return;
+    }
+    Pixel *out = malloc(sizeof(Pixel) * bmp->width * bmp->height);
+    unsigned long filter_start = trace_now();
+    convolve_image(&kernel, bmp, out);
+    trace_span("filter", filter_start, trace_now());
+    finish_job();
+    if (cacheable) {
+        computed_image_response(fd, name, image, bmp, out);
+    } else {
+        // Another kernel's results are cached under this name.
+        write_image_response_header(fd);
+        write_bitmap(fd, bmp, out);
+    }
+    free(out);
+    free_bitmap(bmp);
+}
+
+
+/*
+ * Return 1 if the results of <kernel> may be cached under <name>, from
+ * kernel_cache_name: the name was free or is already <kernel>'s. Return 0 if
+ * another kernel has the same name, or the cache can't be written.
+ */
+int kernel_cache_claim(const Kernel *kernel, const char *name) {
+    char text[KERNEL_TEXT_SIZE];
+    char found[KERNEL_TEXT_SIZE];
+    char path[MAX_PATH];
+    int length = kernel_text(kernel, text, sizeof(text));
+    snprintf(path, sizeof(path), "%s%s%s", CACHE_DIR, name, KERNEL_SUFFIX);
+
+    if (read_kernel_file(path, found, sizeof(found)) == -1) {
+        // The first kernel with this name records itself. link fails if
+        // another one got there first, and then that one is compared.
+        char tmp_path[MAX_PATH];
+        int fd = cache_create(name, CONVOLVE_FILTER, tmp_path, sizeof(tmp_path));
+        if (fd == -1) {
+            return 0;
+        }
+        int written = write(fd, text, length) == length;
+        close(fd);
+        if (written) {
+            link(tmp_path, path);
+        }
+        unlink(tmp_path);
+        if (read_kernel_file(path, found, sizeof(found)) == -1) {
+            return 0;
+        }
+    }
+    return strcmp(found, text) == 0;
+}
+
+
+/*
+ * Write every value that affects the output of <kernel> into <text>.
+ * Return its length.
+ */
+int kernel_text(const Kernel *kernel, char *text, int size) {
+    int length = snprintf(text, size, "%d %d\n", kernel->size, kernel->norm);
+    for (int i = 0; i < kernel->size * kernel->size; i++) {
+        length += snprintf(text + length, size - length, "%d%c", kernel->weights[i],
+                           (i + 1) % kernel->size == 0 ? '\n' : ',');
     }
+    return length;
+}
+
 
-    free(filepath);
-    free(imagepath);
-    // IMPLEMENT THIS
+/*
+ * Read the kernel file at <path> into <text> as a string.
+ * Return 0 on success, -1 if it doesn't exist or can't be read.
+ */
+int read_kernel_file(const char *path, char *text, int size) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    int length = 0;
+    ssize_t n;
+    while (length < size - 1 && (n = read(fd, text + length, size - 1 - length)) > 0) {
+        length += n;
+    }
+    close(fd);
+    text[length] = '\0';
+    return 0;
 }
 
 
 /*
- * Respond to an image-upload request.
+ * Respond to an image-filter request for filter=gaussian_blur with a
+ * 'sigma' query param, blurring in this process instead of running the
+ * fixed 3x3 filter. The result is cached under a name derived from sigma.
+ */
+void gaussian_sigma_response(int fd, const ReqData *reqData, const char *sigma_param) {
+    char *end;
+    double sigma = strtod(sigma_param, &end);
+    if (end == sigma_param || *end != '\0' || !(sigma >= MIN_SIGMA && sigma <= MAX_SIGMA)) {
+        bad_request_response(fd, "'sigma' must be a number between 0.5 and 100.");
+        return;
+    }
+
+    const char *image = reqData->params[0].value;
+    char name[MAX_PATH];
+    char path[MAX_PATH];
+    snprintf(name, sizeof(name), "%s-sigma-%g", reqData->params[1].value, sigma);
+    if (cache_lookup(name, image, path, sizeof(path))) {
+        cached_image_response(fd, path);
+        return;
+    }
+
+    snprintf(path, sizeof(path), "%s%s", IMAGE_DIR, image);
+    // The cost per pixel is the same for any sigma.
+    schedule_filter("gaussian_blur-sigma", path, 1);
+    Bitmap *bmp = read_bitmap(path);
+    if (bmp == NULL) {
+        finish_job();
+        internal_server_error_response(fd, "the image value doesn't refer to a readable 24-bit bitmap under a4/images/.");
+        return;
+    }
+    Pixel *out = malloc(sizeof(Pixel) * bmp->width * bmp->height);
+    unsigned long filter_start = trace_now();
+    gaussian_blur_sigma(bmp, out, sigma);
+    trace_span("filter", filter_start, trace_now());
+    finish_job();
+    computed_image_response(fd, name, image, bmp, out);
+    free(out);
+    free_bitmap(bmp);
+}
+
+
+/*
+ * Respond to an image-filter request for filter=median or filter=percentile,
+ * with the optional 'radius' query param and, for percentiles, 'p'. The
+ * result is cached under a name derived from both.
+ */
+void rank_response(int fd, const ReqData *reqData) {
+    RankFilter rank;
+    if (parse_rank_filter(reqData->params[1].value, get_param(reqData, "radius"),
+                          get_param(reqData, "p"), &rank) == -1) {
+        bad_request_response(fd, "'radius' must be an integer between 1 and 100, and 'p' "
+                                 "(for percentile) a number between 0 and 100.");
+        return;
+    }
+
+    const char *image = reqData->params[0].value;
+    char name[MAX_PATH];
+    char path[MAX_PATH];
+    rank_cache_name(&rank, name, sizeof(name));
+    if (cache_lookup(name, image, path, sizeof(path))) {
+        cached_image_response(fd, path);
+        return;
+    }
+
+    snprintf(path, sizeof(path), "%s%s", IMAGE_DIR, image);
+    // The cost per pixel is the same for any radius.
+    schedule_filter(reqData->params[1].value, path, 1);
+    Bitmap *bmp = read_bitmap(path);
+    if (bmp == NULL) {
+        finish_job();
+        internal_server_error_response(fd, "the image value doesn't refer to a readable 24-bit bitmap under a4/images/.");
+        return;
+    }
+    Pixel *out = malloc(sizeof(Pixel) * bmp->width * bmp->height);
+    unsigned long filter_start = trace_now();
+    rank_image(&rank, bmp, out);
+    trace_span("filter", filter_start, trace_now());
+    finish_job();
+    computed_image_response(fd, name, image, bmp, out);
+    free(out);
+    free_bitmap(bmp);
+}
+
+
+/*
+ * Wait until the scheduler starts the job of running <filter> on the image
+ * at <image_path>. Its cost is estimated from the size in the image's
+ * header, times <cost_factor> for filters whose cost per pixel varies.
+ */
+void schedule_filter(const char *filter, const char *image_path, double cost_factor) {
+    BitmapFile file;
+    double pixels = 0;
+    if (open_bitmap_file(image_path, &file) == 0) {
+        pixels = (double) file.width * file.height;
+        close_bitmap_file(&file);
+    }
+    schedule_job(filter, pixels * cost_factor);
+}
+
+
+/*
+ * Respond with the result <out> of running the filter called <name> (as in
+ * the cache) on <image>, decoded as <bmp>. The result is written through
+ * the cache, or straight to the socket if it can't be cached.
+ */
+void computed_image_response(int fd, const char *name, const char *image,
+                             const Bitmap *bmp, const Pixel *out) {
+    char tmp_path[MAX_PATH];
+    char path[MAX_PATH];
+    int cache_fd = cache_create(name, image, tmp_path, sizeof(tmp_path));
+    if (cache_fd == -1) {
+        write_image_response_header(fd);
+        write_bitmap(fd, bmp, out);
+        return;
+    }
+
+    int result = write_bitmap(cache_fd, bmp, out);
+    close(cache_fd);
+    if (result == 0 && cache_commit(tmp_path, name, image) == 0) {
+        cache_path(path, sizeof(path), name, image);
+        cached_image_response(fd, path);
+    } else {
+        unlink(tmp_path);
+        internal_server_error_response(fd, "Couldn't write the result.");
+    }
+}
+
+
+/*
+ * Respond to an image-upload request. Every file in the body is saved to
+ * IMAGE_DIR, each written by a background thread while the next one is
+ * read. A single file gets a redirect back to main.html (or an error), like
+ * a plain form post; several get one JSON list of how each went.
  */
 void image_upload_response(ClientState *client) {
     // First, extract the boundary string for the request. (i.e. "---7573")
@@ -178,44 +592,274 @@ void image_upload_response(ClientState *client) {
         bad_request_response(client->sock, "Couldn't find boundary string in request.");
         exit(1);
     }
-    fprintf(stderr, "Boundary string: %s\n", boundary);
+    DEBUG_LOG("Boundary string: %s\n", boundary);
+
+    FileWriter *writer = start_file_writer();
+    // Each file is allocated on its own: the writer thread stores its result
+    // through a pointer to it, so it mustn't move when the list grows.
+    UploadedFile **files = NULL;
+    int num_files = 0;
+    int max_files = 0;
+    char filename[MAX_UPLOAD_NAME];
+    int more;
+    // Use the boundary string to find each part and the name of the bitmap
+    // file it holds.
+    while ((more = next_bitmap_part(client, boundary, filename, sizeof(filename))) == 1) {
+        if (filename[0] == '\0') {
+            continue;         // Not a file, or no file was chosen.
+        }
+        if (num_files == max_files) {
+            int new_max = max_files ? 2 * max_files : 16;
+            UploadedFile **new_files = realloc(files, sizeof(UploadedFile *) * new_max);
+            if (new_files == NULL) {
+                perror("realloc");
+                more = -1;      // Report the files so far, and the body as unread.
+                break;
+            }
+            files = new_files;
+            max_files = new_max;
+        }
+        UploadedFile *file = malloc(sizeof(UploadedFile));
+        if (file == NULL) {
+            perror("malloc");
+            more = -1;
+            break;
+        }
+        files[num_files++] = file;
+        snprintf(file->name, sizeof(file->name), "%s", filename);
+        file->written = -1;
+
+        // If the file already exists, or its name isn't a plain file name,
+        // its data is skipped. Or create a new image file in the directory: "images/"
+        char path[MAX_PATH];
+        snprintf(path, sizeof(path), "%s%s", IMAGE_DIR, filename);
+        DEBUG_LOG("Bitmap path: %s\n", path);
+        if (strchr(filename, '/') != NULL || strcmp(filename, ".") == 0 ||
+                strcmp(filename, "..") == 0 || strlen(filename) == sizeof(filename) - 1) {
+            file->status = UPLOAD_BAD_NAME;
+            continue;
+        }
+        int file_fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);  // Create file with name: path for writing.
+        if (file_fd == -1) {
+            file->status = UPLOAD_EXISTS;
+            continue;
+        }
+
+        // Read the bitmap image data from the request and hand it to the
+        // writer for the given fd (representing the file).
+        file->status = UPLOAD_SAVED;
+        if (save_file_upload(client, boundary, writer, file_fd) == -1) {
+            // Don't leave a partial image behind for the filters to trip over.
+            unlink(path);
+            file->status = UPLOAD_BAD_DATA;
+        }
+        writer_close(writer, file_fd, &file->written);
+    }
+    stop_file_writer(writer);
+
+    const char **saved = malloc(sizeof(char *) * (num_files + 1));
+    int num_saved = 0;
+    for (int i = 0; i < num_files; i++) {
+        if (files[i]->status == UPLOAD_SAVED && files[i]->written == -1) {
+            char path[MAX_PATH];
+            snprintf(path, sizeof(path), "%s%s", IMAGE_DIR, files[i]->name);
+            unlink(path);
+            files[i]->status = UPLOAD_WRITE_FAILED;
+        } else if (files[i]->status == UPLOAD_SAVED) {
+            saved[num_saved++] = files[i]->name;
+        }
+    }
 
-    // Use the boundary string to extract the name of the uploaded bitmap file.
-    char *filename = get_bitmap_filename(client, boundary);
-    if (filename == NULL) {
+    if (num_files == 0) {
         bad_request_response(client->sock, "Couldn't find bitmap filename in request.");
-        close(client->sock);
-        exit(1);
+    } else if (num_files > 1) {
+        upload_status_response(client->sock, files, num_files, more == 0);
+    } else if (files[0]->status == UPLOAD_SAVED) {
+        see_other_response(client->sock, MAIN_HTML);
+    } else if (files[0]->status == UPLOAD_EXISTS) {
+        bad_request_response(client->sock, "File already exists.");
+    } else {
+        bad_request_response(client->sock, "Bad Request.");
     }
 
-    // If the file already exists, send a Bad Request error to the user.
-    // Or create a new image file in the directory: "images/"
-    char *path = malloc(strlen(IMAGE_DIR) + strlen(filename) + 1);
-    strcpy(path, IMAGE_DIR);
-    strcat(path, filename);
+    // Warm the result cache so the first "Run filter" on these images is fast.
+    if (num_saved > 0) {
+        precompute_filters(saved, num_saved);
+    }
+    free(saved);
+    for (int i = 0; i < num_files; i++) {
+        free(files[i]);
+    }
+    free(files);
+}
 
-    fprintf(stderr, "Bitmap path: %s\n", path);
 
-    if (access(path, F_OK) >= 0) {
-        bad_request_response(client->sock, "File already exists.");
-        exit(1);
+/*
+ * Write how each file of a multi-file upload went, as JSON:
+ *     {"complete": true, "files": [{"name": "a.bmp", "status": "saved"}, ...]}
+ * If the body wasn't <complete>, files after those listed weren't read, and
+ * the status is 400.
+ */
+void upload_status_response(int fd, UploadedFile *const *files, int num_files, int complete) {
+    response_status = complete ? 200 : 400;
+    // Room for every name escaped in full, so the response goes out in one write.
+    int size = 128 + num_files * (6 * MAX_UPLOAD_NAME + 64);
+    char *response = malloc(size);
+    int len = snprintf(response, size, "HTTP/1.1 %s\r\n"
+                                       "Content-Type: application/json\r\n\r\n"
+                                       "{\"complete\": %s, \"files\": [",
+                       complete ? "200 OK" : "400 Bad Request", complete ? "true" : "false");
+    for (int i = 0; i < num_files; i++) {
+        len += snprintf(response + len, size - len, "%s{\"name\": ", (i > 0) ? ", " : "");
+        len += json_string(response + len, size - len, files[i]->name);
+        len += snprintf(response + len, size - len, ", \"status\": \"%s\"}",
+                        upload_statuses[files[i]->status]);
+    }
+    len += snprintf(response + len, size - len, "]}\n");
+    if (write(fd, response, len) != len) {
+        perror("write");
     }
+    free(response);
+}
 
-    // Up to here, we have the name of the bitmap file uploaded stored in path.
-    // The request has been modified to remove the first few lines.
-    FILE *file = fopen(path, "wb");  // Create file with name: path for writing.
 
-    // Read the bitmap image data from the request and write it
-    // to the given fd (representing the file).
-    int flag = save_file_upload(client, boundary, fileno(file));
-    if (flag == -1) {
-        bad_request_response(client->sock, "Bad Request.");
+/*
+ * Respond to an image-stats request with the statistics of the image, from
+ * the cache if they have been computed since the image last changed.
+ */
+void image_stats_response(int fd, const ReqData *reqData) {
+    const char *image = get_param(reqData, "image");
+    if (image == NULL || strchr(image, '/') != NULL) {
+        bad_request_response(fd, "The query param 'image' is missing or contains '/'.");
+        return;
+    }
+
+    char path[MAX_PATH];
+    if (cache_lookup(STATS_CACHE_NAME, image, path, sizeof(path))) {
+        json_file_response(fd, path);
+        return;
+    }
+
+    snprintf(path, sizeof(path), "%s%s", IMAGE_DIR, image);
+    Bitmap *bmp = read_bitmap(path);
+    if (bmp == NULL) {
+        not_found_response(fd);
+        return;
+    }
+    ImageStats *stats = malloc(sizeof(ImageStats));
+    unsigned long stats_start = trace_now();
+    compute_image_stats(bmp, stats);
+    trace_span("stats", stats_start, trace_now());
+    free_bitmap(bmp);
+
+    char tmp_path[MAX_PATH];
+    int cache_fd = cache_create(STATS_CACHE_NAME, image, tmp_path, sizeof(tmp_path));
+    if (cache_fd != -1 && write_stats_json(cache_fd, image, stats) == 0 &&
+            cache_commit(tmp_path, STATS_CACHE_NAME, image) == 0) {
+        close(cache_fd);
+        cache_path(path, sizeof(path), STATS_CACHE_NAME, image);
+        json_file_response(fd, path);
+    } else {
+        // Not cached, so without a Content-Length; the end of the body is
+        // marked by closing the connection.
+        if (cache_fd != -1) {
+            close(cache_fd);
+            unlink(tmp_path);
+        }
+        response_status = 200;
+        const char *header = "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n\r\n";
+        write(fd, header, strlen(header));
+        write_stats_json(fd, image, stats);
+    }
+    free(stats);
+}
+
+
+/*
+ * Write a JSON response whose body is the file at the given path.
+ */
+void json_file_response(int fd, const char *path) {
+    int file_fd = open(path, O_RDONLY);
+    struct stat st;
+    if (file_fd == -1 || fstat(file_fd, &st) == -1) {
+        internal_server_error_response(fd, "Couldn't open the cached statistics.");
+        return;
+    }
+    response_status = 200;
+    dprintf(fd, JSON_RESPONSE_HEADER, (long) st.st_size);
+    off_t offset = 0;
+    while (offset < st.st_size) {
+        if (sendfile(fd, file_fd, &offset, st.st_size - offset) <= 0) {
+            perror("sendfile");
+            break;
+        }
+    }
+    close(file_fd);
+}
+
+
+/*
+ * Write the resource usage of finished requests, per route and filter.
+ * This process is a fork of the acceptor, so it sees the acceptor's
+ * accounting as of the moment this request was dispatched.
+ */
+void metrics_response(int fd) {
+    response_status = 200;
+    char *header =
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: text/plain\r\n\r\n";
+    write(fd, header, strlen(header));
+    write_cost_report(fd);
+    write_scheduler_report(fd);
+    write_remote_report(fd);
+    write_kernel_report(fd);
+}
+
+
+/*
+ * Write the events recorded for sampled requests as Chrome trace JSON.
+ */
+void trace_response(int fd) {
+    response_status = 200;
+    char *header =
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: application/json\r\n"
+        "Content-Disposition: attachment; filename=\"trace.json\"\r\n\r\n";
+    write(fd, header, strlen(header));
+    write_trace_json(fd);
+}
+
+
+/*
+ * Sample the server for the requested number of seconds and write the
+ * collapsed stacks seen.
+ */
+void profile_response(int fd, const ReqData *reqData) {
+    if (!profiler_enabled()) {
+        not_found_response(fd);
+        return;
+    }
+    int seconds = DEFAULT_PROFILE_SECONDS;
+    const char *param = get_param(reqData, "seconds");
+    if (param != NULL) {
+        char *end;
+        seconds = strtol(param, &end, 10);
+        if (end == param || *end != '\0' || seconds < 1 || seconds > MAX_PROFILE_SECONDS) {
+            bad_request_response(fd, "'seconds' must be an integer between 1 and 300.");
+            return;
+        }
     }
-    fclose(file);
-    free(boundary);
-    free(filename);
-    free(path);
-    see_other_response(client->sock, MAIN_HTML);
+    if (begin_profile() == -1) {
+        bad_request_response(fd, "A profile is already being taken.");
+        return;
+    }
+
+    response_status = 200;
+    char *header =
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: text/plain\r\n\r\n";
+    write(fd, header, strlen(header));
+    write_profile(fd, seconds);
 }
 
 
@@ -223,16 +867,62 @@ void image_upload_response(ClientState *client) {
  * Write the header for a bitmap image response to the given fd.
  */
 void write_image_response_header(int fd) {
-    char *response =
-        "HTTP/1.1 200 OK\r\n"
-        "Content-Type: image/bmp\r\n"
-        "Content-Disposition: attachment; filename=\"output.bmp\"\r\n\r\n";
+    response_status = 200;
+    char *response = IMAGE_RESPONSE_HEADER;
+    trace_instant("first_byte", trace_now());
 
     write(fd, response, strlen(response));
 }
 
 
+/*
+ * Write a bitmap image response whose body is the file at the given path.
+ */
+void cached_image_response(int fd, const char *path) {
+    int file_fd = open(path, O_RDONLY);
+    if (file_fd == -1) {
+        internal_server_error_response(fd, "Couldn't open the cached image.");
+        return;
+    }
+    image_file_response(fd, file_fd);
+    close(file_fd);
+}
+
+
+/*
+ * Write a bitmap image response whose body is the whole of the open file.
+ */
+void image_file_response(int fd, int file_fd) {
+    struct stat st;
+    fstat(file_fd, &st);
+    response_status = 200;
+    unsigned long send_start = trace_now();
+    trace_instant("first_byte", send_start);
+
+    Uring *ring = uring_for_request();
+    if (ring != NULL) {
+        if (uring_send_file(ring, fd, IMAGE_RESPONSE_HEADER, file_fd, st.st_size) == -1) {
+            fprintf(stderr, "io_uring: failed to send an image\n");
+        }
+    } else {
+        write(fd, IMAGE_RESPONSE_HEADER, strlen(IMAGE_RESPONSE_HEADER));
+        off_t offset = 0;
+        while (offset < st.st_size) {
+            if (sendfile(fd, file_fd, &offset, st.st_size - offset) <= 0) {
+                perror("sendfile");
+                break;
+            }
+        }
+    }
+
+    unsigned long send_end = trace_now();
+    trace_span("send", send_start, send_end);
+    trace_instant("last_byte", send_end);
+}
+
+
 void not_found_response(int fd) {
+    response_status = 404;
     char *response =
         "HTTP/1.1 404 Not Found\r\n"
         "Content-Type: text/plain\r\n\r\n"
@@ -241,7 +931,30 @@ void not_found_response(int fd) {
 }
 
 
+void request_timeout_response(int fd) {
+    response_status = 408;
+    char *response =
+        "HTTP/1.1 408 Request Timeout\r\n"
+        "Content-Type: text/plain\r\n"
+        "Connection: close\r\n\r\n"
+        "Request timed out.\r\n";
+    write(fd, response, strlen(response));
+}
+
+
+void uri_too_long_response(int fd) {
+    response_status = 414;
+    char *response =
+        "HTTP/1.1 414 URI Too Long\r\n"
+        "Content-Type: text/plain\r\n"
+        "Connection: close\r\n\r\n"
+        "Request line too long.\r\n";
+    write(fd, response, strlen(response));
+}
+
+
 void internal_server_error_response(int fd, const char *message) {
+    response_status = 500;
     char *response =
         "HTTP/1.1 500 Internal Server Error\r\n"
         "Content-Type: text/html\r\n\r\n"
@@ -257,7 +970,19 @@ void internal_server_error_response(int fd, const char *message) {
 }
 
 
+void conflict_response(int fd, const char *message) {
+    response_status = 409;
+    char *response =
+        "HTTP/1.1 409 Conflict\r\n"
+        "Content-Type: text/plain\r\n\r\n"
+        "%s\r\n";
+
+    dprintf(fd, response, message);
+}
+
+
 void bad_request_response(int fd, const char *message) {
+    response_status = 400;
     char *response_header =
         "HTTP/1.1 400 Bad Request\r\n"
         "Content-Type: text/html\r\n"
@@ -285,6 +1010,7 @@ void bad_request_response(int fd, const char *message) {
 
 
 void see_other_response(int fd, const char *other) {
+    response_status = 303;
     char *response =
         "HTTP/1.1 303 See Other\r\n"
         "Location: %s\r\n\r\n";
@@ -3,8 +3,15 @@
 
 #include <sys/socket.h>
 #include "request.h"
+#include "bitmap.h"
 
 
+/*
+ * The status code of the response this process sent last (0 if none yet),
+ * for the access log.
+ */
+extern int response_status;
+
 /*
  * Write the main.html response to the given fd.
  * This response dynamically populates the image-filter form with
@@ -24,12 +31,58 @@ void image_filter_response(int fd, const ReqData *reqData);
 void image_upload_response(ClientState *client);
 
 
+/*
+ * Write a bitmap image response whose body is the file at the given path.
+ */
+void cached_image_response(int fd, const char *path);
+
+/*
+ * Respond with the result <out> of running the filter called <name> (as in
+ * the cache) on <image>, decoded as <bmp>. The result is written through
+ * the cache, or straight to the socket if it can't be cached.
+ */
+void computed_image_response(int fd, const char *name, const char *image,
+                             const Bitmap *bmp, const Pixel *out);
+
+/*
+ * Wait until the scheduler starts the job of running <filter> on the image
+ * at <image_path>. Its cost is estimated from the size in the image's
+ * header, times <cost_factor> for filters whose cost per pixel varies.
+ */
+void schedule_filter(const char *filter, const char *image_path, double cost_factor);
+
+/*
+ * Write the statistics of an image (histograms, mean, standard deviation,
+ * percentiles) as JSON.
+ */
+void image_stats_response(int fd, const ReqData *reqData);
+
+
+/*
+ * Write the resource usage of finished requests, per route and filter.
+ */
+void metrics_response(int fd);
+
+/*
+ * Write the spans recorded for sampled requests, as Chrome trace JSON.
+ */
+void trace_response(int fd);
+
+/*
+ * Write collapsed stacks sampled from the server for ?seconds=N (see profile.h).
+ */
+void profile_response(int fd, const ReqData *reqData);
+
+
 /*
  * The following are generic responses for different HTTP response codes;
  */
 void not_found_response(int fd);
 void bad_request_response(int fd, const char *message);
 void internal_server_error_response(int fd, const char *message);
+void conflict_response(int fd, const char *message);
+void request_timeout_response(int fd);
+void uri_too_long_response(int fd);
 
 // This one takes a resource name instead, and redirects the client
 // to that resource.
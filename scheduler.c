@@ -0,0 +1,243 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+
+#include "scheduler.h"
+#include "trace.h"
+
+#define JOB_FREE 0
+#define JOB_WAITING 1
+#define JOB_RUNNING 2
+
+typedef struct {
+    int state;                // JOB_FREE, JOB_WAITING or JOB_RUNNING
+    pid_t pid;
+    int model;                // Index into models, or -1 if the table was full.
+    double pixels;
+    double estimate;          // Seconds.
+    double key;               // Waiting jobs start in order of this.
+    unsigned long since_us;   // When it started waiting, then running.
+    sem_t wake;               // Posted when a waiting job may start.
+} SchedJob;
+
+typedef struct {
+    char filter[SCHED_MAX_FILTER_NAME];
+    double ns_per_pixel;      // Moving average of the measured costs.
+    long samples;
+} CostModel;
+
+// Lives in a MAP_SHARED mapping, shared by every process forked afterwards.
+typedef struct {
+    pthread_mutex_t lock;
+    int max_running;
+    int running;
+    int waiting;
+    long started;             // Jobs run so far,
+    long queued;              // how many of them had to wait,
+    double wait_sec;          // and for how long in all.
+    SchedJob jobs[SCHED_MAX_JOBS];
+    int num_models;
+    CostModel models[SCHED_MAX_MODELS];
+} Scheduler;
+
+static Scheduler *sched = NULL;
+
+// Helper function declarations.
+void lock_scheduler(void);
+int find_model(const char *filter);
+void start_waiting_jobs(void);
+
+
+void init_scheduler(int max_running) {
+    if (max_running < 0) {
+        return;
+    }
+    if (max_running == 0) {
+        max_running = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    sched = mmap(NULL, sizeof(Scheduler), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (sched == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    memset(sched, 0, sizeof(Scheduler));
+    sched->max_running = max_running;
+
+    // Robust, so a request process killed while holding it can't wedge
+    // every other one.
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&sched->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    for (int i = 0; i < SCHED_MAX_JOBS; i++) {
+        sem_init(&sched->jobs[i].wake, 1, 0);
+    }
+}
+
+
+void lock_scheduler(void) {
+    if (pthread_mutex_lock(&sched->lock) == EOWNERDEAD) {
+        // Its holder died. Carry on; its job is released when it is reaped.
+        pthread_mutex_consistent(&sched->lock);
+    }
+}
+
+
+/*
+ * Return the index of the cost model of <filter>, adding one if there is
+ * room, or -1 if there isn't. Call with the lock held.
+ */
+int find_model(const char *filter) {
+    for (int i = 0; i < sched->num_models; i++) {
+        if (strcmp(sched->models[i].filter, filter) == 0) {
+            return i;
+        }
+    }
+    if (sched->num_models == SCHED_MAX_MODELS || strlen(filter) >= SCHED_MAX_FILTER_NAME) {
+        return -1;
+    }
+    CostModel *model = &sched->models[sched->num_models];
+    strcpy(model->filter, filter);
+    model->ns_per_pixel = SCHED_DEFAULT_NS_PER_PIXEL;
+    model->samples = 0;
+    return sched->num_models++;
+}
+
+
+void schedule_job(const char *filter, double pixels) {
+    if (sched == NULL) {
+        return;
+    }
+    lock_scheduler();
+    SchedJob *job = NULL;
+    for (int i = 0; i < SCHED_MAX_JOBS && job == NULL; i++) {
+        if (sched->jobs[i].state == JOB_FREE) {
+            job = &sched->jobs[i];
+        }
+    }
+    if (job == NULL) {
+        // More jobs than can be tracked; don't hold this one up as well.
+        pthread_mutex_unlock(&sched->lock);
+        return;
+    }
+
+    unsigned long now = trace_now();
+    job->pid = getpid();
+    job->model = find_model(filter);
+    job->pixels = pixels;
+    double ns_per_pixel = (job->model != -1) ?
+        sched->models[job->model].ns_per_pixel : SCHED_DEFAULT_NS_PER_PIXEL;
+    job->estimate = pixels * ns_per_pixel / 1e9;
+    job->since_us = now;
+    sched->started++;
+    if (sched->running < sched->max_running && sched->waiting == 0) {
+        job->state = JOB_RUNNING;
+        sched->running++;
+        pthread_mutex_unlock(&sched->lock);
+        return;
+    }
+
+    // Waiting lowers the effective cost by the same amount for every job,
+    // so it can be folded into a key that never changes.
+    job->state = JOB_WAITING;
+    job->key = job->estimate + SCHED_AGING_RATE * (now / 1e6);
+    sched->waiting++;
+    sched->queued++;
+    pthread_mutex_unlock(&sched->lock);
+
+    while (sem_wait(&job->wake) == -1 && errno == EINTR) {
+    }
+    trace_span("sched_wait", now, trace_now());
+}
+
+
+void finish_job(void) {
+    release_job(getpid());
+}
+
+
+void release_job(pid_t pid) {
+    if (sched == NULL) {
+        return;
+    }
+    lock_scheduler();
+    for (int i = 0; i < SCHED_MAX_JOBS; i++) {
+        SchedJob *job = &sched->jobs[i];
+        if (job->state == JOB_FREE || job->pid != pid) {
+            continue;
+        }
+        if (job->state == JOB_RUNNING) {
+            sched->running--;
+            double ns = (trace_now() - job->since_us) * 1e3;
+            if (job->model != -1 && job->pixels > 0) {
+                CostModel *model = &sched->models[job->model];
+                double sample = ns / job->pixels;
+                model->ns_per_pixel = (model->samples == 0) ? sample :
+                    (1 - SCHED_EWMA_WEIGHT) * model->ns_per_pixel + SCHED_EWMA_WEIGHT * sample;
+                model->samples++;
+            }
+        } else {
+            sched->waiting--;
+        }
+        // Its process is done with the semaphore, but may have died before
+        // taking a post; start the next user of the slot from zero.
+        sem_destroy(&job->wake);
+        sem_init(&job->wake, 1, 0);
+        job->state = JOB_FREE;
+        job->pid = 0;
+        break;
+    }
+    start_waiting_jobs();
+    pthread_mutex_unlock(&sched->lock);
+}
+
+
+/*
+ * Start the waiting jobs with the smallest keys while there are free
+ * slots. Call with the lock held.
+ */
+void start_waiting_jobs(void) {
+    unsigned long now = trace_now();
+    while (sched->running < sched->max_running && sched->waiting > 0) {
+        SchedJob *next = NULL;
+        for (int i = 0; i < SCHED_MAX_JOBS; i++) {
+            SchedJob *job = &sched->jobs[i];
+            if (job->state == JOB_WAITING && (next == NULL || job->key < next->key)) {
+                next = job;
+            }
+        }
+        sched->wait_sec += (now - next->since_us) / 1e6;
+        next->state = JOB_RUNNING;
+        next->since_us = now;
+        sched->running++;
+        sched->waiting--;
+        sem_post(&next->wake);
+    }
+}
+
+
+void write_scheduler_report(int fd) {
+    if (sched == NULL) {
+        dprintf(fd, "# Filter scheduler: off\n");
+        return;
+    }
+    lock_scheduler();
+    dprintf(fd, "# Filter scheduler: %d running (of %d), %d waiting; "
+                "%ld started, %ld had to wait, %.2f ms average wait\n",
+            sched->running, sched->max_running, sched->waiting, sched->started,
+            sched->queued, sched->queued ? sched->wait_sec * 1e3 / sched->queued : 0.0);
+    dprintf(fd, "%-20s %10s %14s\n", "filter", "samples", "ns_per_pixel");
+    for (int i = 0; i < sched->num_models; i++) {
+        CostModel *model = &sched->models[i];
+        dprintf(fd, "%-20s %10ld %14.2f\n", model->filter, model->samples, model->ns_per_pixel);
+    }
+    pthread_mutex_unlock(&sched->lock);
+}
@@ -0,0 +1,62 @@
+#ifndef SCHEDULER_H_
+#define SCHEDULER_H_
+
+#include <sys/types.h>
+
+/*
+ * Shortest-job-first admission for filter requests, so a thumbnail-sized
+ * copy doesn't wait behind a huge edge detection.
+ *
+ * Only so many filter jobs run at once (one per CPU by default). Before
+ * running, a request process estimates the cost of its job from the size
+ * in the image's header times what that filter has been measured to cost
+ * per pixel, and waits if all the slots are taken. Each time a job ends,
+ * the waiting job with the smallest
+ *     estimated cost - SCHED_AGING_RATE * time waited
+ * starts, so a large job only waits behind small ones for a while. Every
+ * finished job refines its filter's cost per pixel (an exponentially
+ * weighted moving average of the measured run times).
+ *
+ * The state lives in memory shared by all acceptors and request processes.
+ * Jobs whose process dies without finishing are released when it is reaped.
+ */
+
+#define SCHED_MAX_JOBS 256          // Running or waiting at once.
+#define SCHED_MAX_MODELS 32         // Filters with a cost model of their own.
+#define SCHED_MAX_FILTER_NAME 64
+#define SCHED_AGING_RATE 0.5        // Seconds of estimated cost forgiven per second waited.
+#define SCHED_EWMA_WEIGHT 0.2       // Weight of the newest measurement.
+#define SCHED_DEFAULT_NS_PER_PIXEL 20.0  // Until a filter has been measured.
+
+
+/*
+ * Set up the shared scheduler state, allowing <max_running> filter jobs at
+ * once (0 means one per online CPU, a negative number no limit at all).
+ * Must be called before the first fork.
+ */
+void init_scheduler(int max_running);
+
+/*
+ * In a request or batch job process: wait until the job of running
+ * <filter> over <pixels> pixels (scaled for filters whose cost per pixel
+ * varies) may start. Returns at once if the scheduler is off or full.
+ */
+void schedule_job(const char *filter, double pixels);
+
+/*
+ * In the process that called schedule_job: the job has finished, so its
+ * slot can go to the next one. Its cost is measured up to here.
+ */
+void finish_job(void);
+
+/*
+ * Release the job of the process <pid> (which has exited), if it has one.
+ */
+void release_job(pid_t pid);
+
+/*
+ * Write the scheduler's queue lengths and cost models to fd as plain text.
+ */
+void write_scheduler_report(int fd);
+
+#endif /* SCHEDULER_H_ */
@@ -1,12 +1,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <arpa/inet.h>     /* inet_ntoa */
 #include <netdb.h>         /* gethostname */
 #include <sys/socket.h>
+#include <sys/time.h>
 
 #include "socket.h"
+#include "debug.h"
 
 /*
  * Initialize a server address associated with the given port.
@@ -29,8 +32,10 @@ struct sockaddr_in *init_server_addr(int port) {
 
 /*
  * Create and setup a socket for a server to listen on.
+ * If reuseport is set, other sockets may bind to the same address and the
+ * kernel spreads incoming connections between them.
  */
-int setup_server_socket(struct sockaddr_in *self, int num_queue) {
+static int create_server_socket(struct sockaddr_in *self, int num_queue, int reuseport) {
     int soc = socket(PF_INET, SOCK_STREAM, 0);
     if (soc < 0) {
         perror("socket");
@@ -47,6 +52,15 @@ int setup_server_socket(struct sockaddr_in *self, int num_queue) {
         exit(1);
     }
 
+    if (reuseport) {
+        status = setsockopt(soc, SOL_SOCKET, SO_REUSEPORT,
+            (const char *) &on, sizeof(on));
+        if (status < 0) {
+            perror("setsockopt");
+            exit(1);
+        }
+    }
+
     // Associate the process with the address and a port
     if (bind(soc, (struct sockaddr *)self, sizeof(*self)) < 0) {
         // bind failed; could be because port is in use.
@@ -64,6 +78,18 @@ int setup_server_socket(struct sockaddr_in *self, int num_queue) {
     return soc;
 }
 
+int setup_server_socket(struct sockaddr_in *self, int num_queue) {
+    return create_server_socket(self, num_queue, 0);
+}
+
+/*
+ * Create a listening socket that shares its port with the listening sockets
+ * of the other acceptors, each of which gets its own accept queue.
+ */
+int setup_reuseport_socket(struct sockaddr_in *self, int num_queue) {
+    return create_server_socket(self, num_queue, 1);
+}
+
 
 /*
  * Wait for and accept a new connection.
@@ -74,14 +100,13 @@ int accept_connection(int listenfd) {
     unsigned int peer_len = sizeof(peer);
     peer.sin_family = PF_INET;
 
-    fprintf(stderr, "Waiting for a new connection...\n");
+    DEBUG_LOG("Waiting for a new connection...\n");
     int client_socket = accept(listenfd, (struct sockaddr *)&peer, &peer_len);
     if (client_socket < 0) {
         perror("accept");
         return -1;
     } else {
-        fprintf(stderr,
-            "New connection accepted from %s:%d\n",
+        DEBUG_LOG("New connection accepted from %s:%d\n",
             inet_ntoa(peer.sin_addr),
             ntohs(peer.sin_port));
         return client_socket;
@@ -96,10 +121,25 @@ int accept_connection(int listenfd) {
  * Create a socket and connect to the server indicated by the port and hostname
  */
 int connect_to_server(int port, const char *hostname) {
+    int soc = try_connect_to_server(port, hostname, 0);
+    if (soc == -1) {
+        perror("connect");
+        exit(1);
+    }
+    return soc;
+}
+
+/*
+ * Like connect_to_server, but give up after <timeout_ms> (0 waits as long as
+ * connect does) and return -1 rather than exiting if it fails. Sends and
+ * receives on the socket time out after the same time. A failed connect is
+ * left in errno rather than printed, as callers may retry elsewhere.
+ */
+int try_connect_to_server(int port, const char *hostname, int timeout_ms) {
     int soc = socket(PF_INET, SOCK_STREAM, 0);
     if (soc < 0) {
         perror("socket");
-        exit(1);
+        return -1;
     }
     struct sockaddr_in addr;
 
@@ -114,17 +154,26 @@ int connect_to_server(int port, const char *hostname) {
     struct hostent *hp = gethostbyname(hostname);
     if (hp == NULL) {
         fprintf(stderr, "unknown host %s\n", hostname);
-        exit(1);
+        close(soc);
+        return -1;
     }
 
     addr.sin_addr = *((struct in_addr *) hp->h_addr);
 
+    // connect gives up after the send timeout.
+    if (timeout_ms > 0) {
+        struct timeval timeout = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+        setsockopt(soc, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        setsockopt(soc, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    }
+
     // Request connection to server.
     if (connect(soc, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
-        perror("connect");
-        exit(1);
+        int saved = errno;
+        close(soc);
+        errno = saved;
+        return -1;
     }
 
     return soc;
 }
-
@@ -7,8 +7,10 @@
 
 struct sockaddr_in *init_server_addr(int port);
 int setup_server_socket(struct sockaddr_in *self, int num_queue);
+int setup_reuseport_socket(struct sockaddr_in *self, int num_queue);
 int accept_connection(int listenfd);
 
 int connect_to_server(int port, const char *hostname);
+int try_connect_to_server(int port, const char *hostname, int timeout_ms);
 
 #endif
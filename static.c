@@ -0,0 +1,427 @@
+#define _GNU_SOURCE  // strptime, timegm
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+
+#include "static.h"
+#include "cache.h"
+#include "trace.h"
+#include "accesslog.h"
+#include "debug.h"
+
+#define STATIC_HEADER_SIZE 512
+
+#define STATIC_NOT_FOUND \
+    "HTTP/1.1 404 Not Found\r\n" \
+    "Content-Type: text/plain\r\n" \
+    "Content-Length: 16\r\n" \
+    "Connection: close\r\n\r\n" \
+    "Page not found.\n"
+
+// A file held in memory.
+typedef struct static_entry {
+    struct static_entry *hash_next;
+    struct static_entry *lru_prev;    // Towards the most recently used.
+    struct static_entry *lru_next;
+    char path[MAX_PATH];
+    off_t size;
+    struct timespec mtime;            // Of the file when it was read.
+    int stale;                        // The file has changed; no longer in the table.
+    int refs;                         // Clients still sending from data.
+    char *data;
+} StaticEntry;
+
+static const char *static_dir = STATIC_DIR_DEFAULT;
+
+// The cache: a hash table for lookups, and a list from most to least
+// recently used for eviction.
+static StaticEntry *table[STATIC_CACHE_BUCKETS];
+static StaticEntry *lru_head = NULL;
+static StaticEntry *lru_tail = NULL;
+static long cached_bytes = 0;
+
+static const struct {
+    const char *extension;
+    const char *type;
+} content_types[] = {
+    {".html", "text/html"},
+    {".css", "text/css"},
+    {".js", "text/javascript"},
+    {".json", "application/json"},
+    {".txt", "text/plain"},
+    {".svg", "image/svg+xml"},
+    {".png", "image/png"},
+    {".jpg", "image/jpeg"},
+    {".jpeg", "image/jpeg"},
+    {".gif", "image/gif"},
+    {".ico", "image/x-icon"},
+    {".bmp", "image/bmp"},
+    {".wasm", "application/wasm"},
+};
+
+// Helper function declarations.
+int safe_path(const char *path);
+const char *content_type(const char *path);
+StaticEntry *cache_get(const char *path, const struct stat *st);
+int not_modified(const ClientState *client, const char *etag, time_t mtime);
+int start_response(ClientState *client, int status, const char *header);
+void finish_response(ClientState *client);
+
+
+void init_static(const char *dir) {
+    static_dir = dir;
+}
+
+
+int is_static_request(const ReqData *reqData) {
+    return strncmp(reqData->path, STATIC_PREFIX, strlen(STATIC_PREFIX)) == 0;
+}
+
+
+int static_response(ClientState *client) {
+    const char *name = client->reqData->path + strlen(STATIC_PREFIX);
+    char path[MAX_PATH];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", static_dir, name);
+    if (strcmp(client->reqData->method, GET) != 0 || !safe_path(name) ||
+            stat(path, &st) == -1 || !S_ISREG(st.st_mode)) {
+        return start_response(client, 404, STATIC_NOT_FOUND);
+    }
+    time_t mtime = st.st_mtim.tv_sec;
+
+    // Prefer a precompressed sibling if the client can take it.
+    char accept[256];
+    const char *encoding = "";
+    char gz_path[MAX_PATH];
+    struct stat gz_st;
+    if (get_header(client, "Accept-Encoding", accept, sizeof(accept)) &&
+            strstr(accept, "gzip") != NULL &&
+            snprintf(gz_path, sizeof(gz_path), "%s.gz", path) < sizeof(gz_path)) {
+        if (stat(gz_path, &gz_st) == 0 && S_ISREG(gz_st.st_mode)) {
+            strcpy(path, gz_path);
+            st = gz_st;
+            encoding = "Content-Encoding: gzip\r\n";
+        }
+    }
+
+    char etag[64];
+    char last_modified[64];
+    struct tm tm;
+    snprintf(etag, sizeof(etag), "\"%lx-%lx%s\"", (long) st.st_size,
+             st.st_mtim.tv_sec * 1000000000L + st.st_mtim.tv_nsec, encoding[0] ? "-gz" : "");
+    strftime(last_modified, sizeof(last_modified), "%a, %d %b %Y %H:%M:%S GMT",
+             gmtime_r(&mtime, &tm));
+
+    char *header = arena_alloc(&client->arena, STATIC_HEADER_SIZE);
+    if (not_modified(client, etag, mtime)) {
+        snprintf(header, STATIC_HEADER_SIZE,
+                 "HTTP/1.1 304 Not Modified\r\n"
+                 "ETag: %s\r\n"
+                 "Last-Modified: %s\r\n"
+                 "Connection: close\r\n\r\n",
+                 etag, last_modified);
+        return start_response(client, 304, header);
+    }
+
+    snprintf(header, STATIC_HEADER_SIZE,
+             "HTTP/1.1 200 OK\r\n"
+             "Content-Type: %s\r\n"
+             "%s"
+             "Vary: Accept-Encoding\r\n"
+             "Content-Length: %ld\r\n"
+             "ETag: %s\r\n"
+             "Last-Modified: %s\r\n"
+             "Connection: close\r\n\r\n",
+             content_type(name), encoding, (long) st.st_size, etag, last_modified);
+
+    StaticEntry *entry = cache_get(path, &st);
+    if (entry != NULL) {
+        entry->refs++;
+        client->out_pin = &entry->refs;
+        client->out_body = entry->data;
+        client->out_body_len = entry->size;
+    } else {
+        // Too big to cache, or the cache is full of files being sent.
+        client->out_fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (client->out_fd == -1) {
+            return start_response(client, 404, STATIC_NOT_FOUND);
+        }
+        client->out_offset = 0;
+        client->out_end = st.st_size;
+    }
+    return start_response(client, 200, header);
+}
+
+
+int static_continue(ClientState *client) {
+    // The header and an in-memory body go out together.
+    long total = client->out_len + client->out_body_len;
+    while (client->out_sent < total) {
+        struct iovec iov[2];
+        int n = 0;
+        if (client->out_sent < client->out_len) {
+            iov[n].iov_base = (char *) client->out_buf + client->out_sent;
+            iov[n++].iov_len = client->out_len - client->out_sent;
+        }
+        if (client->out_body_len > 0) {
+            long body_sent = (client->out_sent > client->out_len) ?
+                             client->out_sent - client->out_len : 0;
+            iov[n].iov_base = (char *) client->out_body + body_sent;
+            iov[n++].iov_len = client->out_body_len - body_sent;
+        }
+        ssize_t written = writev(client->sock, iov, n);
+        if (written == -1 && errno == EAGAIN) {
+            return 0;
+        } else if (written == -1 && errno != EINTR) {
+            finish_response(client);
+            return 1;
+        } else if (written > 0) {
+            client->out_sent += written;
+        }
+    }
+
+    while (client->out_fd != -1 && client->out_offset < client->out_end) {
+        ssize_t sent = sendfile(client->sock, client->out_fd, &client->out_offset,
+                                client->out_end - client->out_offset);
+        if (sent == -1 && errno == EAGAIN) {
+            return 0;
+        } else if (sent == 0 || (sent == -1 && errno != EINTR)) {
+            break;  // The client went away, or the file shrank.
+        }
+    }
+
+    finish_response(client);
+    return 1;
+}
+
+
+/*
+ * Make the socket non-blocking and send as much of the response as fits.
+ */
+int start_response(ClientState *client, int status, const char *header) {
+    int flags = fcntl(client->sock, F_GETFL);
+    fcntl(client->sock, F_SETFL, flags | O_NONBLOCK);
+    client->out_buf = header;
+    client->out_len = strlen(header);
+    client->out_sent = 0;
+    client->out_status = status;
+    client->out_start_us = trace_now();
+    return static_continue(client);
+}
+
+
+/*
+ * Log a response that is done. The file and the cache entry are released
+ * along with the client.
+ */
+void finish_response(ClientState *client) {
+    AccessRecord record;
+    memset(&record, 0, sizeof(record));
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    unsigned long now_us = trace_now();
+    record.time_ms = now.tv_sec * 1000UL + now.tv_nsec / 1000000 -
+                     (now_us - client->out_start_us) / 1000;
+    record.pid = getpid();
+    record.status = client->out_status;
+    record.bytes = client->out_sent + (client->out_fd != -1 ? client->out_offset : 0);
+    record.wait_us = client->out_start_us - client->accepted_us;
+    record.total_us = now_us - client->out_start_us;
+    snprintf(record.method, sizeof(record.method), "%s", client->reqData->method);
+    snprintf(record.route, sizeof(record.route), "%s", client->reqData->path);
+    log_access(&record);
+}
+
+
+/*
+ * Return 1 if the request's conditional headers say its copy is current:
+ * If-None-Match lists the ETag, or (without If-None-Match) If-Modified-Since
+ * is no earlier than the modification time.
+ */
+int not_modified(const ClientState *client, const char *etag, time_t mtime) {
+    char value[256];
+    if (get_header(client, "If-None-Match", value, sizeof(value))) {
+        return strstr(value, etag) != NULL || strcmp(value, "*") == 0;
+    }
+    if (get_header(client, "If-Modified-Since", value, sizeof(value))) {
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        if (strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm) != NULL) {
+            return mtime <= timegm(&tm);
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * Return 1 if the path (relative to the static directory) stays inside it.
+ */
+int safe_path(const char *path) {
+    if (path[0] == '\0' || path[0] == '/') {
+        return 0;
+    }
+    const char *segment = path;
+    while (segment != NULL) {
+        if (strncmp(segment, "..", 2) == 0 && (segment[2] == '/' || segment[2] == '\0')) {
+            return 0;
+        }
+        segment = strchr(segment, '/');
+        if (segment != NULL) {
+            segment++;
+        }
+    }
+    return 1;
+}
+
+
+const char *content_type(const char *path) {
+    const char *extension = strrchr(path, '.');
+    for (int i = 0; extension != NULL && i < sizeof(content_types) / sizeof(content_types[0]); i++) {
+        if (strcasecmp(extension, content_types[i].extension) == 0) {
+            return content_types[i].type;
+        }
+    }
+    return "application/octet-stream";
+}
+
+
+/******************************************************************************
+ * The in-memory cache
+ *****************************************************************************/
+
+static unsigned hash_path(const char *path) {
+    // FNV-1a.
+    unsigned hash = 2166136261u;
+    for (; *path != '\0'; path++) {
+        hash = (hash ^ (unsigned char) *path) * 16777619u;
+    }
+    return hash % STATIC_CACHE_BUCKETS;
+}
+
+
+static void lru_unlink(StaticEntry *entry) {
+    if (entry->lru_prev != NULL) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        lru_head = entry->lru_next;
+    }
+    if (entry->lru_next != NULL) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        lru_tail = entry->lru_prev;
+    }
+}
+
+
+static void lru_push_front(StaticEntry *entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = lru_head;
+    if (lru_head != NULL) {
+        lru_head->lru_prev = entry;
+    } else {
+        lru_tail = entry;
+    }
+    lru_head = entry;
+}
+
+
+static void table_unlink(StaticEntry *entry) {
+    StaticEntry **link = &table[hash_path(entry->path)];
+    while (*link != entry) {
+        link = &(*link)->hash_next;
+    }
+    *link = entry->hash_next;
+}
+
+
+/*
+ * Free least recently used entries that nobody is sending from, until
+ * <size> more bytes fit. Return 1 if they do.
+ */
+static int make_room(long size) {
+    StaticEntry *entry = lru_tail;
+    while (cached_bytes + size > STATIC_CACHE_BYTES && entry != NULL) {
+        StaticEntry *prev = entry->lru_prev;
+        if (entry->refs == 0) {
+            lru_unlink(entry);
+            if (!entry->stale) {
+                table_unlink(entry);
+            }
+            cached_bytes -= entry->size;
+            DEBUG_LOG("Static cache: evicted %s\n", entry->path);
+            free(entry->data);
+            free(entry);
+        }
+        entry = prev;
+    }
+    return cached_bytes + size <= STATIC_CACHE_BYTES;
+}
+
+
+/*
+ * Return the cache entry for the file at <path>, whose current attributes
+ * are <st>, reading it in if it isn't cached (or has changed since).
+ * Return NULL if it can't be cached.
+ */
+StaticEntry *cache_get(const char *path, const struct stat *st) {
+    unsigned bucket = hash_path(path);
+    for (StaticEntry *entry = table[bucket]; entry != NULL; entry = entry->hash_next) {
+        if (strcmp(entry->path, path) != 0) {
+            continue;
+        }
+        if (entry->size == st->st_size && entry->mtime.tv_sec == st->st_mtim.tv_sec &&
+                entry->mtime.tv_nsec == st->st_mtim.tv_nsec) {
+            lru_unlink(entry);
+            lru_push_front(entry);
+            return entry;
+        }
+        // Changed on disk. Clients may still be sending the old contents, so
+        // leave it to be evicted, and read the file again.
+        table_unlink(entry);
+        entry->stale = 1;
+        break;
+    }
+
+    if (st->st_size > STATIC_MAX_CACHED_FILE || strlen(path) >= MAX_PATH ||
+            !make_room(st->st_size)) {
+        return NULL;
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return NULL;
+    }
+    StaticEntry *entry = calloc(1, sizeof(StaticEntry));
+    entry->data = malloc(st->st_size > 0 ? st->st_size : 1);
+    long total = 0;
+    while (total < st->st_size) {
+        ssize_t n = read(fd, entry->data + total, st->st_size - total);
+        if (n <= 0) {
+            break;
+        }
+        total += n;
+    }
+    close(fd);
+    if (total != st->st_size) {
+        free(entry->data);
+        free(entry);
+        return NULL;
+    }
+
+    strcpy(entry->path, path);
+    entry->size = st->st_size;
+    entry->mtime = st->st_mtim;
+    entry->hash_next = table[bucket];
+    table[bucket] = entry;
+    lru_push_front(entry);
+    cached_bytes += entry->size;
+    return entry;
+}
@@ -0,0 +1,52 @@
+#ifndef STATIC_H_
+#define STATIC_H_
+
+#include "request.h"
+
+/*
+ * Static files under a configurable directory, served by the acceptor itself
+ * inside its event loop instead of by a forked request process.
+ *
+ * Small files are kept in memory, in an LRU cache bounded by bytes; larger
+ * ones (and any that don't fit) are sent from disk with sendfile. If the
+ * client accepts gzip and <file>.gz exists, that is sent instead. Responses
+ * carry Last-Modified and an ETag (from the size and modification time), and
+ * conditional requests that match them get 304 Not Modified.
+ *
+ * The socket is made non-blocking, so a slow client never stalls the loop:
+ * whatever doesn't fit in the socket buffer is sent as it becomes writable.
+ */
+
+#define STATIC_PREFIX "/static/"
+#define STATIC_DIR_DEFAULT "static"
+
+#define STATIC_CACHE_BYTES (16 << 20)     // Memory for cached files, per acceptor.
+#define STATIC_MAX_CACHED_FILE (256 << 10)  // Larger files are always sent from disk.
+#define STATIC_CACHE_BUCKETS 256
+
+
+/*
+ * Serve static files from <dir> instead of STATIC_DIR_DEFAULT.
+ */
+void init_static(const char *dir);
+
+/*
+ * Return 1 if the request is for a static file.
+ */
+int is_static_request(const ReqData *reqData);
+
+/*
+ * Start responding to a static file request, whose headers are in
+ * client->buf. Return 1 if the whole response has been sent (or the client
+ * has gone away), and 0 if the rest must be sent with static_continue once
+ * the socket is writable.
+ */
+int static_response(ClientState *client);
+
+/*
+ * Send more of a response started by static_response. Return 1 once it is
+ * done (or the client has gone away), and 0 if there is more to send.
+ */
+int static_continue(ClientState *client);
+
+#endif /* STATIC_H_ */
@@ -0,0 +1,238 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+
+#include "stats.h"
+#include "isa.h"
+#include "json.h"
+#include "request.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <tmmintrin.h>
+#define HAVE_SSSE3_KERNEL
+#endif
+
+const int stats_percentiles[NUM_PERCENTILES] = {1, 5, 25, 50, 75, 95, 99};
+
+static const char *channel_names[STATS_CHANNELS] = {"blue", "green", "red", "luminance"};
+
+// The counts of one pass: pixel i is counted in copy i % STATS_SUB_HISTOGRAMS.
+typedef unsigned int SubHistograms[STATS_SUB_HISTOGRAMS][STATS_CHANNELS][256];
+
+// Helper function declarations.
+void count_pixels(const Pixel *pixels, long start, long end, SubHistograms counts);
+void merge_counts(SubHistograms counts, ImageStats *stats);
+void write_channel_json(FILE *out, const unsigned int *histogram, long pixels, int luminance);
+
+
+static inline unsigned char luminance(const Pixel *p) {
+    // The weights add up to 256, so the result is at most 255.
+    return (77 * p->red + 150 * p->green + 29 * p->blue) >> 8;
+}
+
+
+/*
+ * Count pixels [start, end) one at a time.
+ */
+void count_pixels(const Pixel *pixels, long start, long end, SubHistograms counts) {
+    for (long i = start; i < end; i++) {
+        const Pixel *p = &pixels[i];
+        unsigned int (*sub)[256] = counts[i % STATS_SUB_HISTOGRAMS];
+        sub[0][p->blue]++;
+        sub[1][p->green]++;
+        sub[2][p->red]++;
+        sub[STATS_LUMINANCE][luminance(p)]++;
+    }
+}
+
+
+#ifdef HAVE_SSSE3_KERNEL
+/*
+ * Count pixels 16 at a time. Their 48 bytes are loaded as three vectors;
+ * shuffling each with the mask for a channel and OR'ing the results gathers
+ * the 16 values of that channel into one vector, in pixel order. Luminance
+ * is then computed on all 16 pixels at once in two halves of 16-bit lanes.
+ */
+__attribute__((target("ssse3")))
+static void count_pixels_ssse3(const Pixel *pixels, long n, SubHistograms counts) {
+    // masks[c][q] moves byte c of each pixel that lies in vector q into
+    // that pixel's lane (0x80 clears the lanes of pixels in other vectors).
+    unsigned char masks[3][3][16] __attribute__((aligned(16)));
+    for (int c = 0; c < 3; c++) {
+        for (int q = 0; q < 3; q++) {
+            for (int j = 0; j < 16; j++) {
+                int offset = 3 * j + c - 16 * q;
+                masks[c][q][j] = (offset >= 0 && offset < 16) ? offset : 0x80;
+            }
+        }
+    }
+    __m128i shuffle[3][3];
+    for (int c = 0; c < 3; c++) {
+        for (int q = 0; q < 3; q++) {
+            shuffle[c][q] = _mm_load_si128((const __m128i *) masks[c][q]);
+        }
+    }
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i weight_blue = _mm_set1_epi16(29);
+    const __m128i weight_green = _mm_set1_epi16(150);
+    const __m128i weight_red = _mm_set1_epi16(77);
+
+    unsigned char values[STATS_CHANNELS][16] __attribute__((aligned(16)));
+    long blocks = n / 16;
+    const unsigned char *bytes = (const unsigned char *) pixels;
+    for (long b = 0; b < blocks; b++) {
+        const __m128i *src = (const __m128i *) (bytes + 48 * b);
+        __m128i v0 = _mm_loadu_si128(src);
+        __m128i v1 = _mm_loadu_si128(src + 1);
+        __m128i v2 = _mm_loadu_si128(src + 2);
+
+        __m128i channel[3];
+        for (int c = 0; c < 3; c++) {
+            channel[c] = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(v0, shuffle[c][0]),
+                                                   _mm_shuffle_epi8(v1, shuffle[c][1])),
+                                      _mm_shuffle_epi8(v2, shuffle[c][2]));
+            _mm_store_si128((__m128i *) values[c], channel[c]);
+        }
+
+        // The weighted sum is below 65536, so 16-bit lanes can't overflow.
+        __m128i luma_lo = _mm_add_epi16(
+                _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(channel[0], zero), weight_blue),
+                              _mm_mullo_epi16(_mm_unpacklo_epi8(channel[1], zero), weight_green)),
+                _mm_mullo_epi16(_mm_unpacklo_epi8(channel[2], zero), weight_red));
+        __m128i luma_hi = _mm_add_epi16(
+                _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(channel[0], zero), weight_blue),
+                              _mm_mullo_epi16(_mm_unpackhi_epi8(channel[1], zero), weight_green)),
+                _mm_mullo_epi16(_mm_unpackhi_epi8(channel[2], zero), weight_red));
+        __m128i luma = _mm_packus_epi16(_mm_srli_epi16(luma_lo, 8), _mm_srli_epi16(luma_hi, 8));
+        _mm_store_si128((__m128i *) values[STATS_LUMINANCE], luma);
+
+        // Blocks start at multiples of 16, so lane j is pixel j % 4's copy.
+#pragma GCC unroll 16
+        for (int j = 0; j < 16; j++) {
+            unsigned int (*sub)[256] = counts[j % STATS_SUB_HISTOGRAMS];
+            sub[0][values[0][j]]++;
+            sub[1][values[1][j]]++;
+            sub[2][values[2][j]]++;
+            sub[STATS_LUMINANCE][values[STATS_LUMINANCE][j]]++;
+        }
+    }
+    count_pixels(pixels, blocks * 16, n, counts);
+}
+#endif
+
+
+/*
+ * Add up the copies of each histogram into <stats>.
+ */
+void merge_counts(SubHistograms counts, ImageStats *stats) {
+    for (int c = 0; c < STATS_CHANNELS; c++) {
+        for (int v = 0; v < 256; v++) {
+            unsigned int total = 0;
+            for (int k = 0; k < STATS_SUB_HISTOGRAMS; k++) {
+                total += counts[k][c][v];
+            }
+            stats->histogram[c][v] = total;
+        }
+    }
+}
+
+
+void compute_image_stats(const Bitmap *bmp, ImageStats *stats) {
+#ifdef HAVE_SSSE3_KERNEL
+    // Every variant but the generic one includes SSSE3.
+    if (active_isa >= ISA_SSE42) {
+        SubHistograms *counts = calloc(1, sizeof(SubHistograms));
+        stats->width = bmp->width;
+        stats->height = bmp->height;
+        stats->pixels = (long) bmp->width * bmp->height;
+        count_pixels_ssse3(bmp->pixels, stats->pixels, *counts);
+        merge_counts(*counts, stats);
+        free(counts);
+        return;
+    }
+#endif
+    compute_image_stats_scalar(bmp, stats);
+}
+
+
+void compute_image_stats_scalar(const Bitmap *bmp, ImageStats *stats) {
+    SubHistograms *counts = calloc(1, sizeof(SubHistograms));
+    stats->width = bmp->width;
+    stats->height = bmp->height;
+    stats->pixels = (long) bmp->width * bmp->height;
+    count_pixels(bmp->pixels, 0, stats->pixels, *counts);
+    merge_counts(*counts, stats);
+    free(counts);
+}
+
+
+int write_stats_json(int fd, const char *image, const ImageStats *stats) {
+    FILE *out = fdopen(dup(fd), "w");
+    if (out == NULL) {
+        perror("fdopen");
+        return -1;
+    }
+
+    char name[6 * MAXLINE + 3];
+    json_string(name, sizeof(name), image);
+    fprintf(out, "{\"image\":%s", name);
+    fprintf(out, ",\"width\":%d,\"height\":%d,\"pixels\":%ld",
+            stats->width, stats->height, stats->pixels);
+    for (int c = 0; c < STATS_CHANNELS; c++) {
+        fprintf(out, ",\n\"%s\":", channel_names[c]);
+        write_channel_json(out, stats->histogram[c], stats->pixels, c == STATS_LUMINANCE);
+    }
+    fprintf(out, "}\n");
+    return (fclose(out) == 0) ? 0 : -1;
+}
+
+
+/*
+ * Write the summary of one channel's histogram, then the histogram itself.
+ * Percentiles are only given for luminance.
+ */
+void write_channel_json(FILE *out, const unsigned int *histogram, long pixels, int luminance) {
+    int min = -1;
+    int max = -1;
+    double sum = 0;
+    double sum_squares = 0;
+    for (int v = 0; v < 256; v++) {
+        if (histogram[v] == 0) {
+            continue;
+        }
+        if (min == -1) {
+            min = v;
+        }
+        max = v;
+        sum += (double) v * histogram[v];
+        sum_squares += (double) v * v * histogram[v];
+    }
+    double mean = pixels ? sum / pixels : 0;
+    double variance = pixels ? sum_squares / pixels - mean * mean : 0;
+    fprintf(out, "{\"min\":%d,\"max\":%d,\"mean\":%.3f,\"stddev\":%.3f",
+            min, max, mean, sqrt(variance > 0 ? variance : 0));
+
+    if (luminance) {
+        // The smallest value that at least p% of the pixels are at or below.
+        fprintf(out, ",\"percentiles\":{");
+        long seen = 0;
+        int v = 0;
+        for (int i = 0; i < NUM_PERCENTILES; i++) {
+            long rank = (pixels * stats_percentiles[i] + 99) / 100;
+            while (v < 255 && seen + histogram[v] < rank) {
+                seen += histogram[v];
+                v++;
+            }
+            fprintf(out, "%s\"p%d\":%d", i ? "," : "", stats_percentiles[i], v);
+        }
+        fprintf(out, "}");
+    }
+
+    fprintf(out, ",\"histogram\":[");
+    for (int v = 0; v < 256; v++) {
+        fprintf(out, "%s%u", v ? "," : "", histogram[v]);
+    }
+    fprintf(out, "]}");
+}
@@ -0,0 +1,60 @@
+#ifndef STATS_H_
+#define STATS_H_
+
+#include "bitmap.h"
+
+/*
+ * Image statistics, requested as
+ *     /image-stats?image=dog.bmp
+ *
+ * Per-channel histograms, min/max, mean and standard deviation, and
+ * luminance percentiles, returned as JSON and cached per image like
+ * filtered results.
+ *
+ * Everything is derived from four histograms (blue, green, red and
+ * luminance, the Rec. 601 weights 77, 150 and 29 out of 256) built in one
+ * pass over the pixels. Each histogram is split into STATS_SUB_HISTOGRAMS
+ * copies, pixel i counting in copy i % STATS_SUB_HISTOGRAMS, so consecutive
+ * increments of the same bin (common in flat areas) don't wait on each
+ * other's stores. On CPUs with SSSE3, 16 pixels at a time are split into
+ * channels with byte shuffles and their luminance computed in 16-bit lanes
+ * before being counted; elsewhere a scalar loop gives the same counts.
+ */
+
+#define IMAGE_STATS "/image-stats"
+
+#define STATS_CACHE_NAME "image-stats"  // Cached as CACHE_DIR/image-stats/<image>.
+#define STATS_SUB_HISTOGRAMS 4
+#define STATS_CHANNELS 4                // Blue, green, red, luminance.
+#define STATS_LUMINANCE 3
+
+#define NUM_PERCENTILES 7
+
+extern const int stats_percentiles[NUM_PERCENTILES];
+
+
+typedef struct {
+    int width;
+    int height;
+    long pixels;
+    unsigned int histogram[STATS_CHANNELS][256];
+} ImageStats;
+
+
+/*
+ * Fill in <stats> for <bmp>, with the SIMD kernel when the CPU has one.
+ */
+void compute_image_stats(const Bitmap *bmp, ImageStats *stats);
+
+/*
+ * The same, always with the scalar kernel. Only used to check the other.
+ */
+void compute_image_stats_scalar(const Bitmap *bmp, ImageStats *stats);
+
+/*
+ * Write <stats> for the image called <image> to <fd> as JSON.
+ * Return 0 on success, -1 on failure.
+ */
+int write_stats_json(int fd, const char *image, const ImageStats *stats);
+
+#endif /* STATS_H_ */
@@ -0,0 +1,370 @@
+#define _GNU_SOURCE  // memfd_create
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "tiles.h"
+#include "bitmap.h"
+#include "cache.h"
+#include "filter.h"
+#include "filterpool.h"
+#include "convolve.h"
+#include "response.h"
+#include "trace.h"
+
+// Helper function declarations.
+int num_levels(int width, int height);
+int level_path(const char *image, int halvings, char *path, int size);
+int build_level(const char *image, int halvings, const char *src_path);
+Bitmap *read_region(const BitmapFile *file, int x, int y, int width, int height);
+Pixel *filter_region(const char *filter, const Bitmap *region);
+void tile_info_response(int fd, const char *image);
+static int write_buffer(int fd, const void *buf, long size);
+
+
+int is_tile_request(const ReqData *reqData) {
+    return strncmp(reqData->path, TILES_PREFIX, strlen(TILES_PREFIX)) == 0;
+}
+
+
+/*
+ * Return the number of zoom levels of an image of the given dimensions:
+ * enough halvings for the largest one to fit in a tile, plus the image.
+ */
+int num_levels(int width, int height) {
+    int levels = 1;
+    int size = (width > height) ? width : height;
+    while (size > TILE_SIZE && levels < MAX_PYRAMID_LEVELS) {
+        size = (size + 1) / 2;
+        levels++;
+    }
+    return levels;
+}
+
+
+/*
+ * Store the path of <image> halved <halvings> times in <path>, building it
+ * (and any level it is built from) if it isn't cached.
+ * Return 0 on success, -1 on failure.
+ */
+int level_path(const char *image, int halvings, char *path, int size) {
+    if (halvings == 0) {
+        snprintf(path, size, "%s%s", IMAGE_DIR, image);
+        return 0;
+    }
+
+    char name[MAX_PATH];
+    snprintf(name, sizeof(name), "%s%d", PYRAMID_CACHE_PREFIX, halvings);
+    if (cache_lookup(name, image, path, size)) {
+        return 0;
+    }
+    if (level_path(image, halvings - 1, path, size) == -1 ||
+            build_level(image, halvings, path) == -1) {
+        return -1;
+    }
+    cache_path(path, size, name, image);
+    return 0;
+}
+
+
+/*
+ * Build the level of <image> halved <halvings> times from the one above it,
+ * at <src_path>, and cache it. Each pixel averages a 2x2 block (the last row
+ * or column standing in for the missing one of an odd dimension). Only two
+ * source rows are in memory at a time. Return 0 on success, -1 on failure.
+ */
+int build_level(const char *image, int halvings, const char *src_path) {
+    BitmapFile src;
+    if (open_bitmap_file(src_path, &src) == -1) {
+        return -1;
+    }
+    char name[MAX_PATH];
+    char tmp_path[MAX_PATH];
+    snprintf(name, sizeof(name), "%s%d", PYRAMID_CACHE_PREFIX, halvings);
+    int out_fd = cache_create(name, image, tmp_path, sizeof(tmp_path));
+    if (out_fd == -1) {
+        close_bitmap_file(&src);
+        return -1;
+    }
+
+    int width = (src.width + 1) / 2;
+    int height = (src.height + 1) / 2;
+    unsigned char header[BMP_MIN_HEADER];
+    bitmap_header(header, width, height);
+    Pixel *top = malloc(sizeof(Pixel) * src.width);
+    Pixel *bottom = malloc(sizeof(Pixel) * src.width);
+    unsigned char *row = calloc(bitmap_row_size(width), 1);
+    Pixel *out = (Pixel *) row;
+
+    // The header has a positive height, so rows go out bottom first.
+    int result = write_buffer(out_fd, header, BMP_MIN_HEADER);
+    for (int y = height - 1; y >= 0 && result == 0; y--) {
+        int y1 = (2 * y + 1 < src.height) ? 2 * y + 1 : 2 * y;
+        if (read_bitmap_row(&src, 2 * y, 0, src.width, top) == -1 ||
+                read_bitmap_row(&src, y1, 0, src.width, bottom) == -1) {
+            result = -1;
+            break;
+        }
+        for (int x = 0; x < width; x++) {
+            int x0 = 2 * x;
+            int x1 = (x0 + 1 < src.width) ? x0 + 1 : x0;
+            out[x].blue = (top[x0].blue + top[x1].blue + bottom[x0].blue + bottom[x1].blue + 2) >> 2;
+            out[x].green = (top[x0].green + top[x1].green + bottom[x0].green + bottom[x1].green + 2) >> 2;
+            out[x].red = (top[x0].red + top[x1].red + bottom[x0].red + bottom[x1].red + 2) >> 2;
+        }
+        result = write_buffer(out_fd, row, bitmap_row_size(width));
+    }
+
+    free(top);
+    free(bottom);
+    free(row);
+    close(out_fd);
+    close_bitmap_file(&src);
+    if (result == -1) {
+        unlink(tmp_path);
+        return -1;
+    }
+    return cache_commit(tmp_path, name, image);
+}
+
+
+int build_pyramid(const char *image) {
+    char path[MAX_PATH];
+    BitmapFile file;
+    snprintf(path, sizeof(path), "%s%s", IMAGE_DIR, image);
+    if (open_bitmap_file(path, &file) == -1) {
+        return -1;
+    }
+    int levels = num_levels(file.width, file.height);
+    close_bitmap_file(&file);
+    return level_path(image, levels - 1, path, sizeof(path));
+}
+
+
+/*
+ * Read the <width> x <height> pixels of <file> whose top left corner is at
+ * (<x>, <y>) into a new bitmap. Return NULL on failure.
+ */
+Bitmap *read_region(const BitmapFile *file, int x, int y, int width, int height) {
+    Bitmap *region = new_bitmap(width, height);
+    for (int row = 0; row < height; row++) {
+        // The new bitmap's rows are stored bottom-up.
+        Pixel *dest = region->pixels + (long) (height - 1 - row) * width;
+        if (read_bitmap_row(file, y + row, x, width, dest) == -1) {
+            free_bitmap(region);
+            return NULL;
+        }
+    }
+    return region;
+}
+
+
+/*
+ * Apply <filter> to <region>. Return the newly allocated output pixels, or
+ * NULL if the filter failed.
+ */
+Pixel *filter_region(const char *filter, const Bitmap *region) {
+    const BuiltinFilter *builtin = find_builtin_filter(filter);
+    if (builtin != NULL) {
+        return run_builtin_filter(builtin, region);
+    }
+
+    // Anything else runs on the region written out as a bitmap of its own.
+    int in_fd = memfd_create("tile-input", MFD_CLOEXEC);
+    int out_fd = memfd_create("tile-output", MFD_CLOEXEC);
+    Pixel *out = NULL;
+    if (in_fd != -1 && out_fd != -1 &&
+            write_bitmap(in_fd, region, region->pixels) == 0 &&
+            lseek(in_fd, 0, SEEK_SET) == 0) {
+        int status = run_filter(filter, in_fd, out_fd);
+        if (status != -1 && WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+            char path[MAX_PATH];
+            snprintf(path, sizeof(path), "/proc/self/fd/%d", out_fd);
+            Bitmap *result = read_bitmap(path);
+            if (result != NULL && result->width == region->width &&
+                    result->height == region->height) {
+                out = result->pixels;
+                result->pixels = NULL;
+            }
+            if (result != NULL) {
+                free_bitmap(result);
+            }
+        }
+    }
+    if (in_fd != -1) {
+        close(in_fd);
+    }
+    if (out_fd != -1) {
+        close(out_fd);
+    }
+    return out;
+}
+
+
+void tile_response(int fd, const ReqData *reqData) {
+    // The image name is the first path segment after the prefix.
+    const char *rest = reqData->path + strlen(TILES_PREFIX);
+    const char *slash = strchr(rest, '/');
+    int len = (slash != NULL) ? slash - rest : strlen(rest);
+    char image[NAME_MAX + 1];
+    if (len == 0 || len >= (int) sizeof(image)) {
+        not_found_response(fd);
+        return;
+    }
+    memcpy(image, rest, len);
+    image[len] = '\0';
+    if (slash == NULL) {
+        tile_info_response(fd, image);
+        return;
+    }
+
+    int z, x, y;
+    int end = 0;
+    if (sscanf(slash, "/%d/%d/%d%n", &z, &x, &y, &end) != 3 || slash[end] != '\0') {
+        bad_request_response(fd, "Tiles are requested as /tiles/<image>/<z>/<x>/<y>.");
+        return;
+    }
+
+    const char *filter = get_param(reqData, "filter");
+    if (filter != NULL && *filter == '\0') {
+        filter = NULL;
+    }
+    if (filter != NULL) {
+        char filepath[MAX_PATH];
+        snprintf(filepath, sizeof(filepath), "%s%s", FILTER_DIR, filter);
+        if (strchr(filter, '/') != NULL || strcmp(filter, CONVOLVE_FILTER) == 0 ||
+                (find_builtin_filter(filter) == NULL && access(filepath, X_OK) != 0)) {
+            bad_request_response(fd, "The filter doesn't exist or can't be applied to tiles.");
+            return;
+        }
+    }
+
+    char name[MAX_PATH];
+    char entry[MAX_PATH];
+    char path[MAX_PATH];
+    snprintf(name, sizeof(name), "%s%s", TILE_CACHE_PREFIX,
+             (filter != NULL) ? filter : UNFILTERED_TILES);
+    snprintf(entry, sizeof(entry), "%s@%d-%d-%d", image, z, x, y);
+    if (cache_lookup_entry(name, entry, image, path, sizeof(path))) {
+        cached_image_response(fd, path);
+        return;
+    }
+
+    unsigned long read_start = trace_now();
+    BitmapFile file;
+    snprintf(path, sizeof(path), "%s%s", IMAGE_DIR, image);
+    if (open_bitmap_file(path, &file) == -1) {
+        not_found_response(fd);
+        return;
+    }
+    int levels = num_levels(file.width, file.height);
+    close_bitmap_file(&file);
+    if (z < 0 || z >= levels) {
+        not_found_response(fd);
+        return;
+    }
+    if (level_path(image, levels - 1 - z, path, sizeof(path)) == -1 ||
+            open_bitmap_file(path, &file) == -1) {
+        internal_server_error_response(fd, "Couldn't build the image pyramid.");
+        return;
+    }
+    if (x < 0 || y < 0 || x >= (file.width + TILE_SIZE - 1) / TILE_SIZE ||
+            y >= (file.height + TILE_SIZE - 1) / TILE_SIZE) {
+        close_bitmap_file(&file);
+        not_found_response(fd);
+        return;
+    }
+
+    // The tile, and the region around it that the filter gets to see.
+    int tile_x = x * TILE_SIZE;
+    int tile_y = y * TILE_SIZE;
+    int tile_width = (file.width - tile_x < TILE_SIZE) ? file.width - tile_x : TILE_SIZE;
+    int tile_height = (file.height - tile_y < TILE_SIZE) ? file.height - tile_y : TILE_SIZE;
+    int apron = (filter != NULL) ? TILE_APRON : 0;
+    int region_x = (tile_x - apron > 0) ? tile_x - apron : 0;
+    int region_y = (tile_y - apron > 0) ? tile_y - apron : 0;
+    int region_right = (tile_x + tile_width + apron < file.width) ?
+                       tile_x + tile_width + apron : file.width;
+    int region_bottom = (tile_y + tile_height + apron < file.height) ?
+                        tile_y + tile_height + apron : file.height;
+    int region_width = region_right - region_x;
+    int region_height = region_bottom - region_y;
+
+    Bitmap *region = read_region(&file, region_x, region_y, region_width, region_height);
+    close_bitmap_file(&file);
+    if (region == NULL) {
+        internal_server_error_response(fd, "Couldn't read the tile.");
+        return;
+    }
+    trace_span("tile_read", read_start, trace_now());
+
+    Pixel *pixels = region->pixels;
+    if (filter != NULL) {
+        unsigned long filter_start = trace_now();
+        pixels = filter_region(filter, region);
+        trace_span("filter", filter_start, trace_now());
+        if (pixels == NULL) {
+            free_bitmap(region);
+            internal_server_error_response(fd, "The filter failed on the tile.");
+            return;
+        }
+    }
+
+    // Crop the apron off; both bitmaps store their rows bottom-up.
+    Bitmap *tile = new_bitmap(tile_width, tile_height);
+    for (int row = 0; row < tile_height; row++) {
+        int region_row = region_height - 1 - (tile_y - region_y + row);
+        memcpy(tile->pixels + (long) (tile_height - 1 - row) * tile_width,
+               pixels + (long) region_row * region_width + (tile_x - region_x),
+               sizeof(Pixel) * tile_width);
+    }
+    if (pixels != region->pixels) {
+        free(pixels);
+    }
+    free_bitmap(region);
+
+    computed_image_response(fd, name, entry, tile, tile->pixels);
+    free_bitmap(tile);
+}
+
+
+/*
+ * Respond with the dimensions of <image> and the number of zoom levels of
+ * its tiles, as JSON.
+ */
+void tile_info_response(int fd, const char *image) {
+    char path[MAX_PATH];
+    BitmapFile file;
+    snprintf(path, sizeof(path), "%s%s", IMAGE_DIR, image);
+    if (open_bitmap_file(path, &file) == -1) {
+        not_found_response(fd);
+        return;
+    }
+    close_bitmap_file(&file);
+
+    response_status = 200;
+    dprintf(fd, "HTTP/1.1 200 OK\r\n"
+                "Content-Type: application/json\r\n\r\n"
+                "{\"width\":%d,\"height\":%d,\"tile_size\":%d,\"levels\":%d}\n",
+            file.width, file.height, TILE_SIZE, num_levels(file.width, file.height));
+}
+
+
+static int write_buffer(int fd, const void *buf, long size) {
+    long written = 0;
+    while (written < size) {
+        ssize_t numWritten = write(fd, (const char *) buf + written, size - written);
+        if (numWritten <= 0) {
+            perror("write");
+            return -1;
+        }
+        written += numWritten;
+    }
+    return 0;
+}
@@ -0,0 +1,56 @@
+#ifndef TILES_H_
+#define TILES_H_
+
+#include "request.h"
+
+/*
+ * Deep-zoom tiles of an image, for viewing large bitmaps a screenful at a
+ * time:
+ *     /tiles/dog.bmp                  JSON: width, height, tile size, levels
+ *     /tiles/dog.bmp/<z>/<x>/<y>      one TILE_SIZE x TILE_SIZE tile
+ *     /tiles/dog.bmp/<z>/<x>/<y>?filter=edge_detection
+ *
+ * Zoom level 0 fits the whole image in a single tile and each level doubles
+ * the resolution, up to the image itself at the last one. Tiles are counted
+ * from the top left; those on the right and bottom edges may be smaller.
+ *
+ * The lower resolutions form a pyramid of halving images, each averaging
+ * 2x2 blocks of the one above, cached as CACHE_DIR/pyramid-<k>/<image> for
+ * k halvings. Levels are built on first access (or in the background after
+ * an upload), streaming two rows at a time, and tiles are read straight out
+ * of them a row segment at a time, so a tile costs the same whatever the
+ * size of the image.
+ *
+ * A filter (built in, or from filters/) is applied to the tile plus an
+ * apron of TILE_APRON pixels around it, so neighbouring tiles line up
+ * without seams. Every tile is cached on its own, as
+ * CACHE_DIR/tiles-<filter>/<image>@<z>-<x>-<y>.
+ */
+
+#define TILES_PREFIX "/tiles/"
+#define TILE_SIZE 256
+#define TILE_APRON 8                  // Enough for kernels up to 17x17.
+#define MAX_PYRAMID_LEVELS 24
+
+#define PYRAMID_CACHE_PREFIX "pyramid-"
+#define TILE_CACHE_PREFIX "tiles-"
+#define UNFILTERED_TILES "none"       // Stands in for the filter in cache names.
+
+
+/*
+ * Return 1 if the request is for a tile (or the tile layout) of an image.
+ */
+int is_tile_request(const ReqData *reqData);
+
+/*
+ * Respond to a tile request.
+ */
+void tile_response(int fd, const ReqData *reqData);
+
+/*
+ * Build every level of the pyramid of <image> that isn't cached yet.
+ * Return 0 on success, -1 on failure.
+ */
+int build_pyramid(const char *image);
+
+#endif /* TILES_H_ */
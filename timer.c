@@ -0,0 +1,175 @@
+#include <time.h>
+
+#include "timer.h"
+
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+
+// Helper function declarations.
+static void timer_insert(TimerWheel *wheel, Timer *timer);
+static void list_append(Timer *head, Timer *timer);
+static void list_remove(Timer *timer);
+static void cascade(TimerWheel *wheel, int level);
+
+
+unsigned long monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+void timer_wheel_init(TimerWheel *wheel) {
+    wheel->now = monotonic_ms() / TIMER_TICK_MS;
+    wheel->count = 0;
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        for (int i = 0; i < WHEEL_SIZE; i++) {
+            timer_init(&wheel->slots[level][i], NULL);
+        }
+    }
+}
+
+
+void timer_init(Timer *timer, void *data) {
+    timer->next = timer;
+    timer->prev = timer;
+    timer->expires = 0;
+    timer->data = data;
+}
+
+
+void timer_add(TimerWheel *wheel, Timer *timer, unsigned long timeout_ms) {
+    timer_del(wheel, timer);
+
+    // Round up, so a timer never fires early.
+    timer->expires = (monotonic_ms() + timeout_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    if (timer->expires <= wheel->now) {
+        timer->expires = wheel->now + 1;  // The current slot is already done.
+    }
+    timer_insert(wheel, timer);
+    wheel->count++;
+}
+
+
+void timer_del(TimerWheel *wheel, Timer *timer) {
+    if (timer_pending(timer)) {
+        list_remove(timer);
+        wheel->count--;
+    }
+}
+
+
+int timer_pending(const Timer *timer) {
+    return timer->next != timer;
+}
+
+
+int timer_wheel_advance(TimerWheel *wheel, Timer *expired) {
+    unsigned long target = monotonic_ms() / TIMER_TICK_MS;
+    int num_expired = 0;
+
+    while (wheel->now < target) {
+        wheel->now++;
+
+        // When a level wraps around, the next slot of the level above is
+        // due: spread its timers over the levels below.
+        for (int level = 1; level < WHEEL_LEVELS; level++) {
+            if ((wheel->now & ((1UL << (WHEEL_BITS * level)) - 1)) != 0) {
+                break;
+            }
+            cascade(wheel, level);
+        }
+
+        Timer *slot = &wheel->slots[0][wheel->now & WHEEL_MASK];
+        while (timer_pending(slot)) {
+            Timer *timer = slot->next;
+            list_remove(timer);
+            list_append(expired, timer);
+            wheel->count--;
+            num_expired++;
+        }
+    }
+    return num_expired;
+}
+
+
+Timer *timer_next_expired(Timer *expired) {
+    if (!timer_pending(expired)) {
+        return NULL;
+    }
+    Timer *timer = expired->next;
+    list_remove(timer);
+    return timer;
+}
+
+
+unsigned long timer_wheel_next_ms(TimerWheel *wheel, unsigned long max_ms) {
+    if (wheel->count == 0) {
+        return max_ms;
+    }
+
+    // Look for the nearest timer on level 0; failing that, wake up when
+    // level 0 wraps around and the level above cascades.
+    unsigned long ticks = WHEEL_SIZE - (wheel->now & WHEEL_MASK);
+    for (unsigned long k = 1; k < ticks; k++) {
+        if (timer_pending(&wheel->slots[0][(wheel->now + k) & WHEEL_MASK])) {
+            ticks = k;
+            break;
+        }
+    }
+
+    // The wheel may be lagging behind the clock.
+    unsigned long target = wheel->now + ticks;
+    unsigned long now = monotonic_ms() / TIMER_TICK_MS;
+    if (target <= now) {
+        return 0;
+    }
+    unsigned long ms = (target - now) * TIMER_TICK_MS;
+    return (ms < max_ms) ? ms : max_ms;
+}
+
+
+/*
+ * Put a timer on the lowest level whose range still contains its expiry.
+ * That is the lowest level above which the expiry and the current tick
+ * agree on every digit, so the timer's slot is always ahead of the
+ * current position on that level.
+ */
+static void timer_insert(TimerWheel *wheel, Timer *timer) {
+    if (timer->expires < wheel->now) {
+        timer->expires = wheel->now;
+    }
+
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 &&
+            ((timer->expires ^ wheel->now) >> (WHEEL_BITS * (level + 1))) != 0) {
+        level++;
+    }
+    int index = (timer->expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    list_append(&wheel->slots[level][index], timer);
+}
+
+
+static void list_append(Timer *head, Timer *timer) {
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+
+static void list_remove(Timer *timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = timer;
+    timer->prev = timer;
+}
+
+
+static void cascade(TimerWheel *wheel, int level) {
+    Timer *slot = &wheel->slots[level][(wheel->now >> (WHEEL_BITS * level)) & WHEEL_MASK];
+    while (timer_pending(slot)) {
+        Timer *timer = slot->next;
+        list_remove(timer);
+        timer_insert(wheel, timer);
+    }
+}
@@ -0,0 +1,83 @@
+#ifndef TIMER_H_
+#define TIMER_H_
+
+/*
+ * A hierarchical timer wheel. Adding and removing a timer are O(1), and
+ * advancing the wheel collects every expired timer in one batch.
+ *
+ * Level 0 has one slot per tick; each level above covers WHEEL_SIZE times
+ * the range of the level below. Timers move down a level ("cascade") when
+ * the wheel reaches their slot, until they expire from level 0.
+ */
+
+#define TIMER_TICK_MS 10
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4          // 64^4 ticks of 10ms: about 46 hours.
+
+typedef struct timer {
+    struct timer *next;
+    struct timer *prev;
+    unsigned long expires;      // In ticks.
+    void *data;                 // Whatever the owner wants back on expiry.
+} Timer;
+
+typedef struct {
+    unsigned long now;          // The current tick.
+    int count;                  // Number of scheduled timers.
+    Timer slots[WHEEL_LEVELS][WHEEL_SIZE];  // Sentinels of circular lists.
+} TimerWheel;
+
+
+/*
+ * Return the current time of the monotonic clock, in milliseconds.
+ */
+unsigned long monotonic_ms(void);
+
+/*
+ * Initialize an empty wheel whose clock starts at the current time.
+ */
+void timer_wheel_init(TimerWheel *wheel);
+
+/*
+ * Initialize a timer that is not on any wheel.
+ */
+void timer_init(Timer *timer, void *data);
+
+/*
+ * (Re)schedule a timer to expire <timeout_ms> from now.
+ */
+void timer_add(TimerWheel *wheel, Timer *timer, unsigned long timeout_ms);
+
+/*
+ * Remove a timer from its wheel. Does nothing if it isn't scheduled.
+ */
+void timer_del(TimerWheel *wheel, Timer *timer);
+
+/*
+ * Return 1 if the timer is currently scheduled, 0 otherwise.
+ */
+int timer_pending(const Timer *timer);
+
+/*
+ * Advance the wheel to the current time. Every timer that has expired is
+ * removed from the wheel and added to the circular list headed by <expired>
+ * (which must have been initialized with timer_init).
+ * Return the number of expired timers.
+ */
+int timer_wheel_advance(TimerWheel *wheel, Timer *expired);
+
+/*
+ * Remove and return the first timer of a list filled by timer_wheel_advance,
+ * or NULL if the list is empty.
+ */
+Timer *timer_next_expired(Timer *expired);
+
+/*
+ * Return how long the caller may sleep before it must advance the wheel
+ * again, in milliseconds and capped at <max_ms>. This never overshoots the
+ * next expiry, but may wake the caller early to cascade higher levels.
+ */
+unsigned long timer_wheel_next_ms(TimerWheel *wheel, unsigned long max_ms);
+
+#endif /* TIMER_H_ */
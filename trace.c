@@ -0,0 +1,189 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "trace.h"
+
+// One recorded event.
+typedef struct {
+    unsigned long ticket;     // Position in the ring plus 1, or 0 while being written.
+    unsigned long request;
+    unsigned long start_us;
+    unsigned long dur_us;
+    int pid;                  // The process that recorded it.
+    char phase;               // 'X' for a span, 'i' for an instant.
+    char name[TRACE_NAME_LEN];
+} TraceEvent;
+
+typedef struct {
+    unsigned long head;       // Number of events ever recorded into the ring.
+    int acceptor;             // pid of the acceptor that owns the ring.
+    TraceEvent events[TRACE_RING_SIZE];
+} TraceRing;
+
+typedef struct {
+    int sample_every;
+    unsigned long next_request;
+    TraceRing rings[MAX_TRACE_RINGS];
+} TraceShared;
+
+// NULL when tracing is off.
+static TraceShared *shared = NULL;
+static TraceRing *ring = NULL;
+static unsigned long current_request = 0;
+static unsigned long num_dispatched = 0;
+
+// Helper function declarations.
+void record_event(unsigned long request, const char *name, char phase,
+                  unsigned long start_us, unsigned long dur_us);
+
+
+void init_trace(int sample_every) {
+    if (sample_every <= 0) {
+        return;
+    }
+    // Pages are only touched as rings fill up, so unused rings cost nothing.
+    shared = mmap(NULL, sizeof(TraceShared), PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    shared->sample_every = sample_every;
+    trace_set_ring(0);
+}
+
+
+void trace_set_ring(int index) {
+    if (shared == NULL) {
+        return;
+    }
+    ring = &shared->rings[index % MAX_TRACE_RINGS];
+    ring->acceptor = getpid();
+}
+
+
+unsigned long trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+
+unsigned long trace_begin_request(void) {
+    if (shared == NULL || num_dispatched++ % shared->sample_every != 0) {
+        return 0;
+    }
+    current_request = __atomic_add_fetch(&shared->next_request, 1, __ATOMIC_RELAXED);
+    return current_request;
+}
+
+
+void trace_end_request(void) {
+    current_request = 0;
+}
+
+
+unsigned long trace_current_request(void) {
+    return current_request;
+}
+
+
+void trace_span(const char *name, unsigned long start_us, unsigned long end_us) {
+    if (current_request != 0) {
+        record_event(current_request, name, 'X', start_us, end_us - start_us);
+    }
+}
+
+
+void trace_instant(const char *name, unsigned long time_us) {
+    if (current_request != 0) {
+        record_event(current_request, name, 'i', time_us, 0);
+    }
+}
+
+
+void trace_request_span(unsigned long request, const char *name,
+                        unsigned long start_us, unsigned long end_us) {
+    if (request != 0) {
+        record_event(request, name, 'X', start_us, end_us - start_us);
+    }
+}
+
+
+/*
+ * Claim the next slot in this process's ring and fill it in. The ticket is
+ * cleared first and published last, so a reader copying the slot at the
+ * same time can tell that its copy is torn.
+ */
+void record_event(unsigned long request, const char *name, char phase,
+                  unsigned long start_us, unsigned long dur_us) {
+    if (ring == NULL) {
+        return;
+    }
+    unsigned long ticket = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED);
+    TraceEvent *event = &ring->events[ticket % TRACE_RING_SIZE];
+
+    __atomic_store_n(&event->ticket, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    event->request = request;
+    event->start_us = start_us;
+    event->dur_us = dur_us;
+    event->pid = getpid();
+    event->phase = phase;
+    strncpy(event->name, name, TRACE_NAME_LEN - 1);
+    event->name[TRACE_NAME_LEN - 1] = '\0';
+    __atomic_store_n(&event->ticket, ticket + 1, __ATOMIC_RELEASE);
+}
+
+
+void write_trace_json(int fd) {
+    FILE *out = fdopen(dup(fd), "w");
+    if (out == NULL) {
+        perror("fdopen");
+        return;
+    }
+
+    // Each acceptor shows up as a process, and each request as a thread.
+    fprintf(out, "{\"traceEvents\":[");
+    const char *separator = "\n";
+    for (int r = 0; shared != NULL && r < MAX_TRACE_RINGS; r++) {
+        TraceRing *current = &shared->rings[r];
+        unsigned long head = __atomic_load_n(&current->head, __ATOMIC_ACQUIRE);
+        if (head == 0) {
+            continue;
+        }
+        fprintf(out, "%s{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+                     "\"args\":{\"name\":\"acceptor %d\"}}",
+                separator, current->acceptor, current->acceptor);
+        separator = ",\n";
+
+        unsigned long first = (head > TRACE_RING_SIZE) ? head - TRACE_RING_SIZE : 0;
+        for (unsigned long ticket = first; ticket < head; ticket++) {
+            TraceEvent *event = &current->events[ticket % TRACE_RING_SIZE];
+            if (__atomic_load_n(&event->ticket, __ATOMIC_ACQUIRE) != ticket + 1) {
+                continue;  // Still being written, or already overwritten.
+            }
+            TraceEvent copy = *event;
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&event->ticket, __ATOMIC_RELAXED) != ticket + 1) {
+                continue;
+            }
+
+            fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%lu,", copy.name,
+                    copy.phase, copy.start_us);
+            if (copy.phase == 'X') {
+                fprintf(out, "\"dur\":%lu,", copy.dur_us);
+            } else {
+                fprintf(out, "\"s\":\"t\",");
+            }
+            fprintf(out, "\"pid\":%d,\"tid\":%lu,\"args\":{\"process\":%d}}",
+                    current->acceptor, copy.request, copy.pid);
+        }
+    }
+    fprintf(out, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    fclose(out);
+}
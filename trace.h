@@ -0,0 +1,74 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+/*
+ * Lightweight per-request tracing. The spans of sampled requests are
+ * recorded with monotonic timestamps into ring buffers in memory shared by
+ * every process the server forks (one ring per acceptor, which its request
+ * processes write into too), and GET /debug/trace returns them as Chrome
+ * trace JSON, to load in chrome://tracing or Perfetto.
+ *
+ * Recording an event is a few stores and one atomic increment, and requests
+ * that aren't sampled record nothing, so tracing can stay on.
+ */
+
+#define DEBUG_TRACE "/debug/trace"
+
+#define MAX_TRACE_RINGS 64        // Acceptors beyond this share rings.
+#define TRACE_RING_SIZE 4096      // Events kept per ring; older ones are overwritten.
+#define TRACE_NAME_LEN 24
+
+
+/*
+ * Set up the shared rings, tracing one request in every <sample_every>
+ * (0 turns tracing off). Must be called before the first fork.
+ */
+void init_trace(int sample_every);
+
+/*
+ * Make the calling acceptor process (and the processes it forks) record
+ * into the ring with the given index.
+ */
+void trace_set_ring(int index);
+
+/*
+ * Return the current monotonic time in microseconds.
+ */
+unsigned long trace_now(void);
+
+/*
+ * Decide whether the request about to be dispatched is sampled. If so, it
+ * becomes the current request of this process (and of the processes it
+ * forks from now on) and its id is returned; otherwise return 0.
+ */
+unsigned long trace_begin_request(void);
+
+/*
+ * Stop attributing events of this process to the current request.
+ */
+void trace_end_request(void);
+
+/*
+ * Return the id of the current request, or 0 if it isn't being traced.
+ */
+unsigned long trace_current_request(void);
+
+/*
+ * Record a span [start_us, end_us) or an instant event at start_us for the
+ * current request. These do nothing if it isn't being traced.
+ */
+void trace_span(const char *name, unsigned long start_us, unsigned long end_us);
+void trace_instant(const char *name, unsigned long time_us);
+
+/*
+ * Record a span for the given request, e.g. one that ended in another process.
+ */
+void trace_request_span(unsigned long request, const char *name,
+                        unsigned long start_us, unsigned long end_us);
+
+/*
+ * Write the events in every ring to fd as a Chrome trace JSON object.
+ */
+void write_trace_json(int fd);
+
+#endif /* TRACE_H_ */
@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tune.h"
+#include "isa.h"
+#include "parallel.h"
+#include "bitmap.h"
+#include "convolve.h"
+#include "blur.h"
+#include "trace.h"
+
+// The workload: a 5x5 binomial convolution and a sigma=3 blur.
+#define TUNE_KERNEL "1,4,6,4,1,4,16,24,16,4,6,24,36,24,6,4,16,24,16,4,1,4,6,4,1"
+#define TUNE_SIGMA 3.0
+
+static const int tune_strips[] = {16, 32, 64, 128};
+
+typedef struct {
+    int threads;
+    int strip;                // 0 for rows split evenly.
+    double mpixels_per_sec;
+} TuneResult;
+
+// Filled in before the acceptors are forked, so they all report it.
+static TuneResult results[MAX_TUNE_CANDIDATES];
+static int num_results = 0;
+static double tune_ms = 0;
+
+// Helper function declarations.
+Bitmap *synthetic_bitmap(void);
+double measure(const Bitmap *bmp, Pixel *out, int threads, int strip);
+void describe_strip(char *buf, int size, int strip);
+
+
+/*
+ * Return a bitmap with smooth gradients and some noise, much like a photo
+ * as far as the kernels are concerned. It has no header.
+ */
+Bitmap *synthetic_bitmap(void) {
+    Bitmap *bmp = calloc(1, sizeof(Bitmap));
+    bmp->width = TUNE_WIDTH;
+    bmp->height = TUNE_HEIGHT;
+    bmp->pixels = malloc(sizeof(Pixel) * TUNE_WIDTH * TUNE_HEIGHT);
+    unsigned int seed = 1;
+    for (int y = 0; y < TUNE_HEIGHT; y++) {
+        for (int x = 0; x < TUNE_WIDTH; x++) {
+            seed = seed * 1103515245 + 12345;
+            int noise = (seed >> 16) & 0x1f;
+            Pixel *p = &bmp->pixels[(long) y * TUNE_WIDTH + x];
+            p->blue = (x * 255 / TUNE_WIDTH + noise) & 0xff;
+            p->green = (y * 255 / TUNE_HEIGHT + noise) & 0xff;
+            p->red = ((x + y) * 127 / TUNE_HEIGHT + noise) & 0xff;
+        }
+    }
+    return bmp;
+}
+
+
+/*
+ * Return the throughput of the workload with the given settings, in
+ * millions of pixels a second, from the fastest of TUNE_RUNS runs.
+ */
+double measure(const Bitmap *bmp, Pixel *out, int threads, int strip) {
+    Kernel kernel;
+    parse_kernel(TUNE_KERNEL, NULL, &kernel);
+    parallel_threads = threads;
+    parallel_strip = strip;
+
+    unsigned long best = 0;
+    for (int run = 0; run < TUNE_RUNS; run++) {
+        unsigned long start = trace_now();
+        convolve_image(&kernel, bmp, out);
+        gaussian_blur_sigma(bmp, out, TUNE_SIGMA);
+        unsigned long elapsed = trace_now() - start;
+        if (run == 0 || elapsed < best) {
+            best = elapsed;
+        }
+    }
+    double rate = 2.0 * bmp->width * bmp->height / (best ? best : 1);
+    if (num_results < MAX_TUNE_CANDIDATES) {
+        results[num_results++] = (TuneResult) {threads, strip, rate};
+    }
+    return rate;
+}
+
+
+void tune_kernels(int threads, int strip) {
+    unsigned long start = trace_now();
+    Bitmap *bmp = synthetic_bitmap();
+    Pixel *out = malloc(sizeof(Pixel) * bmp->width * bmp->height);
+
+    // First the thread count, with the rows split evenly between them.
+    parallel_threads = 0;
+    int max_threads = parallel_thread_count();
+    int best_threads = (threads > 0) ? threads : 1;
+    int best_strip = (strip > 0) ? strip : 0;
+    double best = measure(bmp, out, best_threads, best_strip);
+    for (int t = 1; threads <= 0 && t < max_threads; ) {
+        t = (t * 2 < max_threads) ? t * 2 : max_threads;
+        double rate = measure(bmp, out, t, best_strip);
+        if (rate > best * TUNE_MIN_GAIN) {
+            best = rate;
+            best_threads = t;
+        }
+    }
+
+    // Then strips, which only matter with more than one thread.
+    for (int i = 0; strip <= 0 && best_threads > 1 &&
+            i < sizeof(tune_strips) / sizeof(tune_strips[0]); i++) {
+        double rate = measure(bmp, out, best_threads, tune_strips[i]);
+        if (rate > best * TUNE_MIN_GAIN) {
+            best = rate;
+            best_strip = tune_strips[i];
+        }
+    }
+
+    parallel_threads = best_threads;
+    parallel_strip = best_strip;
+    tune_ms = (trace_now() - start) / 1e3;
+    free(out);
+    free_bitmap(bmp);
+
+    char strip_name[32];
+    describe_strip(strip_name, sizeof(strip_name), best_strip);
+    fprintf(stderr, "Kernels: %s (CPU supports %s); in-process filters use %d thread%s, %s: "
+                    "%.1f Mpixel/s, tuned in %.0f ms\n",
+            isa_name(active_isa), isa_name(detected_isa), best_threads,
+            (best_threads == 1) ? "" : "s", strip_name, best, tune_ms);
+}
+
+
+void describe_strip(char *buf, int size, int strip) {
+    if (strip > 0) {
+        snprintf(buf, size, "%d-row strips", strip);
+    } else {
+        snprintf(buf, size, "rows split evenly");
+    }
+}
+
+
+void write_kernel_report(int fd) {
+    const char *requested = getenv(ISA_ENV);
+    dprintf(fd, "# Kernels: %s (CPU supports %s, %s=%s)\n", isa_name(active_isa),
+            isa_name(detected_isa), ISA_ENV, requested ? requested : "(unset)");
+    char strip_name[32];
+    describe_strip(strip_name, sizeof(strip_name), parallel_strip);
+    dprintf(fd, "# In-process filters: threads %d, %s (tuned at startup in %.0f ms)\n",
+            parallel_thread_count(), strip_name, tune_ms);
+    dprintf(fd, "%-10s %10s %14s\n", "threads", "strip", "mpixel_per_s");
+    for (int i = 0; i < num_results; i++) {
+        char strip[16];
+        snprintf(strip, sizeof(strip), "%d", results[i].strip);
+        dprintf(fd, "%-10d %10s %14.1f\n", results[i].threads,
+                results[i].strip ? strip : "even", results[i].mpixels_per_sec);
+    }
+}
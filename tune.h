@@ -0,0 +1,35 @@
+#ifndef TUNE_H_
+#define TUNE_H_
+
+/*
+ * Startup tuning of the in-process filters (convolve and large blurs). How
+ * many threads pay off, and how many rows each should take at a time,
+ * depend on the host's cores, caches and memory bandwidth, so instead of
+ * fixed defaults the server times a few candidates on a synthetic image
+ * before it starts serving, and keeps the fastest:
+ *   1. thread counts 1, 2, 4, ... up to the CPUs available, rows split evenly;
+ *   2. with the best of those, strips of 16, 32, 64 and 128 rows taken in turn.
+ * A candidate must beat the best so far by TUNE_MIN_GAIN to replace it, so
+ * timing noise doesn't add threads or strips that don't help.
+ */
+
+#define TUNE_WIDTH 1024
+#define TUNE_HEIGHT 768
+#define TUNE_RUNS 3               // Per candidate; the fastest run counts.
+#define TUNE_MIN_GAIN 1.05
+#define MAX_TUNE_CANDIDATES 16
+
+
+/*
+ * Set parallel_threads and parallel_strip to the fastest candidates,
+ * except that <threads> or <strip> greater than 0 fix that setting, and log
+ * the result along with the kernel variant in use. Call after init_isa.
+ */
+void tune_kernels(int threads, int strip);
+
+/*
+ * Write the kernel variant and the tuning results, for /debug/metrics.
+ */
+void write_kernel_report(int fd);
+
+#endif /* TUNE_H_ */
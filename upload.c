@@ -0,0 +1,609 @@
+#define _GNU_SOURCE  // copy_file_range
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/random.h>
+#include <linux/fs.h>  // FICLONERANGE
+
+#include "upload.h"
+#include "bitmap.h"
+#include "cache.h"
+#include "precompute.h"
+#include "response.h"
+
+typedef struct {
+    char id[2 * UPLOAD_ID_BYTES + 1];
+    char dir[sizeof(UPLOAD_DIR) + 2 * UPLOAD_ID_BYTES];  // UPLOAD_DIR<id>
+    char name[NAME_MAX + 1];
+    long size;
+} UploadSession;
+
+// A range of the file, [start, end).
+typedef struct {
+    long start;
+    long end;
+} UploadRange;
+
+// Returned by load_parts for a session holding more than MAX_UPLOAD_PARTS.
+#define TOO_MANY_PARTS -2
+#define TOO_MANY_PARTS_MESSAGE "The upload has more parts than can be assembled; start a new one with larger parts."
+
+// Helper function declarations.
+int valid_image_name(const char *name);
+int open_session(const char *id, UploadSession *session);
+int load_parts(const UploadSession *session, UploadRange *parts);
+int find_gaps(const UploadSession *session, const UploadRange *parts, int num_parts, UploadRange *gaps);
+int copy_range(int out_fd, int in_fd, long in_offset, long out_offset, long length);
+void create_session_response(int fd, const ReqData *reqData);
+void put_part_response(ClientState *client, const UploadSession *session);
+void session_status_response(int fd, int status, const UploadSession *session);
+void finalize_response(int fd, const UploadSession *session);
+void expire_sessions(void);
+void remove_session(const char *dir_path);
+
+
+int is_upload_request(const ReqData *reqData) {
+    return strcmp(reqData->path, UPLOADS) == 0 ||
+        strncmp(reqData->path, UPLOADS "/", strlen(UPLOADS "/")) == 0;
+}
+
+
+void upload_response(ClientState *client) {
+    const ReqData *reqData = client->reqData;
+    int fd = client->sock;
+    if (strcmp(reqData->path, UPLOADS) == 0) {
+        if (strcmp(reqData->method, POST) == 0) {
+            create_session_response(fd, reqData);
+        } else {
+            not_found_response(fd);
+        }
+        return;
+    }
+
+    // The rest are for /uploads/<id>, or an action on it.
+    const char *id = reqData->path + strlen(UPLOADS "/");
+    const char *action = strchr(id, '/');
+    int id_len = (action != NULL) ? action - id : strlen(id);
+    char id_buf[2 * UPLOAD_ID_BYTES + 1];
+    UploadSession session;
+    if (id_len != 2 * UPLOAD_ID_BYTES) {
+        not_found_response(fd);
+        return;
+    }
+    memcpy(id_buf, id, id_len);
+    id_buf[id_len] = '\0';
+    if (open_session(id_buf, &session) == -1) {
+        not_found_response(fd);
+        return;
+    }
+
+    if (action == NULL && strcmp(reqData->method, PUT) == 0) {
+        put_part_response(client, &session);
+    } else if (action == NULL && strcmp(reqData->method, GET) == 0) {
+        session_status_response(fd, 200, &session);
+    } else if (action != NULL && strcmp(action, UPLOAD_FINALIZE) == 0 &&
+            strcmp(reqData->method, POST) == 0) {
+        finalize_response(fd, &session);
+    } else {
+        not_found_response(fd);
+    }
+}
+
+
+/*
+ * Return 1 if <name> can be used as the name of an image: a single path
+ * component that isn't hidden, and needs no escaping in JSON or a URL.
+ */
+int valid_image_name(const char *name) {
+    // Leave room for the prefix and suffix of the temporary file.
+    if (name[0] == '\0' || name[0] == '.' || strlen(name) > NAME_MAX - 32) {
+        return 0;
+    }
+    for (const char *c = name; *c != '\0'; c++) {
+        if (*c == '/' || *c == '"' || *c == '\\' || *c == '%' || (unsigned char) *c <= ' ') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+/*
+ * Fill in <session> from the session directory of <id>.
+ * Return 0 on success, -1 if there is no such session.
+ */
+int open_session(const char *id, UploadSession *session) {
+    for (const char *c = id; *c != '\0'; c++) {
+        if (!((*c >= '0' && *c <= '9') || (*c >= 'a' && *c <= 'f'))) {
+            return -1;
+        }
+    }
+    strcpy(session->id, id);
+    snprintf(session->dir, sizeof(session->dir), "%s%s", UPLOAD_DIR, id);
+
+    char path[MAX_PATH];
+    snprintf(path, sizeof(path), "%s/meta", session->dir);
+    FILE *meta = fopen(path, "r");
+    if (meta == NULL) {
+        return -1;
+    }
+    int matched = fscanf(meta, "%ld %255s", &session->size, session->name);
+    fclose(meta);
+    return (matched == 2) ? 0 : -1;
+}
+
+
+static int compare_ranges(const void *a, const void *b) {
+    const UploadRange *x = a;
+    const UploadRange *y = b;
+    if (x->start != y->start) {
+        return (x->start < y->start) ? -1 : 1;
+    }
+    return (x->end < y->end) ? -1 : (x->end > y->end);
+}
+
+
+/*
+ * Store the ranges of the parts received so far in <parts> (which has room
+ * for MAX_UPLOAD_PARTS), sorted by where they start.
+ * Return the number of parts, -1 if the session can't be read, or
+ * TOO_MANY_PARTS if it holds more than fit (rather than leaving any out).
+ */
+int load_parts(const UploadSession *session, UploadRange *parts) {
+    DIR *dir = opendir(session->dir);
+    if (dir == NULL) {
+        perror("opendir");
+        return -1;
+    }
+    int num_parts = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        long start;
+        long end;
+        int len = 0;
+        // Parts still being written are hidden, and don't match.
+        if (sscanf(entry->d_name, "%ld-%ld%n", &start, &end, &len) == 2 &&
+                entry->d_name[len] == '\0' && start >= 0 && start < end && end <= session->size) {
+            if (num_parts == MAX_UPLOAD_PARTS) {
+                fprintf(stderr, "Upload %s has more than %d parts\n", session->id, MAX_UPLOAD_PARTS);
+                closedir(dir);
+                return TOO_MANY_PARTS;
+            }
+            parts[num_parts].start = start;
+            parts[num_parts].end = end;
+            num_parts++;
+        }
+    }
+    closedir(dir);
+    qsort(parts, num_parts, sizeof(UploadRange), compare_ranges);
+    return num_parts;
+}
+
+
+/*
+ * Store the ranges of the file that none of the (sorted) <parts> cover in
+ * <gaps>, which needs room for num_parts + 1 of them.
+ * Return the number of gaps.
+ */
+int find_gaps(const UploadSession *session, const UploadRange *parts, int num_parts, UploadRange *gaps) {
+    int num_gaps = 0;
+    long covered = 0;  // Everything before this has arrived.
+    for (int i = 0; i < num_parts; i++) {
+        if (parts[i].start > covered) {
+            gaps[num_gaps].start = covered;
+            gaps[num_gaps].end = parts[i].start;
+            num_gaps++;
+        }
+        if (parts[i].end > covered) {
+            covered = parts[i].end;
+        }
+    }
+    if (covered < session->size) {
+        gaps[num_gaps].start = covered;
+        gaps[num_gaps].end = session->size;
+        num_gaps++;
+    }
+    return num_gaps;
+}
+
+
+/*
+ * Start a session for the image named by the query, and respond with its id.
+ */
+void create_session_response(int fd, const ReqData *reqData) {
+    const char *name = get_param(reqData, "name");
+    const char *size_param = get_param(reqData, "size");
+    if (name == NULL || !valid_image_name(name)) {
+        bad_request_response(fd, "The query param 'name' is missing or isn't a valid file name.");
+        return;
+    }
+    char *end = NULL;
+    long size = (size_param != NULL) ? strtol(size_param, &end, 10) : 0;
+    if (size_param == NULL || *end != '\0' || size < BMP_MIN_HEADER || size > INT_MAX) {
+        bad_request_response(fd, "The query param 'size' is missing or out of range.");
+        return;
+    }
+
+    char path[MAX_PATH];
+    snprintf(path, sizeof(path), "%s%s", IMAGE_DIR, name);
+    if (access(path, F_OK) == 0) {
+        bad_request_response(fd, "File already exists.");
+        return;
+    }
+
+    expire_sessions();
+    if (mkdir(UPLOAD_DIR, 0755) == -1 && errno != EEXIST) {
+        perror("mkdir");
+        internal_server_error_response(fd, "Couldn't start the upload.");
+        return;
+    }
+
+    unsigned char bytes[UPLOAD_ID_BYTES];
+    UploadSession session;
+    if (getrandom(bytes, sizeof(bytes), 0) != sizeof(bytes)) {
+        perror("getrandom");
+        internal_server_error_response(fd, "Couldn't start the upload.");
+        return;
+    }
+    for (int i = 0; i < UPLOAD_ID_BYTES; i++) {
+        sprintf(session.id + 2 * i, "%02x", bytes[i]);
+    }
+    snprintf(session.dir, sizeof(session.dir), "%s%s", UPLOAD_DIR, session.id);
+    if (mkdir(session.dir, 0700) == -1) {
+        perror("mkdir");
+        internal_server_error_response(fd, "Couldn't start the upload.");
+        return;
+    }
+
+    snprintf(path, sizeof(path), "%s/meta", session.dir);
+    FILE *meta = fopen(path, "w");
+    if (meta == NULL || fprintf(meta, "%ld %s\n", size, name) < 0 || fclose(meta) != 0) {
+        perror("meta");
+        remove_session(session.dir);
+        internal_server_error_response(fd, "Couldn't start the upload.");
+        return;
+    }
+
+    response_status = 201;
+    dprintf(fd, "HTTP/1.1 201 Created\r\n"
+                "Content-Type: application/json\r\n"
+                "Location: " UPLOADS "/%s\r\n\r\n"
+                "{\"id\":\"%s\",\"name\":\"%s\",\"size\":%ld}\n",
+            session.id, session.id, name, size);
+}
+
+
+/*
+ * Store the body of the request as the part of the file starting at the
+ * offset in the query, and respond with the status of the session.
+ *
+ * If the body stops short (the connection dropped, say), whatever did
+ * arrive is kept as a shorter part, so only the rest has to be sent again.
+ */
+void put_part_response(ClientState *client, const UploadSession *session) {
+    int fd = client->sock;
+    const char *offset_param = get_param(client->reqData, "offset");
+    char *end = NULL;
+    long offset = (offset_param != NULL) ? strtol(offset_param, &end, 10) : -1;
+    if (offset_param == NULL || *end != '\0' || offset < 0 || offset >= session->size) {
+        bad_request_response(fd, "The query param 'offset' is missing or out of range.");
+        return;
+    }
+    if (begin_body(client) == -1) {
+        bad_request_response(fd, "Couldn't read the request headers.");
+        return;
+    }
+    long limit = session->size - offset;
+    if (client->body_length > limit) {
+        bad_request_response(fd, "The part runs past the end of the file.");
+        return;
+    }
+
+    // A session takes no more parts than finalizing can assemble. (Parts
+    // sent in parallel can still overshoot; finalizing then says so.)
+    UploadRange *parts = malloc(sizeof(UploadRange) * MAX_UPLOAD_PARTS);
+    int num_parts = load_parts(session, parts);
+    free(parts);
+    if (num_parts == -1) {
+        internal_server_error_response(fd, "Couldn't read the upload.");
+        return;
+    } else if (num_parts == TOO_MANY_PARTS || num_parts == MAX_UPLOAD_PARTS) {
+        conflict_response(fd, TOO_MANY_PARTS_MESSAGE);
+        return;
+    }
+
+    char tmp_path[MAX_PATH];
+    snprintf(tmp_path, sizeof(tmp_path), "%s/.part.%d", session->dir, getpid());
+    int part_fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (part_fd == -1) {
+        perror("open");
+        internal_server_error_response(fd, "Couldn't store the part.");
+        return;
+    }
+
+    char *data = malloc(UPLOAD_BUFFER_SIZE);
+    long total = 0;
+    int numRead;
+    int overrun = 0;
+    // Ask for one byte more than fits, to catch bodies that run over.
+    while ((numRead = read_body(client, data, (limit + 1 - total < UPLOAD_BUFFER_SIZE) ?
+                                              limit + 1 - total : UPLOAD_BUFFER_SIZE)) > 0) {
+        if (total + numRead > limit) {
+            overrun = 1;
+            break;
+        }
+        for (int written = 0; written < numRead; ) {
+            int numWritten = write(part_fd, data + written, numRead - written);
+            if (numWritten <= 0) {
+                perror("write");
+                free(data);
+                close(part_fd);
+                unlink(tmp_path);
+                internal_server_error_response(fd, "Couldn't store the part.");
+                return;
+            }
+            written += numWritten;
+        }
+        total += numRead;
+    }
+    free(data);
+    close(part_fd);
+    if (overrun || total == 0) {
+        unlink(tmp_path);
+        bad_request_response(fd, overrun ? "The part runs past the end of the file." : "The part is empty.");
+        return;
+    }
+
+    char part_path[MAX_PATH];
+    snprintf(part_path, sizeof(part_path), "%s/%ld-%ld", session->dir, offset, offset + total);
+    if (rename(tmp_path, part_path) == -1) {
+        perror("rename");
+        unlink(tmp_path);
+        internal_server_error_response(fd, "Couldn't store the part.");
+        return;
+    }
+    if (numRead == -1) {
+        bad_request_response(fd, "Couldn't read the whole part.");
+    } else {
+        session_status_response(fd, 200, session);
+    }
+}
+
+
+/*
+ * Respond with how much of the file has arrived and the ranges still
+ * missing, as JSON.
+ */
+void session_status_response(int fd, int status, const UploadSession *session) {
+    UploadRange *parts = malloc(sizeof(UploadRange) * (2 * MAX_UPLOAD_PARTS + 1));
+    UploadRange *gaps = parts + MAX_UPLOAD_PARTS;
+    int num_parts = load_parts(session, parts);
+    if (num_parts == -1) {
+        free(parts);
+        internal_server_error_response(fd, "Couldn't read the upload.");
+        return;
+    } else if (num_parts == TOO_MANY_PARTS) {
+        free(parts);
+        conflict_response(fd, TOO_MANY_PARTS_MESSAGE);
+        return;
+    }
+    int num_gaps = find_gaps(session, parts, num_parts, gaps);
+    long received = session->size;
+    for (int i = 0; i < num_gaps; i++) {
+        received -= gaps[i].end - gaps[i].start;
+    }
+
+    response_status = status;
+    dprintf(fd, "HTTP/1.1 %s\r\n"
+                "Content-Type: application/json\r\n\r\n"
+                "{\"id\":\"%s\",\"name\":\"%s\",\"size\":%ld,\"received\":%ld,\"missing\":[",
+            (status == 200) ? "200 OK" : "409 Conflict",
+            session->id, session->name, session->size, received);
+    for (int i = 0; i < num_gaps; i++) {
+        dprintf(fd, "%s[%ld,%ld]", i ? "," : "", gaps[i].start, gaps[i].end);
+    }
+    dprintf(fd, "]}\n");
+    free(parts);
+}
+
+
+/*
+ * Assemble the parts into the image, if they cover all of it, and end the
+ * session. Responds 409 with the missing ranges if they don't.
+ */
+void finalize_response(int fd, const UploadSession *session) {
+    UploadRange *parts = malloc(sizeof(UploadRange) * (2 * MAX_UPLOAD_PARTS + 1));
+    UploadRange *gaps = parts + MAX_UPLOAD_PARTS;
+    int num_parts = load_parts(session, parts);
+    if (num_parts == -1) {
+        free(parts);
+        internal_server_error_response(fd, "Couldn't read the upload.");
+        return;
+    } else if (num_parts == TOO_MANY_PARTS) {
+        free(parts);
+        conflict_response(fd, TOO_MANY_PARTS_MESSAGE);
+        return;
+    }
+    if (find_gaps(session, parts, num_parts, gaps) > 0) {
+        free(parts);
+        session_status_response(fd, 409, session);
+        return;
+    }
+
+    // Build the image under a hidden name, so nothing sees it half done.
+    char tmp_path[MAX_PATH];
+    char path[MAX_PATH];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%s.%d", IMAGE_DIR, session->name, getpid());
+    snprintf(path, sizeof(path), "%s%s", IMAGE_DIR, session->name);
+    int out_fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd == -1) {
+        perror("open");
+        free(parts);
+        internal_server_error_response(fd, "Couldn't assemble the upload.");
+        return;
+    }
+
+    // Overlapping parts are fine; each byte is taken from the first one.
+    long covered = 0;
+    int result = 0;
+    for (int i = 0; i < num_parts && result == 0; i++) {
+        if (parts[i].end <= covered) {
+            continue;
+        }
+        char part_path[MAX_PATH];
+        snprintf(part_path, sizeof(part_path), "%s/%ld-%ld", session->dir, parts[i].start, parts[i].end);
+        int in_fd = open(part_path, O_RDONLY);
+        long from = (parts[i].start > covered) ? parts[i].start : covered;
+        result = (in_fd == -1) ? -1 :
+            copy_range(out_fd, in_fd, from - parts[i].start, from, parts[i].end - from);
+        if (in_fd != -1) {
+            close(in_fd);
+        }
+        covered = parts[i].end;
+    }
+    free(parts);
+    if (close(out_fd) == -1 || result == -1) {
+        unlink(tmp_path);
+        internal_server_error_response(fd, "Couldn't assemble the upload.");
+        return;
+    }
+
+    BitmapFile file;
+    if (open_bitmap_file(tmp_path, &file) == -1) {
+        unlink(tmp_path);
+        bad_request_response(fd, "The upload isn't a 24-bit bitmap.");
+        return;
+    }
+    close_bitmap_file(&file);
+
+    // Unlike rename, link won't replace an image uploaded meanwhile.
+    if (link(tmp_path, path) == -1) {
+        int link_errno = errno;
+        unlink(tmp_path);
+        if (link_errno == EEXIST) {
+            bad_request_response(fd, "File already exists.");
+        } else {
+            perror("link");
+            internal_server_error_response(fd, "Couldn't assemble the upload.");
+        }
+        return;
+    }
+    unlink(tmp_path);
+    remove_session(session->dir);
+
+    response_status = 201;
+    dprintf(fd, "HTTP/1.1 201 Created\r\n"
+                "Content-Type: application/json\r\n\r\n"
+                "{\"image\":\"%s\",\"size\":%ld}\n",
+            session->name, session->size);
+
+    // Warm the result cache so the first "Run filter" on this image is fast.
+    const char *image = session->name;
+    precompute_filters(&image, 1);
+}
+
+
+/*
+ * Copy <length> bytes of in_fd at <in_offset> to out_fd at <out_offset>.
+ * The file system may share the blocks instead (only when the offsets are
+ * block aligned); otherwise copy_file_range copies them in the kernel. A
+ * plain copy is only the last resort, for file systems that can do neither.
+ * Return 0 on success, -1 on failure.
+ */
+int copy_range(int out_fd, int in_fd, long in_offset, long out_offset, long length) {
+#ifdef FICLONERANGE
+    struct file_clone_range clone = {in_fd, in_offset, length, out_offset};
+    if (ioctl(out_fd, FICLONERANGE, &clone) == 0) {
+        return 0;
+    }
+#endif
+
+    loff_t in_pos = in_offset;
+    loff_t out_pos = out_offset;
+    while (length > 0) {
+        ssize_t numCopied = copy_file_range(in_fd, &in_pos, out_fd, &out_pos, length, 0);
+        if (numCopied <= 0) {
+            break;
+        }
+        length -= numCopied;
+    }
+    if (length == 0) {
+        return 0;
+    }
+
+    char *data = malloc(UPLOAD_BUFFER_SIZE);
+    while (length > 0) {
+        ssize_t numRead = pread(in_fd, data, (length < UPLOAD_BUFFER_SIZE) ? length : UPLOAD_BUFFER_SIZE, in_pos);
+        if (numRead <= 0) {
+            perror("pread");
+            free(data);
+            return -1;
+        }
+        for (ssize_t written = 0; written < numRead; ) {
+            ssize_t numWritten = pwrite(out_fd, data + written, numRead - written, out_pos + written);
+            if (numWritten <= 0) {
+                perror("pwrite");
+                free(data);
+                return -1;
+            }
+            written += numWritten;
+        }
+        in_pos += numRead;
+        out_pos += numRead;
+        length -= numRead;
+    }
+    free(data);
+    return 0;
+}
+
+
+/*
+ * Remove every session nothing has been added to for UPLOAD_SESSION_TTL.
+ */
+void expire_sessions(void) {
+    DIR *dir = opendir(UPLOAD_DIR);
+    if (dir == NULL) {
+        return;
+    }
+    time_t now = time(NULL);
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        char path[MAX_PATH];
+        struct stat st;
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        // Storing a part renames it into the directory, updating its mtime.
+        snprintf(path, sizeof(path), "%s%s", UPLOAD_DIR, entry->d_name);
+        if (stat(path, &st) == 0 && S_ISDIR(st.st_mode) && now - st.st_mtime > UPLOAD_SESSION_TTL) {
+            remove_session(path);
+        }
+    }
+    closedir(dir);
+}
+
+
+void remove_session(const char *dir_path) {
+    DIR *dir = opendir(dir_path);
+    if (dir == NULL) {
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+            char path[MAX_PATH];
+            snprintf(path, sizeof(path), "%s/%s", dir_path, entry->d_name);
+            unlink(path);
+        }
+    }
+    closedir(dir);
+    rmdir(dir_path);
+}
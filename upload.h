@@ -0,0 +1,45 @@
+#ifndef UPLOAD_H_
+#define UPLOAD_H_
+
+#include "request.h"
+
+/*
+ * Resumable uploads, for bitmaps too large to send in one go:
+ *     POST /uploads?name=dog.bmp&size=<bytes>     start a session; returns its id
+ *     PUT  /uploads/<id>?offset=<byte>             send part of the file
+ *     GET  /uploads/<id>                           what has arrived, what is missing
+ *     POST /uploads/<id>/finalize                  assemble images/dog.bmp
+ *
+ * Parts may be sent in any order, in parallel and more than once (each
+ * request body, plain or chunked, is one part); a dropped connection only
+ * loses the part it was sending. Every part is kept as its own file,
+ * UPLOAD_DIR<id>/<start>-<end>, renamed into place once complete.
+ *
+ * Finalizing copies the parts into the image with reflinks where the file
+ * system has them and copy_file_range otherwise, so the data doesn't pass
+ * through this process. A session holds at most MAX_UPLOAD_PARTS parts;
+ * further PUTs get 409 Conflict. Sessions not finalized within
+ * UPLOAD_SESSION_TTL seconds are removed.
+ */
+
+#define UPLOADS "/uploads"
+#define UPLOAD_DIR "uploads/"
+#define UPLOAD_FINALIZE "/finalize"
+
+#define UPLOAD_ID_BYTES 16                  // Random bytes in a session id.
+#define UPLOAD_SESSION_TTL (24 * 60 * 60)
+#define MAX_UPLOAD_PARTS 4096
+
+
+/*
+ * Return 1 if the request is for the resumable upload API.
+ */
+int is_upload_request(const ReqData *reqData);
+
+/*
+ * Respond to a request for the resumable upload API, reading its body if
+ * it has one.
+ */
+void upload_response(ClientState *client);
+
+#endif /* UPLOAD_H_ */
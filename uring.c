@@ -0,0 +1,429 @@
+#define _GNU_SOURCE  // F_SETPIPE_SZ
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+// Size of the pipe used to splice files to sockets.
+#define SPLICE_PIPE_SIZE (1 << 20)
+#define REQUEST_RING_ENTRIES 16
+#define SEND_BATCH 16           // Most entries uring_send_file queues at once.
+
+int use_uring = 0;
+
+
+int uring_init(Uring *ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(Uring));
+
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        return -1;
+    }
+    // Both rings are mapped at once, which needs 5.4. That doesn't mean
+    // every operation we use is supported: multishot accept needs 5.19,
+    // and serve_uring checks for it on its first accept.
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(ring->fd);
+        return -1;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_size = (sq_size > cq_size) ? sq_size : cq_size;
+    ring->ring_ptr = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->ring_ptr == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        munmap(ring->ring_ptr, ring->ring_size);
+        close(ring->fd);
+        return -1;
+    }
+
+    char *ptr = ring->ring_ptr;
+    ring->sq_head = (unsigned *) (ptr + params.sq_off.head);
+    ring->sq_tail = (unsigned *) (ptr + params.sq_off.tail);
+    ring->sq_mask = (unsigned *) (ptr + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (ptr + params.sq_off.array);
+    ring->cq_head = (unsigned *) (ptr + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (ptr + params.cq_off.tail);
+    ring->cq_mask = (unsigned *) (ptr + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (ptr + params.cq_off.cqes);
+    return 0;
+}
+
+
+Uring *uring_for_request(void) {
+    static Uring ring;
+    static pid_t owner = 0;   // A ring set up before fork() must not be reused.
+
+    if (!use_uring) {
+        return NULL;
+    }
+    if (owner != getpid()) {
+        if (uring_init(&ring, REQUEST_RING_ENTRIES) == -1) {
+            use_uring = 0;
+            return NULL;
+        }
+        owner = getpid();
+    }
+    return &ring;
+}
+
+
+void uring_exit(Uring *ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->ring_ptr, ring->ring_size);
+    close(ring->fd);
+}
+
+
+struct io_uring_sqe *uring_get_sqe(Uring *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *ring->sq_tail;
+    if (tail - head > *ring->sq_mask) {
+        // The submission queue is full: hand what is queued to the kernel.
+        while (uring_submit_and_wait(ring, 0) < 0) {
+            if (errno != EINTR) {
+                return NULL;
+            }
+        }
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (tail - head > *ring->sq_mask) {
+            return NULL;
+        }
+    }
+
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+    return sqe;
+}
+
+
+unsigned uring_sq_space(Uring *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    return *ring->sq_mask + 1 - (*ring->sq_tail - head);
+}
+
+
+int uring_submit_and_wait(Uring *ring, unsigned wait_nr) {
+    unsigned flags = (wait_nr > 0) ? IORING_ENTER_GETEVENTS : 0;
+    int ret = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit,
+                      wait_nr, flags, NULL, 0);
+    if (ret >= 0) {
+        ring->to_submit -= ret;
+    }
+    return ret;
+}
+
+
+struct io_uring_cqe *uring_peek_cqe(Uring *ring) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+
+void uring_cqe_seen(Uring *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+
+int uring_register_buffers(Uring *ring, struct iovec *iov, unsigned n) {
+    return syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iov, n);
+}
+
+
+void uring_prep_multishot_accept(struct io_uring_sqe *sqe, int fd, __u64 data) {
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = data;
+}
+
+
+void uring_prep_read_fixed(struct io_uring_sqe *sqe, int fd, void *buf,
+                           unsigned len, int buf_index, __u64 data) {
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long) buf;
+    sqe->len = len;
+    sqe->off = -1;  // Sockets are not seekable: read from the current position.
+    sqe->buf_index = buf_index;
+    sqe->user_data = data;
+}
+
+
+void uring_prep_read(struct io_uring_sqe *sqe, int fd, void *buf,
+                     unsigned len, off_t offset, __u64 data) {
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long) buf;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = data;
+}
+
+
+void uring_prep_send(struct io_uring_sqe *sqe, int fd, const void *buf,
+                     unsigned len, __u64 data) {
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long) buf;
+    sqe->len = len;
+    sqe->user_data = data;
+}
+
+
+void uring_prep_splice(struct io_uring_sqe *sqe, int fd_in, off_t off_in,
+                       int fd_out, unsigned len, __u64 data) {
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->splice_fd_in = fd_in;
+    sqe->splice_off_in = off_in;
+    sqe->fd = fd_out;
+    sqe->off = -1;
+    sqe->len = len;
+    sqe->user_data = data;
+}
+
+
+void uring_prep_poll_add(struct io_uring_sqe *sqe, int fd, unsigned events, __u64 data) {
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->user_data = data;
+}
+
+
+void uring_prep_timeout(struct io_uring_sqe *sqe, struct __kernel_timespec *ts,
+                        __u64 data) {
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (unsigned long) ts;
+    sqe->len = 1;
+    sqe->user_data = data;
+}
+
+
+/*
+ * Wait for and consume <n> completions of a batch whose entries are tagged
+ * with their index in it, storing each result in res[index].
+ * Return 0 on success, -1 if waiting failed.
+ */
+static int uring_wait_batch(Uring *ring, int n, int *res) {
+    while (n > 0) {
+        struct io_uring_cqe *cqe = uring_peek_cqe(ring);
+        if (cqe == NULL) {
+            if (uring_submit_and_wait(ring, 1) < 0) {
+                return -1;
+            }
+            continue;
+        }
+        res[cqe->user_data] = cqe->res;
+        uring_cqe_seen(ring);
+        n--;
+    }
+    return 0;
+}
+
+
+/*
+ * Finish a send that stopped short without the ring: write the rest of the
+ * header from <header_sent>, drain the <in_pipe> bytes left in the pipe, then
+ * sendfile the file from <offset>. Return 0 on success, -1 on failure.
+ */
+static int finish_send_file(int sock, const char *header, int header_sent, int pipe_out,
+                            long in_pipe, int file_fd, off_t offset, off_t size) {
+    int header_len = strlen(header);
+    while (header_sent < header_len) {
+        int numWritten = write(sock, header + header_sent, header_len - header_sent);
+        if (numWritten <= 0) {
+            return -1;
+        }
+        header_sent += numWritten;
+    }
+    while (in_pipe > 0) {
+        ssize_t moved = splice(pipe_out, NULL, sock, NULL, in_pipe, SPLICE_F_MOVE);
+        if (moved <= 0) {
+            return -1;
+        }
+        in_pipe -= moved;
+    }
+    while (offset < size) {
+        if (sendfile(sock, file_fd, &offset, size - offset) <= 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+int uring_send_file(Uring *ring, int sock, const char *header, int file_fd, off_t size) {
+    int pipefd[2];
+    if (pipe(pipefd) == -1) {
+        perror("pipe");
+        return -1;
+    }
+    int pipe_size = fcntl(pipefd[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+    if (pipe_size <= 0) {
+        pipe_size = 65536;
+    }
+
+    // A short send or splice fails the rest of its chain (the send waits for
+    // the whole header, so it can't come up short unnoticed); whatever was
+    // left then goes out with plain system calls.
+    int header_len = strlen(header);
+    int header_sent = 0;
+    off_t offset = 0;
+    int first = 1;
+    int result = 0;
+    while (result == 0 && (first || offset < size)) {
+        int res[SEND_BATCH];
+        unsigned len[SEND_BATCH];
+        unsigned batch_size = uring_sq_space(ring);
+        if (batch_size > SEND_BATCH) {
+            batch_size = SEND_BATCH;
+        }
+        unsigned queued = 0;
+        struct io_uring_sqe *sqe = NULL;
+
+        // The header goes out in the same batch as the first chunk.
+        if (first) {
+            sqe = uring_get_sqe(ring);
+            if (sqe == NULL) {
+                result = -1;
+                break;
+            }
+            len[queued] = header_len;
+            uring_prep_send(sqe, sock, header, header_len, queued++);
+            sqe->msg_flags = MSG_WAITALL;
+            sqe->flags |= IOSQE_IO_LINK;
+        }
+
+        // Fill the pipe from the file, then drain it into the socket.
+        off_t batch_offset = offset;
+        while (offset < size && queued + 2 <= batch_size) {
+            struct io_uring_sqe *in = uring_get_sqe(ring);
+            struct io_uring_sqe *out = uring_get_sqe(ring);
+            if (in == NULL || out == NULL) {
+                result = -1;
+                break;
+            }
+            unsigned chunk = (size - offset < pipe_size) ? size - offset : pipe_size;
+            len[queued] = chunk;
+            uring_prep_splice(in, file_fd, offset, pipefd[1], chunk, queued++);
+            in->splice_flags = SPLICE_F_MOVE;
+            in->flags |= IOSQE_IO_LINK;
+            len[queued] = chunk;
+            uring_prep_splice(out, pipefd[0], -1, sock, chunk, queued++);
+            out->splice_flags = SPLICE_F_MOVE;
+            out->flags |= IOSQE_IO_LINK;
+            sqe = out;
+            offset += chunk;
+        }
+        if (result == -1 || sqe == NULL) {
+            result = -1;
+            break;
+        }
+
+        // The last entry of a batch must not link to the next batch.
+        sqe->flags &= ~IOSQE_IO_LINK;
+        if (uring_submit_and_wait(ring, queued) < 0 ||
+                uring_wait_batch(ring, queued, res) == -1) {
+            result = -1;
+            break;
+        }
+
+        // See how far the batch got before something came up short.
+        unsigned i = 0;
+        if (first) {
+            header_sent = (res[0] > 0) ? res[0] : 0;
+            first = 0;
+            i = 1;
+        }
+        int complete = (header_sent == header_len);
+        long in_pipe = 0;
+        off_t read_to = batch_offset;
+        for (; complete && i < queued; i += 2) {
+            if (res[i] > 0) {
+                in_pipe += res[i];
+                read_to += res[i];
+            }
+            if (res[i + 1] > 0) {
+                in_pipe -= res[i + 1];
+            }
+            complete = (res[i] == (int) len[i] && res[i + 1] == (int) len[i + 1]);
+        }
+        if (!complete) {
+            result = finish_send_file(sock, header, header_sent, pipefd[0], in_pipe,
+                                      file_fd, read_to, size);
+            break;
+        }
+    }
+
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return result;
+}
+
+
+ssize_t uring_read_file(Uring *ring, const char *path, void *buf, size_t size) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+
+    // Regular file reads normally complete in one go; loop in case they don't.
+    ssize_t total = 0;
+    while (total < size) {
+        struct io_uring_sqe *sqe = uring_get_sqe(ring);
+        if (sqe == NULL) {
+            total = -1;
+            break;
+        }
+        uring_prep_read(sqe, fd, (char *) buf + total, size - total, total, 0);
+        struct io_uring_cqe *cqe = NULL;
+        while ((cqe = uring_peek_cqe(ring)) == NULL) {
+            if (uring_submit_and_wait(ring, 1) < 0) {
+                break;
+            }
+        }
+        if (cqe == NULL) {
+            total = -1;
+            break;
+        }
+        int res = cqe->res;
+        uring_cqe_seen(ring);
+        if (res < 0) {
+            total = -1;
+            break;
+        } else if (res == 0) {
+            break;  // End of file.
+        }
+        total += res;
+    }
+    close(fd);
+    return total;
+}
@@ -0,0 +1,115 @@
+#ifndef URING_H_
+#define URING_H_
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+
+/*
+ * A minimal io_uring instance, driven through the raw system calls so the
+ * server does not depend on liburing.
+ */
+typedef struct {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned to_submit;      // SQEs queued since the last uring_submit.
+    void *ring_ptr;          // Mapping for both the SQ and the CQ ring.
+    size_t ring_size;
+    size_t sqes_size;
+} Uring;
+
+
+// Set when the server runs with -u; response code then uses io_uring too.
+extern int use_uring;
+
+/*
+ * Return a small ring private to the calling process, setting it up on first
+ * use, or NULL if io_uring is disabled or unavailable.
+ */
+Uring *uring_for_request(void);
+
+
+/*
+ * Set up a ring with room for <entries> submissions.
+ * Return 0 on success, or -1 if io_uring is unavailable on this kernel.
+ */
+int uring_init(Uring *ring, unsigned entries);
+
+/*
+ * Tear down the ring and release its mappings.
+ */
+void uring_exit(Uring *ring);
+
+/*
+ * Return a zeroed submission entry to fill in. If the queue is full, what is
+ * queued is submitted first (so a batch can be split across system calls);
+ * return NULL if that fails.
+ */
+struct io_uring_sqe *uring_get_sqe(Uring *ring);
+
+/*
+ * Return the number of entries that can be queued before the queue is full.
+ */
+unsigned uring_sq_space(Uring *ring);
+
+/*
+ * Submit all queued entries and wait for at least <wait_nr> completions,
+ * in a single system call. Return the number submitted, or -1 on error.
+ */
+int uring_submit_and_wait(Uring *ring, unsigned wait_nr);
+
+/*
+ * Return the next completion, or NULL if there are none.
+ * Every completion returned must be released with uring_cqe_seen.
+ */
+struct io_uring_cqe *uring_peek_cqe(Uring *ring);
+void uring_cqe_seen(Uring *ring);
+
+/*
+ * Register <n> fixed buffers for use with IORING_OP_READ_FIXED.
+ */
+int uring_register_buffers(Uring *ring, struct iovec *iov, unsigned n);
+
+
+/******************************************************************************
+ * Helpers for preparing submissions.
+ *****************************************************************************/
+void uring_prep_multishot_accept(struct io_uring_sqe *sqe, int fd, __u64 data);
+void uring_prep_read_fixed(struct io_uring_sqe *sqe, int fd, void *buf,
+                           unsigned len, int buf_index, __u64 data);
+void uring_prep_read(struct io_uring_sqe *sqe, int fd, void *buf,
+                     unsigned len, off_t offset, __u64 data);
+void uring_prep_send(struct io_uring_sqe *sqe, int fd, const void *buf,
+                     unsigned len, __u64 data);
+void uring_prep_splice(struct io_uring_sqe *sqe, int fd_in, off_t off_in,
+                       int fd_out, unsigned len, __u64 data);
+void uring_prep_poll_add(struct io_uring_sqe *sqe, int fd, unsigned events, __u64 data);
+void uring_prep_timeout(struct io_uring_sqe *sqe, struct __kernel_timespec *ts,
+                        __u64 data);
+
+
+/*
+ * Send <header> followed by <size> bytes of <file_fd> to <sock>,
+ * splicing the file through a pipe so its contents never enter user space.
+ * The steps are linked and submitted in batches; if one comes up short, the
+ * rest is sent with write, splice and sendfile instead.
+ * Return 0 on success, -1 on failure.
+ */
+int uring_send_file(Uring *ring, int sock, const char *header, int file_fd, off_t size);
+
+/*
+ * Read up to <size> bytes of the file at <path> into <buf>.
+ * Return the number of bytes read, or -1 on failure.
+ */
+ssize_t uring_read_file(Uring *ring, const char *path, void *buf, size_t size);
+
+#endif /* URING_H_ */
@@ -0,0 +1,607 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <dirent.h>
+#include <math.h>
+
+#include "bitmap.h"
+#include "filter.h"
+#include "convolve.h"
+#include "blur.h"
+#include "rank.h"
+#include "stats.h"
+#include "request.h"
+#include "isa.h"
+
+#define NOISE_SIZE 512
+#define BLUR_MIN_SIZE 1000     // Images are tiled up to this size to compare blurs.
+#define MAX_CORPUS 256
+#define NUM_SIGMAS 4
+#define NUM_RANK_CHECKS 6
+
+static const double sigmas[NUM_SIGMAS] = {5, 10, 20, 50};
+
+// Radius and percentile of each rank filter checked against counting.
+static const struct {
+    int radius;
+    double percentile;
+} rank_checks[NUM_RANK_CHECKS] = {{1, 50}, {2, 50}, {7, 50}, {1, 0}, {3, 10}, {4, 100}};
+
+/*
+ * Check the integer built-in filters against their floating point references:
+ *     ./validate                  every image in images/
+ *     ./validate a.bmp b.bmp      the given files
+ *
+ * Besides the given images, a random noise image is always included, since
+ * it produces gradients of every strength. For each filter, prints the
+ * maximum and mean difference of any channel between the two outputs, the
+ * number of differing pixels, and the time each version took.
+ *
+ * Then checks the convolution engine on the noise image: a separable kernel
+ * of each size must give the same output whether applied in two passes or
+ * directly, and the gaussian kernel the same output as gaussian_blur. The
+ * median and percentile filters must give the same output as counting the
+ * values in each window.
+ *
+ * The image statistics kernel must give the same histograms as the scalar
+ * one on every image, and every instruction set variant of the kernels this
+ * CPU can run the same output as the generic one on the noise image.
+ *
+ * Exits with status 1 if any output differs. Finally, prints how far the
+ * box blur approximation of large Gaussian blurs is from a true Gaussian on
+ * the given images, each tiled up to at least BLUR_MIN_SIZE pixels square so
+ * that even the widest blur leaves an interior to measure (blur.h quotes
+ * the numbers for images/dog.bmp). That is expected to differ a little.
+ */
+
+typedef struct {
+    long pixels;
+    long differing;
+    int max_diff;
+    double total_diff;
+    double apply_ms;
+    double reference_ms;
+} FilterReport;
+
+typedef struct {
+    int images;
+    int differing;            // Images whose histograms differ.
+    double kernel_ms;
+    double scalar_ms;
+} StatsReport;
+
+typedef struct {
+    long pixels;
+    int max_diff;
+    double total_diff;
+    long interior_pixels;     // Those at least 3 sigma from the edges.
+    int interior_max_diff;
+    double interior_total_diff;
+    double box_ms;
+    double exact_ms;
+} BlurReport;
+
+
+double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+
+/*
+ * Return a bitmap of random pixels, from a fixed seed so runs are repeatable.
+ * It has no header, which is fine since it's never written out.
+ */
+Bitmap *noise_bitmap(void) {
+    Bitmap *bmp = calloc(1, sizeof(Bitmap));
+    bmp->width = NOISE_SIZE;
+    bmp->height = NOISE_SIZE;
+    bmp->pixels = malloc(sizeof(Pixel) * NOISE_SIZE * NOISE_SIZE);
+    srand(1);
+    for (int i = 0; i < NOISE_SIZE * NOISE_SIZE; i++) {
+        bmp->pixels[i].blue = rand() & 0xff;
+        bmp->pixels[i].green = rand() & 0xff;
+        bmp->pixels[i].red = rand() & 0xff;
+    }
+    return bmp;
+}
+
+
+/*
+ * Run both versions of <filter> on <bmp> and add the differences to <report>.
+ */
+void compare(const BuiltinFilter *filter, const Bitmap *bmp, FilterReport *report) {
+    long n = (long) bmp->width * bmp->height;
+    Pixel *fast = malloc(sizeof(Pixel) * n);
+    Pixel *reference = malloc(sizeof(Pixel) * n);
+
+    double start = now_ms();
+    filter->apply(bmp, fast, 0, bmp->height);
+    double middle = now_ms();
+    filter->reference(bmp, reference, 0, bmp->height);
+    report->apply_ms += middle - start;
+    report->reference_ms += now_ms() - middle;
+
+    for (long i = 0; i < n; i++) {
+        int diffs[3] = {
+            abs(fast[i].blue - reference[i].blue),
+            abs(fast[i].green - reference[i].green),
+            abs(fast[i].red - reference[i].red)
+        };
+        int pixel_diff = 0;
+        for (int c = 0; c < 3; c++) {
+            report->total_diff += diffs[c];
+            pixel_diff = (diffs[c] > pixel_diff) ? diffs[c] : pixel_diff;
+        }
+        if (pixel_diff > 0) {
+            report->differing++;
+        }
+        if (pixel_diff > report->max_diff) {
+            report->max_diff = pixel_diff;
+        }
+    }
+    report->pixels += n;
+
+    free(fast);
+    free(reference);
+}
+
+
+/*
+ * Return the largest difference of any channel between two images of <n> pixels.
+ */
+int max_difference(const Pixel *a, const Pixel *b, long n) {
+    int max_diff = 0;
+    for (long i = 0; i < n; i++) {
+        int diffs[3] = {
+            abs(a[i].blue - b[i].blue),
+            abs(a[i].green - b[i].green),
+            abs(a[i].red - b[i].red)
+        };
+        for (int c = 0; c < 3; c++) {
+            max_diff = (diffs[c] > max_diff) ? diffs[c] : max_diff;
+        }
+    }
+    return max_diff;
+}
+
+
+/*
+ * Check the convolution engine against itself and the built-in blur.
+ * Return 1 if everything matches, 0 otherwise.
+ */
+int validate_convolution(const Bitmap *bmp) {
+    long n = (long) bmp->width * bmp->height;
+    Pixel *passes = malloc(sizeof(Pixel) * n);
+    Pixel *direct = malloc(sizeof(Pixel) * n);
+    int exact = 1;
+
+    printf("\n%-16s %8s %12s %10s\n", "kernel", "max_diff", "separable_ms", "direct_ms");
+    for (int size = MIN_KERNEL_SIZE; size <= MAX_KERNEL_SIZE; size += 2) {
+        // A binomial-like kernel: the outer product of 1, 2, ..., 2, 1.
+        char weights[MAX_KERNEL_SIZE * MAX_KERNEL_SIZE * 4];
+        int len = 0;
+        for (int i = 0; i < size; i++) {
+            for (int j = 0; j < size; j++) {
+                int a = (i == 0 || i == size - 1) ? 1 : 2;
+                int b = (j == 0 || j == size - 1) ? 1 : 2;
+                len += sprintf(weights + len, "%s%d", len ? "," : "", a * b);
+            }
+        }
+        Kernel kernel;
+        parse_kernel(weights, NULL, &kernel);
+
+        double start = now_ms();
+        convolve(&kernel, bmp, passes, 0, bmp->height);
+        double middle = now_ms();
+        kernel.separable = 0;
+        convolve(&kernel, bmp, direct, 0, bmp->height);
+        double end = now_ms();
+
+        int max_diff = max_difference(passes, direct, n);
+        char name[32];
+        sprintf(name, "%dx%d", size, size);
+        printf("%-16s %8d %12.2f %10.2f\n", name, max_diff, middle - start, end - middle);
+        exact = exact && max_diff == 0;
+    }
+
+    Kernel gaussian;
+    parse_kernel("1,2,1,2,4,2,1,2,1", "16", &gaussian);
+    convolve(&gaussian, bmp, passes, 0, bmp->height);
+    find_builtin_filter("gaussian_blur")->apply(bmp, direct, 0, bmp->height);
+    int max_diff = max_difference(passes, direct, n);
+    printf("%-16s %8d\n", "gaussian_blur", max_diff);
+    exact = exact && max_diff == 0;
+
+    free(passes);
+    free(direct);
+    return exact;
+}
+
+
+/*
+ * Filter <bmp> with <rank> by counting the values in the window around each
+ * pixel, with the image edges extended like rank_filter does.
+ */
+void counted_rank_filter(const RankFilter *rank, const Bitmap *bmp, Pixel *out) {
+    int r = rank->radius;
+    for (int y = 0; y < bmp->height; y++) {
+        for (int x = 0; x < bmp->width; x++) {
+            for (int c = 0; c < 3; c++) {
+                int counts[256] = {0};
+                for (int i = y - r; i <= y + r; i++) {
+                    int row = (i < 0) ? 0 : (i >= bmp->height) ? bmp->height - 1 : i;
+                    for (int j = x - r; j <= x + r; j++) {
+                        int col = (j < 0) ? 0 : (j >= bmp->width) ? bmp->width - 1 : j;
+                        counts[((unsigned char *) &bmp->pixels[(long) row * bmp->width + col])[c]]++;
+                    }
+                }
+                int v = 0;
+                for (int below = counts[0]; below <= rank->rank; below += counts[++v]) {
+                }
+                ((unsigned char *) &out[(long) y * bmp->width + x])[c] = v;
+            }
+        }
+    }
+}
+
+
+/*
+ * Check the median and percentile filters against counting each window.
+ * Return 1 if everything matches, 0 otherwise.
+ */
+int validate_rank(const Bitmap *bmp) {
+    long n = (long) bmp->width * bmp->height;
+    Pixel *histograms = malloc(sizeof(Pixel) * n);
+    Pixel *counted = malloc(sizeof(Pixel) * n);
+    int exact = 1;
+
+    printf("\n%-16s %8s %12s %10s\n", "rank filter", "max_diff", "histogram_ms", "count_ms");
+    for (int i = 0; i < NUM_RANK_CHECKS; i++) {
+        char radius[16];
+        char percentile[16];
+        sprintf(radius, "%d", rank_checks[i].radius);
+        sprintf(percentile, "%g", rank_checks[i].percentile);
+        RankFilter rank;
+        parse_rank_filter(PERCENTILE_FILTER, radius, percentile, &rank);
+
+        double start = now_ms();
+        rank_filter(&rank, bmp, histograms, 0, bmp->height);
+        double middle = now_ms();
+        counted_rank_filter(&rank, bmp, counted);
+        double end = now_ms();
+
+        int max_diff = max_difference(histograms, counted, n);
+        char name[32];
+        sprintf(name, "r=%d p=%g", rank.radius, rank.percentile);
+        printf("%-16s %8d %12.2f %10.2f\n", name, max_diff, middle - start, end - middle);
+        exact = exact && max_diff == 0;
+    }
+
+    free(histograms);
+    free(counted);
+    return exact;
+}
+
+
+/*
+ * Run every kernel with instruction set variants on <bmp>, storing the
+ * outputs one after the other in <outs>. Return the time taken in ms.
+ */
+double run_variant_kernels(const Bitmap *bmp, Pixel *outs) {
+    long n = (long) bmp->width * bmp->height;
+    double start = now_ms();
+    for (int f = 0; f < num_builtin_filters; f++) {
+        builtin_filters[f].apply(bmp, outs, 0, bmp->height);
+        outs += n;
+    }
+    for (int separable = 0; separable <= 1; separable++) {
+        for (int size = 3; size <= 9; size += 2) {
+            char weights[9 * 9 * 4];
+            int len = 0;
+            for (int i = 0; i < size * size; i++) {
+                len += sprintf(weights + len, "%s%d", len ? "," : "", (i % 3) + (i / size) % 2);
+            }
+            Kernel kernel;
+            parse_kernel(weights, NULL, &kernel);
+            kernel.separable = kernel.separable && separable;
+            convolve(&kernel, bmp, outs, 0, bmp->height);
+            outs += n;
+        }
+    }
+    gaussian_blur_sigma(bmp, outs, sigmas[0]);
+    outs += n;
+    RankFilter median;
+    parse_rank_filter(MEDIAN_FILTER, "3", NULL, &median);
+    rank_filter(&median, bmp, outs, 0, bmp->height);
+    return now_ms() - start;
+}
+
+
+/*
+ * Check that every variant of the kernels this CPU can run gives the same
+ * output as the generic one. Return 1 if they all do, 0 otherwise.
+ */
+int validate_variants(const Bitmap *bmp) {
+    long n = (long) bmp->width * bmp->height;
+    int outputs = num_builtin_filters + 2 * 4 + 2;
+    Pixel *expected = malloc(sizeof(Pixel) * n * outputs);
+    Pixel *actual = malloc(sizeof(Pixel) * n * outputs);
+    int chosen = active_isa;
+    int exact = 1;
+
+    printf("\n%-16s %8s %10s\n", "variant", "max_diff", "ms");
+    for (int isa = ISA_GENERIC; isa < NUM_ISAS; isa++) {
+        if (!isa_supported(isa)) {
+            printf("%-16s %8s\n", isa_name(isa), "-");
+            continue;
+        }
+        active_isa = isa;
+        double ms = run_variant_kernels(bmp, (isa == ISA_GENERIC) ? expected : actual);
+        int max_diff = (isa == ISA_GENERIC) ? 0 : max_difference(expected, actual, n * outputs);
+        printf("%-16s %8d %10.2f\n", isa_name(isa), max_diff, ms);
+        exact = exact && max_diff == 0;
+    }
+    active_isa = chosen;
+
+    free(expected);
+    free(actual);
+    return exact;
+}
+
+
+/*
+ * Compute the statistics of <bmp> with the kernel used by the server and
+ * with the scalar one, and check that they agree.
+ */
+void compare_stats(const Bitmap *bmp, StatsReport *report) {
+    ImageStats *kernel = malloc(sizeof(ImageStats));
+    ImageStats *scalar = malloc(sizeof(ImageStats));
+    double start = now_ms();
+    compute_image_stats(bmp, kernel);
+    double middle = now_ms();
+    compute_image_stats_scalar(bmp, scalar);
+    double end = now_ms();
+
+    report->images++;
+    if (memcmp(kernel->histogram, scalar->histogram, sizeof(kernel->histogram)) != 0) {
+        report->differing++;
+    }
+    report->kernel_ms += middle - start;
+    report->scalar_ms += end - middle;
+    free(kernel);
+    free(scalar);
+}
+
+
+/*
+ * Blur <bmp> with a true Gaussian of the given sigma, truncated at 4 sigma:
+ * one horizontal and one vertical pass in floating point, with the image
+ * edges extended like the box blur does.
+ */
+void exact_gaussian_blur(const Bitmap *bmp, Pixel *out, double sigma) {
+    int radius = ceil(4 * sigma);
+    double *weights = malloc(sizeof(double) * (2 * radius + 1));
+    double total = 0;
+    for (int i = -radius; i <= radius; i++) {
+        weights[i + radius] = exp(-i * i / (2 * sigma * sigma));
+        total += weights[i + radius];
+    }
+    for (int i = 0; i <= 2 * radius; i++) {
+        weights[i] /= total;
+    }
+
+    int width = bmp->width;
+    int height = bmp->height;
+    double *tmp = malloc(sizeof(double) * 3 * width * height);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            double sums[3] = {0, 0, 0};
+            for (int i = -radius; i <= radius; i++) {
+                int xi = (x + i < 0) ? 0 : (x + i >= width) ? width - 1 : x + i;
+                const Pixel *p = &bmp->pixels[(long) y * width + xi];
+                sums[0] += weights[i + radius] * p->blue;
+                sums[1] += weights[i + radius] * p->green;
+                sums[2] += weights[i + radius] * p->red;
+            }
+            memcpy(&tmp[3 * ((long) y * width + x)], sums, sizeof(sums));
+        }
+    }
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            double sums[3] = {0, 0, 0};
+            for (int i = -radius; i <= radius; i++) {
+                int yi = (y + i < 0) ? 0 : (y + i >= height) ? height - 1 : y + i;
+                for (int c = 0; c < 3; c++) {
+                    sums[c] += weights[i + radius] * tmp[3 * ((long) yi * width + x) + c];
+                }
+            }
+            Pixel *o = &out[(long) y * width + x];
+            o->blue = lround(sums[0]);
+            o->green = lround(sums[1]);
+            o->red = lround(sums[2]);
+        }
+    }
+    free(tmp);
+    free(weights);
+}
+
+
+/*
+ * Return a copy of <bmp> repeated across and down to at least BLUR_MIN_SIZE
+ * pixels each way (or as is if it is already that large). It has no header.
+ */
+Bitmap *tiled_bitmap(const Bitmap *bmp) {
+    Bitmap *tiled = calloc(1, sizeof(Bitmap));
+    tiled->width = (bmp->width < BLUR_MIN_SIZE) ? BLUR_MIN_SIZE : bmp->width;
+    tiled->height = (bmp->height < BLUR_MIN_SIZE) ? BLUR_MIN_SIZE : bmp->height;
+    tiled->pixels = malloc(sizeof(Pixel) * tiled->width * tiled->height);
+    for (int y = 0; y < tiled->height; y++) {
+        for (int x = 0; x < tiled->width; x++) {
+            tiled->pixels[(long) y * tiled->width + x] =
+                bmp->pixels[(long) (y % bmp->height) * bmp->width + x % bmp->width];
+        }
+    }
+    return tiled;
+}
+
+
+/*
+ * Compare the box blur of <bmp> against a true Gaussian for each sigma.
+ */
+void compare_blur(const Bitmap *bmp, BlurReport *reports) {
+    long n = (long) bmp->width * bmp->height;
+    Pixel *box = malloc(sizeof(Pixel) * n);
+    Pixel *exact = malloc(sizeof(Pixel) * n);
+
+    for (int s = 0; s < NUM_SIGMAS; s++) {
+        BlurReport *report = &reports[s];
+        double start = now_ms();
+        gaussian_blur_sigma(bmp, box, sigmas[s]);
+        double middle = now_ms();
+        exact_gaussian_blur(bmp, exact, sigmas[s]);
+        report->box_ms += middle - start;
+        report->exact_ms += now_ms() - middle;
+
+        // Near the edges the box passes each extend an already blurred
+        // image, so the error there is reported separately.
+        int margin = ceil(3 * sigmas[s]);
+        for (long i = 0; i < n; i++) {
+            int x = i % bmp->width;
+            int y = i / bmp->width;
+            int interior = x >= margin && x < bmp->width - margin &&
+                           y >= margin && y < bmp->height - margin;
+            int diffs[3] = {
+                abs(box[i].blue - exact[i].blue),
+                abs(box[i].green - exact[i].green),
+                abs(box[i].red - exact[i].red)
+            };
+            for (int c = 0; c < 3; c++) {
+                report->total_diff += diffs[c];
+                report->max_diff = (diffs[c] > report->max_diff) ? diffs[c] : report->max_diff;
+                if (interior) {
+                    report->interior_total_diff += diffs[c];
+                    if (diffs[c] > report->interior_max_diff) {
+                        report->interior_max_diff = diffs[c];
+                    }
+                }
+            }
+            report->interior_pixels += interior;
+        }
+        report->pixels += n;
+    }
+    free(box);
+    free(exact);
+}
+
+
+/*
+ * Store the paths of the images in IMAGE_DIR in <paths>.
+ * Return the number of paths.
+ */
+int list_images(char **paths, int max_paths) {
+    DIR *d = opendir(IMAGE_DIR);
+    if (d == NULL) {
+        return 0;
+    }
+    int count = 0;
+    struct dirent *dir;
+    while ((dir = readdir(d)) != NULL && count < max_paths) {
+        if (dir->d_name[0] != '.') {
+            paths[count] = malloc(strlen(IMAGE_DIR) + strlen(dir->d_name) + 1);
+            sprintf(paths[count], "%s%s", IMAGE_DIR, dir->d_name);
+            count++;
+        }
+    }
+    closedir(d);
+    return count;
+}
+
+
+int main(int argc, char **argv) {
+    char *paths[MAX_CORPUS];
+    int num_paths;
+    if (argc > 1) {
+        num_paths = (argc - 1 < MAX_CORPUS) ? argc - 1 : MAX_CORPUS;
+        memcpy(paths, argv + 1, num_paths * sizeof(char *));
+    } else {
+        num_paths = list_images(paths, MAX_CORPUS);
+    }
+
+    init_isa();
+    init_builtin_filters();
+    FilterReport *reports = calloc(num_builtin_filters, sizeof(FilterReport));
+    BlurReport blur_reports[NUM_SIGMAS] = {{0}};
+    StatsReport stats_report = {0};
+
+    int num_images = 0;
+    Bitmap *noise = noise_bitmap();
+    for (int i = 0; i <= num_paths; i++) {
+        // The noise image goes last.
+        Bitmap *bmp = (i < num_paths) ? read_bitmap(paths[i]) : noise;
+        if (bmp == NULL) {
+            fprintf(stderr, "Skipping %s: not a 24-bit bitmap\n", paths[i]);
+            continue;
+        }
+        for (int f = 0; f < num_builtin_filters; f++) {
+            compare(&builtin_filters[f], bmp, &reports[f]);
+        }
+        compare_stats(bmp, &stats_report);
+        if (bmp != noise) {
+            Bitmap *tiled = tiled_bitmap(bmp);
+            compare_blur(tiled, blur_reports);
+            free_bitmap(tiled);
+            free_bitmap(bmp);
+        }
+        num_images++;
+    }
+
+    printf("Compared %d images (including noise)\n", num_images);
+    printf("%-16s %8s %10s %12s %10s %10s\n", "filter", "max_diff", "mean_diff",
+           "differing", "int_ms", "float_ms");
+    int exact = 1;
+    for (int f = 0; f < num_builtin_filters; f++) {
+        FilterReport *r = &reports[f];
+        printf("%-16s %8d %10.6f %12ld %10.2f %10.2f\n", builtin_filters[f].name,
+               r->max_diff, r->total_diff / (3.0 * r->pixels), r->differing,
+               r->apply_ms, r->reference_ms);
+        if (r->differing > 0) {
+            exact = 0;
+        }
+    }
+    if (!validate_convolution(noise)) {
+        exact = 0;
+    }
+    if (!validate_rank(noise)) {
+        exact = 0;
+    }
+    if (!validate_variants(noise)) {
+        exact = 0;
+    }
+
+    printf("\n%-16s %8s %10s %10s\n", "image stats", "differing", "kernel_ms", "scalar_ms");
+    printf("%-16s %8d %10.2f %10.2f\n", "histograms", stats_report.differing,
+           stats_report.kernel_ms, stats_report.scalar_ms);
+    if (stats_report.differing > 0) {
+        exact = 0;
+    }
+    free_bitmap(noise);
+
+    printf("\n%-16s %8s %10s %12s %12s %10s %10s\n", "box blur", "max_diff", "mean_diff",
+           "interior_max", "interior_mean", "box_ms", "exact_ms");
+    for (int s = 0; s < NUM_SIGMAS; s++) {
+        BlurReport *r = &blur_reports[s];
+        char name[32];
+        sprintf(name, "sigma=%g", sigmas[s]);
+        printf("%-16s %8d %10.4f %12d %12.4f %10.2f %10.2f\n", name, r->max_diff,
+               r->pixels ? r->total_diff / (3.0 * r->pixels) : 0, r->interior_max_diff,
+               r->interior_pixels ? r->interior_total_diff / (3.0 * r->interior_pixels) : 0,
+               r->box_ms, r->exact_ms);
+    }
+
+    printf(exact ? "All filters are bit-exact.\n" : "Some filters differ.\n");
+    return exact ? 0 : 1;
+}